@@ -0,0 +1,119 @@
+#include "Particle.h"
+#include "MyPersistentData.h"
+#include "TestAssert.h"
+
+// Loads a sysStatus file saved by v1.5.10 and earlier (SYS_DATA_VERSION 2, where the release strings
+// were declared as String) and checks that sysStatusData's migration keeps every setting.
+
+extern const char *persistentDataPathSystem;
+extern const char *persistentDataPathCurrent;
+
+// sysStatusData::SYS_DATA_MAGIC, which has not changed since version 2
+static const uint32_t SYS_DATA_MAGIC = 0x20a99e75;
+
+// sysStatusData::SysData as it was declared in SYS_DATA_VERSION 2. Do not change it.
+class SysDataVersion2 {
+public:
+    StorageHelperRK::PersistentDataBase::SavedDataHeader sysHeader;
+    uint8_t structuresVersion;
+    bool verboseMode;
+    bool solarPowerMode;
+    bool lowPowerMode;
+    bool lowBatteryMode;
+    uint8_t resetCount;
+    char timeZoneStr[39];
+    uint8_t openTime;
+    uint8_t closeTime;
+    time_t lastReport;
+    time_t lastConnection;
+    time_t lastHookResponse;
+    uint16_t lastConnectionDuration;
+    uint8_t sensorType;
+    // Declared as String, but set_*() stored the characters in place
+    alignas(String) char firmwareRelease[sizeof(String)];
+    alignas(String) char assetFirmwareRelease[sizeof(String)];
+};
+
+static void removeFiles() {
+    unlink("./sysStatus.dat");
+    unlink("./sysStatus.dat.b");
+    unlink("./current.dat");
+    unlink("./current.dat.b");
+}
+
+static int getFileSize(const char *path) {
+    struct stat sb;
+    return (stat(path, &sb) == 0) ? (int)sb.st_size : -1;
+}
+
+// Writes the file the old firmware would have
+static void writeVersion2Image(const char *path) {
+    SysDataVersion2 old;
+    memset(&old, 0, sizeof(old));
+
+    old.structuresVersion = 7;
+    old.verboseMode = true;
+    old.solarPowerMode = true;
+    old.lowPowerMode = false;
+    old.lowBatteryMode = true;
+    old.resetCount = 5;
+    strcpy(old.timeZoneStr, "NZST-12NZDT,M9.5.0,M4.1.0/3");
+    old.openTime = 6;
+    old.closeTime = 21;
+    old.lastReport = 1700000000;
+    old.lastConnection = 1700000100;
+    old.lastHookResponse = 1700000200;
+    old.lastConnectionDuration = 45;
+    old.sensorType = 1;
+    // Like setValueString(): at most sizeof(String) - 1 characters, null terminated
+    strncpy(old.firmwareRelease, "1.5.10", sizeof(old.firmwareRelease) - 1);
+    strncpy(old.assetFirmwareRelease, "2.1", sizeof(old.assetFirmwareRelease) - 1);
+
+    old.sysHeader.magic = SYS_DATA_MAGIC;
+    old.sysHeader.version = 2;
+    old.sysHeader.size = sizeof(SysDataVersion2);
+    old.sysHeader.hash = 0;
+    old.sysHeader.hash = StorageHelperRK::murmur3_32((const uint8_t *)&old, sizeof(old), StorageHelperRK::PersistentDataBase::HASH_SEED);
+
+    FILE *fp = fopen(path, "w");
+    fwrite(&old, 1, sizeof(old), fp);
+    fclose(fp);
+}
+
+int main(int argc, char *argv[]) {
+    persistentDataPathSystem = "./sysStatus.dat";
+    persistentDataPathCurrent = "./current.dat";
+    removeFiles();
+
+    writeVersion2Image("./sysStatus.dat");
+    sysStatus.setup();
+
+    const sysStatusData::SysData data = sysStatus.snapshot();
+    assertInt("", data.sysHeader.version, 3);
+    assertInt("", data.structuresVersion, 7);
+    assertInt("", data.verboseMode, true);
+    assertInt("", data.solarPowerMode, true);
+    assertInt("", data.lowPowerMode, false);
+    assertInt("", data.lowBatteryMode, true);
+    assertInt("", data.resetCount, 5);
+    assertStr("", data.timeZoneStr, "NZST-12NZDT,M9.5.0,M4.1.0/3");
+    assertInt("", data.openTime, 6);
+    assertInt("", data.closeTime, 21);
+    assertInt("", data.lastReport, 1700000000);
+    assertInt("", data.lastConnection, 1700000100);
+    assertInt("", data.lastHookResponse, 1700000200);
+    assertInt("", data.lastConnectionDuration, 45);
+    assertInt("", data.sensorType, 1);
+
+    assertStr("", data.firmwareRelease, "1.5.10");
+    assertStr("", data.assetFirmwareRelease, "2.1");
+
+    // The migrated data is saved in the new layout, to the other slot
+    sysStatus.flush(true);
+    assertInt("", getFileSize("./sysStatus.dat.b"), (int)sizeof(sysStatusData::SysData));
+
+    removeFiles();
+
+    fprintf(stderr, "migration test passed\n");
+    return 0;
+}
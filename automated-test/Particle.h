@@ -0,0 +1,24 @@
+#pragma once
+
+// Host mock of the Device OS APIs used by the application sources under test. The rest of
+// the mock (String, Logger, Time, millis(), publish flags) comes from StorageHelperRK's UnitTestLib.
+
+#include "../lib/StorageHelperRK/automated-test/UnitTestLib/Particle.h"
+
+#include <chrono>
+
+#define retained
+
+inline uint32_t micros() {
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Never connected, so nothing is published
+class CloudClass {
+public:
+    bool connected() { return false; }
+    bool publish(const char *eventName, const char *eventData, PublishFlags flags) { return false; }
+};
+static CloudClass Particle;
+
+#define waitUntil(condition) while(!(condition)()) {}
@@ -0,0 +1,3 @@
+#pragma once
+
+// Stands in for the library header, which Record_Counts.cpp includes but does not use
@@ -0,0 +1,148 @@
+#include "Particle.h"
+#include "MyPersistentData.h"
+#include "Record_Counts.h"
+#include "Particle_Functions.h"
+#include "TestAssert.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+// Stress test for the Record_Counts event ring: a thread stands in for the sensor interrupt and
+// calls queueCountEvent() at kHz rates while the main thread drains the ring with recordCounts()
+// like loop() does, sometimes blocked for longer than the ring lasts. Every queued event must
+// be counted exactly once or show up in the overflow counter.
+
+extern const char *persistentDataPathSystem;
+extern const char *persistentDataPathCurrent;
+
+// recordCounts() only calls these when connected, and the mock never is
+Particle_Functions *Particle_Functions::_instance;
+
+Particle_Functions &Particle_Functions::instance() {
+    return *_instance;
+}
+
+bool Particle_Functions::meterParticlePublish() {
+    return true;
+}
+
+static const uint16_t QUEUE_SIZE = Record_Counts::COUNT_EVENT_QUEUE_SIZE;
+
+// Counts that have made it out of the ring, committed or not
+static uint32_t getCounted() {
+    return current.get_hourlyCount() + Record_Counts::instance().getPendingCounts();
+}
+
+// Calls queueCountEvent() rateHz times a second for durationMs, like the sensor interrupt
+static uint32_t runInterrupt(uint32_t rateHz, uint32_t durationMs, std::atomic<bool> &done) {
+    auto next = std::chrono::steady_clock::now();
+    const auto period = std::chrono::nanoseconds(1000000000 / rateHz);
+    uint32_t queued = 0;
+
+    for(uint32_t ii = 0; ii < rateHz * durationMs / 1000; ii++) {
+        std::this_thread::sleep_until(next);
+        next += period;
+        Record_Counts::queueCountEvent((uint16_t)ii);
+        queued++;
+    }
+    done = true;
+    return queued;
+}
+
+// Runs the interrupt on another thread and drains the ring every loopMs. Every blockEvery loops, the
+// loop is blocked for blockMs instead. Returns the number of events queued.
+static uint32_t runLoop(uint32_t rateHz, uint32_t durationMs, uint32_t loopMs, uint32_t blockEvery, uint32_t blockMs) {
+    std::atomic<bool> done(false);
+    uint32_t queued = 0;
+    std::thread isr([&]() { queued = runInterrupt(rateHz, durationMs, done); });
+
+    uint32_t loops = 0;
+    while(!done) {
+        if (Record_Counts::countsPending()) {
+            Record_Counts::instance().recordCounts();
+        }
+        loops++;
+        uint32_t sleepMs = (blockEvery && (loops % blockEvery) == 0) ? blockMs : loopMs;
+        std::this_thread::sleep_for(std::chrono::milliseconds(sleepMs));
+    }
+    isr.join();
+
+    while(Record_Counts::countsPending()) {
+        Record_Counts::instance().recordCounts();
+    }
+    Record_Counts::instance().commitCounts();
+    return queued;
+}
+
+int main(int argc, char *argv[]) {
+    persistentDataPathSystem = "./sysStatus.dat";
+    persistentDataPathCurrent = "./current.dat";
+    unlink("./sysStatus.dat");
+    unlink("./sysStatus.dat.b");
+    unlink("./current.dat");
+    unlink("./current.dat.b");
+
+    sysStatus.setup();
+    current.setup();
+    Record_Counts::instance().setup();
+    assertInt("", sysStatus.get_sensorType(), 2);                // Magnetometer: every event counts
+    assertInt("", getCounted(), 0);
+
+    // A loop that drains before the ring fills never drops: fill it to exactly QUEUE_SIZE each time
+    for(int round = 0; round < 100; round++) {
+        for(uint16_t ii = 0; ii < QUEUE_SIZE; ii++) {
+            Record_Counts::queueCountEvent(ii);
+        }
+        assertTrue("", Record_Counts::instance().recordCounts());
+        assertTrue("", !Record_Counts::countsPending());
+    }
+    Record_Counts::instance().commitCounts();
+    assertInt("", Record_Counts::getOverflowCount(), 0);
+    assertInt("", current.get_hourlyCount(), 100 * QUEUE_SIZE);
+    assertInt("", current.get_dailyCount(), 100 * QUEUE_SIZE);
+
+    // 2 kHz with a 1 ms loop. A loaded machine can stall the loop for longer than the ring lasts,
+    // so only check that each event is either counted or dropped.
+    uint32_t countedBefore = getCounted();
+    uint32_t overflowBefore = Record_Counts::getOverflowCount();
+    uint32_t queued = runLoop(2000, 2000, 1, 0, 0);
+    uint32_t counted = getCounted() - countedBefore;
+    uint32_t dropped = Record_Counts::getOverflowCount() - overflowBefore;
+    assertInt("", counted + dropped, queued);
+    assertInt("", current.get_dailyCount(), current.get_hourlyCount());
+    fprintf(stderr, "2 kHz: %u queued, %u counted, %u dropped\n", (unsigned)queued, (unsigned)counted, (unsigned)dropped);
+
+    // With the loop blocked, the ring holds exactly QUEUE_SIZE events and the rest are dropped
+    countedBefore = getCounted();
+    overflowBefore = Record_Counts::getOverflowCount();
+    for(int ii = 0; ii < 200; ii++) {
+        Record_Counts::queueCountEvent(0);
+    }
+    assertInt("", Record_Counts::getOverflowCount() - overflowBefore, 200 - QUEUE_SIZE);
+    assertTrue("", Record_Counts::instance().recordCounts());
+    assertTrue("", !Record_Counts::countsPending());
+    assertInt("", getCounted() - countedBefore, QUEUE_SIZE);
+    assertTrue("", !Record_Counts::instance().recordCounts());
+    Record_Counts::instance().commitCounts();
+
+    // 10 kHz with the loop blocked for 20 ms (200 events) every 50 loops overflows repeatedly.
+    // Each event is either counted or dropped, never both and never twice.
+    countedBefore = getCounted();
+    overflowBefore = Record_Counts::getOverflowCount();
+    queued = runLoop(10000, 2000, 1, 50, 20);
+    counted = getCounted() - countedBefore;
+    dropped = Record_Counts::getOverflowCount() - overflowBefore;
+    assertTrue("", dropped > 0);
+    assertInt("", counted + dropped, queued);
+    assertInt("", current.get_dailyCount(), current.get_hourlyCount());
+    fprintf(stderr, "10 kHz, blocked loop: %u queued, %u counted, %u dropped\n", (unsigned)queued, (unsigned)counted, (unsigned)dropped);
+
+    unlink("./sysStatus.dat");
+    unlink("./sysStatus.dat.b");
+    unlink("./current.dat");
+    unlink("./current.dat.b");
+
+    fprintf(stderr, "record counts test passed\n");
+    return 0;
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+// Minimal host mock of the Device OS APIs used by BackgroundPublishRK, with a counter of
+// the times the publish thread wakes up (returns from delay() or os_queue_take()).
+// The cloud completes each publish from its own thread after mockPublishLatencyMs. Events
+// with the data "fail" fail.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern std::atomic<uint32_t> mockWakeups;	//!< Incremented each time a thread returns from delay() or os_queue_take()
+extern uint32_t mockPublishLatencyMs;		//!< Time from Particle.publish() until the Future completes
+
+inline uint32_t millis() {
+    static auto start = std::chrono::steady_clock::now();
+    return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+template<typename T>
+inline T constrain(T value, T low, T high) {
+    return (value < low) ? low : ((value > high) ? high : value);
+}
+
+inline void delay(uint32_t ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    mockWakeups++;
+}
+
+class PublishFlags {
+public:
+    PublishFlags(int value = 0) : value(value) {}
+    PublishFlags operator|(const PublishFlags &other) const { return PublishFlags(value | other.value); }
+    int value;
+};
+const PublishFlags PRIVATE(1);
+const PublishFlags NO_ACK(2);
+const PublishFlags WITH_ACK(8);
+
+#define WITH_LOCK(lock) for (std::unique_lock<typename std::remove_reference<decltype(lock)>::type> __lock##__LINE__((lock)); __lock##__LINE__; __lock##__LINE__.unlock())
+
+// Mutex
+typedef std::recursive_mutex *os_mutex_t;
+inline int os_mutex_create(os_mutex_t *mutex) { *mutex = new std::recursive_mutex(); return 0; }
+inline int os_mutex_lock(os_mutex_t mutex) { mutex->lock(); return 0; }
+inline int os_mutex_unlock(os_mutex_t mutex) { mutex->unlock(); return 0; }
+
+// Queue
+const uint32_t CONCURRENT_WAIT_FOREVER = (uint32_t)-1;
+
+struct MockQueue {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::vector<uint8_t>> items;
+    size_t itemSize;
+    size_t itemCount;
+};
+typedef MockQueue *os_queue_t;
+
+inline int os_queue_create(os_queue_t *queue, size_t item_size, size_t item_count, void *reserved) {
+    *queue = new MockQueue();
+    (*queue)->itemSize = item_size;
+    (*queue)->itemCount = item_count;
+    return 0;
+}
+
+inline int os_queue_put(os_queue_t queue, const void *item, uint32_t delay, void *reserved) {
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    if (queue->items.size() >= queue->itemCount) {
+        return 1;
+    }
+    const uint8_t *p = (const uint8_t *)item;
+    queue->items.push_back(std::vector<uint8_t>(p, p + queue->itemSize));
+    queue->cond.notify_one();
+    return 0;
+}
+
+inline int os_queue_take(os_queue_t queue, void *item, uint32_t delay, void *reserved) {
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    auto ready = [queue]() { return !queue->items.empty(); };
+    bool have;
+    if (delay == CONCURRENT_WAIT_FOREVER) {
+        queue->cond.wait(lock, ready);
+        have = true;
+    }
+    else {
+        have = queue->cond.wait_for(lock, std::chrono::milliseconds(delay), ready);
+    }
+    mockWakeups++;
+    if (!have) {
+        return 1;
+    }
+    memcpy(item, queue->items.front().data(), queue->itemSize);
+    queue->items.pop_front();
+    return 0;
+}
+
+// Thread
+const int OS_THREAD_PRIORITY_DEFAULT = 2;
+
+class Thread {
+public:
+    Thread(const char *name, std::function<void()> fn, int priority) : thread(fn) {}
+    void dispose() { if (thread.joinable()) thread.join(); }
+private:
+    std::thread thread;
+};
+
+// Future
+namespace particle {
+
+class Error {
+public:
+    Error(int type = 0) : type(type) {}
+    int type;
+};
+
+template<typename T>
+class Future {
+public:
+    struct State {
+        std::mutex mutex;
+        bool done = false;
+        bool succeeded = false;
+        std::vector<std::function<void(T)>> onSuccess;
+        std::vector<std::function<void(Error)>> onError;
+    };
+
+    Future() : state(std::make_shared<State>()) {}
+
+    bool isDone() const { std::lock_guard<std::mutex> lock(state->mutex); return state->done; }
+    bool isSucceeded() const { std::lock_guard<std::mutex> lock(state->mutex); return state->done && state->succeeded; }
+
+    Future &onSuccess(std::function<void(T)> cb) {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        if (!state->done) {
+            state->onSuccess.push_back(cb);
+        }
+        else if (state->succeeded) {
+            lock.unlock();
+            cb(T());
+        }
+        return *this;
+    }
+
+    Future &onError(std::function<void(Error)> cb) {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        if (!state->done) {
+            state->onError.push_back(cb);
+        }
+        else if (!state->succeeded) {
+            lock.unlock();
+            cb(Error());
+        }
+        return *this;
+    }
+
+    void complete(bool succeeded) {
+        std::vector<std::function<void(T)>> successCallbacks;
+        std::vector<std::function<void(Error)>> errorCallbacks;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->done = true;
+            state->succeeded = succeeded;
+            successCallbacks.swap(state->onSuccess);
+            errorCallbacks.swap(state->onError);
+        }
+        if (succeeded) {
+            for(auto &cb : successCallbacks) cb(T());
+        }
+        else {
+            for(auto &cb : errorCallbacks) cb(Error());
+        }
+    }
+
+private:
+    std::shared_ptr<State> state;
+};
+
+}
+
+class CloudClass {
+public:
+    particle::Future<bool> publish(const char *name, const char *data, PublishFlags flags) {
+        particle::Future<bool> future;
+        uint32_t latency = mockPublishLatencyMs;
+        bool succeeds = strcmp(data, "fail") != 0;
+        std::thread([future, latency, succeeds]() mutable {
+            std::this_thread::sleep_for(std::chrono::milliseconds(latency));
+            future.complete(succeeds);
+        }).detach();
+        return future;
+    }
+};
+extern CloudClass Particle;
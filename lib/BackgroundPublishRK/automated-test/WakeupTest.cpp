@@ -0,0 +1,93 @@
+#include "Particle.h"
+#include "BackgroundPublishRK.h"
+
+// Counts how often the publish thread wakes up while idle and while publishing.
+// The thread should block until there is something to do, not poll.
+// Also checks that withMaxInFlight() publishes can be in progress at the same time, and that
+// publishNoCopy() passes the caller's buffers through.
+
+std::atomic<uint32_t> mockWakeups(0);
+uint32_t mockPublishLatencyMs = 200;
+CloudClass Particle;
+
+static const uint32_t IDLE_MS = 2000;
+static const int NUM_PUBLISHES = 10;
+static const double MAX_WAKEUPS_PER_SECOND = 20.0;
+static const double MAX_WAKEUPS_PER_PUBLISH = 4.0;
+static const size_t MAX_IN_FLIGHT = 3;
+
+int main(int argc, char *argv[]) {
+    BackgroundPublishRK::instance().withMaxInFlight(MAX_IN_FLIGHT).start();
+
+    // Idle
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    mockWakeups = 0;
+    uint32_t start = millis();
+    std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_MS));
+    double idleRate = mockWakeups * 1000.0 / (millis() - start);
+    printf("idle: %.1f wakeups/sec\n", idleRate);
+
+    // Publishing, alternating success and failure
+    std::atomic<int> completed(0);
+    std::atomic<int> succeeded(0);
+    mockWakeups = 0;
+    start = millis();
+    for(int ii = 0; ii < NUM_PUBLISHES; ii++) {
+        const char *data = ((ii % 2) == 0) ? "ok" : "fail";
+        while(!BackgroundPublishRK::instance().publish("test", data, PRIVATE, [&](bool ok, const char *, const char *, const void *) {
+            if (ok) {
+                succeeded++;
+            }
+            completed++;
+        })) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    while(completed < NUM_PUBLISHES) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    double publishRate = mockWakeups * 1000.0 / (millis() - start);
+    double perPublish = (double)mockWakeups / NUM_PUBLISHES;
+    printf("publishing: %.1f wakeups/sec, %.1f per publish (%d publishes, %d succeeded, %u ms latency)\n", publishRate, perPublish, NUM_PUBLISHES, (int)succeeded, mockPublishLatencyMs);
+
+    // In flight window: MAX_IN_FLIGHT publishes are accepted at once and complete together
+    completed = 0;
+    start = millis();
+    size_t accepted = 0;
+    for(size_t ii = 0; ii < MAX_IN_FLIGHT + 1; ii++) {
+        if (BackgroundPublishRK::instance().publish("test", "ok", PRIVATE, [&](bool ok, const char *, const char *, const void *) {
+            completed++;
+        })) {
+            accepted++;
+        }
+    }
+    while(completed < (int)accepted) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    uint32_t windowMs = millis() - start;
+    printf("window: %u of %u accepted, completed in %u ms\n", (unsigned)accepted, (unsigned)(MAX_IN_FLIGHT + 1), windowMs);
+
+    // No copy: the callback gets the same pointers
+    static char noCopyName[] = "nocopy";
+    static char noCopyData[] = "ok";
+    std::atomic<bool> sameBuffers(false);
+    completed = 0;
+    BackgroundPublishRK::instance().publishNoCopy(noCopyName, noCopyData, PRIVATE, [&](bool ok, const char *name, const char *data, const void *) {
+        sameBuffers = (name == noCopyName && data == noCopyData);
+        completed++;
+    });
+    while(completed < 1) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    printf("no copy: %s\n", sameBuffers ? "same buffers" : "copied");
+
+    BackgroundPublishRK::instance().stop();
+
+    if (idleRate > MAX_WAKEUPS_PER_SECOND || perPublish > MAX_WAKEUPS_PER_PUBLISH || succeeded != NUM_PUBLISHES / 2 ||
+        accepted != MAX_IN_FLIGHT || windowMs >= 2 * mockPublishLatencyMs || !sameBuffers) {
+        printf("FAILED\n");
+        return 1;
+    }
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+// Host mock of the Device OS protocol limits used by BackgroundPublishRK
+
+namespace particle { namespace protocol {
+const size_t MAX_EVENT_NAME_LENGTH = 64;
+const size_t MAX_EVENT_DATA_LENGTH = 1024;
+} }
@@ -9,6 +9,14 @@
 
 BackgroundPublishRK *BackgroundPublishRK::_instance;
 
+// Number of wake() calls that can be pending. When the queue is full a wake is already pending,
+// and each time the thread wakes it checks all of the requests.
+static const size_t WAKE_QUEUE_SIZE = 4;
+
+// While a publish is in progress, the Future callbacks wake the thread. This is only a fallback
+// in case a callback is not called.
+static const uint32_t PUBLISH_CHECK_MS = 1000;
+
 BackgroundPublishRK::BackgroundPublishRK() {
 }
 
@@ -24,11 +32,34 @@ BackgroundPublishRK &BackgroundPublishRK::instance() {
     return *_instance;
 }
 
+BackgroundPublishRK &BackgroundPublishRK::withMaxInFlight(size_t maxInFlight)
+{
+    if(!requests)
+    {
+        if(maxInFlight < 1)
+        {
+            maxInFlight = 1;
+        }
+        if(maxInFlight > MAX_IN_FLIGHT)
+        {
+            maxInFlight = MAX_IN_FLIGHT;
+        }
+        this->maxInFlight = maxInFlight;
+    }
+    return *this;
+}
+
 void BackgroundPublishRK::start()
 {
     if(!thread)
     {
-        os_mutex_create(&mutex);
+        if(!requests)
+        {
+            os_mutex_create(&mutex);
+            os_queue_create(&queue, sizeof(uint8_t), WAKE_QUEUE_SIZE, NULL);
+            requests = new PublishRequest[maxInFlight];
+        }
+        state = BACKGROUND_PUBLISH_IDLE;
 
         // use OS_THREAD_PRIORITY_DEFAULT so that application, system, and
         // background publish thread will all run at the same priority and
@@ -44,6 +75,7 @@ void BackgroundPublishRK::stop()
     if(thread)
     {
         state = BACKGROUND_PUBLISH_STOP;
+        wake();
         thread->dispose();
         delete thread;
         thread = NULL;
@@ -52,101 +84,169 @@ void BackgroundPublishRK::stop()
 
 void BackgroundPublishRK::thread_f()
 {
-    while(true)
+    while(state != BACKGROUND_PUBLISH_STOP)
     {
-        while(state == BACKGROUND_PUBLISH_IDLE)
-        {
-            // yield to rest of system while we wait
-            // a condition variable would be ideal but doesn't look like
-            // std::condition_variable is supported
-            delay(1);
-        }
+        bool inProgress = processRequests();
 
-        if(state == BACKGROUND_PUBLISH_STOP)
-        {
-            return;
-        }
+        // block until publish(), stop(), or a completed publish wakes the thread
+        uint8_t msg;
+        os_queue_take(queue, &msg, inProgress ? PUBLISH_CHECK_MS : CONCURRENT_WAIT_FOREVER, NULL);
+    }
+}
 
-        // temporarily acquire the lock
-        // this allows a calling thread to block the publish thread if it needs
-        // additional synchronization around a publish request and acts as a
-        // memory barrier around publish arguments to ensure all updates
-        // are complete
-        lock();
-        unlock();
-
-        // kick off the publish
-        // WITH_ACK does not work as expected from a background thread
-        // use the Future<bool> object directly as its default wait
-        // (used by WITH_ACK) short-circuits when not called from the
-        // main application thread
-        auto ok = Particle.publish(event_name, event_data, event_flags);
-
-        // then wait for publish to complete
-        while(!ok.isDone() && state != BACKGROUND_PUBLISH_STOP)
-        {
-            // yield to rest of system while we wait
-            delay(1);
-        }
+bool BackgroundPublishRK::processRequests()
+{
+    bool inProgress = false;
 
-        if(completed_cb)
+    for(size_t ii = 0; ii < maxInFlight && state != BACKGROUND_PUBLISH_STOP; ii++)
+    {
+        PublishRequest &req = requests[ii];
+
+        if(req.state == BACKGROUND_PUBLISH_REQUESTED)
         {
-            completed_cb(ok.isSucceeded(),
-                event_name,
-                event_data,
-                event_context);
+            // temporarily acquire the lock
+            // this allows a calling thread to block the publish thread if it needs
+            // additional synchronization around a publish request and acts as a
+            // memory barrier around publish arguments to ensure all updates
+            // are complete
+            lock();
+            unlock();
+
+            // kick off the publish
+            // WITH_ACK does not work as expected from a background thread
+            // use the Future<bool> object directly as its default wait
+            // (used by WITH_ACK) short-circuits when not called from the
+            // main application thread
+            req.future = Particle.publish(req.event_name, req.event_data, req.event_flags);
+            req.state = BACKGROUND_PUBLISH_IN_PROGRESS;
+
+            // the Future callbacks are called from the system thread when
+            // the publish completes, and may be called immediately if it
+            // already has
+            req.future.onSuccess([this](bool) { wake(); });
+            req.future.onError([this](particle::Error) { wake(); });
         }
 
-        WITH_LOCK(*this)
+        if(req.state == BACKGROUND_PUBLISH_IN_PROGRESS)
         {
-            if(state == BACKGROUND_PUBLISH_STOP)
+            if(!req.future.isDone())
+            {
+                inProgress = true;
+                continue;
+            }
+
+            if(req.completed_cb)
             {
-                return;
+                req.completed_cb(req.future.isSucceeded(),
+                    req.event_name,
+                    req.event_data,
+                    req.event_context);
+            }
+
+            WITH_LOCK(*this)
+            {
+                req.event_name = req.event_data = NULL;
+                req.event_context = NULL;
+                req.completed_cb = NULL;
+                req.state = BACKGROUND_PUBLISH_IDLE;
             }
-            event_context = NULL;
-            completed_cb = NULL;
-            state = BACKGROUND_PUBLISH_IDLE;
         }
     }
+
+    return inProgress;
 }
 
 bool BackgroundPublishRK::publish(const char *name, const char *data, PublishFlags flags, PublishCompletedCallback cb, const void *context)
+{
+    return publishCommon(name, data, flags, cb, context, true);
+}
+
+bool BackgroundPublishRK::publishNoCopy(const char *name, const char *data, PublishFlags flags, PublishCompletedCallback cb, const void *context)
+{
+    return publishCommon(name, data, flags, cb, context, false);
+}
+
+bool BackgroundPublishRK::publishCommon(const char *name, const char *data, PublishFlags flags, PublishCompletedCallback cb, const void *context, bool copy)
 {
     // protect against separate threads trying to publish at the same time
     WITH_LOCK(*this)
-
-    // check currently in idle state and ready to accept publish request
-    if(!thread || state != BACKGROUND_PUBLISH_IDLE)
     {
-        return false;
-    }
+        // check running and ready to accept publish request
+        if(!thread || state != BACKGROUND_PUBLISH_IDLE)
+        {
+            return false;
+        }
 
-    // event name is required to publish
-    // all other arguments may be be left out or defaulted
-    if(!name)
-    {
-        return false;
-    }
+        // event name is required to publish
+        // all other arguments may be be left out or defaulted
+        if(!name)
+        {
+            return false;
+        }
 
-    // have the lock and thread is currently idle
-    // safe to prepare publish request
-    strncpy(event_name, name, sizeof(event_name));
-    event_name[sizeof(event_name)-1] = '\0'; // ensure null termination
+        // find a request that is not in use
+        PublishRequest *req = NULL;
+        for(size_t ii = 0; ii < maxInFlight; ii++)
+        {
+            if(requests[ii].state == BACKGROUND_PUBLISH_IDLE)
+            {
+                req = &requests[ii];
+                break;
+            }
+        }
+        if(!req)
+        {
+            return false;
+        }
 
-    if(data)
-    {
-        strncpy(event_data, data, sizeof(event_data));
-        event_data[sizeof(event_data)-1] = '\0'; // ensure null termination
-    }
-    else
-    {
-        event_data[0] = '\0'; // null terminate at start for no event data
-    }
+        if(!data)
+        {
+            data = "";
+        }
+
+        // have the lock and the request is idle
+        // safe to prepare publish request
+        if(copy)
+        {
+            if(!req->buffer)
+            {
+                req->buffer = new char[BUFFER_SIZE];
+                if(!req->buffer)
+                {
+                    return false;
+                }
+            }
+
+            const size_t nameSize = particle::protocol::MAX_EVENT_NAME_LENGTH + 1;
+            char *event_name = req->buffer;
+            char *event_data = &req->buffer[nameSize];
+
+            strncpy(event_name, name, nameSize);
+            event_name[nameSize-1] = '\0'; // ensure null termination
 
-    completed_cb = cb;
-    event_context = context;
-    event_flags = flags;
-    state = BACKGROUND_PUBLISH_REQUESTED;
+            strncpy(event_data, data, BUFFER_SIZE - nameSize);
+            event_data[BUFFER_SIZE - nameSize - 1] = '\0'; // ensure null termination
+
+            name = event_name;
+            data = event_data;
+        }
+
+        req->event_name = name;
+        req->event_data = data;
+
+        req->completed_cb = cb;
+        req->event_context = context;
+        req->event_flags = flags;
+        req->state = BACKGROUND_PUBLISH_REQUESTED;
+        wake();
+    }
 
     return true;
 }
+
+void BackgroundPublishRK::wake()
+{
+    // a full queue already has a pending wake, so the result is ignored
+    uint8_t msg = 0;
+    os_queue_put(queue, &msg, 0, NULL);
+}
@@ -14,6 +14,7 @@ typedef enum {
     BACKGROUND_PUBLISH_IDLE = 0,	//!< Not currently publishing
     BACKGROUND_PUBLISH_REQUESTED,	//!< Publish started
     BACKGROUND_PUBLISH_STOP,		//!< Thread stopped (need to start again to publish)
+    BACKGROUND_PUBLISH_IN_PROGRESS,	//!< Particle.publish called, waiting for it to complete
 } publish_thread_state_t;
 
 /**
@@ -51,6 +52,26 @@ public:
      */
     static BackgroundPublishRK &instance();
 
+    /**
+     * @brief Set the number of publishes that can be in progress at the same time. Default = 1.
+     *
+     * @param maxInFlight The number of publishes, from 1 to MAX_IN_FLIGHT.
+     *
+     * Must be called before start(). Each publish() in progress uses a buffer for a copy of the
+     * event name and data; publishNoCopy() does not.
+     *
+     * With more than one, publish() can be called again before the previous publish has been
+     * acknowledged, which is faster when the acknowledgement takes a long time. The callbacks
+     * are called in the order the publishes complete, which may not be the order they were made.
+     * You are still responsible for not publishing faster than the cloud allows.
+     */
+    BackgroundPublishRK &withMaxInFlight(size_t maxInFlight);
+
+    /**
+     * @brief Get the number of publishes that can be in progress at the same time
+     */
+    size_t getMaxInFlight() const { return maxInFlight; };
+
     /**
      * @brief Start the background publish thread. Required!
      *
@@ -93,6 +114,30 @@ public:
         PublishCompletedCallback cb = NULL,
         const void *context = NULL);
 
+    /**
+     * @brief Publish without copying the event name and data
+     *
+     * @param name Event name to publish (required)
+     *
+     * @param data Event data, or NULL for none.
+     *
+     * @param flags The publish flags, typically `PRIVATE | WITH_ACK`.
+     *
+     * @param cb The callback function to call when the publish completes. The name and data passed to it
+     * are the pointers passed to this method.
+     *
+     * @param context Optional parameter passed to the callback.
+     *
+     * The name and data must not be changed or freed until the callback returns. This is for callers that
+     * already keep the event in a buffer until it's sent, such as a queue. Unlike publish(), it does not
+     * need the buffers for a copy of the event name and data.
+     */
+    bool publishNoCopy(const char *name,
+        const char *data,
+        PublishFlags flags,
+        PublishCompletedCallback cb,
+        const void *context = NULL);
+
     /**
      * @brief Used internally to mutex lock to safely access data structures from multiple threads
      *
@@ -105,6 +150,11 @@ public:
      */
     void unlock() { os_mutex_unlock(mutex); };
 
+    /**
+     * @brief The largest value for withMaxInFlight(), the number of events the cloud accepts in a burst
+     */
+    static const size_t MAX_IN_FLIGHT = 4;
+
 private:
     /**
      * @brief Constructor - This class is a singleton and you cannot construct one.
@@ -130,18 +180,57 @@ private:
     BackgroundPublishRK& operator=(const BackgroundPublishRK&) = delete;
 
 
+    /**
+     * @brief Wake the publish thread to check state, or the result of a publish
+     *
+     * Called from publish(), stop(), and the Future callbacks when a publish completes.
+     */
+    void wake();
+
+    /**
+     * @brief A publish request. There are maxInFlight of them, allocated during start().
+     */
+    struct PublishRequest {
+        volatile publish_thread_state_t state = BACKGROUND_PUBLISH_IDLE; //!< IDLE, REQUESTED, or IN_PROGRESS
+
+        // arguments for Particle.publish
+        const char *event_name = NULL;	//!< name passed to publish, points into buffer or to the caller's name for publishNoCopy
+        const char *event_data = NULL;	//!< event data passed to publish (may be empty string)
+        PublishFlags event_flags; 	//!< event flags, typically PRIVATE, PRIVATE | WITH_ACK, or PRIVATE | NO_ACK.
+        // callback when publish completes
+        PublishCompletedCallback completed_cb = NULL; 	//!< Completion callback (optional)
+        const void *event_context = NULL; 		//!< Context passed to completion (optional)
+
+        particle::Future<bool> future;	//!< Result of Particle.publish. Only used while IN_PROGRESS; kept until the next publish replaces it.
+
+        char *buffer = NULL;	//!< Copy of the name and data for publish(), BUFFER_SIZE bytes. Allocated the first time it's used.
+    };
+
+    /**
+     * @brief Size of the buffer for the name and data, both null terminated
+     */
+    static const size_t BUFFER_SIZE = particle::protocol::MAX_EVENT_NAME_LENGTH + 1 + particle::protocol::MAX_EVENT_DATA_LENGTH + 1;
+
+    /**
+     * @brief Common code for publish() and publishNoCopy()
+     */
+    bool publishCommon(const char *name, const char *data, PublishFlags flags, PublishCompletedCallback cb, const void *context, bool copy);
+
+    /**
+     * @brief Start publishes that were requested and complete publishes that are done
+     *
+     * @return true if there are publishes in progress
+     */
+    bool processRequests();
+
     Thread *thread = NULL;		//!< Thread object pointer. Allocated during start()
     void thread_f();			//!< Thread function, passed to the Thread object
     os_mutex_t mutex;	//!< Mutex to protect access to class members from multiple threads
-    volatile publish_thread_state_t state = BACKGROUND_PUBLISH_IDLE; //!< Current state
-
-    // arguments for Particle.publish
-    char event_name[particle::protocol::MAX_EVENT_NAME_LENGTH+1];	//!< name passed to publish
-    char event_data[particle::protocol::MAX_EVENT_DATA_LENGTH+1];	//!< event data passed to publish (may be empty string)
-    PublishFlags event_flags; 	//!< event flags, typically PRIVATE, PRIVATE | WITH_ACK, or PRIVATE | NO_ACK.
-    // callback when publish completes
-    PublishCompletedCallback completed_cb = NULL; 	//!< Completion callback (optional)
-    const void *event_context = NULL; 		//!< Context passed to completion (optional)
+    os_queue_t queue = NULL;	//!< The thread blocks on this queue until wake() is called
+    volatile publish_thread_state_t state = BACKGROUND_PUBLISH_IDLE; //!< IDLE while running, or STOP
+
+    size_t maxInFlight = 1;		//!< Number of publish requests
+    PublishRequest *requests = NULL;	//!< Array of maxInFlight publish requests. Allocated during start()
 
     static BackgroundPublishRK *_instance; //!< Singleton instance of this class
 };
@@ -0,0 +1,132 @@
+#include "Particle.h"
+#include "PublishQueuePacing.h"
+#include "TestAssert.h"
+
+#include <vector>
+
+// Checks the PublishQueuePacing delays: the interval shrinks after quick acknowledgements and doubles
+// after failures and slow ones, retries back off exponentially with jitter, starts never exceed the
+// cloud rate limit, and the acknowledgement time percentiles.
+
+typedef PublishQueuePacing P;
+
+static void testInterval() {
+    PublishQueuePacing pacing;
+    pacing.reset(1000, 2000, 30000);
+    assertInt("", pacing.getIntervalMs(), 1000);
+
+    for(int ii = 0; ii < 5; ii++) {
+        pacing.publishCompleted(true, 300, false);
+    }
+    assertInt("", pacing.getIntervalMs(), 1000 - 5 * P::INTERVAL_STEP_MS);
+    for(int ii = 0; ii < 100; ii++) {
+        pacing.publishCompleted(true, 300, false);
+    }
+    assertInt("", pacing.getIntervalMs(), P::MIN_INTERVAL_MS);
+
+    pacing.publishCompleted(true, P::SLOW_ACK_MS + 1, false);
+    assertInt("", pacing.getIntervalMs(), 2 * P::MIN_INTERVAL_MS);
+    pacing.publishCompleted(false, 0, false);
+    assertInt("", pacing.getIntervalMs(), 4 * P::MIN_INTERVAL_MS);
+    for(int ii = 0; ii < 10; ii++) {
+        pacing.publishCompleted(false, 0, false);
+    }
+    assertInt("", pacing.getIntervalMs(), P::MAX_INTERVAL_MS);
+}
+
+static void testConnectDelay() {
+    PublishQueuePacing pacing;
+    pacing.reset(1000, 2000, 30000);
+
+    pacing.publishCompleted(true, 300, false);
+    assertInt("", pacing.getConnectDelayMs(), 2000);
+    pacing.publishCompleted(true, 300, true);
+    assertInt("", pacing.getConnectDelayMs(), 2000 - P::CONNECT_DELAY_STEP_MS);
+    for(int ii = 0; ii < 20; ii++) {
+        pacing.publishCompleted(true, 300, true);
+    }
+    assertInt("", pacing.getConnectDelayMs(), P::MIN_CONNECT_DELAY_MS);
+    pacing.publishCompleted(false, 0, true);
+    assertInt("", pacing.getConnectDelayMs(), 2 * P::MIN_CONNECT_DELAY_MS);
+}
+
+static void testRetry() {
+    PublishQueuePacing pacing;
+    pacing.reset(1000, 2000, 30000);
+
+    for(int trial = 0; trial < 200; trial++) {
+        pacing.publishCompleted(true, 300, false);
+        unsigned long expected = P::MIN_RETRY_DELAY_MS;
+        for(int ii = 0; ii < 8; ii++) {
+            pacing.publishCompleted(false, 0, false);
+            unsigned long delayMs = pacing.getRetryDelayMs();
+            assertTrue("", delayMs >= expected / 2);
+            assertTrue("", delayMs <= expected);
+            assertInt("", pacing.getStats().consecutiveFailures, (size_t)ii + 1);
+            expected = (expected * 2 < 30000) ? expected * 2 : 30000;
+        }
+    }
+}
+
+static void testRateLimit() {
+    PublishQueuePacing pacing;
+    pacing.reset(1000, 2000, 30000);
+
+    // Start whenever allowed for 60 seconds
+    std::vector<unsigned long> starts;
+    for(unsigned long now = 0; now < 60000; now += 10) {
+        while(pacing.getRateLimitWaitMs(now) == 0) {
+            pacing.publishStarted(now);
+            starts.push_back(now);
+        }
+    }
+    // A burst of 4, then one a second
+    assertTrue("", starts.size() >= 4);
+    assertInt("", starts[3], 0);
+    assertInt("", starts.size(), 4 + 59);
+    for(size_t ii = 0; ii < starts.size(); ii++) {
+        for(size_t jj = ii + 4; jj < starts.size(); jj++) {
+            assertTrue("", starts[jj] - starts[ii] >= (jj - ii - 3) * P::RATE_LIMIT_MS);
+        }
+    }
+
+    // After being idle the burst is available again
+    unsigned long now = 120000;
+    for(int ii = 0; ii < 4; ii++) {
+        assertInt("", pacing.getRateLimitWaitMs(now), 0);
+        pacing.publishStarted(now);
+    }
+    assertInt("", pacing.getRateLimitWaitMs(now), P::RATE_LIMIT_MS);
+}
+
+static void testPercentiles() {
+    PublishQueuePacing pacing;
+    pacing.reset(1000, 2000, 30000);
+    assertInt("", pacing.getStats().numSamples, 0);
+    assertInt("", pacing.getStats().rttP50Ms, 0);
+
+    // Only the most recent RTT_SAMPLES are kept
+    for(int ii = 0; ii < 10; ii++) {
+        pacing.publishCompleted(true, 9000, false);
+    }
+    for(unsigned long ii = 1; ii <= P::RTT_SAMPLES; ii++) {
+        pacing.publishCompleted(true, ii * 100, false);
+        pacing.publishCompleted(false, 50, false);
+    }
+    PublishQueuePacing::Stats stats = pacing.getStats();
+    assertInt("", stats.numSamples, P::RTT_SAMPLES);
+    assertInt("", stats.rttMaxMs, P::RTT_SAMPLES * 100);
+    assertInt("", stats.rttP50Ms, 1600);
+    assertInt("", stats.rttP90Ms, 2800);
+}
+
+int main(int argc, char *argv[]) {
+    testInterval();
+    testConnectDelay();
+    testRetry();
+    testRateLimit();
+    testPercentiles();
+
+    printf("pacing test passed\n");
+    return 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+// Minimal host mock of the Device OS APIs used by PublishQueueEventPool and PublishQueuePacing
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mutex>
+#include <type_traits>
+
+class Logger {
+public:
+    Logger(const char *name) {}
+    template<typename... Args> void trace(const char *fmt, Args... args) const {}
+    template<typename... Args> void info(const char *fmt, Args... args) const {}
+    template<typename... Args> void error(const char *fmt, Args... args) const { printf("ERROR: "); printf(fmt, args...); printf("\n"); }
+};
+
+#define WITH_LOCK(lock) for (std::unique_lock<typename std::remove_reference<decltype(lock)>::type> __lock##__LINE__((lock)); __lock##__LINE__; __lock##__LINE__.unlock())
+
+// Mutex
+typedef std::mutex *os_mutex_t;
+inline int os_mutex_create(os_mutex_t *mutex) { *mutex = new std::mutex(); return 0; }
+inline int os_mutex_lock(os_mutex_t mutex) { mutex->lock(); return 0; }
+inline int os_mutex_unlock(os_mutex_t mutex) { mutex->unlock(); return 0; }
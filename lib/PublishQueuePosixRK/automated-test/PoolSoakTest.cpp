@@ -0,0 +1,227 @@
+#include "Particle.h"
+#include "PublishQueueEventPool.h"
+#include "TestAssert.h"
+
+#include <random>
+#include <thread>
+#include <vector>
+
+// Soak test for PublishQueueEventPool: millions of allocations of random sizes, freed in random
+// order, as events of different sizes are queued and sent for a long time. Checks that an
+// allocation only fails when every block it fits in is in use, that live blocks never overlap,
+// that the statistics match, and that every block can still be allocated at the end, so
+// nothing has fragmented or leaked. Then repeats it from several threads at once.
+
+// Same as PublishQueuePosix: sizeof(PublishQueueEvent) + 128, 384 and MAX_EVENT_DATA_LENGTH bytes of data
+static const size_t HEADER_SIZE = 67;
+static const size_t NUM_CLASSES = 3;
+static const size_t blockSizes[NUM_CLASSES] = { HEADER_SIZE + 128, HEADER_SIZE + 384, HEADER_SIZE + 1024 };
+static const size_t numBlocks[NUM_CLASSES] = { 8, 4, 5 };
+
+static const int NUM_OPERATIONS = 2000000;
+static const int NUM_THREADS = 4;
+static const int THREAD_OPERATIONS = 200000;
+
+struct Allocation {
+    uint8_t *ptr;
+    size_t size;
+    uint8_t fill;
+};
+
+// Random event size, mostly small like typical JSON reports
+static size_t randomSize(std::mt19937 &rng) {
+    uint32_t r = rng() % 100;
+    if (r < 70) {
+        return HEADER_SIZE + rng() % 129;
+    }
+    if (r < 90) {
+        return HEADER_SIZE + rng() % 385;
+    }
+    return HEADER_SIZE + rng() % 1025;
+}
+
+// Index of the smallest class the size fits in, using the block sizes after rounding by the pool
+static size_t classFor(size_t size) {
+    size_t ii = 0;
+    while(size > PublishQueueEventPool::instance().getStats(ii).blockSize) {
+        ii++;
+    }
+    return ii;
+}
+
+static void checkFill(const Allocation &a) {
+    for(size_t ii = 0; ii < a.size; ii++) {
+        assertInt("", a.ptr[ii], a.fill);
+    }
+}
+
+static void singleThread(PublishQueueEventPool &pool) {
+    std::mt19937 rng(1234);
+    std::vector<Allocation> live;
+    size_t inUse[NUM_CLASSES] = {0};
+    size_t failures = 0;
+
+    for(int op = 0; op < NUM_OPERATIONS; op++) {
+        // Allocate a little more often than free so the pool is often full
+        if (live.empty() || rng() % 100 < 52) {
+            size_t size = randomSize(rng);
+            Allocation a;
+            a.ptr = (uint8_t *)pool.alloc(size);
+            a.size = size;
+            a.fill = (uint8_t)op;
+
+            // Expected to fail only if this class and all larger classes are full
+            bool full = true;
+            for(size_t ii = classFor(size); ii < NUM_CLASSES; ii++) {
+                if (inUse[ii] < numBlocks[ii]) {
+                    full = false;
+                }
+            }
+            if (!a.ptr) {
+                assertTrue("", full);
+                failures++;
+                continue;
+            }
+            assertTrue("", !full);
+
+            // Find the class it came from from the stats
+            size_t found = NUM_CLASSES;
+            for(size_t ii = 0; ii < NUM_CLASSES; ii++) {
+                if (pool.getStats(ii).inUse != inUse[ii]) {
+                    found = ii;
+                }
+            }
+            assertTrue("", found < NUM_CLASSES);
+            assertTrue("", found >= classFor(size));
+            inUse[found]++;
+
+            memset(a.ptr, a.fill, a.size);
+            live.push_back(a);
+        }
+        else {
+            size_t index = rng() % live.size();
+            Allocation a = live[index];
+            live[index] = live.back();
+            live.pop_back();
+
+            // Overlapping blocks would have overwritten the fill
+            checkFill(a);
+            size_t before[NUM_CLASSES];
+            for(size_t ii = 0; ii < NUM_CLASSES; ii++) {
+                before[ii] = pool.getStats(ii).inUse;
+            }
+            pool.free(a.ptr);
+            for(size_t ii = 0; ii < NUM_CLASSES; ii++) {
+                if (pool.getStats(ii).inUse != before[ii]) {
+                    inUse[ii]--;
+                }
+            }
+        }
+    }
+
+    size_t totalFailures = 0;
+    for(size_t ii = 0; ii < NUM_CLASSES; ii++) {
+        PublishQueueEventPool::Stats stats = pool.getStats(ii);
+        printf("class %u: blockSize=%u numBlocks=%u inUse=%u highWater=%u failures=%u\n", (unsigned)ii, (unsigned)stats.blockSize,
+            (unsigned)stats.numBlocks, (unsigned)stats.inUse, (unsigned)stats.highWater, (unsigned)stats.failures);
+        assertInt("", stats.inUse, inUse[ii]);
+        assertInt("", stats.highWater, stats.numBlocks);
+        totalFailures += stats.failures;
+    }
+    assertInt("", totalFailures, failures);
+    assertInt("", pool.getFailures(), failures);
+    printf("single thread: %d operations, %u failures when full\n", NUM_OPERATIONS, (unsigned)failures);
+
+    for(auto it = live.begin(); it != live.end(); it++) {
+        checkFill(*it);
+        pool.free(it->ptr);
+    }
+}
+
+// After everything is freed, every block can be allocated again and the blocks are distinct
+static void checkAllFree(PublishQueueEventPool &pool) {
+    std::vector<uint8_t *> blocks;
+    for(size_t ii = 0; ii < NUM_CLASSES; ii++) {
+        assertInt("", pool.getStats(ii).inUse, 0);
+    }
+    for(size_t ii = NUM_CLASSES; ii > 0; ii--) {
+        for(size_t jj = 0; jj < numBlocks[ii - 1]; jj++) {
+            uint8_t *ptr = (uint8_t *)pool.alloc(blockSizes[ii - 1]);
+            assertTrue("", ptr);
+            memset(ptr, (int)blocks.size(), blockSizes[ii - 1]);
+            blocks.push_back(ptr);
+        }
+    }
+    size_t failures = pool.getFailures();
+    assertTrue("", pool.alloc(1) == NULL);
+    assertInt("", pool.getFailures(), failures + 1);
+    assertTrue("", pool.alloc(pool.getStats(NUM_CLASSES - 1).blockSize + 1) == NULL);
+    assertInt("", pool.getFailures(), failures + 1);
+    for(size_t ii = 0; ii < blocks.size(); ii++) {
+        assertInt("", blocks[ii][0], (uint8_t)ii);
+        pool.free(blocks[ii]);
+    }
+}
+
+static void threadSoak(PublishQueueEventPool &pool, int seed) {
+    std::mt19937 rng(seed);
+    std::vector<Allocation> live;
+
+    for(int op = 0; op < THREAD_OPERATIONS; op++) {
+        if (live.size() < 3 && rng() % 100 < 55) {
+            Allocation a;
+            a.size = randomSize(rng);
+            a.ptr = (uint8_t *)pool.alloc(a.size);
+            a.fill = (uint8_t)(seed * 31 + op);
+            if (a.ptr) {
+                memset(a.ptr, a.fill, a.size);
+                live.push_back(a);
+            }
+        }
+        else
+        if (!live.empty()) {
+            size_t index = rng() % live.size();
+            checkFill(live[index]);
+            pool.free(live[index].ptr);
+            live[index] = live.back();
+            live.pop_back();
+        }
+    }
+    for(auto it = live.begin(); it != live.end(); it++) {
+        checkFill(*it);
+        pool.free(it->ptr);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    PublishQueueEventPool &pool = PublishQueueEventPool::instance();
+
+    // Before setup() the heap is used
+    void *heap = pool.alloc(10);
+    assertTrue("", heap);
+
+    assertTrue("", pool.setup(blockSizes, numBlocks, NUM_CLASSES));
+    assertInt("", pool.getNumSizeClasses(), NUM_CLASSES);
+    for(size_t ii = 0; ii < NUM_CLASSES; ii++) {
+        assertTrue("", pool.getStats(ii).blockSize >= blockSizes[ii]);
+        assertInt("", pool.getStats(ii).blockSize % PublishQueueEventPool::BLOCK_ALIGN, 0);
+    }
+    pool.free(heap);
+    assertInt("", pool.getStats(0).inUse, 0);
+
+    singleThread(pool);
+    checkAllFree(pool);
+
+    std::vector<std::thread> threads;
+    for(int ii = 0; ii < NUM_THREADS; ii++) {
+        threads.push_back(std::thread([&pool, ii]() { threadSoak(pool, ii + 1); }));
+    }
+    for(auto it = threads.begin(); it != threads.end(); it++) {
+        it->join();
+    }
+    printf("%d threads: %d operations each\n", NUM_THREADS, THREAD_OPERATIONS);
+    checkAllFree(pool);
+
+    printf("pool soak test passed\n");
+    return 0;
+}
@@ -0,0 +1,268 @@
+#include "Particle.h"
+#include "PublishQueuePosixRK.h"
+#include "SimCloud.h"
+#include "SimMock.h"
+#include "TestAssert.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Checks how damaged events are found and discarded: queue files that fail the CRC check or are shorter
+// than their header says are not read, files written by version 1 without a CRC still are, and
+// PublishQueuePosix sends the rest and counts the discarded ones in Metrics::evictedCorrupted. In the
+// ring file, a record whose data is corrupted is discarded without losing the records after it, and one
+// whose header is corrupted discards the rest of the ring and counts them in getNumCorrupted(). Events
+// that can't be written to the file system are counted in Metrics::evictedWriteFailed.
+
+static const char *TEST_DIR = "/tmp/CorruptionTest";
+
+static PublishQueueEvent *makeEvent(const std::string &data) {
+    PublishQueueEvent *event = PublishQueuePosix::allocEvent(data.size());
+    assertTrue("", event);
+    event->flags = PRIVATE | WITH_ACK;
+    strcpy(event->eventName, "t");
+    strcpy(event->eventData, data.c_str());
+    return event;
+}
+
+static void writeEvent(PublishQueueStorageEngine &engine, const std::string &data) {
+    PublishQueueEvent *event = makeEvent(data);
+    assertTrue("", engine.writeEvent(event));
+    PublishQueuePosix::freeEvent(event);
+}
+
+static std::string readEvent(PublishQueueStorageEngine &engine, size_t index) {
+    uint32_t id;
+    PublishQueueEvent *event = engine.readEvent(index, id);
+    if (!event) {
+        return "";
+    }
+    std::string result = event->eventData;
+    PublishQueuePosix::freeEvent(event);
+    return result;
+}
+
+static std::string drain(PublishQueueStorageEngine &engine) {
+    std::string result;
+    while(engine.getQueueLen()) {
+        result += readEvent(engine, 0) + ",";
+        engine.removeFront();
+    }
+    return result;
+}
+
+static std::string makeDir(const char *name) {
+    std::string dir = std::string(TEST_DIR) + "/" + name;
+    std::string cmd = std::string("mkdir -p ") + dir;
+    system(cmd.c_str());
+    return dir;
+}
+
+static off_t getFileSize(const std::string &path) {
+    struct stat sb;
+    return (stat(path.c_str(), &sb) == 0) ? sb.st_size : -1;
+}
+
+// Adds value to the byte at offset in the file
+static void corrupt(const std::string &path, off_t offset, uint8_t value) {
+    FILE *fp = fopen(path.c_str(), "r+");
+    assertTrue("", fp);
+    fseek(fp, offset, SEEK_SET);
+    uint8_t c = (uint8_t)fgetc(fp);
+    fseek(fp, offset, SEEK_SET);
+    fputc((uint8_t)(c + value), fp);
+    fclose(fp);
+}
+
+// Writes a queue file as version 1 did: an 8-byte header without the event size or a CRC
+static void writeVersion1File(SequentialFile &files, const std::string &data) {
+    PublishQueueEvent *event = makeEvent(data);
+    PublishQueueFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PublishQueuePosix::FILE_MAGIC;
+    hdr.version = 1;
+    hdr.headerSize = PublishQueuePosix::FILE_HEADER_SIZE_V1;
+    hdr.nameLen = sizeof(PublishQueueEvent::eventName);
+
+    int fileNum = files.reserveFile();
+    FILE *fp = fopen(files.getPathForFileNum(fileNum), "w");
+    assertTrue("", fp);
+    fwrite(&hdr, 1, PublishQueuePosix::FILE_HEADER_SIZE_V1, fp);
+    fwrite(event, 1, sizeof(PublishQueueEvent) + data.size(), fp);
+    fclose(fp);
+    files.addFileToQueue(fileNum);
+    PublishQueuePosix::freeEvent(event);
+}
+
+// Creates the files in dir, checks them with the file per event engine, and returns the events that can be read
+static std::string writeQueueFiles(const std::string &dir) {
+    SequentialFile files;
+    files.withDirPath(dir.c_str());
+    files.scanDir();
+    PublishQueueFileEngine engine(files);
+    assertTrue("", engine.setup());
+
+    for(int ii = 0; ii < 4; ii++) {
+        writeEvent(engine, "F" + std::to_string(ii));
+    }
+    writeVersion1File(files, "V4");
+    assertInt("", engine.getQueueLen(), 5);
+
+    // F1 has a changed byte in its data, so it fails the CRC check
+    corrupt(files.getPathForFileNum(files.getFileFromQueueAt(1)).c_str(), sizeof(PublishQueueFileHeader) + offsetof(PublishQueueEvent, eventData), 1);
+
+    // F2 is shorter than its header says, like a file written when the reset happened
+    std::string path = files.getPathForFileNum(files.getFileFromQueueAt(2)).c_str();
+    truncate(path.c_str(), getFileSize(path) - 1);
+
+    std::string result;
+    for(size_t ii = 0; ii < engine.getQueueLen(); ii++) {
+        result += readEvent(engine, ii) + ",";
+    }
+    assertStr("", result.c_str(), "F0,,,F3,V4,");
+
+    // A version 1 file with a changed byte is still read, as there's no CRC to check
+    writeVersion1File(files, "V5");
+    corrupt(files.getPathForFileNum(files.getFileFromQueueAt(5)).c_str(), PublishQueuePosix::FILE_HEADER_SIZE_V1 + offsetof(PublishQueueEvent, eventData), 1);
+    assertStr("", readEvent(engine, 5).c_str(), "W5");
+    files.removeFileNum(files.getFileFromQueueAt(5), false);
+
+    return result;
+}
+
+static void testFileQueue() {
+    std::string dir = makeDir("files");
+    writeQueueFiles(dir);
+
+    std::vector<std::string> received;
+    SimCloud::Settings cloudSettings;
+    SimCloud &cloud = SimCloud::instance();
+    cloud.withSettings(cloudSettings, 1)
+        .withReceivedCallback([&received](const char *eventName, const char *eventData) { received.push_back(eventData); });
+
+    PublishQueuePosix &pq = PublishQueuePosix::instance();
+    pq.withDirPath(dir.c_str()).setup();
+    simRunThreads();
+    assertInt("", pq.getNumEvents(), 5);
+
+    uint32_t startMs = millis();
+    while(millis() - startMs < 60000 && !(pq.getNumEvents() == 0 && cloud.idle() && pq.getCanSleep())) {
+        simAdvanceMillis(10);
+        cloud.advance();
+        simRunThreads();
+        pq.loop();
+        simRunThreads();
+    }
+    assertInt("", pq.getNumEvents(), 0);
+
+    // A publish that fails is retried after the ones in flight with it, so the order can change
+    std::sort(received.begin(), received.end());
+    std::string receivedStr;
+    for(auto it = received.begin(); it != received.end(); it++) {
+        receivedStr += *it + ",";
+    }
+    assertStr("", receivedStr.c_str(), "F0,F3,V4,");
+    assertInt("", pq.getMetrics().evictedCorrupted, 2);
+}
+
+static void testWriteFailure() {
+    // Uses the PublishQueuePosix set up by testFileQueue(). Publishing is paused so the events are not sent.
+    PublishQueuePosix &pq = PublishQueuePosix::instance();
+    pq.resetMetrics();
+    pq.setPausePublishing(true);
+
+    // The third event is more than the RAM queue holds, so the queue is written to files, which fails
+    simSetWriteFailure(true);
+    for(int ii = 0; ii < 3; ii++) {
+        assertTrue("", pq.publish("t", ("W" + std::to_string(ii)).c_str(), PRIVATE | WITH_ACK));
+    }
+    simSetWriteFailure(false);
+
+    // The events are freed and counted, and the files that could not be written are not in the queue
+    assertInt("", pq.getNumEvents(), 0);
+    assertInt("", pq.getMetrics().evictedWriteFailed, 3);
+    assertInt("", pq.getMetrics().ramToFileSpills, 0);
+
+    pq.publish("t", "W3", PRIVATE | WITH_ACK);
+    pq.writeQueueToFiles();
+    assertInt("", pq.getNumEvents(), 1);
+    assertInt("", pq.getMetrics().ramToFileSpills, 1);
+    pq.setPausePublishing(false);
+}
+
+static void testRingFile() {
+    std::string dir = makeDir("ring");
+    std::string path = dir + "/ring.dat";
+    SequentialFile sequentialFile;
+    sequentialFile.withDirPath(dir.c_str());
+
+    // The records all have 2 characters of data, so they're the same size, and start after the two copies of the header
+    const off_t DATA_START = 2 * sizeof(PublishQueueRingFileHeader);
+    const off_t RECORD_SIZE = (sizeof(PublishQueueRingRecordHeader) + sizeof(PublishQueueEvent) + 2 + 3) & ~3;
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        assertTrue("", engine.setup());
+        for(int ii = 0; ii < 4; ii++) {
+            writeEvent(engine, "R" + std::to_string(ii));
+        }
+    }
+
+    // The data of R1 was changed after it was written. Its header and the record after it are valid, so only R1 is lost.
+    corrupt(path, DATA_START + RECORD_SIZE + sizeof(PublishQueueRingRecordHeader) + offsetof(PublishQueueEvent, eventData), 1);
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        assertTrue("", engine.setup());
+        assertInt("", engine.getQueueLen(), 4);
+        assertStr("", readEvent(engine, 0).c_str(), "R0");
+        assertStr("", readEvent(engine, 1).c_str(), "");
+        assertStr("", readEvent(engine, 2).c_str(), "R2");
+
+        // PublishQueuePosix removes it when it can't be read
+        assertTrue("", engine.removeEvent(engine.getIdAt(1)));
+        assertInt("", engine.getNumCorrupted(), 0);
+    }
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        assertTrue("", engine.setup());
+        assertStr("", drain(engine).c_str(), "R0,R2,R3,");
+
+        for(int ii = 4; ii < 8; ii++) {
+            writeEvent(engine, "R" + std::to_string(ii));
+        }
+
+        // The length in the header of R5 was changed, so the records after it can't be found
+        off_t offset = DATA_START + 5 * RECORD_SIZE + offsetof(PublishQueueRingRecordHeader, length) + 1;
+        corrupt(path, offset, 0x80);
+        engine.removeFront();
+        assertInt("", engine.getQueueLen(), 3);
+        assertStr("", readEvent(engine, 0).c_str(), "");
+
+        // Removing R5, which PublishQueuePosix counts itself, discards R6 and R7
+        engine.removeFront();
+        assertInt("", engine.getQueueLen(), 0);
+        assertInt("", engine.getNumCorrupted(), 2);
+
+        // The ring is still usable
+        writeEvent(engine, "R8");
+    }
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        assertTrue("", engine.setup());
+        assertStr("", drain(engine).c_str(), "R8,");
+        assertInt("", engine.getNumCorrupted(), 0);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    std::string cmd = std::string("rm -rf ") + TEST_DIR + "; mkdir -p " + TEST_DIR;
+    system(cmd.c_str());
+
+    // Uses PublishQueuePosix::instance(), which sets up the event pool
+    testFileQueue();
+    testWriteFailure();
+    testRingFile();
+
+    printf("corruption test passed\n");
+    return 0;
+}
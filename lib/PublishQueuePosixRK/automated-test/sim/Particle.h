@@ -0,0 +1,227 @@
+#ifndef __PARTICLE_H
+#define __PARTICLE_H
+
+// Host mock of the Device OS APIs used by PublishQueuePosixRK, SequentialFileRK and BackgroundPublishRK,
+// for the publish queue simulation. String, Time and the publish flags come from the UnitTestLib mocks in
+// lib/StorageHelperRK/automated-test/UnitTestLib. This adds a virtual clock, threads that run as coroutines
+// on the main thread, OS queues and mutexes, Future, and a Particle cloud object backed by SimCloud.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#include "spark_wiring_flags.h"
+#include "spark_wiring_string.h"
+#include "spark_wiring_time.h"
+#include "system_tick_hal.h"
+
+typedef enum LogLevel {
+    LOG_LEVEL_ALL = 1,
+    LOG_LEVEL_TRACE = 1,
+    LOG_LEVEL_INFO = 30,
+    LOG_LEVEL_WARN = 40,
+    LOG_LEVEL_ERROR = 50,
+    LOG_LEVEL_PANIC = 60,
+    LOG_LEVEL_NONE = 70
+} LogLevel;
+
+extern LogLevel simLogLevel; //!< Messages below this level are not printed
+
+class Logger {
+public:
+    Logger(const char *name) : name(name) {};
+
+    void trace(const char *fmt, ...) const __attribute__((format(printf, 2, 3))) { va_list ap; va_start(ap, fmt); vlog(LOG_LEVEL_TRACE, fmt, ap); va_end(ap); }
+    void info(const char *fmt, ...) const __attribute__((format(printf, 2, 3))) { va_list ap; va_start(ap, fmt); vlog(LOG_LEVEL_INFO, fmt, ap); va_end(ap); }
+    void warn(const char *fmt, ...) const __attribute__((format(printf, 2, 3))) { va_list ap; va_start(ap, fmt); vlog(LOG_LEVEL_WARN, fmt, ap); va_end(ap); }
+    void error(const char *fmt, ...) const __attribute__((format(printf, 2, 3))) { va_list ap; va_start(ap, fmt); vlog(LOG_LEVEL_ERROR, fmt, ap); va_end(ap); }
+
+    void vlog(LogLevel level, const char *fmt, va_list ap) const;
+
+    const char *name;
+};
+extern const Logger Log;
+
+namespace particle { namespace protocol {
+    const size_t MAX_EVENT_NAME_LENGTH = 64;
+    const size_t MAX_EVENT_DATA_LENGTH = 1024;
+}};
+
+// system_cloud.h
+const uint32_t PUBLISH_EVENT_FLAG_PUBLIC = 0x0;
+const uint32_t PUBLISH_EVENT_FLAG_PRIVATE = 0x1;
+const uint32_t PUBLISH_EVENT_FLAG_NO_ACK = 0x2;
+const uint32_t PUBLISH_EVENT_FLAG_WITH_ACK = 0x8;
+
+// spark_wiring_cloud.h
+struct PublishFlagType;
+typedef particle::Flags<PublishFlagType, uint8_t> PublishFlags;
+typedef PublishFlags::FlagType PublishFlag;
+
+const PublishFlag PUBLIC(PUBLISH_EVENT_FLAG_PUBLIC);
+const PublishFlag PRIVATE(PUBLISH_EVENT_FLAG_PRIVATE);
+const PublishFlag NO_ACK(PUBLISH_EVENT_FLAG_NO_ACK);
+const PublishFlag WITH_ACK(PUBLISH_EVENT_FLAG_WITH_ACK);
+
+// Virtual clock, advanced only by the simulation
+uint32_t millis();
+void delay(uint32_t ms);
+
+// Mutexes. Threads are coroutines that only switch while waiting on a queue, so these never block.
+typedef std::mutex *os_mutex_t;
+typedef std::recursive_mutex *os_mutex_recursive_t;
+inline int os_mutex_create(os_mutex_t *mutex) { *mutex = new std::mutex(); return 0; }
+inline int os_mutex_lock(os_mutex_t mutex) { mutex->lock(); return 0; }
+inline int os_mutex_unlock(os_mutex_t mutex) { mutex->unlock(); return 0; }
+inline int os_mutex_recursive_create(os_mutex_recursive_t *mutex) { *mutex = new std::recursive_mutex(); return 0; }
+inline int os_mutex_recursive_lock(os_mutex_recursive_t mutex) { mutex->lock(); return 0; }
+inline int os_mutex_recursive_trylock(os_mutex_recursive_t mutex) { return mutex->try_lock() ? 0 : 1; }
+inline int os_mutex_recursive_unlock(os_mutex_recursive_t mutex) { mutex->unlock(); return 0; }
+
+#define WITH_LOCK(lock) for (std::unique_lock<typename std::remove_reference<decltype(lock)>::type> __lock##__LINE__((lock)); __lock##__LINE__; __lock##__LINE__.unlock())
+
+// Queues. A thread that takes from an empty queue switches back to the main thread until an item is put
+// or the timeout in virtual time expires.
+typedef struct SimQueue *os_queue_t;
+const uint32_t CONCURRENT_WAIT_FOREVER = 0xffffffff;
+int os_queue_create(os_queue_t *queue, size_t itemSize, size_t itemCount, void *reserved);
+int os_queue_put(os_queue_t queue, const void *item, uint32_t delay, void *reserved);
+int os_queue_take(os_queue_t queue, void *item, uint32_t delay, void *reserved);
+
+const int OS_THREAD_PRIORITY_DEFAULT = 2;
+
+/**
+ * @brief A thread that runs as a coroutine on the main thread, from simRunThreads()
+ */
+class Thread {
+public:
+    Thread(const char *name, std::function<void()> function, int priority = OS_THREAD_PRIORITY_DEFAULT, size_t stackSize = 3072);
+
+    /**
+     * @brief Run the thread until its function returns
+     */
+    void dispose();
+
+    struct SimThread *simThread; //!< Coroutine state
+};
+
+namespace particle {
+class Error {
+public:
+    Error(int type = 0) : t(type) {};
+    int type() const { return t; };
+    int t;
+};
+
+/**
+ * @brief Result of Particle.publish(). Copies share the result, which the simulated cloud sets with simComplete().
+ */
+template<typename T> class Future {
+public:
+    Future() : state(std::make_shared<State>()) {};
+
+    bool isDone() const { return state->done; };
+    bool isSucceeded() const { return state->done && state->succeeded; };
+    T result() const { return state->value; };
+
+    Future &onSuccess(std::function<void(T)> cb) {
+        if (!state->done) {
+            state->successCallbacks.push_back(cb);
+        }
+        else
+        if (state->succeeded) {
+            cb(state->value);
+        }
+        return *this;
+    };
+
+    Future &onError(std::function<void(Error)> cb) {
+        if (!state->done) {
+            state->errorCallbacks.push_back(cb);
+        }
+        else
+        if (!state->succeeded) {
+            cb(Error(1));
+        }
+        return *this;
+    };
+
+    void simComplete(bool succeeded, T value = T()) {
+        if (state->done) {
+            return;
+        }
+        state->done = true;
+        state->succeeded = succeeded;
+        state->value = value;
+        if (succeeded) {
+            for(auto it = state->successCallbacks.begin(); it != state->successCallbacks.end(); it++) {
+                (*it)(value);
+            }
+        }
+        else {
+            for(auto it = state->errorCallbacks.begin(); it != state->errorCallbacks.end(); it++) {
+                (*it)(Error(1));
+            }
+        }
+        state->successCallbacks.clear();
+        state->errorCallbacks.clear();
+    };
+
+protected:
+    struct State {
+        bool done = false;
+        bool succeeded = false;
+        T value = T();
+        std::vector<std::function<void(T)>> successCallbacks;
+        std::vector<std::function<void(Error)>> errorCallbacks;
+    };
+    std::shared_ptr<State> state;
+};
+
+namespace feature { enum State { DISABLED, ENABLED }; }
+}
+namespace spark { namespace feature = particle::feature; }
+
+int system_thread_get_state(void *reserved);
+
+// system_event.h
+typedef uint64_t system_event_t;
+const system_event_t reset = 1 << 7;
+const system_event_t cloud_status = 1 << 10;
+const int cloud_status_disconnected = 0;
+const int cloud_status_connecting = 1;
+const int cloud_status_connected = 8;
+const int cloud_status_disconnecting = 9;
+
+/**
+ * @brief Particle.publish() and Particle.connected() are handled by SimCloud
+ */
+class CloudClass {
+public:
+    static particle::Future<bool> publish(const char *eventName, const char *eventData, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
+    static bool connected();
+};
+extern CloudClass Particle;
+
+/**
+ * @brief System.on() saves the handler, which SimCloud calls when the connection changes
+ */
+class SystemClass {
+public:
+    static void on(system_event_t events, void (*handler)(system_event_t event, int param));
+};
+extern SystemClass System;
+
+#endif /* __PARTICLE_H */
@@ -0,0 +1,338 @@
+// Deterministic simulation of the publish pipeline: PublishQueuePosixRK, SequentialFileRK and BackgroundPublishRK
+// running against SimCloud on a virtual clock. Settings are key=value arguments; run with help for a list.
+//
+// Each event's data is {"seq":N,"pad":"..."}, so the cloud can tell which events it received, including
+// events combined into batches by withCoalesce().
+
+#include "PublishQueuePosixRK.h"
+#include "SimCloud.h"
+#include "SimMock.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static const char *SIM_EVENT_NAME = "simEvent";
+static const char *SIM_BATCH_EVENT_NAME = "simBatch";
+
+struct SimSettings {
+    uint32_t backlog = 100; //!< Events queued before the cloud connects
+    uint32_t events = 0; //!< Events published after the backlog
+    uint32_t everyMs = 10000; //!< Time between events after the backlog
+    size_t size = 32; //!< Approximate size of the event data
+    uint32_t connectMs = 0; //!< Time until the cloud first connects
+    uint32_t tickMs = 10; //!< Virtual time between calls to loop()
+    uint32_t maxTimeMs = 86400000; //!< Stop if not drained by then
+    bool ring = false; //!< Use StorageEngine::RING_FILE
+    size_t ramQueueSize = 2; //!< withRamQueueSize()
+    size_t fileQueueSize = 100; //!< withFileQueueSize()
+    size_t ringFileSize = 0; //!< withRingFileSize(), 0 for the default
+    size_t retainedSize = 0; //!< withRetainedBuffer() size, 0 for none
+    size_t maxInFlight = 1; //!< withMaxInFlight()
+    bool adaptive = false; //!< withAdaptivePacing()
+    bool coalesce = false; //!< withCoalesce()
+    uint32_t seed = 1; //!< Random number seed
+    std::string dir = "/tmp/PublishQueueSim"; //!< Queue directory, removed before starting
+};
+
+static void usage() {
+    printf("usage: PublishQueueSim [key=value ...]\n"
+        "workload:\n"
+        "  backlog=N            events queued before the cloud connects (100)\n"
+        "  events=N             events published after the backlog (0)\n"
+        "  every=SEC            seconds between those events (10)\n"
+        "  size=BYTES           approximate event data size (32)\n"
+        "queue:\n"
+        "  engine=file|ring     storage engine (file)\n"
+        "  ram=N                RAM queue size (2)\n"
+        "  files=N              file queue size (100)\n"
+        "  ringsize=BYTES       ring file size (library default)\n"
+        "  retained=BYTES       retained memory buffer size (0, none)\n"
+        "  inflight=N           publishes in flight (1)\n"
+        "  adaptive=0|1         adaptive pacing (0)\n"
+        "  coalesce=0|1         combine events into batches (0)\n"
+        "cloud:\n"
+        "  latency=fixed:MS | uniform:MIN:MAX | lognormal:MEDIAN:P90   (fixed:1000)\n"
+        "  loss=FRACTION        publishes that never reach the cloud (0)\n"
+        "  ackloss=FRACTION     publishes that reach the cloud but are not acknowledged (0)\n"
+        "  timeout=MS           time until a lost publish fails (20000)\n"
+        "  ratelimit=0|1        reject publishes over 1/sec with bursts of 4 (1)\n"
+        "  connect=SEC          seconds until the cloud first connects (0)\n"
+        "  disconnect=SEC:SEC   disconnected from the first time for the second, repeatable\n"
+        "run:\n"
+        "  seed=N               random number seed (1)\n"
+        "  tick=MS              virtual time between calls to loop() (10)\n"
+        "  maxtime=SEC          stop if not drained (86400)\n"
+        "  log=trace|info|warn|error  library log level (error)\n"
+        "  dir=PATH             queue directory, removed first (/tmp/PublishQueueSim)\n");
+}
+
+static bool parseLatency(const char *value, SimCloud::Settings &cloudSettings) {
+    unsigned a = 0, b = 0;
+    if (sscanf(value, "fixed:%u", &a) == 1) {
+        cloudSettings.latency = SimCloud::Latency::FIXED;
+        cloudSettings.latencyMs = cloudSettings.latencyMaxMs = a;
+        return true;
+    }
+    if (sscanf(value, "uniform:%u:%u", &a, &b) == 2 && a <= b) {
+        cloudSettings.latency = SimCloud::Latency::UNIFORM;
+    }
+    else
+    if (sscanf(value, "lognormal:%u:%u", &a, &b) == 2 && a > 0 && a <= b) {
+        cloudSettings.latency = SimCloud::Latency::LOGNORMAL;
+    }
+    else {
+        return false;
+    }
+    cloudSettings.latencyMs = a;
+    cloudSettings.latencyMaxMs = b;
+    return true;
+}
+
+static bool parseArg(const char *arg, SimSettings &settings, SimCloud::Settings &cloudSettings) {
+    const char *eq = strchr(arg, '=');
+    if (!eq) {
+        return false;
+    }
+    std::string key(arg, eq - arg);
+    const char *value = eq + 1;
+
+    if (key == "backlog") settings.backlog = atoi(value);
+    else if (key == "events") settings.events = atoi(value);
+    else if (key == "every") settings.everyMs = (uint32_t)(atof(value) * 1000);
+    else if (key == "size") settings.size = atoi(value);
+    else if (key == "engine") settings.ring = (strcmp(value, "ring") == 0);
+    else if (key == "ram") settings.ramQueueSize = atoi(value);
+    else if (key == "files") settings.fileQueueSize = atoi(value);
+    else if (key == "ringsize") settings.ringFileSize = atoi(value);
+    else if (key == "retained") settings.retainedSize = atoi(value);
+    else if (key == "inflight") settings.maxInFlight = atoi(value);
+    else if (key == "adaptive") settings.adaptive = atoi(value) != 0;
+    else if (key == "coalesce") settings.coalesce = atoi(value) != 0;
+    else if (key == "latency") return parseLatency(value, cloudSettings);
+    else if (key == "loss") cloudSettings.lossRate = atof(value);
+    else if (key == "ackloss") cloudSettings.ackLossRate = atof(value);
+    else if (key == "timeout") cloudSettings.timeoutMs = atoi(value);
+    else if (key == "ratelimit") cloudSettings.rateLimit = atoi(value) != 0;
+    else if (key == "connect") settings.connectMs = (uint32_t)(atof(value) * 1000);
+    else if (key == "disconnect") {
+        double start, duration;
+        if (sscanf(value, "%lf:%lf", &start, &duration) != 2) {
+            return false;
+        }
+        SimCloud::Window window;
+        window.startMs = (uint32_t)(start * 1000);
+        window.durationMs = (uint32_t)(duration * 1000);
+        cloudSettings.disconnects.push_back(window);
+    }
+    else if (key == "seed") settings.seed = atoi(value);
+    else if (key == "tick") settings.tickMs = atoi(value);
+    else if (key == "maxtime") settings.maxTimeMs = (uint32_t)(atof(value) * 1000);
+    else if (key == "log") {
+        if (strcmp(value, "trace") == 0) simLogLevel = LOG_LEVEL_TRACE;
+        else if (strcmp(value, "info") == 0) simLogLevel = LOG_LEVEL_INFO;
+        else if (strcmp(value, "warn") == 0) simLogLevel = LOG_LEVEL_WARN;
+        else simLogLevel = LOG_LEVEL_ERROR;
+    }
+    else if (key == "dir") settings.dir = value;
+    else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief What the cloud received, by event sequence number
+ */
+struct SimResults {
+    std::vector<uint32_t> publishMs; //!< millis() when PublishQueuePosix::publish() was called
+    std::vector<uint32_t> received; //!< Times received by the cloud
+    std::vector<uint32_t> latencyMs; //!< From publish() to first received, for each event received
+    uint32_t lastReceivedMs = 0; //!< millis() when the cloud last received an event
+};
+
+static void onReceived(SimResults &results, const char *eventData) {
+    const char *cp = eventData;
+    while((cp = strstr(cp, "\"seq\":")) != NULL) {
+        cp += 6;
+        size_t seq = (size_t) strtoul(cp, NULL, 10);
+        if (seq < results.received.size()) {
+            if (results.received[seq]++ == 0) {
+                results.latencyMs.push_back(millis() - results.publishMs[seq]);
+            }
+        }
+    }
+    results.lastReceivedMs = millis();
+}
+
+static void publishEvent(PublishQueuePosix &pq, const SimSettings &settings, SimResults &results) {
+    size_t seq = results.publishMs.size();
+    results.publishMs.push_back(millis());
+    results.received.push_back(0);
+
+    char data[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+    int len = snprintf(data, sizeof(data), "{\"seq\":%u,\"pad\":\"", (unsigned)seq);
+    while(len < (int)settings.size - 2 && len < (int)sizeof(data) - 3) {
+        data[len++] = 'x';
+    }
+    strcpy(&data[len], "\"}");
+
+    pq.publish(SIM_EVENT_NAME, data, PRIVATE | WITH_ACK);
+}
+
+static uint32_t percentile(std::vector<uint32_t> values, int pct) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[(values.size() - 1) * pct / 100];
+}
+
+int main(int argc, char **argv) {
+    SimSettings settings;
+    SimCloud::Settings cloudSettings;
+
+    for(int ii = 1; ii < argc; ii++) {
+        if (!parseArg(argv[ii], settings, cloudSettings)) {
+            usage();
+            return 1;
+        }
+    }
+    srand(settings.seed);
+
+    uint32_t startMs = millis();
+    if (settings.connectMs) {
+        SimCloud::Window window;
+        window.startMs = startMs;
+        window.durationMs = settings.connectMs;
+        cloudSettings.disconnects.push_back(window);
+    }
+    else {
+        for(auto it = cloudSettings.disconnects.begin(); it != cloudSettings.disconnects.end(); it++) {
+            it->startMs += startMs;
+        }
+    }
+
+    SimResults results;
+    SimCloud &cloud = SimCloud::instance();
+    cloud.withSettings(cloudSettings, settings.seed)
+        .withReceivedCallback([&results](const char *eventName, const char *eventData) { onReceived(results, eventData); });
+
+    std::string cmd = "rm -rf " + settings.dir;
+    system(cmd.c_str());
+
+    PublishQueuePosix &pq = PublishQueuePosix::instance();
+    pq.withDirPath(settings.dir.c_str())
+        .withRamQueueSize(settings.ramQueueSize)
+        .withFileQueueSize(settings.fileQueueSize)
+        .withMaxInFlight(settings.maxInFlight)
+        .withAdaptivePacing(settings.adaptive);
+    if (settings.ring) {
+        pq.withStorageEngine(PublishQueuePosix::StorageEngine::RING_FILE);
+        if (settings.ringFileSize) {
+            pq.withRingFileSize(settings.ringFileSize);
+        }
+    }
+    std::vector<uint8_t> retainedBuffer(settings.retainedSize);
+    if (settings.retainedSize) {
+        pq.withRetainedBuffer(retainedBuffer.data(), retainedBuffer.size());
+    }
+    if (settings.coalesce) {
+        pq.withCoalesce(SIM_EVENT_NAME, SIM_BATCH_EVENT_NAME);
+    }
+    pq.setup();
+    simRunThreads();
+
+    // Only count what happens after setup
+    simFileStats = {};
+    pq.resetMetrics();
+
+    for(uint32_t ii = 0; ii < settings.backlog; ii++) {
+        publishEvent(pq, settings, results);
+    }
+
+    uint32_t eventsPublished = 0;
+    uint32_t nextEventMs = startMs + settings.everyMs;
+    uint32_t lastPublishMs = startMs;
+    bool drained = false;
+
+    // getDrainEstimateMs() each tick, to compare with the drain time, and the last queue drained callback
+    std::vector<unsigned long> estimateMs;
+    uint32_t drainedCallbackMs = 0;
+    pq.withQueueDrainedCallback([&drainedCallbackMs]() { drainedCallbackMs = millis(); });
+
+    while(millis() - startMs < settings.maxTimeMs) {
+        simAdvanceMillis(settings.tickMs);
+        cloud.advance();
+        simRunThreads();
+
+        if (eventsPublished < settings.events && (int32_t)(millis() - nextEventMs) >= 0) {
+            publishEvent(pq, settings, results);
+            eventsPublished++;
+            nextEventMs += settings.everyMs;
+            lastPublishMs = millis();
+        }
+
+        pq.loop();
+        simRunThreads();
+        estimateMs.push_back(pq.getDrainEstimateMs());
+
+        if (eventsPublished == settings.events && pq.getNumEvents() == 0 && cloud.idle() && pq.getCanSleep()) {
+            drained = true;
+            break;
+        }
+    }
+    uint32_t endMs = millis();
+
+    // Drain time is measured from when there was something to drain and a connection to drain it
+    uint32_t drainStartMs = lastPublishMs;
+    for(auto it = cloudSettings.disconnects.begin(); it != cloudSettings.disconnects.end(); it++) {
+        uint32_t connectedMs = it->startMs + it->durationMs;
+        if (connectedMs <= endMs && connectedMs > drainStartMs) {
+            drainStartMs = connectedMs;
+        }
+    }
+
+    uint32_t total = (uint32_t) results.publishMs.size();
+    uint32_t delivered = 0, duplicates = 0;
+    for(auto it = results.received.begin(); it != results.received.end(); it++) {
+        if (*it) {
+            delivered++;
+            duplicates += *it - 1;
+        }
+    }
+
+    const SimCloud::Stats &cloudStats = cloud.getStats();
+    PublishQueuePosix::Metrics metrics = pq.getMetrics();
+
+    printf("engine=%s inflight=%u adaptive=%d coalesce=%d seed=%lu\n", settings.ring ? "ring" : "file", (unsigned)settings.maxInFlight,
+        settings.adaptive, settings.coalesce, (unsigned long)settings.seed);
+    printf("events:     published=%lu delivered=%lu duplicates=%lu lost=%lu\n", (unsigned long)total, (unsigned long)delivered,
+        (unsigned long)duplicates, (unsigned long)(total - delivered));
+    if (drained) {
+        printf("drain:      %.1f sec (total %.1f sec)\n", (endMs - drainStartMs) / 1000.0, (endMs - startMs) / 1000.0);
+    }
+    else {
+        printf("drain:      not drained after %.1f sec, %u events queued\n", (endMs - startMs) / 1000.0, (unsigned)pq.getNumEvents());
+    }
+    size_t estimateIndex = (drainStartMs - startMs) / settings.tickMs;
+    printf("estimate:   %.1f sec at drain start, drained callback at %.1f sec\n",
+        (estimateIndex < estimateMs.size()) ? estimateMs[estimateIndex] / 1000.0 : 0.0,
+        drainedCallbackMs ? (drainedCallbackMs - startMs) / 1000.0 : 0.0);
+    printf("publishes:  total=%lu perEvent=%.2f succeeded=%lu offline=%lu lost=%lu ackLost=%lu rateLimited=%lu disconnected=%lu\n",
+        (unsigned long)cloudStats.publishes, delivered ? (double)cloudStats.publishes / delivered : 0.0, (unsigned long)cloudStats.succeeded,
+        (unsigned long)cloudStats.offline, (unsigned long)cloudStats.lost, (unsigned long)cloudStats.ackLost,
+        (unsigned long)cloudStats.rateLimited, (unsigned long)cloudStats.disconnected);
+    printf("latency:    p50=%.1f p90=%.1f max=%.1f sec\n", percentile(results.latencyMs, 50) / 1000.0,
+        percentile(results.latencyMs, 90) / 1000.0, percentile(results.latencyMs, 100) / 1000.0);
+    printf("flash:      written=%llu read=%llu bytes, writes=%lu reads=%lu creates=%lu unlinks=%lu fsyncs=%lu\n",
+        (unsigned long long)simFileStats.bytesWritten, (unsigned long long)simFileStats.bytesRead, (unsigned long)simFileStats.writes,
+        (unsigned long)simFileStats.reads, (unsigned long)simFileStats.creates, (unsigned long)simFileStats.unlinks,
+        (unsigned long)simFileStats.fsyncs);
+    printf("metrics:    maxDepth=%lu spills=%lu retainedOverflows=%lu evictedQueueFull=%lu evictedRingFull=%lu evictedCorrupted=%lu evictedPoolFull=%lu failures=%lu\n",
+        (unsigned long)metrics.maxDepth, (unsigned long)metrics.ramToFileSpills, (unsigned long)metrics.retainedOverflows, (unsigned long)metrics.evictedQueueFull,
+        (unsigned long)metrics.evictedRingFull, (unsigned long)metrics.evictedCorrupted, (unsigned long)metrics.evictedPoolFull,
+        (unsigned long)metrics.publishFailures);
+
+    return drained ? 0 : 2;
+}
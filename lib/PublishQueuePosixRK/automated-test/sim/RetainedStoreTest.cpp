@@ -0,0 +1,330 @@
+#include "Particle.h"
+#include "PublishQueuePosixRK.h"
+#include "TestAssert.h"
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// Checks PublishQueueRetainedStore and PublishQueueRetainedEngine: overflow to the flash engine keeps the
+// events in order with increasing identifiers, also while other priorities spill to flash, the buffer
+// survives a simulated reset, wraps around with events of two priorities removed out of order, a reset
+// part way through an append or a remove leaves a valid buffer, and a copy saved by saveToFile() is
+// loaded after a simulated power loss.
+
+static const char *TEST_DIR = "/tmp/RetainedStoreTest";
+static const char *SAVE_PATH = "/tmp/RetainedStoreTest/retained.dat";
+
+alignas(4) static uint8_t retBuf[300];
+
+static PublishQueueEvent *makeEvent(const std::string &data) {
+    PublishQueueEvent *event = PublishQueuePosix::allocEvent(data.size());
+    assertTrue("", event);
+    event->flags = PRIVATE | WITH_ACK;
+    strcpy(event->eventName, "t");
+    strcpy(event->eventData, data.c_str());
+    return event;
+}
+
+static void writeEvent(PublishQueueStorageEngine &engine, const std::string &data) {
+    PublishQueueEvent *event = makeEvent(data);
+    assertTrue("", engine.writeEvent(event));
+    PublishQueuePosix::freeEvent(event);
+}
+
+static std::string drain(PublishQueueStorageEngine &engine) {
+    std::string result;
+    while(engine.getQueueLen()) {
+        PublishQueueEvent *event = engine.readFront();
+        assertTrue("", event);
+        assertInt("", event->flags.value(), (PRIVATE | WITH_ACK).value());
+        result += std::string(event->eventData) + ",";
+        PublishQueuePosix::freeEvent(event);
+        engine.removeFront();
+    }
+    return result;
+}
+
+static std::string longData(int ii) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "R%02d-xxxxxxxxxxxxxxxxxxxxxxxxxxxxx", ii);
+    return buf;
+}
+
+static void testEngine(SequentialFile &sequentialFile) {
+    memset(retBuf, 0, sizeof(retBuf));
+    std::vector<uint32_t> ids;
+    {
+        PublishQueueRetainedStore store;
+        assertInt("", store.setup(retBuf, sizeof(retBuf), 2), 0);
+        assertTrue("", store.isValid());
+        PublishQueueFileEngine flash(sequentialFile);
+        assertTrue("", flash.setup());
+        PublishQueueRetainedEngine engine;
+        engine.withStore(&store, 1, &flash).setup();
+
+        // Records are 16 + 2 + 2 + 33 bytes, 5 fit in the buffer
+        for(int ii = 0; ii < 8; ii++) {
+            writeEvent(engine, longData(ii));
+            ids.push_back(engine.getBackId());
+        }
+        assertInt("", store.getCount(1), 5);
+        assertInt("", flash.getQueueLen(), 3);
+        assertInt("", engine.getNumOverflows(), 3);
+        for(size_t ii = 0; ii < ids.size(); ii++) {
+            assertInt("", engine.getIdAt(ii), ids[ii]);
+            assertTrue("", ii == 0 || ids[ii] > ids[ii - 1]);
+        }
+
+        // Remove one from each tier by identifier
+        assertTrue("", engine.removeEvent(ids[2]));
+        assertTrue("", engine.removeEvent(ids[6]));
+        assertTrue("", !engine.removeEvent(ids[6]));
+        assertInt("", engine.getQueueLen(), 6);
+
+        // There is room again, but events go to flash until it's empty to stay in order
+        writeEvent(engine, "R08");
+        assertInt("", store.getCount(1), 4);
+        assertInt("", flash.getQueueLen(), 3);
+    }
+    {
+        // Simulated reset: the retained buffer and the files are still there
+        PublishQueueRetainedStore store;
+        assertInt("", store.setup(retBuf, sizeof(retBuf), 2), 4);
+        PublishQueueFileEngine flash(sequentialFile);
+        assertTrue("", flash.setup());
+        PublishQueueRetainedEngine engine;
+        engine.withStore(&store, 1, &flash).setup();
+        assertInt("", engine.getQueueLen(), 7);
+        for(size_t ii = 1; ii < 7; ii++) {
+            assertTrue("", engine.getIdAt(ii) > engine.getIdAt(ii - 1));
+        }
+        assertTrue("", engine.removeEvent(engine.getIdAt(5)));
+        assertStr("", drain(engine).c_str(), (longData(0) + "," + longData(1) + "," + longData(3) + "," + longData(4) + "," + longData(5) + ",R08,").c_str());
+
+        // Flash is empty, so retained memory is used again
+        writeEvent(engine, "S0");
+        assertInt("", store.getCount(1), 1);
+        assertInt("", flash.getQueueLen(), 0);
+    }
+}
+
+// Identifiers of one priority's events keep increasing while the other priorities spill to flash.
+// Writing to a flash engine must not move the shared next identifier backwards.
+static void testThreePriorities() {
+    memset(retBuf, 0, sizeof(retBuf));
+    std::string cmd = std::string("mkdir -p ") + TEST_DIR + "/p0 " + TEST_DIR + "/p1 " + TEST_DIR + "/p2";
+    system(cmd.c_str());
+
+    PublishQueueRetainedStore store;
+    assertInt("", store.setup(retBuf, sizeof(retBuf), 3), 0);
+
+    SequentialFile sequentialFiles[3];
+    for(int ii = 0; ii < 3; ii++) {
+        sequentialFiles[ii].withDirPath((std::string(TEST_DIR) + "/p" + std::to_string(ii)).c_str()).scanDir();
+    }
+    PublishQueueFileEngine flash0(sequentialFiles[0]), flash1(sequentialFiles[1]), flash2(sequentialFiles[2]);
+    assertTrue("", flash0.setup());
+    assertTrue("", flash1.setup());
+    assertTrue("", flash2.setup());
+
+    PublishQueueRetainedEngine critical, alert, diagnostic;
+    critical.withStore(&store, 0, &flash0).setup();
+    alert.withStore(&store, 1, &flash1).setup();
+    diagnostic.withStore(&store, 2, &flash2).setup();
+
+    // Fill retained memory, then both ALERT and DIAGNOSTIC spill to flash
+    writeEvent(alert, longData(0));
+    writeEvent(alert, longData(1));
+    writeEvent(critical, longData(9));
+    writeEvent(diagnostic, longData(2));
+    writeEvent(diagnostic, longData(3));
+    writeEvent(diagnostic, "D0");
+    writeEvent(alert, "A0");
+    for(int ii = 1; ii < 5; ii++) {
+        writeEvent(diagnostic, "D" + std::to_string(ii));
+    }
+    assertInt("", store.getCount(1), 2);
+    assertInt("", store.getCount(2), 3);
+    assertInt("", flash1.getQueueLen(), 1);
+    assertInt("", flash2.getQueueLen(), 4);
+
+    // Make room for CRITICAL in retained memory, interleaved with more ALERT events in flash
+    for(int ii = 1; ii < 4; ii++) {
+        if (ii < 3) {
+            alert.removeFront();
+        }
+        else {
+            diagnostic.removeFront();
+        }
+        writeEvent(critical, "C" + std::to_string(ii));
+        writeEvent(alert, "A" + std::to_string(ii));
+    }
+    assertInt("", store.getCount(0), 4);
+    assertInt("", flash0.getQueueLen(), 0);
+
+    PublishQueueRetainedEngine *engines[3] = { &critical, &alert, &diagnostic };
+    for(PublishQueueRetainedEngine *engine : engines) {
+        for(size_t ii = 1; ii < engine->getQueueLen(); ii++) {
+            assertTrue("", (int32_t)(engine->getIdAt(ii) - engine->getIdAt(ii - 1)) > 0);
+        }
+    }
+    assertStr("", drain(critical).c_str(), (longData(9) + ",C1,C2,C3,").c_str());
+    assertStr("", drain(alert).c_str(), "A0,A1,A2,A3,");
+    assertStr("", drain(diagnostic).c_str(), (longData(3) + ",D0,D1,D2,D3,D4,").c_str());
+}
+
+static void testSaveToFile(SequentialFile &sequentialFile) {
+    memset(retBuf, 0, sizeof(retBuf));
+    uint32_t id0, id2;
+    {
+        PublishQueueRetainedStore store;
+        store.setup(retBuf, sizeof(retBuf), 2, SAVE_PATH);
+        PublishQueueFileEngine flash(sequentialFile);
+        assertTrue("", flash.setup());
+        PublishQueueRetainedEngine engine;
+        engine.withStore(&store, 1, &flash).setup();
+        writeEvent(engine, "S0");
+        writeEvent(engine, "S1");
+        writeEvent(flash, "F0");
+        engine.setup();
+        id0 = engine.getIdAt(0);
+        id2 = engine.getIdAt(2);
+        assertTrue("", store.saveToFile(SAVE_PATH));
+    }
+
+    // Simulated power loss: retained memory is lost, the copy is loaded, and identifiers and order are the same
+    memset(retBuf, 0xa5, sizeof(retBuf));
+    PublishQueueRetainedStore store;
+    assertInt("", store.setup(retBuf, sizeof(retBuf), 2, SAVE_PATH), 2);
+    assertTrue("", access(SAVE_PATH, F_OK) != 0);
+    PublishQueueFileEngine flash(sequentialFile);
+    assertTrue("", flash.setup());
+    PublishQueueRetainedEngine engine;
+    engine.withStore(&store, 1, &flash).setup();
+    assertInt("", engine.getIdAt(0), id0);
+    assertInt("", engine.getIdAt(2), id2);
+    assertStr("", drain(engine).c_str(), "S0,S1,F0,");
+
+    // The copy is removed when the buffer changes, and not loaded over valid retained memory
+    assertTrue("", store.saveToFile(SAVE_PATH));
+    PublishQueueEvent *event = makeEvent("G0");
+    assertTrue("", store.append(0, event));
+    PublishQueuePosix::freeEvent(event);
+    assertTrue("", access(SAVE_PATH, F_OK) != 0);
+    assertTrue("", store.saveToFile(SAVE_PATH));
+    PublishQueueRetainedStore store2;
+    assertInt("", store2.setup(retBuf, sizeof(retBuf), 2, SAVE_PATH), 1);
+    assertTrue("", access(SAVE_PATH, F_OK) != 0);
+}
+
+static void testWrap() {
+    memset(retBuf, 0, sizeof(retBuf));
+    PublishQueueRetainedStore store;
+    store.setup(retBuf, sizeof(retBuf), 2);
+
+    // The expected contents of each priority, oldest first
+    std::vector<std::pair<uint32_t, std::string>> model[2];
+    srand(3);
+    int appended = 0, full = 0;
+    for(int ii = 0; ii < 20000; ii++) {
+        uint8_t priority = rand() % 2;
+        if (rand() % 3 < 2) {
+            std::string data = "D" + std::to_string(ii) + std::string(rand() % 40, 'x');
+            PublishQueueEvent *event = makeEvent(data);
+            uint32_t seq = store.getNextSeq();
+            if (store.append(priority, event)) {
+                model[priority].push_back(std::make_pair(seq, data));
+                appended++;
+            }
+            else {
+                full++;
+            }
+            PublishQueuePosix::freeEvent(event);
+        }
+        else
+        if (!model[priority].empty()) {
+            // Usually the oldest, sometimes another one, as when publishes complete out of order
+            size_t index = (rand() % 4 == 0) ? rand() % model[priority].size() : 0;
+            size_t offset = store.findSeq(priority, model[priority][index].first);
+            assertTrue("", offset);
+            store.remove(offset);
+            model[priority].erase(model[priority].begin() + index);
+        }
+
+        if (ii % 97 == 0) {
+            PublishQueueRetainedStore store2;
+            assertInt("", store2.setup(retBuf, sizeof(retBuf), 2), model[0].size() + model[1].size());
+        }
+        for(uint8_t pp = 0; pp < 2; pp++) {
+            assertInt("", store.getCount(pp), model[pp].size());
+            for(size_t kk = 0; kk < model[pp].size(); kk++) {
+                PublishQueueRetainedRecordHeader recordHdr;
+                size_t offset = store.find(pp, kk, recordHdr);
+                assertTrue("", offset);
+                assertInt("", recordHdr.seq, model[pp][kk].first);
+                PublishQueueEvent *event = store.readEvent(offset);
+                assertTrue("", event);
+                assertStr("", model[pp][kk].second.c_str(), event->eventData);
+                PublishQueuePosix::freeEvent(event);
+            }
+        }
+    }
+    assertTrue("", appended > 5000);
+    assertTrue("", full > 100);
+
+    // Reset during an append: the record is written but the tail does not include it yet
+    size_t count = model[0].size() + model[1].size();
+    uint8_t saved[sizeof(retBuf)];
+    memcpy(saved, retBuf, sizeof(retBuf));
+    PublishQueueEvent *event = makeEvent("Z");
+    store.append(0, event);
+    PublishQueuePosix::freeEvent(event);
+    memcpy(retBuf, saved, sizeof(PublishQueueRetainedHeader));
+    {
+        PublishQueueRetainedStore store2;
+        assertInt("", store2.setup(retBuf, sizeof(retBuf), 2), count);
+    }
+
+    // Reset during a remove: the record is flagged but the head has not moved
+    if (count) {
+        PublishQueueRetainedRecordHeader recordHdr;
+        size_t offset = store.find(model[0].empty() ? 1 : 0, 0, recordHdr);
+        retBuf[offset + offsetof(PublishQueueRetainedRecordHeader, flags)] |= PublishQueueRetainedStore::RECORD_FLAG_REMOVED;
+        PublishQueueRetainedStore store2;
+        assertInt("", store2.setup(retBuf, sizeof(retBuf), 2), count - 1);
+    }
+}
+
+static void testSetup() {
+    // A different size clears the buffer, and a buffer that is too small or not aligned is not used
+    PublishQueueRetainedStore store;
+    assertInt("", store.setup(retBuf, 280, 2), 0);
+    assertTrue("", store.isValid());
+    assertInt("", store.getCount(0), 0);
+    assertInt("", store.setup(retBuf, 100, 2), 0);
+    assertTrue("", !store.isValid());
+    assertInt("", store.setup(retBuf + 1, 280, 2), 0);
+    assertTrue("", !store.isValid());
+}
+
+int main(int argc, char *argv[]) {
+    size_t blockSizes[1] = { sizeof(PublishQueueEvent) + particle::protocol::MAX_EVENT_DATA_LENGTH };
+    size_t blockCounts[1] = { 8 };
+    PublishQueueEventPool::instance().setup(blockSizes, blockCounts, 1);
+
+    std::string cmd = std::string("rm -rf ") + TEST_DIR + "; mkdir -p " + TEST_DIR;
+    system(cmd.c_str());
+    SequentialFile sequentialFile;
+    sequentialFile.withDirPath(TEST_DIR).withIndex();
+    sequentialFile.scanDir();
+
+    testEngine(sequentialFile);
+    testSaveToFile(sequentialFile);
+    testThreePriorities();
+    testWrap();
+    testSetup();
+
+    printf("retained store test passed\n");
+    return 0;
+}
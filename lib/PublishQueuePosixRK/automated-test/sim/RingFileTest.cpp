@@ -0,0 +1,416 @@
+#include "Particle.h"
+#include "PublishQueuePosixRK.h"
+#include "TestAssert.h"
+
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+// Checks PublishQueueRingFileEngine: 20000 random writes, removes and reads, with the ring file reopened
+// from time to time, match a simple model of the queue; a record torn by a reset part way through a write
+// and a torn header leave the events written before them; a different data size recreates the file;
+// and setup() moves events left by the file per event engine into the ring in order.
+
+static const char *TEST_DIR = "/tmp/RingFileTest";
+
+static PublishQueueEvent *makeEvent(const std::string &data) {
+    PublishQueueEvent *event = PublishQueuePosix::allocEvent(data.size());
+    assertTrue("", event);
+    event->flags = PRIVATE | WITH_ACK;
+    strcpy(event->eventName, "t");
+    strcpy(event->eventData, data.c_str());
+    return event;
+}
+
+static void writeEvent(PublishQueueStorageEngine &engine, const std::string &data) {
+    PublishQueueEvent *event = makeEvent(data);
+    assertTrue("", engine.writeEvent(event));
+    PublishQueuePosix::freeEvent(event);
+}
+
+static std::string readFront(PublishQueueStorageEngine &engine) {
+    PublishQueueEvent *event = engine.readFront();
+    assertTrue("", event);
+    std::string result = event->eventData;
+    PublishQueuePosix::freeEvent(event);
+    return result;
+}
+
+static std::string drain(PublishQueueStorageEngine &engine) {
+    std::string result;
+    while(engine.getQueueLen()) {
+        result += readFront(engine) + ",";
+        engine.removeFront();
+    }
+    return result;
+}
+
+static std::string ringPath(const char *dir) {
+    return std::string(dir) + "/ring.dat";
+}
+
+static std::string makeDir(const char *name) {
+    std::string dir = std::string(TEST_DIR) + "/" + name;
+    std::string cmd = std::string("mkdir -p ") + dir;
+    system(cmd.c_str());
+    return dir;
+}
+
+static off_t getFileSize(const std::string &path) {
+    struct stat sb;
+    return (stat(path.c_str(), &sb) == 0) ? sb.st_size : -1;
+}
+
+// Overwrites len bytes at offset in the file, as a write interrupted by a reset would have left them
+static void overwrite(const std::string &path, off_t offset, uint8_t value, size_t len) {
+    std::vector<uint8_t> buf(len, value);
+    FILE *fp = fopen(path.c_str(), "r+");
+    assertTrue("", fp);
+    fseek(fp, offset, SEEK_SET);
+    fwrite(buf.data(), 1, len, fp);
+    fclose(fp);
+}
+
+// Offset in the file of the data area and of the copy of the header that was written last
+static const off_t DATA_START = 2 * sizeof(PublishQueueRingFileHeader);
+
+static off_t newestHeaderOffset(const std::string &path) {
+    PublishQueueRingFileHeader hdr[2];
+    FILE *fp = fopen(path.c_str(), "r");
+    assertTrue("", fp);
+    assertInt("", fread(hdr, 1, sizeof(hdr), fp), sizeof(hdr));
+    fclose(fp);
+    return ((int32_t)(hdr[1].generation - hdr[0].generation) > 0) ? sizeof(PublishQueueRingFileHeader) : 0;
+}
+
+// Size of the record for data, the same as PublishQueueRingFileEngine::recordSize()
+static off_t recordSize(const std::string &data) {
+    return (sizeof(PublishQueueRingRecordHeader) + sizeof(PublishQueueEvent) + data.size() + 3) & ~3;
+}
+
+struct ModelEvent {
+    uint32_t id;
+    std::string data;
+};
+
+// Checks the engine against the model: the length and identifiers always, and the events when full is set
+static void checkModel(PublishQueueRingFileEngine &engine, const std::deque<ModelEvent> &model, bool full) {
+    assertInt("", engine.getQueueLen(), model.size());
+    assertInt("", engine.getFrontId(), model.empty() ? 0 : model.front().id);
+    if (!full) {
+        return;
+    }
+    for(size_t ii = 0; ii < model.size(); ii++) {
+        assertInt("", engine.getIdAt(ii), model[ii].id);
+        uint32_t id = 0;
+        PublishQueueEvent *event = engine.readEvent(ii, id);
+        assertTrue("", event);
+        assertInt("", id, model[ii].id);
+        assertStr("", event->eventData, model[ii].data.c_str());
+        PublishQueuePosix::freeEvent(event);
+    }
+    assertInt("", engine.getIdAt(model.size()), 0);
+}
+
+static void testModel() {
+    std::string dir = makeDir("model");
+    SequentialFile sequentialFile;
+    sequentialFile.withDirPath(dir.c_str());
+
+    std::mt19937 rng(1234);
+    std::deque<ModelEvent> model;
+    PublishQueueRingFileEngine *engine = new PublishQueueRingFileEngine(sequentialFile);
+    engine->withDataSize(PublishQueueRingFileEngine::MIN_DATA_SIZE);
+    assertTrue("", engine->setup());
+
+    uint32_t lastId = 0;
+    size_t numWrites = 0, numDiscarded = 0, numReopens = 0;
+    for(int op = 0; op < 20000; op++) {
+        int action = rng() % 100;
+        if (action < 45) {
+            // Mostly short events, sometimes long enough that one or more old ones are discarded
+            size_t len = (rng() % 8 == 0) ? 200 + rng() % 600 : rng() % 60;
+            std::string data = "E" + std::to_string(op) + "-" + std::string(len, 'a' + op % 26);
+            uint32_t discardedBefore = engine->getNumDiscarded();
+            writeEvent(*engine, data);
+            numWrites++;
+
+            // Each discard removes the front event. Removed records after it are skipped without counting.
+            for(uint32_t ii = discardedBefore; ii < engine->getNumDiscarded(); ii++) {
+                assertTrue("", !model.empty());
+                model.pop_front();
+                numDiscarded++;
+            }
+            assertTrue("", engine->getBackId() > lastId);
+            lastId = engine->getBackId();
+            model.push_back({lastId, data});
+        }
+        else
+        if (action < 65) {
+            if (!model.empty()) {
+                assertStr("", readFront(*engine).c_str(), model.front().data.c_str());
+                engine->removeFront();
+                model.pop_front();
+            }
+        }
+        else
+        if (action < 85) {
+            if (!model.empty()) {
+                size_t index = rng() % model.size();
+                assertTrue("", engine->removeEvent(model[index].id));
+                assertTrue("", !engine->removeEvent(model[index].id));
+                model.erase(model.begin() + index);
+            }
+        }
+        else
+        if (action < 95) {
+            if (!model.empty()) {
+                size_t index = rng() % model.size();
+                uint32_t id = 0;
+                PublishQueueEvent *event = engine->readEvent(index, id);
+                assertTrue("", event);
+                assertInt("", id, model[index].id);
+                assertStr("", event->eventData, model[index].data.c_str());
+                PublishQueuePosix::freeEvent(event);
+            }
+        }
+        else
+        if (action < 99) {
+            // Reopen, like a reset
+            delete engine;
+            engine = new PublishQueueRingFileEngine(sequentialFile);
+            engine->withDataSize(PublishQueueRingFileEngine::MIN_DATA_SIZE);
+            assertTrue("", engine->setup());
+            numReopens++;
+            checkModel(*engine, model, true);
+        }
+        else {
+            engine->removeAll();
+            model.clear();
+        }
+        checkModel(*engine, model, (op % 64) == 0);
+    }
+    assertInt("", engine->getNumCorrupted(), 0);
+    assertTrue("", numDiscarded > 0);
+    delete engine;
+
+    printf("model: %u writes, %u discarded, %u reopens\n", (unsigned)numWrites, (unsigned)numDiscarded, (unsigned)numReopens);
+}
+
+static void testTornRecord() {
+    std::string dir = makeDir("tornRecord");
+    std::string path = ringPath(dir.c_str());
+    SequentialFile sequentialFile;
+    sequentialFile.withDirPath(dir.c_str());
+
+    const char *data[4] = { "T0", "T1", "T2", "T3-xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx" };
+    off_t offset = DATA_START;
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        assertTrue("", engine.setup());
+        for(int ii = 0; ii < 4; ii++) {
+            writeEvent(engine, data[ii]);
+            if (ii < 3) {
+                offset += recordSize(data[ii]);
+            }
+        }
+        assertInt("", engine.getBackId(), 4);
+    }
+
+    // The reset happened part way through the data of the last record, which is still zeros from format()
+    off_t end = offset + recordSize(data[3]);
+    overwrite(path, end - 16, 0, 16);
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        assertTrue("", engine.setup());
+        assertInt("", engine.getQueueLen(), 3);
+        assertInt("", engine.getBackId(), 3);
+        assertInt("", engine.getNumCorrupted(), 0);
+
+        // The space is reused
+        writeEvent(engine, "T4");
+        assertInt("", engine.getBackId(), 4);
+    }
+
+    // Only part of the record header of T5 was written
+    offset += recordSize("T4");
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        assertTrue("", engine.setup());
+        writeEvent(engine, "T5");
+    }
+    overwrite(path, offset + offsetof(PublishQueueRingRecordHeader, length), 0xff, sizeof(PublishQueueRingRecordHeader) - offsetof(PublishQueueRingRecordHeader, length));
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        assertTrue("", engine.setup());
+        assertStr("", drain(engine).c_str(), "T0,T1,T2,T4,");
+        assertInt("", engine.getNumCorrupted(), 0);
+    }
+}
+
+static void testTornHeader() {
+    std::string dir = makeDir("tornHeader");
+    std::string path = ringPath(dir.c_str());
+    SequentialFile sequentialFile;
+    sequentialFile.withDirPath(dir.c_str());
+
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        assertTrue("", engine.setup());
+        for(int ii = 0; ii < 5; ii++) {
+            writeEvent(engine, "H" + std::to_string(ii));
+        }
+        engine.removeFront();
+        engine.removeFront();
+    }
+
+    // The header written by the second removeFront() was torn, so the previous one is used and H1 is sent again
+    overwrite(path, newestHeaderOffset(path) + offsetof(PublishQueueRingFileHeader, headOffset), 0xa5, 8);
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        assertTrue("", engine.setup());
+        assertInt("", engine.getFrontId(), 2);
+        assertInt("", engine.getQueueLen(), 4);
+        engine.removeFront();
+    }
+
+    // The header written after the reset replaced the torn one
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        assertTrue("", engine.setup());
+        assertStr("", drain(engine).c_str(), "H2,H3,H4,");
+    }
+
+    // With neither header valid, the file is recreated
+    overwrite(path, 0, 0xa5, DATA_START);
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        assertTrue("", engine.setup());
+        assertInt("", engine.getQueueLen(), 0);
+        writeEvent(engine, "H5");
+        assertInt("", engine.getBackId(), 1);
+    }
+}
+
+static void testResize() {
+    std::string dir = makeDir("resize");
+    std::string path = ringPath(dir.c_str());
+    SequentialFile sequentialFile;
+    sequentialFile.withDirPath(dir.c_str());
+
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        engine.withDataSize(8192);
+        assertTrue("", engine.setup());
+        assertInt("", getFileSize(path), DATA_START + 8192);
+        writeEvent(engine, "S0");
+        writeEvent(engine, "S1");
+    }
+
+    // The same size keeps the events
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        engine.withDataSize(8192);
+        assertTrue("", engine.setup());
+        assertInt("", engine.getQueueLen(), 2);
+    }
+
+    // A different size recreates the file. Sizes are at least MIN_DATA_SIZE and a multiple of 4.
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        engine.withDataSize(100);
+        assertTrue("", engine.setup());
+        assertInt("", engine.getDataSize(), PublishQueueRingFileEngine::MIN_DATA_SIZE);
+        assertInt("", getFileSize(path), DATA_START + PublishQueueRingFileEngine::MIN_DATA_SIZE);
+        assertInt("", engine.getQueueLen(), 0);
+        writeEvent(engine, "S2");
+    }
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        engine.withDataSize(6002);
+        assertTrue("", engine.setup());
+        assertInt("", engine.getDataSize(), 6000);
+        assertInt("", getFileSize(path), DATA_START + 6000);
+        assertInt("", engine.getQueueLen(), 0);
+    }
+
+    // A file that is the wrong length for its header is recreated too
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        engine.withDataSize(6000);
+        assertTrue("", engine.setup());
+        writeEvent(engine, "S3");
+    }
+    truncate(path.c_str(), DATA_START + 3000);
+    {
+        PublishQueueRingFileEngine engine(sequentialFile);
+        engine.withDataSize(6000);
+        assertTrue("", engine.setup());
+        assertInt("", getFileSize(path), DATA_START + 6000);
+        assertInt("", engine.getQueueLen(), 0);
+    }
+}
+
+static void testImport() {
+    // Events queued by the file per event engine, for Priority::NORMAL and Priority::ALERT
+    std::string dir = makeDir("import");
+    std::string alertDir = makeDir("import/alert");
+    {
+        SequentialFile normalFiles, alertFiles;
+        normalFiles.withDirPath(dir.c_str()).withIndex();
+        normalFiles.scanDir();
+        alertFiles.withDirPath(alertDir.c_str()).withIndex();
+        alertFiles.scanDir();
+        PublishQueueFileEngine normal(normalFiles), alert(alertFiles);
+        assertTrue("", normal.setup());
+        assertTrue("", alert.setup());
+        for(int ii = 0; ii < 6; ii++) {
+            writeEvent(normal, "N" + std::to_string(ii));
+        }
+        for(int ii = 0; ii < 3; ii++) {
+            writeEvent(alert, "A" + std::to_string(ii));
+        }
+    }
+
+    PublishQueuePosix &pq = PublishQueuePosix::instance();
+    pq.withDirPath(dir.c_str()).withStorageEngine(PublishQueuePosix::StorageEngine::RING_FILE).setup();
+    assertInt("", pq.getNumEvents(PublishQueuePosix::Priority::NORMAL), 6);
+    assertInt("", pq.getNumEvents(PublishQueuePosix::Priority::ALERT), 3);
+
+    // The files were removed after they were copied
+    SequentialFile normalFiles, alertFiles;
+    normalFiles.withDirPath(dir.c_str());
+    normalFiles.scanDir();
+    alertFiles.withDirPath(alertDir.c_str());
+    alertFiles.scanDir();
+    assertInt("", normalFiles.getQueueLen(), 0);
+    assertInt("", alertFiles.getQueueLen(), 0);
+
+    // The rings have the events in the order they were queued
+    PublishQueueRingFileEngine normal(normalFiles), alert(alertFiles);
+    assertTrue("", normal.setup());
+    assertTrue("", alert.setup());
+    assertStr("", drain(normal).c_str(), "N0,N1,N2,N3,N4,N5,");
+    assertStr("", drain(alert).c_str(), "A0,A1,A2,");
+}
+
+int main(int argc, char *argv[]) {
+    size_t blockSizes[1] = { sizeof(PublishQueueEvent) + particle::protocol::MAX_EVENT_DATA_LENGTH };
+    size_t blockCounts[1] = { 8 };
+    PublishQueueEventPool::instance().setup(blockSizes, blockCounts, 1);
+
+    std::string cmd = std::string("rm -rf ") + TEST_DIR + "; mkdir -p " + TEST_DIR;
+    system(cmd.c_str());
+
+    testModel();
+    testTornRecord();
+    testTornHeader();
+    testResize();
+
+    // Uses PublishQueuePosix::instance(), so last
+    testImport();
+
+    printf("ring file test passed\n");
+    return 0;
+}
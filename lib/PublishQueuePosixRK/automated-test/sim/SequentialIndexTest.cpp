@@ -0,0 +1,261 @@
+#include "Particle.h"
+#include "PublishQueuePosixRK.h"
+#include "SimMock.h"
+#include "TestAssert.h"
+
+#include <string>
+
+// Checks the SequentialFile index used by withIndex(): adding and removing files does not write it,
+// only scanDir() and flushIndex() do, and a reset before it's flushed scans the directory. An index that
+// fails validation (CRC, version, length, filename extension, or files added or removed without it) is
+// not used and the directory is scanned instead, which queues the files oldest first. PublishQueuePosix
+// flushes it when the queue is idle and on reset.
+
+static const char *TEST_DIR = "/tmp/SequentialIndexTest";
+
+static std::string makeDir(const char *name) {
+    std::string dir = std::string(TEST_DIR) + "/" + name;
+    std::string cmd = std::string("mkdir -p ") + dir;
+    system(cmd.c_str());
+    return dir;
+}
+
+static std::string getIndexPath(const std::string &dir) {
+    return dir + "/" + SequentialFile::INDEX_NAME;
+}
+
+static bool fileExists(const std::string &path) {
+    struct stat sb;
+    return stat(path.c_str(), &sb) == 0;
+}
+
+static void createFile(SequentialFile &files, int fileNum) {
+    FILE *fp = fopen(files.getPathForFileNum(fileNum), "w");
+    assertTrue("", fp);
+    fputs("x", fp);
+    fclose(fp);
+}
+
+static int addFile(SequentialFile &files) {
+    int fileNum = files.reserveFile();
+    createFile(files, fileNum);
+    files.addFileToQueue(fileNum);
+    return fileNum;
+}
+
+// The file numbers in the queue, in queue order
+static std::string getQueueStr(SequentialFile &files) {
+    std::string result;
+    for(int ii = 0; ii < files.getQueueLen(); ii++) {
+        result += std::to_string(files.getFileFromQueueAt(ii)) + ",";
+    }
+    return result;
+}
+
+// Loads the queue like setup() after a reset, and returns the file numbers in it
+static std::string load(const std::string &dir, bool &loadedFromIndex, const char *ext = "") {
+    SequentialFile files;
+    files.withDirPath(dir.c_str()).withFilenameExtension(ext).withIndex();
+    assertTrue("", files.scanDir());
+    loadedFromIndex = files.getLoadedFromIndex();
+    return getQueueStr(files);
+}
+
+static std::string readFile(const std::string &path) {
+    std::string result;
+    FILE *fp = fopen(path.c_str(), "r");
+    assertTrue("", fp);
+    int c;
+    while((c = fgetc(fp)) != EOF) {
+        result += (char)c;
+    }
+    fclose(fp);
+    return result;
+}
+
+static void writeFile(const std::string &path, const std::string &data) {
+    FILE *fp = fopen(path.c_str(), "w");
+    assertTrue("", fp);
+    fwrite(data.data(), 1, data.size(), fp);
+    fclose(fp);
+}
+
+static void testLazyWrite() {
+    std::string dir = makeDir("lazy");
+    bool loadedFromIndex;
+
+    SequentialFile files;
+    files.withDirPath(dir.c_str()).withIndex();
+    assertTrue("", files.scanDir());
+    assertTrue("", fileExists(getIndexPath(dir)));
+
+    // Adding and removing files deletes the index the first time, and doesn't write it
+    uint32_t writesBefore = simFileStats.writes;
+    for(int ii = 0; ii < 20; ii++) {
+        addFile(files);
+    }
+    for(int ii = 0; ii < 5; ii++) {
+        files.removeFileNum(files.getFileFromQueue(true), false);
+    }
+    assertTrue("", files.removeFileFromQueue(10));
+    files.removeFileNum(10, false);
+    assertInt("", simFileStats.writes - writesBefore, 0);
+    assertTrue("", !fileExists(getIndexPath(dir)));
+
+    // A reset now scans the directory
+    const char *expected = "6,7,8,9,11,12,13,14,15,16,17,18,19,20,";
+    assertStr("", load(dir, loadedFromIndex).c_str(), expected);
+    assertTrue("", !loadedFromIndex);
+
+    // Flushing writes the header and bitmap once, and the index is used after a reset
+    writesBefore = simFileStats.writes;
+    files.flushIndex();
+    files.flushIndex();
+    assertInt("", simFileStats.writes - writesBefore, 2);
+    assertStr("", load(dir, loadedFromIndex).c_str(), expected);
+    assertTrue("", loadedFromIndex);
+
+    // A file number reserved but not used leaves a gap the index check can't see, so the index
+    // must not survive the file added after it
+    files.reserveFile();
+    addFile(files);
+    assertStr("", load(dir, loadedFromIndex).c_str(), "6,7,8,9,11,12,13,14,15,16,17,18,19,20,22,");
+    assertTrue("", !loadedFromIndex);
+
+    // Without withIndex() there's no index to flush
+    std::string plainDir = makeDir("plain");
+    SequentialFile plain;
+    plain.withDirPath(plainDir.c_str());
+    plain.scanDir();
+    addFile(plain);
+    plain.flushIndex();
+    assertTrue("", !fileExists(getIndexPath(plainDir)));
+}
+
+static void testValidation() {
+    std::string dir = makeDir("validation");
+    std::string indexPath = getIndexPath(dir);
+    bool loadedFromIndex;
+
+    SequentialFile files;
+    files.withDirPath(dir.c_str()).withIndex();
+    files.scanDir();
+    for(int ii = 0; ii < 10; ii++) {
+        addFile(files);
+    }
+    files.flushIndex();
+
+    const char *expected = "1,2,3,4,5,6,7,8,9,10,";
+    assertStr("", load(dir, loadedFromIndex).c_str(), expected);
+    assertTrue("", loadedFromIndex);
+    const std::string index = readFile(indexPath);
+    assertInt("", (int)index.size(), (int)sizeof(SequentialFileIndexHeader) + 2);
+
+    // A changed bit in the bitmap fails the CRC check
+    std::string changed = index;
+    changed[sizeof(SequentialFileIndexHeader) + 1] ^= 0x04;
+    writeFile(indexPath, changed);
+    assertStr("", load(dir, loadedFromIndex).c_str(), expected);
+    assertTrue("", !loadedFromIndex);
+
+    // A different version
+    changed = index;
+    changed[offsetof(SequentialFileIndexHeader, version)]++;
+    writeFile(indexPath, changed);
+    assertStr("", load(dir, loadedFromIndex).c_str(), expected);
+    assertTrue("", !loadedFromIndex);
+
+    // Shorter than the header says
+    writeFile(indexPath, index.substr(0, index.size() - 1));
+    assertStr("", load(dir, loadedFromIndex).c_str(), expected);
+    assertTrue("", !loadedFromIndex);
+
+    // Written for a different filename extension. There are no files with it, so the queue is empty.
+    writeFile(indexPath, index);
+    assertStr("", load(dir, loadedFromIndex, "dat").c_str(), "");
+    assertTrue("", !loadedFromIndex);
+
+    // A file added after the index was written
+    writeFile(indexPath, index);
+    createFile(files, 11);
+    assertStr("", load(dir, loadedFromIndex).c_str(), "1,2,3,4,5,6,7,8,9,10,11,");
+    assertTrue("", !loadedFromIndex);
+    unlink(files.getPathForFileNum(11));
+
+    // The files at the front and the back of the queue removed after the index was written
+    writeFile(indexPath, index);
+    unlink(files.getPathForFileNum(1));
+    assertStr("", load(dir, loadedFromIndex).c_str(), "2,3,4,5,6,7,8,9,10,");
+    assertTrue("", !loadedFromIndex);
+    createFile(files, 1);
+
+    writeFile(indexPath, index);
+    unlink(files.getPathForFileNum(10));
+    assertStr("", load(dir, loadedFromIndex).c_str(), "1,2,3,4,5,6,7,8,9,");
+    assertTrue("", !loadedFromIndex);
+    createFile(files, 10);
+
+    // The index is still good after all that
+    writeFile(indexPath, index);
+    assertStr("", load(dir, loadedFromIndex).c_str(), expected);
+    assertTrue("", loadedFromIndex);
+
+    // Files added out of order can't be in the bitmap, so flushing removes the index
+    createFile(files, 5);
+    files.addFileToQueue(5);
+    files.flushIndex();
+    assertTrue("", !fileExists(indexPath));
+}
+
+static void testPublishQueue() {
+    std::string dir = makeDir("queue");
+    std::string indexPath = getIndexPath(dir);
+
+    PublishQueuePosix &pq = PublishQueuePosix::instance();
+    pq.withDirPath(dir.c_str()).withRamQueueSize(0).setup();
+    pq.setPausePublishing(true);
+    simRunThreads();
+    pq.loop();
+    assertTrue("", fileExists(indexPath));
+
+    // Events written to files don't write the index until loop() finds the queue idle
+    uint32_t writesBefore = simFileStats.writes;
+    for(int ii = 0; ii < 10; ii++) {
+        assertTrue("", pq.publish("t", ("E" + std::to_string(ii)).c_str(), PRIVATE | WITH_ACK));
+    }
+    assertInt("", pq.getNumEvents(), 10);
+    assertTrue("", !fileExists(indexPath));
+
+    // One write of the header and one of the bitmap for each file queued, and the two for the index
+    pq.loop();
+    assertTrue("", fileExists(indexPath));
+    assertInt("", simFileStats.writes - writesBefore, 10 * 2 + 2);
+
+    bool loadedFromIndex;
+    assertStr("", load(dir, loadedFromIndex).c_str(), "1,2,3,4,5,6,7,8,9,10,");
+    assertTrue("", loadedFromIndex);
+
+    // The reset system event writes it too
+    pq.publish("t", "E10", PRIVATE | WITH_ACK);
+    assertTrue("", !fileExists(indexPath));
+    simSystemEvent(reset, 0);
+    assertTrue("", fileExists(indexPath));
+    assertStr("", load(dir, loadedFromIndex).c_str(), "1,2,3,4,5,6,7,8,9,10,11,");
+    assertTrue("", loadedFromIndex);
+
+    pq.clearQueues();
+}
+
+int main(int argc, char *argv[]) {
+    std::string cmd = std::string("rm -rf ") + TEST_DIR + "; mkdir -p " + TEST_DIR;
+    system(cmd.c_str());
+
+    testLazyWrite();
+    testValidation();
+
+    // Uses PublishQueuePosix::instance(), which sets up the event pool
+    testPublishQueue();
+
+    printf("sequential index test passed\n");
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include "SimCloud.h"
+#include "SimMock.h"
+
+#include <math.h>
+
+// Cloud rate limit: one publish per second on average, with bursts of up to 4
+static const uint32_t RATE_LIMIT_MS = 1000;
+static const uint32_t RATE_LIMIT_BURST = 4;
+
+SimCloud &SimCloud::instance() {
+    static SimCloud *cloud = new SimCloud();
+    return *cloud;
+}
+
+SimCloud &SimCloud::withSettings(const Settings &settings, uint32_t seed) {
+    this->settings = settings;
+    rng.seed(seed);
+    isConnected = !inDisconnectWindow();
+    return *this;
+}
+
+uint32_t SimCloud::sampleLatencyMs() {
+    switch(settings.latency) {
+        case Latency::UNIFORM:
+            return std::uniform_int_distribution<uint32_t>(settings.latencyMs, settings.latencyMaxMs)(rng);
+
+        case Latency::LOGNORMAL: {
+            // The 90th percentile of a normal distribution is 1.2816 standard deviations above the median
+            double mu = log((double)settings.latencyMs);
+            double sigma = (log((double)settings.latencyMaxMs) - mu) / 1.2816;
+            return (uint32_t) std::lognormal_distribution<double>(mu, (sigma > 0) ? sigma : 0.001)(rng);
+        }
+
+        case Latency::FIXED:
+        default:
+            return settings.latencyMs;
+    }
+}
+
+bool SimCloud::inDisconnectWindow() const {
+    for(auto it = settings.disconnects.begin(); it != settings.disconnects.end(); it++) {
+        if (millis() >= it->startMs && millis() - it->startMs < it->durationMs) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SimCloud::allConnected() const {
+    for(auto it = settings.disconnects.begin(); it != settings.disconnects.end(); it++) {
+        if (millis() < it->startMs + it->durationMs) {
+            return false;
+        }
+    }
+    return true;
+}
+
+particle::Future<bool> SimCloud::publish(const char *eventName, const char *eventData, PublishFlags flags) {
+    particle::Future<bool> future;
+    stats.publishes++;
+
+    if (!isConnected) {
+        stats.offline++;
+        future.simComplete(false);
+        return future;
+    }
+
+    Pending p;
+    p.future = future;
+    p.eventName = eventName;
+    p.eventData = eventData ? eventData : "";
+    p.succeeded = true;
+    p.received = true;
+    p.completeMs = millis() + sampleLatencyMs();
+
+    std::uniform_real_distribution<double> chance(0, 1);
+    if (chance(rng) < settings.lossRate) {
+        stats.lost++;
+        p.succeeded = p.received = false;
+        p.completeMs = millis() + settings.timeoutMs;
+    }
+    else
+    if (chance(rng) < settings.ackLossRate) {
+        stats.ackLost++;
+        p.succeeded = false;
+        p.completeMs = millis() + settings.timeoutMs;
+    }
+    else
+    if (settings.rateLimit) {
+        // GCRA: conforms if no more than the burst allowance ahead of the average rate
+        if (!rateLimitStarted || (int32_t)(rateLimitTime - millis()) < 0) {
+            rateLimitTime = millis();
+            rateLimitStarted = true;
+        }
+        if (rateLimitTime - millis() > (RATE_LIMIT_BURST - 1) * RATE_LIMIT_MS) {
+            stats.rateLimited++;
+            p.succeeded = p.received = false;
+        }
+        else {
+            rateLimitTime += RATE_LIMIT_MS;
+        }
+    }
+
+    pending.push_back(p);
+    return future;
+}
+
+void SimCloud::advance() {
+    bool wasConnected = isConnected;
+    isConnected = !inDisconnectWindow();
+
+    if (wasConnected && !isConnected) {
+        stats.disconnects++;
+        simSystemEvent(cloud_status, cloud_status_disconnecting);
+
+        // Publishes that have not reached the cloud fail
+        for(auto it = pending.begin(); it != pending.end(); it++) {
+            if (it->received && it->succeeded) {
+                stats.disconnected++;
+            }
+            it->future.simComplete(false);
+        }
+        pending.clear();
+        simSystemEvent(cloud_status, cloud_status_disconnected);
+    }
+    else
+    if (!wasConnected && isConnected) {
+        simSystemEvent(cloud_status, cloud_status_connected);
+    }
+
+    for(auto it = pending.begin(); it != pending.end(); ) {
+        if ((int32_t)(millis() - it->completeMs) < 0) {
+            it++;
+            continue;
+        }
+        Pending p = *it;
+        it = pending.erase(it);
+
+        if (p.received && receivedCallback) {
+            receivedCallback(p.eventName.c_str(), p.eventData.c_str());
+        }
+        if (p.succeeded) {
+            stats.succeeded++;
+        }
+        p.future.simComplete(p.succeeded);
+    }
+}
@@ -0,0 +1,144 @@
+#ifndef __SIMCLOUD_H
+#define __SIMCLOUD_H
+
+#include "Particle.h"
+
+#include <random>
+#include <string>
+
+/**
+ * @brief Scriptable Particle cloud for the publish queue simulation
+ *
+ * Particle.publish() calls publish(), which completes the Future after a time from the latency distribution,
+ * virtual time. A publish can be lost on the way to the cloud, or reach the cloud and have its acknowledgement
+ * lost; either way it fails after the timeout. Publishes faster than the cloud rate limit fail. While
+ * disconnected, publishes fail at once, and publishes in progress when the connection is lost fail.
+ *
+ * advance() must be called each time the virtual clock is advanced.
+ */
+class SimCloud {
+public:
+    /**
+     * @brief How the time from publish to acknowledgement is chosen
+     */
+    enum class Latency {
+        FIXED,          //!< Always latencyMs
+        UNIFORM,        //!< Uniform from latencyMs to latencyMaxMs
+        LOGNORMAL       //!< Log-normal with median latencyMs and 90th percentile latencyMaxMs
+    };
+
+    /**
+     * @brief A time without a cloud connection
+     */
+    struct Window {
+        uint32_t startMs; //!< millis() value when the connection is lost
+        uint32_t durationMs; //!< How long until it's connected again
+    };
+
+    /**
+     * @brief Cloud behavior, set using withSettings()
+     */
+    struct Settings {
+        Latency latency = Latency::FIXED; //!< Latency distribution
+        uint32_t latencyMs = 1000; //!< Fixed latency, uniform minimum, or log-normal median
+        uint32_t latencyMaxMs = 1000; //!< Uniform maximum or log-normal 90th percentile
+        double lossRate = 0; //!< Fraction of publishes that never reach the cloud
+        double ackLossRate = 0; //!< Fraction of publishes that reach the cloud but whose acknowledgement is lost
+        uint32_t timeoutMs = 20000; //!< Time until a lost publish fails
+        bool rateLimit = true; //!< Publishes over 1 per second on average, with bursts of 4, fail
+        std::vector<Window> disconnects; //!< Times without a connection
+    };
+
+    /**
+     * @brief Counts of what happened to publishes
+     */
+    struct Stats {
+        uint32_t publishes; //!< Particle.publish() calls
+        uint32_t succeeded; //!< Acknowledged
+        uint32_t offline; //!< Failed because not connected
+        uint32_t lost; //!< Lost on the way to the cloud
+        uint32_t ackLost; //!< Reached the cloud but the acknowledgement was lost
+        uint32_t rateLimited; //!< Rejected by the rate limit
+        uint32_t disconnected; //!< Failed because the connection was lost while in progress
+        uint32_t disconnects; //!< Times the connection was lost
+    };
+
+    /**
+     * @brief Gets the singleton instance
+     */
+    static SimCloud &instance();
+
+    /**
+     * @brief Set the behavior and the random number seed. Call before the simulation starts.
+     */
+    SimCloud &withSettings(const Settings &settings, uint32_t seed);
+
+    /**
+     * @brief Set a function to call with each event that reaches the cloud
+     */
+    SimCloud &withReceivedCallback(std::function<void(const char *eventName, const char *eventData)> cb) { receivedCallback = cb; return *this; };
+
+    /**
+     * @brief Handle Particle.publish()
+     */
+    particle::Future<bool> publish(const char *eventName, const char *eventData, PublishFlags flags);
+
+    /**
+     * @brief Handle Particle.connected()
+     */
+    bool connected() const { return isConnected; };
+
+    /**
+     * @brief Update the connection and complete publishes whose time has come. Call after advancing the clock.
+     */
+    void advance();
+
+    /**
+     * @brief Returns true if the connection will not be lost after now
+     */
+    bool allConnected() const;
+
+    /**
+     * @brief Returns true if no publishes are waiting to complete
+     */
+    bool idle() const { return pending.empty(); };
+
+    /**
+     * @brief Gets the counts
+     */
+    const Stats &getStats() const { return stats; };
+
+protected:
+    /**
+     * @brief A publish that has not completed
+     */
+    struct Pending {
+        particle::Future<bool> future; //!< Completed at completeMs
+        uint32_t completeMs; //!< millis() value when it completes
+        bool succeeded; //!< Result
+        bool received; //!< Reaches the cloud at completeMs, even if it fails
+        std::string eventName; //!< Event name, for receivedCallback
+        std::string eventData; //!< Event data, for receivedCallback
+    };
+
+    /**
+     * @brief Choose a latency from the distribution
+     */
+    uint32_t sampleLatencyMs();
+
+    /**
+     * @brief Returns true if millis() is in a disconnect window
+     */
+    bool inDisconnectWindow() const;
+
+    Settings settings; //!< Set by withSettings()
+    std::mt19937 rng; //!< Random numbers for latency and losses
+    std::vector<Pending> pending; //!< Publishes in progress
+    std::function<void(const char *eventName, const char *eventData)> receivedCallback; //!< Set by withReceivedCallback()
+    bool isConnected = true; //!< Connected to the cloud
+    uint32_t rateLimitTime = 0; //!< Theoretical time of the next publish at the rate limit
+    bool rateLimitStarted = false; //!< rateLimitTime is valid
+    Stats stats = {}; //!< Counts
+};
+
+#endif /* __SIMCLOUD_H */
@@ -0,0 +1,286 @@
+#include "SimMock.h"
+#include "SimCloud.h"
+
+#include <deque>
+#include <stdarg.h>
+#include <ucontext.h>
+
+// Device OS mock implementation for the publish queue simulation: virtual clock, coroutine threads,
+// queues, the cloud and system objects, and file system call counting.
+
+LogLevel simLogLevel = LOG_LEVEL_ERROR;
+const Logger Log("app");
+
+void Logger::vlog(LogLevel level, const char *fmt, va_list ap) const {
+    if (level < simLogLevel) {
+        return;
+    }
+    const char *levelStr = (level >= LOG_LEVEL_ERROR) ? "ERROR" : (level >= LOG_LEVEL_WARN) ? "WARN" : (level >= LOG_LEVEL_INFO) ? "INFO" : "TRACE";
+    char buf[512];
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    printf("%10.3f %s %s: %s\n", millis() / 1000.0, name, levelStr, buf);
+}
+
+// Used by the UnitTestLib String
+extern "C" char *itoa(int value, char *str, int base) {
+    sprintf(str, (base == 16) ? "%x" : (base == 8) ? "%o" : "%d", value);
+    return str;
+}
+
+extern "C" char *utoa(unsigned int value, char *str, int base) {
+    sprintf(str, (base == 16) ? "%x" : (base == 8) ? "%o" : "%u", value);
+    return str;
+}
+
+extern "C" char *ltoa(long value, char *str, int base) {
+    sprintf(str, (base == 16) ? "%lx" : (base == 8) ? "%lo" : "%ld", value);
+    return str;
+}
+
+extern "C" char *ultoa(unsigned long value, char *str, int base, char pad) {
+    sprintf(str, (base == 16) ? "%lx" : (base == 8) ? "%lo" : "%lu", value);
+    return str;
+}
+
+//
+// Clock
+//
+
+static uint32_t simMillis = 1000;
+static bool simTimeValid = true;
+static const time32_t SIM_START_TIME = 1700000000;
+
+uint32_t millis() {
+    return simMillis;
+}
+
+void delay(uint32_t ms) {
+    simMillis += ms;
+}
+
+void simAdvanceMillis(uint32_t ms) {
+    simMillis += ms;
+}
+
+void simSetTimeValid(bool valid) {
+    simTimeValid = valid;
+}
+
+TimeClass Time;
+
+time32_t TimeClass::now() {
+    return SIM_START_TIME + (time32_t)(simMillis / 1000);
+}
+
+bool TimeClass::isValid() {
+    return simTimeValid;
+}
+
+//
+// Threads and queues
+//
+
+struct SimQueue {
+    size_t itemSize;
+    size_t itemCount;
+    std::deque<std::vector<uint8_t>> items;
+};
+
+struct SimThread {
+    std::function<void()> function;
+    ucontext_t context;
+    std::vector<uint8_t> stack;
+    bool finished = false;
+    SimQueue *waitQueue = NULL; //!< Queue the thread is waiting on, NULL if it's ready to run
+    bool waitForever = false;
+    uint32_t waitUntil = 0; //!< millis() value when the wait times out
+};
+
+static std::vector<SimThread *> simThreads;
+static SimThread *currentThread = NULL;
+static ucontext_t mainContext;
+
+// Coroutine stacks are large because they run host code with host-sized stack frames
+static const size_t SIM_STACK_SIZE = 256 * 1024;
+
+static void threadEntry() {
+    currentThread->function();
+    currentThread->finished = true;
+    swapcontext(&currentThread->context, &mainContext);
+}
+
+Thread::Thread(const char *name, std::function<void()> function, int priority, size_t stackSize) {
+    simThread = new SimThread();
+    simThread->function = function;
+    simThread->stack.resize(SIM_STACK_SIZE);
+    getcontext(&simThread->context);
+    simThread->context.uc_stack.ss_sp = simThread->stack.data();
+    simThread->context.uc_stack.ss_size = simThread->stack.size();
+    simThread->context.uc_link = NULL;
+    makecontext(&simThread->context, threadEntry, 0);
+    simThreads.push_back(simThread);
+}
+
+void Thread::dispose() {
+    while(!simThread->finished) {
+        simRunThreads();
+    }
+}
+
+static bool threadReady(const SimThread *thread) {
+    if (thread->finished) {
+        return false;
+    }
+    if (!thread->waitQueue || !thread->waitQueue->items.empty()) {
+        return true;
+    }
+    return !thread->waitForever && (int32_t)(millis() - thread->waitUntil) >= 0;
+}
+
+void simRunThreads() {
+    bool ran;
+    do {
+        ran = false;
+        for(size_t ii = 0; ii < simThreads.size(); ii++) {
+            SimThread *thread = simThreads[ii];
+            if (threadReady(thread)) {
+                currentThread = thread;
+                swapcontext(&mainContext, &thread->context);
+                currentThread = NULL;
+                ran = true;
+            }
+        }
+    } while(ran);
+}
+
+int os_queue_create(os_queue_t *queue, size_t itemSize, size_t itemCount, void *reserved) {
+    *queue = new SimQueue();
+    (*queue)->itemSize = itemSize;
+    (*queue)->itemCount = itemCount;
+    return 0;
+}
+
+int os_queue_put(os_queue_t queue, const void *item, uint32_t delay, void *reserved) {
+    if (queue->items.size() >= queue->itemCount) {
+        return 1;
+    }
+    const uint8_t *p = (const uint8_t *)item;
+    queue->items.push_back(std::vector<uint8_t>(p, p + queue->itemSize));
+    return 0;
+}
+
+int os_queue_take(os_queue_t queue, void *item, uint32_t delay, void *reserved) {
+    if (queue->items.empty() && delay != 0 && currentThread) {
+        // Switch to the main thread until there is an item or the timeout expires
+        currentThread->waitQueue = queue;
+        currentThread->waitForever = (delay == CONCURRENT_WAIT_FOREVER);
+        currentThread->waitUntil = millis() + delay;
+        swapcontext(&currentThread->context, &mainContext);
+        currentThread->waitQueue = NULL;
+    }
+    if (queue->items.empty()) {
+        return 1;
+    }
+    memcpy(item, queue->items.front().data(), queue->itemSize);
+    queue->items.pop_front();
+    return 0;
+}
+
+//
+// Cloud and system
+//
+
+CloudClass Particle;
+SystemClass System;
+
+static system_event_t systemEvents = 0;
+static void (*systemEventHandler)(system_event_t event, int param) = NULL;
+
+int system_thread_get_state(void *reserved) {
+    return particle::feature::ENABLED;
+}
+
+particle::Future<bool> CloudClass::publish(const char *eventName, const char *eventData, PublishFlags flags1, PublishFlags flags2) {
+    return SimCloud::instance().publish(eventName, eventData, flags1 | flags2);
+}
+
+bool CloudClass::connected() {
+    return SimCloud::instance().connected();
+}
+
+void SystemClass::on(system_event_t events, void (*handler)(system_event_t event, int param)) {
+    systemEvents = events;
+    systemEventHandler = handler;
+}
+
+void simSystemEvent(system_event_t event, int param) {
+    if (systemEventHandler && (systemEvents & event)) {
+        systemEventHandler(event, param);
+    }
+}
+
+//
+// File system call counting
+//
+
+SimFileStats simFileStats = {};
+static bool simWriteFailure = false;
+
+void simSetWriteFailure(bool fail) {
+    simWriteFailure = fail;
+}
+
+extern "C" {
+int __real_open(const char *path, int flags, ...);
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+int __real_fsync(int fd);
+int __real_unlink(const char *path);
+
+int __wrap_open(const char *path, int flags, ...) {
+    // The code under test does not pass a mode with O_CREAT, which Device OS ignores
+    if ((flags & O_CREAT) && access(path, F_OK) != 0) {
+        simFileStats.creates++;
+    }
+    int fd = __real_open(path, flags, 0666);
+    if (fd >= 0) {
+        simFileStats.opens++;
+    }
+    return fd;
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+    ssize_t result = __real_read(fd, buf, count);
+    simFileStats.reads++;
+    if (result > 0) {
+        simFileStats.bytesRead += result;
+    }
+    return result;
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t count) {
+    simFileStats.writes++;
+    if (simWriteFailure) {
+        errno = ENOSPC;
+        return -1;
+    }
+    ssize_t result = __real_write(fd, buf, count);
+    if (result > 0) {
+        simFileStats.bytesWritten += result;
+    }
+    return result;
+}
+
+int __wrap_fsync(int fd) {
+    simFileStats.fsyncs++;
+    return __real_fsync(fd);
+}
+
+int __wrap_unlink(const char *path) {
+    int result = __real_unlink(path);
+    if (result == 0) {
+        simFileStats.unlinks++;
+    }
+    return result;
+}
+}
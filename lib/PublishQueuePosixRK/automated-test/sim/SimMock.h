@@ -0,0 +1,49 @@
+#ifndef __SIMMOCK_H
+#define __SIMMOCK_H
+
+#include "Particle.h"
+
+/**
+ * @brief Advance the virtual clock returned by millis() and Time.now()
+ */
+void simAdvanceMillis(uint32_t ms);
+
+/**
+ * @brief Set whether Time.isValid() returns true (default: true)
+ */
+void simSetTimeValid(bool valid);
+
+/**
+ * @brief Set whether write() fails with ENOSPC, like a full file system (default: false)
+ */
+void simSetWriteFailure(bool fail);
+
+/**
+ * @brief Run threads that are waiting on a queue with an item in it, or whose timeout expired, until none are
+ */
+void simRunThreads();
+
+/**
+ * @brief Call the handler registered with System.on() if it includes event
+ */
+void simSystemEvent(system_event_t event, int param);
+
+/**
+ * @brief File system calls made by the code under test
+ *
+ * Counted by wrapping open(), read(), write(), fsync() and unlink() with the linker (-Wl,--wrap), so
+ * SequentialFileRK directory and file operations are included as well as the storage engines.
+ */
+struct SimFileStats {
+    uint32_t opens; //!< Files opened
+    uint32_t creates; //!< Files opened with O_CREAT that did not exist
+    uint32_t unlinks; //!< Files removed
+    uint32_t fsyncs; //!< fsync() calls
+    uint32_t reads; //!< read() calls
+    uint32_t writes; //!< write() calls
+    uint64_t bytesRead; //!< Bytes read
+    uint64_t bytesWritten; //!< Bytes written
+};
+extern SimFileStats simFileStats;
+
+#endif /* __SIMMOCK_H */
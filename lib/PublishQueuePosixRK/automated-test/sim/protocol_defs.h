@@ -0,0 +1,3 @@
+#pragma once
+
+// Included by BackgroundPublishRK.h. The protocol limits used by the simulation are in Particle.h.
@@ -0,0 +1,143 @@
+#include "PublishQueueEventPool.h"
+
+PublishQueueEventPool *PublishQueueEventPool::_instance;
+
+static Logger _log("app.pubq");
+
+PublishQueueEventPool &PublishQueueEventPool::instance() {
+    if (!_instance) {
+        _instance = new PublishQueueEventPool();
+    }
+    return *_instance;
+}
+
+bool PublishQueueEventPool::setup(const size_t *blockSizes, const size_t *numBlocks, size_t numSizeClasses) {
+    if (arena) {
+        return true;
+    }
+    if (numSizeClasses > MAX_SIZE_CLASSES) {
+        numSizeClasses = MAX_SIZE_CLASSES;
+    }
+
+    size_t arenaSize = 0;
+    size_t numClasses = 0;
+    for(size_t ii = 0; ii < numSizeClasses; ii++) {
+        if (numBlocks[ii] == 0) {
+            continue;
+        }
+        SizeClass &sizeClass = classes[numClasses++];
+        sizeClass.blockSize = (blockSizes[ii] + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+        sizeClass.numBlocks = numBlocks[ii];
+        arenaSize += sizeClass.blockSize * sizeClass.numBlocks;
+    }
+    if (arenaSize == 0) {
+        // No blocks, alloc() uses the heap
+        return false;
+    }
+
+    char *mem = new char[arenaSize];
+    if (!mem) {
+        _log.error("could not allocate event pool %u bytes", (unsigned)arenaSize);
+        return false;
+    }
+    os_mutex_create(&mutex);
+
+    char *next = mem;
+    for(size_t ii = 0; ii < numClasses; ii++) {
+        SizeClass &sizeClass = classes[ii];
+        sizeClass.start = next;
+
+        // Link the blocks in order so the first ones are used first
+        void **link = &sizeClass.freeList;
+        for(size_t jj = 0; jj < sizeClass.numBlocks; jj++) {
+            *link = next;
+            link = (void **)next;
+            next += sizeClass.blockSize;
+        }
+        *link = NULL;
+    }
+
+    WITH_LOCK(*this) {
+        this->numSizeClasses = numClasses;
+        arena = mem;
+        arenaEnd = next;
+    }
+    _log.info("event pool %u bytes", (unsigned)arenaSize);
+    return true;
+}
+
+void *PublishQueueEventPool::alloc(size_t size) {
+    if (!arena) {
+        return new char[size];
+    }
+
+    WITH_LOCK(*this) {
+        size_t first = 0;
+        while(first < numSizeClasses && size > classes[first].blockSize) {
+            first++;
+        }
+        if (first == numSizeClasses) {
+            // Larger than any block. Not counted as a failure because a free block would not help.
+            return NULL;
+        }
+
+        for(size_t ii = first; ii < numSizeClasses; ii++) {
+            SizeClass &sizeClass = classes[ii];
+            if (sizeClass.freeList) {
+                void *block = sizeClass.freeList;
+                sizeClass.freeList = *(void **)block;
+                if (++sizeClass.inUse > sizeClass.highWater) {
+                    sizeClass.highWater = sizeClass.inUse;
+                }
+                return block;
+            }
+        }
+        classes[first].failures++;
+    }
+    return NULL;
+}
+
+void PublishQueueEventPool::free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    if ((char *)ptr < arena || (char *)ptr >= arenaEnd) {
+        // Allocated from the heap before setup()
+        delete[] (char *)ptr;
+        return;
+    }
+
+    WITH_LOCK(*this) {
+        for(size_t ii = numSizeClasses; ii > 0; ii--) {
+            SizeClass &sizeClass = classes[ii - 1];
+            if ((char *)ptr >= sizeClass.start) {
+                *(void **)ptr = sizeClass.freeList;
+                sizeClass.freeList = ptr;
+                sizeClass.inUse--;
+                break;
+            }
+        }
+    }
+}
+
+PublishQueueEventPool::Stats PublishQueueEventPool::getStats(size_t sizeClass) const {
+    Stats stats;
+    memset(&stats, 0, sizeof(stats));
+    if (sizeClass < numSizeClasses) {
+        const SizeClass &c = classes[sizeClass];
+        stats.blockSize = c.blockSize;
+        stats.numBlocks = c.numBlocks;
+        stats.inUse = c.inUse;
+        stats.highWater = c.highWater;
+        stats.failures = c.failures;
+    }
+    return stats;
+}
+
+size_t PublishQueueEventPool::getFailures() const {
+    size_t result = 0;
+    for(size_t ii = 0; ii < numSizeClasses; ii++) {
+        result += classes[ii].failures;
+    }
+    return result;
+}
@@ -0,0 +1,131 @@
+#ifndef __PUBLISHQUEUEEVENTPOOL_H
+#define __PUBLISHQUEUEEVENTPOOL_H
+
+// Github: https://github.com/rickkas7/PublishQueuePosixRK
+// License: MIT
+
+#include "Particle.h"
+
+/**
+ * @brief Fixed-size block allocator for queued events
+ *
+ * All of the blocks are allocated from the heap once, in one piece, by setup(). Blocks are
+ * grouped into size classes and each class has a free list, so allocating and freeing events
+ * of different sizes for a long time does not fragment the heap.
+ *
+ * alloc() uses the smallest class with a free block that the size fits in. If that class
+ * is empty a block from a larger class is used. When there is no free block it returns NULL
+ * and counts a failure; it does not fall back to the heap. Before setup(), or if the pool has
+ * no blocks, alloc() and free() use the heap.
+ *
+ * The methods can be called from any thread.
+ */
+class PublishQueueEventPool {
+public:
+    /**
+     * @brief Gets the singleton instance of this class
+     */
+    static PublishQueueEventPool &instance();
+
+    /**
+     * @brief Allocate the blocks
+     *
+     * @param blockSizes Size of the blocks in each class in bytes, smallest first
+     *
+     * @param numBlocks Number of blocks in each class
+     *
+     * @param numSizeClasses Number of entries in blockSizes and numBlocks, up to MAX_SIZE_CLASSES
+     *
+     * @return true if the blocks were allocated. Only the first call does anything.
+     */
+    bool setup(const size_t *blockSizes, const size_t *numBlocks, size_t numSizeClasses);
+
+    /**
+     * @brief Returns true if setup() has allocated the blocks
+     */
+    bool isSetup() const { return arena != NULL; };
+
+    /**
+     * @brief Allocate a block
+     *
+     * @param size Number of bytes needed
+     *
+     * @return The block, or NULL if there is no free block or size is larger than the largest class
+     */
+    void *alloc(size_t size);
+
+    /**
+     * @brief Free a block returned by alloc(). NULL is ignored.
+     */
+    void free(void *ptr);
+
+    /**
+     * @brief Statistics for one size class, returned by getStats()
+     */
+    struct Stats {
+        size_t blockSize;   //!< Size of each block in bytes
+        size_t numBlocks;   //!< Number of blocks
+        size_t inUse;       //!< Number of blocks allocated now
+        size_t highWater;   //!< Largest number of blocks allocated at the same time
+        size_t failures;    //!< Number of allocations of a size that fits this class that found no free block
+    };
+
+    /**
+     * @brief Get the statistics for a size class
+     *
+     * @param sizeClass 0 to getNumSizeClasses() - 1
+     */
+    Stats getStats(size_t sizeClass) const;
+
+    /**
+     * @brief Get the number of size classes set by setup()
+     */
+    size_t getNumSizeClasses() const { return numSizeClasses; };
+
+    /**
+     * @brief Get the number of allocations that failed because there was no free block, all classes
+     */
+    size_t getFailures() const;
+
+    /**
+     * @brief Lock the pool mutex. Used by WITH_LOCK().
+     */
+    void lock() { if (mutex) { os_mutex_lock(mutex); } };
+
+    /**
+     * @brief Unlock the pool mutex
+     */
+    void unlock() { if (mutex) { os_mutex_unlock(mutex); } };
+
+    static const size_t MAX_SIZE_CLASSES = 4; //!< Maximum number of size classes passed to setup()
+    static const size_t BLOCK_ALIGN = 8; //!< Blocks sizes are rounded up to a multiple of this
+
+protected:
+    /**
+     * @brief Constructor. Use instance() instead.
+     */
+    PublishQueueEventPool() {};
+
+    /**
+     * @brief Blocks of one size
+     */
+    struct SizeClass {
+        size_t blockSize = 0;       //!< Size of each block
+        size_t numBlocks = 0;       //!< Number of blocks
+        char *start = NULL;         //!< First block in the arena
+        void *freeList = NULL;      //!< Free blocks, each holding a pointer to the next
+        size_t inUse = 0;           //!< Blocks allocated now
+        size_t highWater = 0;       //!< Most blocks allocated at the same time
+        size_t failures = 0;        //!< Allocations that found no free block
+    };
+
+    SizeClass classes[MAX_SIZE_CLASSES]; //!< Size classes, smallest first
+    size_t numSizeClasses = 0; //!< Number of entries used in classes
+    char *arena = NULL; //!< All of the blocks
+    char *arenaEnd = NULL; //!< Byte after the last block
+    os_mutex_t mutex = 0; //!< Created by setup()
+
+    static PublishQueueEventPool *_instance; //!< singleton instance of this class
+};
+
+#endif /* __PUBLISHQUEUEEVENTPOOL_H */
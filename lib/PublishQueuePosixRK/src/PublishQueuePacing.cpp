@@ -0,0 +1,94 @@
+#include "PublishQueuePacing.h"
+
+#include <algorithm>
+#include <stdlib.h>
+
+// Arguments by value, as std::min() and std::max() take references to the static const members, which are not defined
+static unsigned long minMs(unsigned long a, unsigned long b) { return (a < b) ? a : b; }
+static unsigned long maxMs(unsigned long a, unsigned long b) { return (a > b) ? a : b; }
+
+void PublishQueuePacing::reset(unsigned long intervalMs, unsigned long connectDelayMs, unsigned long maxRetryDelayMs) {
+    this->intervalMs = minMs(maxMs(intervalMs, MIN_INTERVAL_MS), MAX_INTERVAL_MS);
+    this->connectDelayMs = minMs(maxMs(connectDelayMs, MIN_CONNECT_DELAY_MS), MAX_CONNECT_DELAY_MS);
+    this->maxRetryDelayMs = maxMs(maxRetryDelayMs, MIN_RETRY_DELAY_MS);
+    retryDelayMs = 0;
+    consecutiveFailures = 0;
+    rateLimitStarted = false;
+    numSamples = nextSample = 0;
+}
+
+unsigned long PublishQueuePacing::getRateLimitWaitMs(unsigned long now) const {
+    if (!rateLimitStarted) {
+        return 0;
+    }
+    // A start conforms if it's no more than the burst allowance ahead of the average rate
+    long early = (long)(rateLimitTime - (RATE_LIMIT_BURST - 1) * RATE_LIMIT_MS - now);
+    return (early > 0) ? (unsigned long)early : 0;
+}
+
+void PublishQueuePacing::publishStarted(unsigned long now) {
+    if (!rateLimitStarted || (long)(rateLimitTime - now) < 0) {
+        rateLimitTime = now;
+        rateLimitStarted = true;
+    }
+    rateLimitTime += RATE_LIMIT_MS;
+}
+
+void PublishQueuePacing::publishCompleted(bool succeeded, unsigned long rttMs, bool firstAfterConnect) {
+    if (succeeded) {
+        consecutiveFailures = 0;
+
+        rttSamples[nextSample] = (uint16_t) minMs(rttMs, 0xffff);
+        nextSample = (nextSample + 1) % RTT_SAMPLES;
+        if (numSamples < RTT_SAMPLES) {
+            numSamples++;
+        }
+
+        if (rttMs <= SLOW_ACK_MS) {
+            intervalMs = maxMs(intervalMs - minMs(intervalMs, INTERVAL_STEP_MS), MIN_INTERVAL_MS);
+        }
+        else {
+            intervalMs = minMs(intervalMs * 2, MAX_INTERVAL_MS);
+        }
+
+        if (firstAfterConnect) {
+            connectDelayMs = maxMs(connectDelayMs - minMs(connectDelayMs, CONNECT_DELAY_STEP_MS), MIN_CONNECT_DELAY_MS);
+        }
+    }
+    else {
+        consecutiveFailures++;
+        intervalMs = minMs(intervalMs * 2, MAX_INTERVAL_MS);
+
+        if (firstAfterConnect) {
+            connectDelayMs = minMs(connectDelayMs * 2, MAX_CONNECT_DELAY_MS);
+        }
+
+        // Exponential backoff, then keep between half and all of it
+        unsigned long delayMs = MIN_RETRY_DELAY_MS;
+        for(size_t ii = 1; ii < consecutiveFailures && delayMs < maxRetryDelayMs; ii++) {
+            delayMs *= 2;
+        }
+        delayMs = minMs(delayMs, maxRetryDelayMs);
+        retryDelayMs = delayMs / 2 + (unsigned long)rand() % (delayMs / 2 + 1);
+    }
+}
+
+PublishQueuePacing::Stats PublishQueuePacing::getStats() const {
+    Stats stats;
+    stats.intervalMs = intervalMs;
+    stats.connectDelayMs = connectDelayMs;
+    stats.retryDelayMs = retryDelayMs;
+    stats.consecutiveFailures = consecutiveFailures;
+    stats.numSamples = numSamples;
+    stats.rttP50Ms = stats.rttP90Ms = stats.rttMaxMs = 0;
+
+    if (numSamples > 0) {
+        uint16_t sorted[RTT_SAMPLES];
+        std::copy(rttSamples, rttSamples + numSamples, sorted);
+        std::sort(sorted, sorted + numSamples);
+        stats.rttP50Ms = sorted[(numSamples - 1) * 50 / 100];
+        stats.rttP90Ms = sorted[(numSamples - 1) * 90 / 100];
+        stats.rttMaxMs = sorted[numSamples - 1];
+    }
+    return stats;
+}
@@ -0,0 +1,123 @@
+#ifndef __PUBLISHQUEUEPACING_H
+#define __PUBLISHQUEUEPACING_H
+
+// Github: https://github.com/rickkas7/PublishQueuePosixRK
+// License: MIT
+
+#include "Particle.h"
+
+/**
+ * @brief Adaptive delays between publishes, used by PublishQueuePosix::withAdaptivePacing()
+ *
+ * Three delays are adjusted from the results of publishes:
+ *
+ * - The interval from the start of one publish to the start of the next. It gets shorter by INTERVAL_STEP_MS
+ *   after each publish that is acknowledged within SLOW_ACK_MS, and doubles after a failure or a slow
+ *   acknowledgement (additive decrease, multiplicative increase of the delay).
+ * - The delay after connecting before the first publish. It gets shorter by CONNECT_DELAY_STEP_MS each time
+ *   the first publish after connecting succeeds, and doubles when it fails.
+ * - The delay before retrying after a failure. It doubles for each consecutive failure, from MIN_RETRY_DELAY_MS
+ *   up to the maximum, and is randomly reduced by up to half so devices that fail together don't retry together.
+ *
+ * Independently of the interval, starts are limited to the cloud rate limit: an average of one per
+ * RATE_LIMIT_MS with bursts of up to RATE_LIMIT_BURST.
+ *
+ * Times are passed in so this class does not call millis(). It's not thread safe; PublishQueuePosix
+ * calls it with its mutex locked.
+ */
+class PublishQueuePacing {
+public:
+    /**
+     * @brief Set the starting delays and clear the measurements
+     *
+     * @param intervalMs Starting interval between publishes
+     *
+     * @param connectDelayMs Starting delay after connecting
+     *
+     * @param maxRetryDelayMs Longest delay before retrying after failures
+     */
+    void reset(unsigned long intervalMs, unsigned long connectDelayMs, unsigned long maxRetryDelayMs);
+
+    /**
+     * @brief Delay from the start of a publish to the start of the next one
+     */
+    unsigned long getIntervalMs() const { return intervalMs; };
+
+    /**
+     * @brief Delay after connecting to the cloud before the first publish
+     */
+    unsigned long getConnectDelayMs() const { return connectDelayMs; };
+
+    /**
+     * @brief Delay before publishing again after the most recent failure
+     */
+    unsigned long getRetryDelayMs() const { return retryDelayMs; };
+
+    /**
+     * @brief How long until a publish can be started without exceeding the cloud rate limit, 0 if it can start now
+     */
+    unsigned long getRateLimitWaitMs(unsigned long now) const;
+
+    /**
+     * @brief Record that a publish was started
+     */
+    void publishStarted(unsigned long now);
+
+    /**
+     * @brief Record the result of a publish and adjust the delays
+     *
+     * @param succeeded true if the publish was acknowledged
+     *
+     * @param rttMs Time from publishStarted() until it completed
+     *
+     * @param firstAfterConnect true if it was the first publish after connecting
+     */
+    void publishCompleted(bool succeeded, unsigned long rttMs, bool firstAfterConnect);
+
+    /**
+     * @brief Current delays and acknowledgement times, returned by getStats()
+     */
+    struct Stats {
+        unsigned long intervalMs;       //!< Current interval between publishes
+        unsigned long connectDelayMs;   //!< Current delay after connecting
+        unsigned long retryDelayMs;     //!< Delay after the most recent failure
+        size_t consecutiveFailures;     //!< Failures since the last success
+        size_t numSamples;              //!< Number of acknowledgement times below, up to RTT_SAMPLES
+        unsigned long rttP50Ms;         //!< Median time from publish to acknowledgement of the recent successful publishes
+        unsigned long rttP90Ms;         //!< 90th percentile
+        unsigned long rttMaxMs;         //!< Longest
+    };
+
+    /**
+     * @brief Get the current delays and the percentiles of recent acknowledgement times
+     */
+    Stats getStats() const;
+
+    static const unsigned long RATE_LIMIT_MS = 1000; //!< Cloud limit of one publish per second on average
+    static const unsigned long RATE_LIMIT_BURST = 4; //!< ... with up to 4 at once
+    static const unsigned long MIN_INTERVAL_MS = 250; //!< Shortest interval between publishes
+    static const unsigned long MAX_INTERVAL_MS = 8000; //!< Longest interval between publishes
+    static const unsigned long INTERVAL_STEP_MS = 100; //!< Interval decrease after a quick acknowledgement
+    static const unsigned long SLOW_ACK_MS = 5000; //!< Acknowledgements slower than this increase the interval
+    static const unsigned long MIN_CONNECT_DELAY_MS = 250; //!< Shortest delay after connecting
+    static const unsigned long MAX_CONNECT_DELAY_MS = 8000; //!< Longest delay after connecting
+    static const unsigned long CONNECT_DELAY_STEP_MS = 250; //!< Connect delay decrease after a successful first publish
+    static const unsigned long MIN_RETRY_DELAY_MS = 2000; //!< Delay after the first failure, before jitter
+    static const size_t RTT_SAMPLES = 32; //!< Number of recent acknowledgement times kept for the percentiles
+
+protected:
+    unsigned long intervalMs = 1000; //!< Interval between publishes
+    unsigned long connectDelayMs = 2000; //!< Delay after connecting
+    unsigned long retryDelayMs = 0; //!< Delay after the most recent failure
+    unsigned long maxRetryDelayMs = 30000; //!< Set by reset()
+    size_t consecutiveFailures = 0; //!< Failures since the last success
+
+    unsigned long rateLimitTime = 0; //!< Theoretical time of the next start at the average rate (GCRA)
+    bool rateLimitStarted = false; //!< rateLimitTime is valid
+
+    uint16_t rttSamples[RTT_SAMPLES] = {}; //!< Recent acknowledgement times, circular
+    size_t numSamples = 0; //!< Number of entries used in rttSamples
+    size_t nextSample = 0; //!< Where the next sample is stored
+};
+
+#endif /* __PUBLISHQUEUEPACING_H */
@@ -1,8 +1,8 @@
 #include "PublishQueuePosixRK.h"
 
-#include "BackgroundPublishRK.h"
-
+#include <algorithm>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 
@@ -10,6 +10,17 @@ PublishQueuePosix *PublishQueuePosix::_instance;
 
 static Logger _log("app.pubq");
 
+// Subdirectory of the queue directory for each priority. Priority::NORMAL uses the queue directory
+// itself so events queued before priorities were added are still found.
+static const char * const priorityDirNames[PublishQueuePosix::NUM_PRIORITIES] = { "critical", "alert", NULL, "diagnostic" };
+
+// Largest event data in each size class of the event pool, not including the null terminator. Small fits
+// typical JSON reports and the large class fits any event.
+static const size_t eventPoolDataSizes[PublishQueuePosix::NUM_EVENT_POOL_CLASSES] = { 128, 384, particle::protocol::MAX_EVENT_DATA_LENGTH };
+
+// Upper bound in seconds of each Metrics::latency bucket except the last, which counts the rest
+static const uint32_t latencyBucketSec[PublishQueuePosix::NUM_LATENCY_BUCKETS - 1] = { 10, 60, 10 * 60, 3600, 6 * 3600, 24 * 3600 };
+
 
 PublishQueuePosix &PublishQueuePosix::instance() {
     if (!_instance) {
@@ -39,6 +50,63 @@ PublishQueuePosix &PublishQueuePosix::withFileQueueSize(size_t size) {
     return *this; 
 }
 
+PublishQueuePosix &PublishQueuePosix::withPriorityQueueSize(Priority priority, size_t size) {
+    getQueue(priority).maxFileEvents = size;
+
+    if (stateHandler) {
+        _log.trace("withPriorityQueueSize(%d, %u)", (int)priority, size);
+        checkQueueLimits();
+    }
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withRingFileSize(size_t size) {
+    for(size_t ii = 0; ii < NUM_PRIORITIES; ii++) {
+        queues[ii].ringEngine.withDataSize(size);
+    }
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withCoalesce(const char *eventName, const char *batchEventName) {
+    if (strncmp(batchEventName, eventName, strlen(eventName)) == 0) {
+        // The webhook for eventName would also receive the batches
+        _log.error("batch event name %s cannot begin with %s", batchEventName, eventName);
+        return *this;
+    }
+
+    CoalesceRule rule;
+    rule.eventName = eventName;
+    rule.batchEventName = batchEventName;
+    coalesceRules.push_back(rule);
+
+    return *this;
+}
+
+PublishQueuePosix &PublishQueuePosix::withEventPoolSize(size_t smallBlocks, size_t mediumBlocks, size_t largeBlocks) {
+    eventPoolBlocks[0] = smallBlocks;
+    eventPoolBlocks[1] = mediumBlocks;
+    eventPoolBlocks[2] = largeBlocks;
+    return *this;
+}
+
+PublishQueueEvent *PublishQueuePosix::allocEvent(size_t dataLen) {
+    if (dataLen > particle::protocol::MAX_EVENT_DATA_LENGTH) {
+        return NULL;
+    }
+    return (PublishQueueEvent *) PublishQueueEventPool::instance().alloc(sizeof(PublishQueueEvent) + dataLen);
+}
+
+PublishQueuePosix &PublishQueuePosix::withMaxInFlight(size_t maxInFlight) {
+    if (maxInFlight < 1) {
+        maxInFlight = 1;
+    }
+    if (maxInFlight > BackgroundPublishRK::MAX_IN_FLIGHT) {
+        maxInFlight = BackgroundPublishRK::MAX_IN_FLIGHT;
+    }
+    this->maxInFlight = maxInFlight;
+    return *this;
+}
+
 void PublishQueuePosix::setup() {
     if (system_thread_get_state(nullptr) != spark::feature::ENABLED) {
         _log.error("SYSTEM_THREAD(ENABLED) is required");
@@ -51,9 +119,77 @@ void PublishQueuePosix::setup() {
     System.on(reset | cloud_status, systemEventHandler);
 
     // Start the background publish thread
-    BackgroundPublishRK::instance().start();
+    BackgroundPublishRK::instance().withMaxInFlight(maxInFlight).start();
+
+    // Allocate all of the event blocks now, while the heap is not fragmented
+    size_t blockSizes[NUM_EVENT_POOL_CLASSES];
+    for(size_t ii = 0; ii < NUM_EVENT_POOL_CLASSES; ii++) {
+        blockSizes[ii] = sizeof(PublishQueueEvent) + std::min(eventPoolDataSizes[ii], (size_t)particle::protocol::MAX_EVENT_DATA_LENGTH);
+    }
+    PublishQueueEventPool::instance().setup(blockSizes, eventPoolBlocks, NUM_EVENT_POOL_CLASSES);
+    inFlight.reserve(maxInFlight);
+    enqueueTimes.reserve(MAX_ENQUEUE_TIMES);
+
+    pacing.reset(waitBetweenPublish, waitAfterConnect, waitAfterFailure);
+
+    // The queue directory is used by Priority::NORMAL and must be created before the subdirectories,
+    // which are scanned first
+    String dirPath = getDirPath();
+    SequentialFile::createDirIfNecessary(dirPath);
+    for(size_t ii = 0; ii < NUM_PRIORITIES; ii++) {
+        if (priorityDirNames[ii]) {
+            queues[ii].fileQueue.withDirPath(dirPath + "/" + priorityDirNames[ii]).withIndex();
+        }
+    }
 
-    fileQueue.scanDir();
+    // Events in retained memory are older than the events in flash, including a copy saved by writeAllToFiles()
+    // before a power down, so load it before the storage engines
+    size_t numRetained = 0;
+    if (retainedBuffer) {
+        numRetained = retainedStore.setup(retainedBuffer, retainedBufferSize, NUM_PRIORITIES, getRetainedFilePath().c_str());
+        if (!retainedStore.isValid()) {
+            _log.error("retained buffer must be %u to 65535 bytes and aligned to 4 bytes", (unsigned)PublishQueueRetainedStore::MIN_SIZE);
+        }
+    }
+
+    for(size_t ii = 0; ii < NUM_PRIORITIES; ii++) {
+        PriorityQueue &queue = queues[ii];
+
+        queue.fileQueue.scanDir();
+
+        if (storageEngineType == StorageEngine::RING_FILE) {
+            queue.storageEngine = &queue.ringEngine;
+            if (queue.ringEngine.setup()) {
+                // Move events left in files by the file per event engine into the ring
+                while(queue.fileEngine.getQueueLen() > 0) {
+                    PublishQueueEvent *event = queue.fileEngine.readFront();
+                    if (event) {
+                        if (!queue.ringEngine.writeEvent(event)) {
+                            metrics.evictedWriteFailed++;
+                        }
+                        freeEvent(event);
+                    }
+                    else {
+                        metrics.evictedCorrupted++;
+                    }
+                    queue.fileEngine.removeFront();
+                }
+            }
+        }
+        else {
+            queue.storageEngine = &queue.fileEngine;
+            queue.fileEngine.setup();
+        }
+    }
+
+    if (retainedStore.isValid()) {
+        for(size_t ii = 0; ii < NUM_PRIORITIES; ii++) {
+            PriorityQueue &queue = queues[ii];
+            queue.retainedEngine.withStore(&retainedStore, (uint8_t)ii, queue.storageEngine).setup();
+            queue.storageEngine = &queue.retainedEngine;
+        }
+        _log.info("%u events in retained memory", (unsigned)numRetained);
+    }
 
     checkQueueLimits();
 
@@ -64,22 +200,63 @@ void PublishQueuePosix::loop() {
     if (stateHandler) {
         stateHandler(*this);
     }
+
+    if (canSleep) {
+        flushIndexes();
+    }
+
+    if (queueDrainedCallback) {
+        bool empty = inFlight.empty() && getNumEvents() == 0;
+        if (empty && !drained) {
+            _log.trace("queue drained");
+            queueDrainedCallback();
+        }
+        drained = empty;
+    }
 }
 
-bool PublishQueuePosix::publishCommon(const char *eventName, const char *eventData, int ttl, PublishFlags flags1, PublishFlags flags2) {
+bool PublishQueuePosix::publishCommon(const char *eventName, const char *eventData, int ttl, PublishFlags flags1, PublishFlags flags2, Priority priority, const char *supersedeKey) {
 
-    PublishQueueEvent *event = newRamEvent(eventName, eventData, flags1 | flags2);
-    if (!event) {
+    if (!eventData) {
+        eventData = "";
+    }
+    if (strlen(eventName) > particle::protocol::MAX_EVENT_NAME_LENGTH || strlen(eventData) > particle::protocol::MAX_EVENT_DATA_LENGTH) {
         return false;
     }
-    _log.trace("publishCommon eventName=%s eventData=%s", eventName, eventData ? eventData : "");
+    _log.trace("publishCommon eventName=%s eventData=%s", eventName, eventData);
 
     WITH_LOCK(*this) {
-        ramQueue.push_back(event);
+        PublishQueueEvent *event = newRamEvent(eventName, eventData, flags1 | flags2);
+        if (!event) {
+            // The event pool is full. Move the RAM queue to the file queue to free its blocks.
+            _log.info("event pool full, writing to files");
+            writeQueueToFiles();
+            event = newRamEvent(eventName, eventData, flags1 | flags2);
+            if (!event) {
+                // Every block is being published
+                _log.error("event pool full, event discarded");
+                metrics.evictedPoolFull++;
+                return false;
+            }
+        }
+
+        if (supersedeKey && supersedeKey[0]) {
+            removeSuperseded(supersedeKey);
 
-        _log.trace("fileQueueLen=%u ramQueueLen=%u connected=%d", fileQueue.getQueueLen(), ramQueue.size(), Particle.connected());
+            SupersedeEntry entry;
+            entry.key = supersedeKey;
+            entry.priority = priority;
+            entry.ramEvent = event;
+            entry.storageId = 0;
+            supersedeEntries.push_back(entry);
+        }
+
+        getQueue(priority).ramQueue.push_back(event);
+        addEnqueueTime(priority, event);
 
-        if (fileQueue.getQueueLen() == 0 && (ramQueue.size() <= ramQueueSize) && Particle.connected()) {
+        _log.trace("fileQueueLen=%u ramQueueLen=%u connected=%d", getFileQueueLen(), getRamQueueLen(), Particle.connected());
+
+        if (getFileQueueLen() == 0 && (getRamQueueLen() <= ramQueueSize) && Particle.connected()) {
             // No files in the disk-based queue, RAM-based queue is not full, and we are cloud connected
             // Leave the event in the RAM queue and return true
             _log.trace("queued to ramQueue");
@@ -89,6 +266,7 @@ bool PublishQueuePosix::publishCommon(const char *eventName, const char *eventDa
             writeQueueToFiles();
         }
         checkQueueLimits();
+        updateMaxDepth();
     }
 
 
@@ -107,9 +285,7 @@ PublishQueueEvent *PublishQueuePosix::newRamEvent(const char *eventName, const c
         return NULL;
     }
 
-    PublishQueueEvent *event;
-
-    event = (PublishQueueEvent *) new char[sizeof(PublishQueueEvent) + strlen(eventData)];
+    PublishQueueEvent *event = allocEvent(strlen(eventData));
     if (event) {
         event->flags = flags;
         strcpy(event->eventName, eventName);
@@ -121,90 +297,66 @@ PublishQueueEvent *PublishQueuePosix::newRamEvent(const char *eventName, const c
 void PublishQueuePosix::writeQueueToFiles() {
 
     WITH_LOCK(*this) {
-        while(!ramQueue.empty()) {
-            PublishQueueEvent *event = ramQueue.front();
-            ramQueue.pop_front();
-
-            int fileNum = fileQueue.reserveFile();
-
-            int fd = open(fileQueue.getPathForFileNum(fileNum), O_RDWR | O_CREAT);
-            if (fd) {
-                PublishQueueFileHeader hdr;
-                hdr.magic = FILE_MAGIC;
-                hdr.version = FILE_VERSION;
-                hdr.headerSize = sizeof(PublishQueueFileHeader);
-                hdr.nameLen = sizeof(PublishQueueEvent::eventName);
-                write(fd, &hdr, sizeof(hdr));
-
-                write(fd, event, sizeof(PublishQueueEvent) + strlen(event->eventData));
-                close(fd);
+        for(size_t ii = 0; ii < NUM_PRIORITIES; ii++) {
+            PriorityQueue &queue = queues[ii];
+
+            while(!queue.ramQueue.empty()) {
+                PublishQueueEvent *event = queue.ramQueue.front();
+                queue.ramQueue.erase(queue.ramQueue.begin());
+
+                // The event is freed even if the write fails. Keeping it would leave it holding a block
+                // when this is called to free blocks because the event pool is full.
+                bool written = queue.storageEngine->writeEvent(event);
+                uint32_t storageId = written ? queue.storageEngine->getBackId() : 0;
+                updateSuperseded(event, storageId);
+                updateEnqueueTime(event, storageId);
+                if (written) {
+                    metrics.ramToFileSpills++;
+                }
+                else {
+                    metrics.evictedWriteFailed++;
+                }
 
-                // This message is monitored by the automated test tool. If you edit this, change that too.
-                _log.trace("writeQueueToFiles fileNum=%d", fileNum);
+                freeEvent(event);
             }
-            fileQueue.addFileToQueue(fileNum);
-
-            delete event;
         }
     }
 }
 
+void PublishQueuePosix::writeAllToFiles() {
+    WITH_LOCK(*this) {
+        writeQueueToFiles();
+        flushIndexes();
 
-PublishQueueEvent *PublishQueuePosix::readQueueFile(int fileNum) {
-    PublishQueueEvent *result = NULL;
-
-    int fd = open(fileQueue.getPathForFileNum(fileNum), O_RDONLY);
-    if (fd) {
-        struct stat sb;
-        fstat(fd, &sb);
-
-        _log.trace("fileNum=%d size=%ld", fileNum, sb.st_size);
-
-        PublishQueueFileHeader hdr;
-        
-        lseek(fd, 0, SEEK_SET);
-        read(fd, &hdr, sizeof(PublishQueueFileHeader));
-        if (sb.st_size >= (off_t)(sizeof(PublishQueueFileHeader) + sizeof(PublishQueueEvent)) &&
-            hdr.magic == FILE_MAGIC && 
-            hdr.version == FILE_VERSION &&
-            hdr.headerSize == sizeof(PublishQueueFileHeader) &&
-            hdr.nameLen == sizeof(PublishQueueEvent::eventName)) {
-
-            size_t eventSize = sb.st_size - sizeof(PublishQueueFileHeader);
-
-            result = (PublishQueueEvent *)new char[eventSize];
-            if (result) {
-                read(fd, result, eventSize);
-
-                if (((char *)result)[eventSize - 1] == 0 && strlen(result->eventName) < (sizeof(PublishQueueEvent::eventName) - 1)) {
-                    _log.trace("readQueueFile %d event=%s data=%s", fileNum, result->eventName, result->eventData);
-                }
-                else {
-                    _log.trace("readQueueFile %d corrupted event name or data", fileNum);
-                    delete result;
-                    result = NULL;
-                }
-
-            }
-        } else {
-            _log.trace("readQueueFile %d bad magic=%08lx version=%u headerSize=%u nameLen=%u", fileNum, hdr.magic, hdr.version, hdr.headerSize, hdr.nameLen);
+        // The buffer is copied as it is, so event identifiers and the order of the events don't change
+        if (retainedStore.isValid() && retainedStore.saveToFile(getRetainedFilePath().c_str())) {
+            _log.trace("saved retained events to %s", getRetainedFilePath().c_str());
         }
-
-        close(fd);
     }
-    return result;
 }
 
 void PublishQueuePosix::clearQueues() {
     WITH_LOCK(*this) {
-        while(!ramQueue.empty()) {
-            PublishQueueEvent *event = ramQueue.front();
-            ramQueue.pop_front();
+        for(size_t ii = 0; ii < NUM_PRIORITIES; ii++) {
+            PriorityQueue &queue = queues[ii];
 
-            delete event;
+            while(!queue.ramQueue.empty()) {
+                PublishQueueEvent *event = queue.ramQueue.front();
+                queue.ramQueue.erase(queue.ramQueue.begin());
+
+                freeEvent(event);
+            }
+
+            queue.storageEngine->removeAll();
         }
+        supersedeEntries.clear();
+        enqueueTimes.clear();
 
-        fileQueue.removeAll(true);
+        // Publishes in progress finish, but the events are not removed from or returned to the queue
+        for(auto it = inFlight.begin(); it != inFlight.end(); it++) {
+            (*it)->storageId = (*it)->storageLastId = 0;
+            (*it)->cleared = true;
+        }
     }
 
     _log.trace("clearQueues");
@@ -225,184 +377,1795 @@ void PublishQueuePosix::setPausePublishing(bool value) {
 
 void PublishQueuePosix::checkQueueLimits() {
     WITH_LOCK(*this) {
-        if (ramQueue.size() > ramQueueSize) {
+        if (getRamQueueLen() > ramQueueSize) {
             // RAM queue is too large, move all to files
             writeQueueToFiles();
         }
 
-        while(fileQueue.getQueueLen() > (int)fileQueueSize) {
-            int fileNum = fileQueue.getFileFromQueue(true);
-            if (fileNum) {
-                fileQueue.removeFileNum(fileNum, false);
-                _log.info("discarded event %d", fileNum);
+        for(size_t ii = 0; ii < NUM_PRIORITIES; ii++) {
+            PriorityQueue &queue = queues[ii];
+
+            while(queue.maxFileEvents && queue.storageEngine->getQueueLen() > queue.maxFileEvents) {
+                _log.info("discarded event %lu priority %u", queue.storageEngine->getFrontId(), ii);
+                queue.storageEngine->removeFront();
+                metrics.evictedPriorityLimit++;
+            }
+        }
+
+        // Discard from the lowest priority first
+        size_t ii = NUM_PRIORITIES;
+        while(getFileQueueLen() > fileQueueSize && ii > 0) {
+            PriorityQueue &queue = queues[ii - 1];
+            if (queue.storageEngine->getQueueLen() == 0) {
+                ii--;
+                continue;
             }
+            _log.info("discarded event %lu priority %u", queue.storageEngine->getFrontId(), ii - 1);
+            queue.storageEngine->removeFront();
+            metrics.evictedQueueFull++;
         }
     }
 }
 
-size_t PublishQueuePosix::getNumEvents() {
-    size_t result = 0;
+void PublishQueuePosix::removeSuperseded(const char *supersedeKey) {
+    for(auto it = supersedeEntries.begin(); it != supersedeEntries.end(); it++) {
+        if (!it->key.equals(supersedeKey)) {
+            continue;
+        }
 
-    WITH_LOCK(*this) {
-        result = ramQueue.size();
-        if (result == 0) {
-            result = fileQueue.getQueueLen();
-
-            if (curEvent && curFileNum == 0) {
-                // This happens when we are sending an event from the RAM queue
-                // It's not in the RAM queue, but we want to count it, because
-                // otherwise getNumEvents would return 1 for the event sent from
-                // a file (because the file is not deleted until sent) and
-                // this makes the behavior consistent.
-                result++;
+        PriorityQueue &queue = getQueue(it->priority);
+        if (it->ramEvent) {
+            // If it's not in the RAM queue it's in flight
+            auto ramIt = std::find(queue.ramQueue.begin(), queue.ramQueue.end(), it->ramEvent);
+            if (ramIt != queue.ramQueue.end()) {
+                updateEnqueueTime(*ramIt, 0);
+                freeEvent(*ramIt);
+                queue.ramQueue.erase(ramIt);
+                metrics.evictedSuperseded++;
+                _log.trace("superseded ram event %s", supersedeKey);
+            }
+        }
+        else
+        if (!isInFlight(it->priority, it->storageId)) {
+            if (queue.storageEngine->removeEvent(it->storageId)) {
+                auto timeIt = findEnqueueTime(it->priority, NULL, it->storageId);
+                if (timeIt != enqueueTimes.end()) {
+                    enqueueTimes.erase(timeIt);
+                }
+                metrics.evictedSuperseded++;
+                _log.trace("superseded file %lu %s", it->storageId, supersedeKey);
             }
         }
+
+        supersedeEntries.erase(it);
+        break;
+    }
+}
+
+void PublishQueuePosix::updateSuperseded(const PublishQueueEvent *event, uint32_t storageId) {
+    for(auto it = supersedeEntries.begin(); it != supersedeEntries.end(); it++) {
+        if (it->ramEvent == event) {
+            if (storageId) {
+                it->ramEvent = NULL;
+                it->storageId = storageId;
+            }
+            else {
+                supersedeEntries.erase(it);
+            }
+            break;
+        }
     }
-    return result;
 }
 
-void PublishQueuePosix::publishCompleteCallback(bool succeeded, const char *eventName, const char *eventData) {
-    publishComplete = true;
-    publishSuccess = succeeded;
+void PublishQueuePosix::updateEnqueueTime(const PublishQueueEvent *event, uint32_t storageId) {
+    for(auto it = enqueueTimes.begin(); it != enqueueTimes.end(); it++) {
+        if (it->ramEvent == event) {
+            if (storageId) {
+                it->ramEvent = NULL;
+                it->storageId = storageId;
+            }
+            else {
+                enqueueTimes.erase(it);
+            }
+            break;
+        }
+    }
+}
 
-    if (publishCompleteUserCallback) {
-        publishCompleteUserCallback(succeeded, eventName, eventData);
+std::vector<PublishQueuePosix::EnqueueTime>::iterator PublishQueuePosix::findEnqueueTime(Priority priority, const PublishQueueEvent *ramEvent, uint32_t storageId) {
+    for(auto it = enqueueTimes.begin(); it != enqueueTimes.end(); it++) {
+        if (ramEvent ? (it->ramEvent == ramEvent) : (!it->ramEvent && it->priority == priority && it->storageId == storageId)) {
+            return it;
+        }
     }
+    return enqueueTimes.end();
 }
 
+void PublishQueuePosix::addEnqueueTime(Priority priority, const PublishQueueEvent *event) {
+    if (!Time.isValid()) {
+        return;
+    }
 
-void PublishQueuePosix::stateConnectWait() {
-    canSleep = (pausePublishing || getNumEvents() == 0);
+    if (enqueueTimes.size() >= MAX_ENQUEUE_TIMES) {
+        // Remove the entries for events that were discarded from the front of the file queue
+        for(auto it = enqueueTimes.begin(); it != enqueueTimes.end(); ) {
+            uint32_t frontId = getQueue(it->priority).storageEngine->getFrontId();
+            if (!it->ramEvent && (frontId == 0 || it->storageId < frontId)) {
+                it = enqueueTimes.erase(it);
+            }
+            else {
+                it++;
+            }
+        }
+        if (enqueueTimes.size() >= MAX_ENQUEUE_TIMES) {
+            // The oldest event won't be included in the latency
+            enqueueTimes.erase(enqueueTimes.begin());
+        }
+    }
 
-    if (Particle.connected()) {
-        stateTime = millis();
-        durationMs = waitAfterConnect;
-        stateHandler = &PublishQueuePosix::stateWait;
+    EnqueueTime entry;
+    entry.priority = priority;
+    entry.ramEvent = event;
+    entry.storageId = 0;
+    entry.time = (uint32_t) Time.now();
+    enqueueTimes.push_back(entry);
+}
+
+void PublishQueuePosix::recordLatency(uint32_t enqueueTime) {
+    uint32_t now = (uint32_t) Time.now();
+    uint32_t latencySec = (now > enqueueTime) ? now - enqueueTime : 0;
+
+    size_t bucket = 0;
+    while(bucket < NUM_LATENCY_BUCKETS - 1 && latencySec >= latencyBucketSec[bucket]) {
+        bucket++;
+    }
+    metrics.latency[bucket]++;
+    if (latencySec > metrics.maxLatencySec) {
+        metrics.maxLatencySec = latencySec;
     }
 }
 
+void PublishQueuePosix::updateMaxDepth() {
+    size_t depth = getTotalQueueLen();
+    if (depth > metrics.maxDepth) {
+        metrics.maxDepth = depth;
+    }
+}
 
-void PublishQueuePosix::stateWait() {
-    if (!Particle.connected()) {
-        stateHandler = &PublishQueuePosix::stateConnectWait;
-        return;
+size_t PublishQueuePosix::getTotalQueueLen() const {
+    size_t result = getRamQueueLen() + getFileQueueLen();
+    for(auto it = inFlight.begin(); it != inFlight.end(); it++) {
+        if ((*it)->storageId == 0 && !(*it)->cleared) {
+            // Sending from the RAM queue, see getNumEvents()
+            result++;
+        }
     }
+    return result;
+}
 
-    if (pausePublishing) {
-        canSleep = true;
-        return;
+size_t PublishQueuePosix::getRamQueueLen() const {
+    size_t result = 0;
+    for(size_t ii = 0; ii < NUM_PRIORITIES; ii++) {
+        result += queues[ii].ramQueue.size();
     }
+    return result;
+}
 
-    if (millis() - stateTime < durationMs) {
-        canSleep = (getNumEvents() == 0);
-        return;
+size_t PublishQueuePosix::getFileQueueLen() const {
+    size_t result = 0;
+    for(size_t ii = 0; ii < NUM_PRIORITIES; ii++) {
+        result += queues[ii].storageEngine->getQueueLen();
     }
-    
-    curFileNum = fileQueue.getFileFromQueue(false);
-    if (curFileNum) {
-        curEvent = readQueueFile(curFileNum);
-        if (!curEvent) {
-            // Probably a corrupted file, discard
-            _log.info("discarding corrupted file %d", curFileNum);
-            fileQueue.getFileFromQueue(true);
-            fileQueue.removeFileNum(curFileNum, false);
+    return result;
+}
+
+size_t PublishQueuePosix::getNumEvents() {
+    size_t result = 0;
+
+    WITH_LOCK(*this) {
+        result = getRamQueueLen();
+        if (result == 0) {
+            result = getFileQueueLen();
+
+            for(auto it = inFlight.begin(); it != inFlight.end(); it++) {
+                if ((*it)->storageId == 0 && !(*it)->cleared) {
+                    // This happens when we are sending an event from the RAM queue
+                    // It's not in the RAM queue, but we want to count it, because
+                    // otherwise getNumEvents would return 1 for the event sent from
+                    // a file (because the file is not deleted until sent) and
+                    // this makes the behavior consistent.
+                    result++;
+                }
+            }
         }
     }
-    else {
-        if (!ramQueue.empty()) {
-            curEvent = ramQueue.front();
-            ramQueue.pop_front();
+    return result;
+}
+
+PublishQueuePacing::Stats PublishQueuePosix::getPacingStats() {
+    PublishQueuePacing::Stats stats;
+
+    WITH_LOCK(*this) {
+        stats = pacing.getStats();
+    }
+    return stats;
+}
+
+PublishQueuePosix::Metrics PublishQueuePosix::getMetrics() {
+    Metrics result;
+
+    WITH_LOCK(*this) {
+        result = metrics;
+
+        // The storage engines count their own file system use
+        for(size_t ii = 0; ii < NUM_PRIORITIES; ii++) {
+            const PriorityQueue &queue = queues[ii];
+            result.fileBytesWritten += queue.fileEngine.getBytesWritten() + queue.ringEngine.getBytesWritten();
+            result.fileBytesRead += queue.fileEngine.getBytesRead() + queue.ringEngine.getBytesRead();
+            result.evictedRingFull += queue.ringEngine.getNumDiscarded();
+            result.evictedCorrupted += queue.fileEngine.getNumCorrupted() + queue.ringEngine.getNumCorrupted();
+            result.retainedOverflows += queue.retainedEngine.getNumOverflows();
         }
-        else {
-            curEvent = NULL;
+    }
+    return result;
+}
+
+void PublishQueuePosix::resetMetrics() {
+    WITH_LOCK(*this) {
+        metrics = {};
+        for(size_t ii = 0; ii < NUM_PRIORITIES; ii++) {
+            queues[ii].fileEngine.resetCounters();
+            queues[ii].ringEngine.resetCounters();
+            queues[ii].retainedEngine.resetCounters();
         }
+        updateMaxDepth();
     }
+}
 
-    if (curEvent) {
-        stateTime = millis();
-        stateHandler = &PublishQueuePosix::statePublishWait;
-        publishComplete = false;
-        publishSuccess = false;
-        canSleep = false;
+unsigned long PublishQueuePosix::getDrainEstimateMs() {
+    // Not getNumEvents(), which leaves out the file queue while there are events in the RAM queue
+    size_t numEvents;
+    PublishQueuePacing::Stats stats;
+    WITH_LOCK(*this) {
+        numEvents = getTotalQueueLen();
+        stats = pacing.getStats();
+    }
+    if (numEvents == 0 && inFlight.empty()) {
+        return 0;
+    }
 
-        // This message is monitored by the automated test tool. If you edit this, change that too.
-        _log.trace("publishing %s event=%s data=%s", (curFileNum ? "file" : "ram"), curEvent->eventName, curEvent->eventData);
+    unsigned long ackMs = stats.numSamples ? stats.rttP50Ms : DRAIN_ESTIMATE_ACK_MS;
 
-        if (BackgroundPublishRK::instance().publish(curEvent->eventName, curEvent->eventData, curEvent->flags, 
-            [this](bool succeeded, const char *eventName, const char *eventData, const void *context) {
-                publishCompleteCallback(succeeded, eventName, eventData);
-            })) {
-            // Successfully started publish
+    // Time from the start of one publish to the start of the next. Without adaptive pacing the delay is
+    // from the completion of the previous publish when all of the in-flight slots are used.
+    unsigned long publishMs;
+    if (adaptivePacing) {
+        publishMs = pacing.getIntervalMs();
+        if (publishMs < ackMs / maxInFlight) {
+            publishMs = ackMs / maxInFlight;
         }
     }
     else {
-        // No events, can sleep
-        canSleep = true;
+        publishMs = waitBetweenPublish;
+        if (publishMs < (waitBetweenPublish + ackMs) / maxInFlight) {
+            publishMs = (waitBetweenPublish + ackMs) / maxInFlight;
+        }
     }
-}
-void PublishQueuePosix::statePublishWait() {
-    if (!publishComplete) {
-        return;
+    if (publishMs < PublishQueuePacing::RATE_LIMIT_MS) {
+        publishMs = PublishQueuePacing::RATE_LIMIT_MS;
+    }
+
+    // Until the next publish can start
+    unsigned long waitMs;
+    if (!Particle.connected()) {
+        waitMs = adaptivePacing ? pacing.getConnectDelayMs() : waitAfterConnect;
+    }
+    else {
+        unsigned long elapsedMs = millis() - stateTime;
+        waitMs = (elapsedMs < durationMs) ? durationMs - elapsedMs : 0;
     }
 
-    if (publishSuccess) {
-        // Remove from the queue
-        _log.trace("publish success %d", curFileNum);
+    if (numEvents == 0) {
+        return ackMs;
+    }
+    return waitMs + (numEvents - 1) * publishMs + ackMs;
+}
+
+size_t PublishQueuePosix::getNumEvents(Priority priority) {
+    size_t result = 0;
+
+    WITH_LOCK(*this) {
+        PriorityQueue &queue = getQueue(priority);
 
-        if (curFileNum) {
-            // Was from the file-based queue
-            int fileNum = fileQueue.getFileFromQueue(false);
-            if (fileNum == curFileNum) {
-                fileQueue.getFileFromQueue(true);
-                fileQueue.removeFileNum(fileNum, false);
-                _log.trace("removed file %d", fileNum);
+        result = queue.ramQueue.size() + queue.storageEngine->getQueueLen();
+        for(auto it = inFlight.begin(); it != inFlight.end(); it++) {
+            if ((*it)->storageId == 0 && !(*it)->cleared && (*it)->priority == priority) {
+                // Sending from the RAM queue, see getNumEvents()
+                result++;
             }
-            curFileNum = 0;
         }
+    }
+    return result;
+}
 
-        delete curEvent;
-        curEvent = NULL;
-        durationMs = waitBetweenPublish;
+void PublishQueuePosix::coalesceEvents(InFlightPublish *publish, PublishQueueStorageEngine *storageEngine, size_t index) {
+    PublishQueueEvent *event = publish->event;
+    const char *batchEventName = NULL;
+    for(auto it = coalesceRules.begin(); it != coalesceRules.end(); it++) {
+        if (it->eventName.equals(event->eventName)) {
+            batchEventName = it->batchEventName.c_str();
+            break;
+        }
+    }
+    if (!batchEventName || !event->eventData[0]) {
+        return;
     }
-    else {
-        // Wait and retry
-        // This message is monitored by the automated test tool. If you edit this, change that too.
-        _log.trace("publish failed %d", curFileNum);
-        durationMs = waitAfterFailure;
 
-        if (curFileNum) {
-            // Was from the file-based queue
-            delete curEvent;
-            curEvent = NULL;
+    const size_t maxLen = particle::protocol::MAX_EVENT_DATA_LENGTH;
+
+    PublishQueueEvent *batch = allocEvent(maxLen);
+    if (!batch) {
+        // No free large block, send the event by itself
+        return;
+    }
+    batch->flags = event->flags;
+    strcpy(batch->eventName, batchEventName);
+
+    char *data = batch->eventData;
+    size_t len = strlen(event->eventData);
+    data[0] = '[';
+    memcpy(&data[1], event->eventData, len);
+    len++;
+
+    size_t numEvents = 1;
+    while(true) {
+        uint32_t id;
+        PublishQueueEvent *next = storageEngine->readEvent(index + numEvents, id);
+        if (!next) {
+            break;
         }
-        else {
-            // Was in the RAM-based queue, put back
-            WITH_LOCK(*this) {
-                ramQueue.push_front(curEvent);
-            }
-            // Then write the entire queue to files
-            _log.trace("writing to files after publish failure");
-            writeQueueToFiles();
+        if (isInFlight(publish->priority, id)) {
+            // Behind an event that failed, the rest are already being published
+            freeEvent(next);
+            break;
+        }
+
+        // Room is needed for the comma and the closing bracket
+        size_t nextLen = strlen(next->eventData);
+        bool combine = strcmp(next->eventName, event->eventName) == 0 && 
+            next->flags.value() == event->flags.value() &&
+            nextLen > 0 && 
+            len + 1 + nextLen + 1 <= maxLen;
+        if (combine) {
+            data[len++] = ',';
+            memcpy(&data[len], next->eventData, nextLen);
+            len += nextLen;
+            numEvents++;
+            publish->storageLastId = id;
+        }
+        freeEvent(next);
+
+        if (!combine) {
+            break;
         }
     }
 
-    stateHandler = &PublishQueuePosix::stateWait;
-    stateTime = millis();
-}
+    if (numEvents == 1) {
+        freeEvent(batch);
+        return;
+    }
 
+    data[len++] = ']';
+    data[len] = 0;
+    _log.trace("combined %u events %lu-%lu into %s", (unsigned)numEvents, publish->storageId, publish->storageLastId, batchEventName);
 
-PublishQueuePosix::PublishQueuePosix() {
-    fileQueue.withDirPath("/usr/pubqueue");
+    freeEvent(event);
+    publish->event = batch;
 }
 
-PublishQueuePosix::~PublishQueuePosix() {
+void PublishQueuePosix::publishCompleteCallback(InFlightPublish *publish, bool succeeded, const char *eventName, const char *eventData) {
+    // eventName and eventData point into publish->event, which can be freed as soon as complete is set
+    if (publishCompleteUserCallback) {
+        publishCompleteUserCallback(succeeded, eventName, eventData);
+    }
 
+    publish->succeeded = succeeded;
+    publish->complete = true;
 }
 
-void PublishQueuePosix::systemEventHandler(system_event_t event, int param) {
-    if ((event == reset) || ((event == cloud_status) && (param == cloud_status_disconnecting))) {
-        _log.trace("reset or disconnect event, save files to queue");
-        PublishQueuePosix::instance().writeQueueToFiles();
+
+void PublishQueuePosix::flushIndexes() {
+    WITH_LOCK(*this) {
+        for(size_t ii = 0; ii < NUM_PRIORITIES; ii++) {
+            queues[ii].fileQueue.flushIndex();
+        }
     }
 }
 
+void PublishQueuePosix::stateConnectWait() {
+    completePublishes();
+
+    canSleep = (pausePublishing || getNumEvents() == 0);
+
+    if (Particle.connected()) {
+        stateTime = millis();
+        durationMs = adaptivePacing ? pacing.getConnectDelayMs() : waitAfterConnect;
+        firstAfterConnect = true;
+        stateHandler = &PublishQueuePosix::stateWait;
+    }
+}
+
+
+void PublishQueuePosix::stateWait() {
+    completePublishes();
+
+    if (!Particle.connected()) {
+        stateHandler = &PublishQueuePosix::stateConnectWait;
+        return;
+    }
+
+    if (pausePublishing) {
+        canSleep = true;
+        return;
+    }
+
+    if (millis() - stateTime < durationMs) {
+        canSleep = (getNumEvents() == 0);
+        return;
+    }
+
+    if (inFlight.size() >= maxInFlight) {
+        stateHandler = &PublishQueuePosix::statePublishWait;
+        return;
+    }
+
+    if (adaptivePacing && pacing.getRateLimitWaitMs(millis()) > 0) {
+        canSleep = (getNumEvents() == 0);
+        return;
+    }
+
+    InFlightPublish *publish = NULL;
+    WITH_LOCK(*this) {
+        publish = nextPublish();
+        if (publish) {
+            publish->startMs = millis();
+            publish->firstAfterConnect = firstAfterConnect;
+            inFlight.push_back(publish);
+        }
+    }
+
+    if (publish) {
+        stateTime = millis();
+        durationMs = adaptivePacing ? pacing.getIntervalMs() : waitBetweenPublish;
+        canSleep = false;
+
+        // This message is monitored by the automated test tool. If you edit this, change that too.
+        _log.trace("publishing %s event=%s data=%s", (publish->storageId ? "file" : "ram"), publish->event->eventName, publish->event->eventData);
+
+        // The event is not copied. It's freed by completePublishes() after the callback has returned.
+        if (BackgroundPublishRK::instance().publishNoCopy(publish->event->eventName, publish->event->eventData, publish->event->flags, 
+            [this](bool succeeded, const char *eventName, const char *eventData, const void *context) {
+                publishCompleteCallback((InFlightPublish *)context, succeeded, eventName, eventData);
+            }, publish)) {
+            // Successfully started publish
+            WITH_LOCK(*this) {
+                pacing.publishStarted(publish->startMs);
+            }
+            firstAfterConnect = false;
+            if (inFlight.size() >= maxInFlight) {
+                stateHandler = &PublishQueuePosix::statePublishWait;
+            }
+        }
+        else {
+            // No free publish request, which can happen right after a publish completes. Try again after waitBetweenPublish.
+            _log.trace("publish not started");
+            WITH_LOCK(*this) {
+                inFlight.pop_back();
+                if (publish->storageId) {
+                    freeEvent(publish->event);
+                }
+                else {
+                    PriorityQueue &queue = getQueue(publish->priority);
+                    queue.ramQueue.insert(queue.ramQueue.begin(), publish->event);
+                }
+                publish->inUse = false;
+            }
+        }
+    }
+    else {
+        // No events, can sleep
+        canSleep = inFlight.empty();
+    }
+}
+
+void PublishQueuePosix::statePublishWait() {
+    bool failed = completePublishes();
+
+    if (inFlight.size() < maxInFlight) {
+        if (!failed && !adaptivePacing) {
+            // With adaptive pacing the interval is from the start of the previous publish
+            durationMs = waitBetweenPublish;
+            stateTime = millis();
+        }
+        stateHandler = &PublishQueuePosix::stateWait;
+    }
+}
+
+PublishQueuePosix::InFlightPublish *PublishQueuePosix::nextPublish() {
+    // Highest priority first. Within a priority, events in files are older than events in RAM.
+    for(size_t ii = 0; ii < NUM_PRIORITIES; ii++) {
+        PriorityQueue &queue = queues[ii];
+        Priority priority = (Priority) ii;
+
+        // Events in files stay in the queue until their publish succeeds, so skip the ones in flight
+        uint32_t id;
+        size_t index = 0;
+        while((id = queue.storageEngine->getIdAt(index)) != 0 && isInFlight(priority, id)) {
+            index++;
+        }
+
+        PublishQueueEvent *event = NULL;
+        if (id) {
+            size_t poolFailures = PublishQueueEventPool::instance().getFailures();
+            event = queue.storageEngine->readEvent(index, id);
+            if (!event) {
+                if (PublishQueueEventPool::instance().getFailures() != poolFailures) {
+                    // No free block, try again when a publish completes
+                    _log.trace("event pool full, not reading %lu", id);
+                    return NULL;
+                }
+                // Probably a corrupted file, discard
+                _log.info("discarding corrupted event %lu", id);
+                queue.storageEngine->removeEvent(id);
+                metrics.evictedCorrupted++;
+                return NULL;
+            }
+        }
+        else
+        if (!queue.ramQueue.empty()) {
+            event = queue.ramQueue.front();
+            queue.ramQueue.erase(queue.ramQueue.begin());
+        }
+
+        if (event) {
+            InFlightPublish *publish = NULL;
+            for(size_t jj = 0; jj < maxInFlight; jj++) {
+                if (!inFlightSlots[jj].inUse) {
+                    publish = &inFlightSlots[jj];
+                    break;
+                }
+            }
+            // There is always a free slot because stateWait() only calls this when inFlight.size() < maxInFlight
+            publish->inUse = true;
+            publish->event = event;
+            publish->priority = priority;
+            publish->storageId = publish->storageLastId = id;
+            publish->cleared = false;
+            publish->complete = publish->succeeded = false;
+
+            if (id) {
+                coalesceEvents(publish, queue.storageEngine, index);
+            }
+            return publish;
+        }
+    }
+    return NULL;
+}
+
+bool PublishQueuePosix::isInFlight(Priority priority, uint32_t storageId) const {
+    for(auto it = inFlight.begin(); it != inFlight.end(); it++) {
+        const InFlightPublish *publish = *it;
+        if (publish->storageId && publish->priority == priority && storageId >= publish->storageId && storageId <= publish->storageLastId) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool PublishQueuePosix::completePublishes() {
+    bool failed = false;
+    bool writeToFiles = false;
+
+    WITH_LOCK(*this) {
+        // Publishes can complete in any order
+        for(auto it = inFlight.begin(); it != inFlight.end(); ) {
+            InFlightPublish *publish = *it;
+            if (!publish->complete) {
+                it++;
+                continue;
+            }
+            it = inFlight.erase(it);
+
+            pacing.publishCompleted(publish->succeeded, millis() - publish->startMs, publish->firstAfterConnect);
+
+            if (publish->succeeded) {
+                _log.trace("publish success %lu", publish->storageId);
+
+                if (publish->storageId) {
+                    // Was from the file-based queue, possibly several events combined by coalesceEvents(). 
+                    // Some may have been discarded while publishing if the queue was full.
+                    PublishQueueStorageEngine *storageEngine = getQueue(publish->priority).storageEngine;
+                    for(uint32_t id = publish->storageId; id <= publish->storageLastId; id++) {
+                        if (storageEngine->removeEvent(id)) {
+                            _log.trace("removed file %lu", id);
+                            metrics.eventsSent++;
+                        }
+                        auto timeIt = findEnqueueTime(publish->priority, NULL, id);
+                        if (timeIt != enqueueTimes.end()) {
+                            recordLatency(timeIt->time);
+                            enqueueTimes.erase(timeIt);
+                        }
+                    }
+
+                    for(auto supersedeIt = supersedeEntries.begin(); supersedeIt != supersedeEntries.end(); ) {
+                        if (!supersedeIt->ramEvent && supersedeIt->priority == publish->priority && 
+                            supersedeIt->storageId >= publish->storageId && supersedeIt->storageId <= publish->storageLastId) {
+                            supersedeIt = supersedeEntries.erase(supersedeIt);
+                        }
+                        else {
+                            supersedeIt++;
+                        }
+                    }
+                }
+                else {
+                    updateSuperseded(publish->event, 0);
+                    metrics.eventsSent++;
+
+                    auto timeIt = findEnqueueTime(publish->priority, publish->event, 0);
+                    if (timeIt != enqueueTimes.end()) {
+                        recordLatency(timeIt->time);
+                        enqueueTimes.erase(timeIt);
+                    }
+                }
+                freeEvent(publish->event);
+            }
+            else {
+                // This message is monitored by the automated test tool. If you edit this, change that too.
+                _log.trace("publish failed %lu", publish->storageId);
+                failed = true;
+                metrics.publishFailures++;
+
+                if (publish->storageId || publish->cleared) {
+                    // Was from the file-based queue and is still in it, or the queues were cleared
+                    freeEvent(publish->event);
+                }
+                else {
+                    // Was in the RAM-based queue, put back
+                    PriorityQueue &queue = getQueue(publish->priority);
+                    queue.ramQueue.insert(queue.ramQueue.begin(), publish->event);
+                    writeToFiles = true;
+                }
+            }
+            publish->inUse = false;
+        }
+    }
+
+    if (writeToFiles) {
+        // Then write the entire queue to files
+        _log.trace("writing to files after publish failure");
+        writeQueueToFiles();
+    }
+
+    if (failed) {
+        // Wait and retry
+        durationMs = adaptivePacing ? pacing.getRetryDelayMs() : waitAfterFailure;
+        stateTime = millis();
+    }
+    return failed;
+}
+
+
+PublishQueuePosix::PublishQueuePosix() {
+    getQueue(Priority::NORMAL).fileQueue.withDirPath("/usr/pubqueue").withIndex();   // setup() does not need to read the whole directory
+}
+
+PublishQueuePosix::~PublishQueuePosix() {
+
+}
+
+void PublishQueuePosix::systemEventHandler(system_event_t event, int param) {
+    if ((event == reset) || ((event == cloud_status) && (param == cloud_status_disconnecting))) {
+        _log.trace("reset or disconnect event, save files to queue");
+        PublishQueuePosix::instance().writeQueueToFiles();
+        PublishQueuePosix::instance().flushIndexes();
+    }
+}
+
+
+
+//
+// PublishQueueFileEngine
+//
+
+// CRC-32 (IEEE 802.3), bitwise so it does not need a table in RAM or flash
+static uint32_t queueCrc32(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    for(size_t ii = 0; ii < len; ii++) {
+        crc ^= p[ii];
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t fileEventCrc(const PublishQueueFileHeader &hdr, const PublishQueueEvent *event) {
+    PublishQueueFileHeader tempHdr = hdr;
+    tempHdr.crc = 0;
+    uint32_t crc = queueCrc32(0, &tempHdr, sizeof(tempHdr));
+    return queueCrc32(crc, event, hdr.eventSize);
+}
+
+bool PublishQueueFileEngine::setup() {
+    // The directory was already scanned by PublishQueuePosix::setup()
+    return true;
+}
+
+bool PublishQueueFileEngine::writeEvent(const PublishQueueEvent *event) {
+    int fileNum = fileQueue.reserveFile();
+
+    int fd = open(fileQueue.getPathForFileNum(fileNum), O_RDWR | O_CREAT | O_TRUNC);
+    if (fd < 0) {
+        _log.error("could not open queue file %d errno=%d", fileNum, errno);
+        return false;
+    }
+
+    PublishQueueFileHeader hdr;
+    hdr.magic = PublishQueuePosix::FILE_MAGIC;
+    hdr.version = PublishQueuePosix::FILE_VERSION;
+    hdr.headerSize = sizeof(PublishQueueFileHeader);
+    hdr.nameLen = sizeof(PublishQueueEvent::eventName);
+    hdr.eventSize = sizeof(PublishQueueEvent) + strlen(event->eventData);
+    hdr.crc = fileEventCrc(hdr, event);
+
+    // A short write leaves a file that fails the size or CRC check, but remove it now rather than when it's read
+    int count = write(fd, &hdr, sizeof(hdr));
+    if (count > 0) {
+        bytesWritten += count;
+    }
+    bool result = (count == (int)sizeof(hdr));
+    if (result) {
+        count = write(fd, event, hdr.eventSize);
+        if (count > 0) {
+            bytesWritten += count;
+        }
+        result = (count == (int)hdr.eventSize);
+    }
+    if (close(fd) != 0) {
+        result = false;
+    }
+
+    if (!result) {
+        _log.error("write failed for queue file %d errno=%d", fileNum, errno);
+        fileQueue.removeFileNum(fileNum, false);
+        return false;
+    }
+
+    // This message is monitored by the automated test tool. If you edit this, change that too.
+    _log.trace("writeQueueToFiles fileNum=%d", fileNum);
+
+    fileQueue.addFileToQueue(fileNum);
+
+    return true;
+}
+
+uint32_t PublishQueueFileEngine::getFrontId() {
+    return (uint32_t) fileQueue.getFileFromQueue(false);
+}
+
+PublishQueueEvent *PublishQueueFileEngine::readFront() {
+    int fileNum = fileQueue.getFileFromQueue(false);
+    if (fileNum) {
+        return readQueueFile(fileNum);
+    }
+    else {
+        return NULL;
+    }
+}
+
+PublishQueueEvent *PublishQueueFileEngine::readEvent(size_t index, uint32_t &id) {
+    int fileNum = fileQueue.getFileFromQueueAt(index);
+    id = (uint32_t) fileNum;
+    if (fileNum) {
+        return readQueueFile(fileNum);
+    }
+    else {
+        return NULL;
+    }
+}
+
+uint32_t PublishQueueFileEngine::getIdAt(size_t index) {
+    return (uint32_t) fileQueue.getFileFromQueueAt(index);
+}
+
+void PublishQueueFileEngine::removeFront() {
+    int fileNum = fileQueue.getFileFromQueue(true);
+    if (fileNum) {
+        fileQueue.removeFileNum(fileNum, false);
+    }
+}
+
+bool PublishQueueFileEngine::removeEvent(uint32_t id) {
+    int fileNum = (int) id;
+    if (!fileQueue.removeFileFromQueue(fileNum)) {
+        return false;
+    }
+    fileQueue.removeFileNum(fileNum, false);
+    return true;
+}
+
+uint32_t PublishQueueFileEngine::getBackId() {
+    int len = fileQueue.getQueueLen();
+    return (len > 0) ? (uint32_t) fileQueue.getFileFromQueueAt(len - 1) : 0;
+}
+
+void PublishQueueFileEngine::removeAll() {
+    fileQueue.removeAll(true);
+}
+
+PublishQueueEvent *PublishQueueFileEngine::readQueueFile(int fileNum) {
+    PublishQueueEvent *result = NULL;
+
+    int fd = open(fileQueue.getPathForFileNum(fileNum), O_RDONLY);
+    if (fd >= 0) {
+        struct stat sb;
+        fstat(fd, &sb);
+
+        _log.trace("fileNum=%d size=%ld", fileNum, sb.st_size);
+
+        PublishQueueFileHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        
+        lseek(fd, 0, SEEK_SET);
+        int count = read(fd, &hdr, sizeof(PublishQueueFileHeader));
+        if (count > 0) {
+            bytesRead += count;
+        }
+
+        // Version 1 files have a shorter header and no CRC
+        bool hasCrc = (hdr.version == PublishQueuePosix::FILE_VERSION && hdr.headerSize == sizeof(PublishQueueFileHeader));
+        bool isV1 = (hdr.version == 1 && hdr.headerSize == PublishQueuePosix::FILE_HEADER_SIZE_V1);
+        if (isV1 && sb.st_size >= PublishQueuePosix::FILE_HEADER_SIZE_V1) {
+            hdr.eventSize = sb.st_size - PublishQueuePosix::FILE_HEADER_SIZE_V1;
+        }
+
+        // A file that is shorter than the header says was not completely written
+        if (count >= (int)PublishQueuePosix::FILE_HEADER_SIZE_V1 &&
+            hdr.magic == PublishQueuePosix::FILE_MAGIC && 
+            (hasCrc || isV1) &&
+            hdr.nameLen == sizeof(PublishQueueEvent::eventName) &&
+            hdr.eventSize >= sizeof(PublishQueueEvent) &&
+            sb.st_size == (off_t)(hdr.headerSize + hdr.eventSize)) {
+
+            size_t eventSize = hdr.eventSize;
+
+            result = (eventSize <= sizeof(PublishQueueEvent) + particle::protocol::MAX_EVENT_DATA_LENGTH) ? 
+                PublishQueuePosix::allocEvent(eventSize - sizeof(PublishQueueEvent)) : NULL;
+            if (result) {
+                lseek(fd, hdr.headerSize, SEEK_SET);
+                count = read(fd, result, eventSize);
+                if (count > 0) {
+                    bytesRead += count;
+                }
+
+                if (count == (int)eventSize &&
+                    (!hasCrc || hdr.crc == fileEventCrc(hdr, result)) &&
+                    ((char *)result)[eventSize - 1] == 0 && strlen(result->eventName) < (sizeof(PublishQueueEvent::eventName) - 1)) {
+                    _log.trace("readQueueFile %d event=%s data=%s", fileNum, result->eventName, result->eventData);
+                }
+                else {
+                    _log.trace("readQueueFile %d corrupted event name or data", fileNum);
+                    PublishQueuePosix::freeEvent(result);
+                    result = NULL;
+                }
+
+            }
+        } else {
+            _log.trace("readQueueFile %d bad magic=%08lx version=%u headerSize=%u nameLen=%u eventSize=%lu size=%ld", 
+                fileNum, hdr.magic, hdr.version, hdr.headerSize, hdr.nameLen, hdr.eventSize, sb.st_size);
+        }
+
+        close(fd);
+    }
+    return result;
+}
+
+//
+// PublishQueueRingFileEngine
+//
+
+static uint32_t ringRecordCrc(const PublishQueueRingRecordHeader &hdr, const void *data) {
+    PublishQueueRingRecordHeader tempHdr = hdr;
+    tempHdr.crc = 0;
+    tempHdr.flags &= ~PublishQueueRingFileEngine::RECORD_FLAG_REMOVED;     // Set later without rewriting the record
+    uint32_t crc = queueCrc32(0, &tempHdr, sizeof(tempHdr));
+    return queueCrc32(crc, data, hdr.length);
+}
+
+// The two copies of PublishQueueRingFileHeader are followed by the data area
+static const size_t RING_DATA_START = 2 * sizeof(PublishQueueRingFileHeader);
+
+PublishQueueRingFileEngine::~PublishQueueRingFileEngine() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool PublishQueueRingFileEngine::setup() {
+    if (dataSize < MIN_DATA_SIZE) {
+        dataSize = MIN_DATA_SIZE;
+    }
+    dataSize &= ~3;
+
+    String path = String(fileQueue.getDirPath()) + "/ring.dat";
+    fd = open(path, O_RDWR | O_CREAT);
+    if (fd < 0) {
+        _log.error("could not open %s", path.c_str());
+        return false;
+    }
+
+    // Use the valid header with the newest generation
+    bool found = false;
+    for(int ii = 0; ii < 2; ii++) {
+        PublishQueueRingFileHeader hdr;
+        lseek(fd, ii * sizeof(PublishQueueRingFileHeader), SEEK_SET);
+        if (read(fd, &hdr, sizeof(hdr)) != (int)sizeof(hdr)) {
+            continue;
+        }
+        uint32_t crc = hdr.crc;
+        hdr.crc = 0;
+        if (crc == queueCrc32(0, &hdr, sizeof(hdr)) &&
+            hdr.magic == RING_MAGIC &&
+            hdr.version == RING_VERSION &&
+            hdr.headerSize == sizeof(PublishQueueRingFileHeader) &&
+            hdr.nameLen == sizeof(PublishQueueEvent::eventName) &&
+            hdr.dataSize == dataSize &&
+            hdr.headOffset < dataSize &&
+            (!found || (int32_t)(hdr.generation - generation) > 0)) {
+            headOffset = hdr.headOffset;
+            headSeq = hdr.headSeq;
+            generation = hdr.generation;
+            found = true;
+        }
+    }
+
+    struct stat sb;
+    fstat(fd, &sb);
+    if (!found || sb.st_size != (off_t)(RING_DATA_START + dataSize)) {
+        _log.info("creating ring file %s dataSize=%u", path.c_str(), (unsigned)dataSize);
+        return format();
+    }
+
+    scan();
+    _log.info("ring file %s has %u events", path.c_str(), (unsigned)getQueueLen());
+
+    return true;
+}
+
+bool PublishQueueRingFileEngine::format() {
+    // Write the whole file now so the space is allocated and later writes don't extend it
+    ftruncate(fd, 0);
+    lseek(fd, 0, SEEK_SET);
+
+    uint8_t zeros[256];
+    memset(zeros, 0, sizeof(zeros));
+    for(size_t offset = 0; offset < RING_DATA_START + dataSize; offset += sizeof(zeros)) {
+        size_t len = RING_DATA_START + dataSize - offset;
+        if (len > sizeof(zeros)) {
+            len = sizeof(zeros);
+        }
+        if (write(fd, zeros, len) != (int)len) {
+            _log.error("could not allocate ring file");
+            return false;
+        }
+        bytesWritten += len;
+    }
+
+    headOffset = tailOffset = 0;
+    headSeq = 1;
+    count = removedCount = 0;
+    generation = 0;
+    return writeHeader();
+}
+
+bool PublishQueueRingFileEngine::writeHeader() {
+    PublishQueueRingFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = RING_MAGIC;
+    hdr.version = RING_VERSION;
+    hdr.headerSize = sizeof(PublishQueueRingFileHeader);
+    hdr.nameLen = sizeof(PublishQueueEvent::eventName);
+    hdr.dataSize = dataSize;
+    hdr.headOffset = headOffset;
+    hdr.headSeq = headSeq;
+    hdr.generation = ++generation;
+    hdr.crc = queueCrc32(0, &hdr, sizeof(hdr));
+
+    // Alternate copies so the previous header is still valid if this write is interrupted
+    lseek(fd, (generation & 1) * sizeof(PublishQueueRingFileHeader), SEEK_SET);
+    if (write(fd, &hdr, sizeof(hdr)) != (int)sizeof(hdr)) {
+        return false;
+    }
+    bytesWritten += sizeof(hdr);
+    return fsync(fd) == 0;
+}
+
+bool PublishQueueRingFileEngine::readData(uint32_t offset, void *buf, size_t len) {
+    if (fd < 0 || offset + len > dataSize) {
+        return false;
+    }
+    lseek(fd, RING_DATA_START + offset, SEEK_SET);
+    if (read(fd, buf, len) != (int)len) {
+        return false;
+    }
+    bytesRead += len;
+    return true;
+}
+
+bool PublishQueueRingFileEngine::writeData(uint32_t offset, const void *buf, size_t len) {
+    if (fd < 0 || offset + len > dataSize) {
+        return false;
+    }
+    lseek(fd, RING_DATA_START + offset, SEEK_SET);
+    if (write(fd, buf, len) != (int)len) {
+        return false;
+    }
+    bytesWritten += len;
+    return true;
+}
+
+bool PublishQueueRingFileEngine::readRecord(uint32_t offset, uint32_t seq, PublishQueueRingRecordHeader &hdr, PublishQueueEvent **event) {
+    if (!readData(offset, &hdr, sizeof(hdr)) || hdr.seq != seq) {
+        return false;
+    }
+
+    if (hdr.flags & RECORD_FLAG_WRAP) {
+        return hdr.length == 0 && hdr.crc == ringRecordCrc(hdr, NULL);
+    }
+
+    if (hdr.length < sizeof(PublishQueueEvent) || hdr.length > sizeof(PublishQueueEvent) + particle::protocol::MAX_EVENT_DATA_LENGTH ||
+        offset + recordSize(hdr.length) > dataSize) {
+        return false;
+    }
+
+    char *data = (char *) PublishQueuePosix::allocEvent(hdr.length - sizeof(PublishQueueEvent));
+    if (!data) {
+        return false;
+    }
+
+    bool valid = readData(offset + sizeof(hdr), data, hdr.length) && 
+        hdr.crc == ringRecordCrc(hdr, data) &&
+        data[hdr.length - 1] == 0 &&
+        strlen(((PublishQueueEvent *)data)->eventName) < (sizeof(PublishQueueEvent::eventName) - 1);
+
+    if (valid && event) {
+        *event = (PublishQueueEvent *)data;
+    }
+    else {
+        PublishQueuePosix::freeEvent((PublishQueueEvent *)data);
+    }
+    return valid;
+}
+
+void PublishQueueRingFileEngine::scan() {
+    uint32_t offset = headOffset;
+    uint32_t seq = headSeq;
+    size_t scanned = 0;
+
+    count = removedCount = 0;
+    while(scanned < dataSize) {
+        PublishQueueRingRecordHeader hdr = {};
+        bool wrap = (offset + sizeof(PublishQueueRingRecordHeader) > dataSize);    // No room for a record header
+        if (!wrap) {
+            if (!readRecord(offset, seq, hdr, NULL) && !corruptedRecordHasNext(offset, seq, hdr)) {
+                break;
+            }
+            wrap = (hdr.flags & RECORD_FLAG_WRAP) != 0;
+        }
+
+        if (wrap) {
+            if (count == 0) {
+                // The saved head is not moved past the end when the queue is empty
+                headOffset = 0;
+            }
+            scanned += dataSize - offset;
+            offset = 0;
+            continue;
+        }
+
+        if (hdr.flags & RECORD_FLAG_REMOVED) {
+            removedCount++;
+        }
+        scanned += recordSize(hdr.length);
+        offset += recordSize(hdr.length);
+        seq++;
+        count++;
+    }
+
+    if (count == 0) {
+        headOffset = offset;
+    }
+    tailOffset = offset;
+
+    if (count > 0 && (count == removedCount || headRemoved())) {
+        // Normally the head is moved past removed records before the header is written
+        advanceHead();
+    }
+}
+
+bool PublishQueueRingFileEngine::corruptedRecordHasNext(uint32_t offset, uint32_t seq, const PublishQueueRingRecordHeader &hdr) {
+    // A torn write is always the last record, so there is no valid record after it. A record
+    // in the middle whose data was corrupted later is kept so the records after it are not lost;
+    // it fails the CRC check when it's read and is discarded then.
+    if (hdr.seq != seq || (hdr.flags & RECORD_FLAG_WRAP) || hdr.length < sizeof(PublishQueueEvent) ||
+        hdr.length > sizeof(PublishQueueEvent) + particle::protocol::MAX_EVENT_DATA_LENGTH ||
+        offset + recordSize(hdr.length) > dataSize) {
+        return false;
+    }
+
+    uint32_t nextOffset = offset + recordSize(hdr.length);
+    if (nextOffset + sizeof(PublishQueueRingRecordHeader) > dataSize) {
+        nextOffset = 0;
+    }
+    PublishQueueRingRecordHeader nextHdr;
+    if (!readRecord(nextOffset, seq + 1, nextHdr, NULL)) {
+        return false;
+    }
+
+    _log.info("record %lu is corrupted, keeping the records after it", seq);
+    return true;
+}
+
+bool PublishQueueRingFileEngine::writeEvent(const PublishQueueEvent *event) {
+    if (fd < 0) {
+        return false;
+    }
+
+    size_t length = sizeof(PublishQueueEvent) + strlen(event->eventData);
+    uint32_t size = recordSize(length);
+    if (size > dataSize / 2) {
+        _log.error("event too large for ring file");
+        return false;
+    }
+
+    // Find space after the tail, discarding the oldest events if necessary
+    uint32_t offset;
+    while(true) {
+        offset = tailOffset;
+        if (count == 0 || tailOffset > headOffset) {
+            // Free space is from the tail to the end, and from the beginning to the head
+            if (tailOffset + size > dataSize) {
+                offset = 0;
+            }
+            if (offset + size <= ((offset == 0 && tailOffset != 0) ? headOffset : dataSize)) {
+                break;
+            }
+        }
+        else
+        if (tailOffset < headOffset && tailOffset + size <= headOffset) {
+            break;
+        }
+
+        if (count == 0) {
+            return false;
+        }
+        _log.info("discarded event %lu to make room", headSeq);
+        numDiscarded++;
+        advanceHead();
+        writeHeader();
+    }
+
+    uint32_t seq = headSeq + count;
+
+    if (offset != tailOffset && tailOffset + sizeof(PublishQueueRingRecordHeader) <= dataSize) {
+        // Mark the rest of the data area as unused
+        PublishQueueRingRecordHeader wrapHdr;
+        memset(&wrapHdr, 0, sizeof(wrapHdr));
+        wrapHdr.seq = seq;
+        wrapHdr.flags = RECORD_FLAG_WRAP;
+        wrapHdr.crc = ringRecordCrc(wrapHdr, NULL);
+        writeData(tailOffset, &wrapHdr, sizeof(wrapHdr));
+    }
+    if (offset != tailOffset && count == 0) {
+        headOffset = 0;
+    }
+
+    PublishQueueRingRecordHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.seq = seq;
+    hdr.length = (uint16_t) length;
+    hdr.crc = ringRecordCrc(hdr, event);
+
+    bool result = writeData(offset, &hdr, sizeof(hdr)) && 
+        writeData(offset + sizeof(hdr), event, length) &&
+        fsync(fd) == 0;
+    if (result) {
+        tailOffset = offset + size;
+        count++;
+
+        // This message is monitored by the automated test tool. If you edit this, change that too.
+        _log.trace("writeQueueToFiles fileNum=%lu", seq);
+    }
+    else {
+        _log.error("ring file write failed");
+    }
+    return result;
+}
+
+PublishQueueEvent *PublishQueueRingFileEngine::readFront() {
+    PublishQueueEvent *result = NULL;
+
+    if (count > 0) {
+        PublishQueueRingRecordHeader hdr;
+        if (!readRecord(headOffset, headSeq, hdr, &result)) {
+            _log.trace("readFront %lu corrupted", headSeq);
+            result = NULL;
+        }
+    }
+    return result;
+}
+
+PublishQueueEvent *PublishQueueRingFileEngine::readEvent(size_t index, uint32_t &id) {
+    PublishQueueEvent *result = NULL;
+
+    if (index >= getQueueLen()) {
+        return NULL;
+    }
+
+    uint32_t offset = headOffset;
+    uint32_t seq = headSeq;
+    for(size_t ii = 0; ii < count; ii++) {
+        uint32_t recordOffset = offset;
+        uint32_t recordSeq = seq;
+        PublishQueueRingRecordHeader hdr;
+        if (!nextRecord(offset, seq, hdr)) {
+            return NULL;
+        }
+        if (hdr.flags & RECORD_FLAG_REMOVED) {
+            continue;
+        }
+        if (index-- == 0) {
+            id = recordSeq;
+            if (!readRecord(recordOffset, recordSeq, hdr, &result)) {
+                _log.trace("readEvent %lu corrupted", recordSeq);
+                result = NULL;
+            }
+            break;
+        }
+    }
+    return result;
+}
+
+uint32_t PublishQueueRingFileEngine::getIdAt(size_t index) {
+    if (index >= getQueueLen()) {
+        return 0;
+    }
+    if (removedCount == 0) {
+        // Sequence numbers are consecutive when no records are marked removed
+        return headSeq + index;
+    }
+
+    uint32_t offset = headOffset;
+    uint32_t seq = headSeq;
+    for(size_t ii = 0; ii < count; ii++) {
+        uint32_t recordSeq = seq;
+        PublishQueueRingRecordHeader hdr;
+        if (!nextRecord(offset, seq, hdr)) {
+            break;
+        }
+        if (hdr.flags & RECORD_FLAG_REMOVED) {
+            continue;
+        }
+        if (index-- == 0) {
+            return recordSeq;
+        }
+    }
+    return 0;
+}
+
+bool PublishQueueRingFileEngine::nextRecord(uint32_t &offset, uint32_t &seq, PublishQueueRingRecordHeader &hdr) {
+    if (!readData(offset, &hdr, sizeof(hdr)) || hdr.seq != seq || (hdr.flags & RECORD_FLAG_WRAP) ||
+        offset + recordSize(hdr.length) > dataSize) {
+        return false;
+    }
+    offset += recordSize(hdr.length);
+    seq++;
+
+    PublishQueueRingRecordHeader nextHdr;
+    if (offset + sizeof(PublishQueueRingRecordHeader) > dataSize) {
+        offset = 0;
+    }
+    else 
+    if (readData(offset, &nextHdr, sizeof(nextHdr)) && (nextHdr.flags & RECORD_FLAG_WRAP)) {
+        offset = 0;
+    }
+    return true;
+}
+
+bool PublishQueueRingFileEngine::headRemoved() {
+    PublishQueueRingRecordHeader hdr;
+    return readData(headOffset, &hdr, sizeof(hdr)) && hdr.seq == headSeq && (hdr.flags & RECORD_FLAG_REMOVED);
+}
+
+void PublishQueueRingFileEngine::advanceHead() {
+    // Remove the front record, then any records after it that were removed by removeEvent()
+    do {
+        PublishQueueRingRecordHeader hdr;
+        if (!nextRecord(headOffset, headSeq, hdr)) {
+            // The length can't be trusted so the next record can't be found. The caller counts the front record
+            // as sent, discarded or corrupted, so only the records after it are counted here.
+            _log.info("discarding %u events after corrupted record %lu", (unsigned)(getQueueLen() - 1), headSeq);
+            numCorrupted += getQueueLen() - 1;
+            headSeq += count;
+            count = removedCount = 0;
+            headOffset = tailOffset;
+            return;
+        }
+        count--;
+        if (hdr.flags & RECORD_FLAG_REMOVED) {
+            removedCount--;
+        }
+    } while(count > 0 && (count == removedCount || headRemoved()));
+
+    if (count == 0) {
+        headOffset = tailOffset;
+    }
+}
+
+void PublishQueueRingFileEngine::removeFront() {
+    if (count > 0) {
+        advanceHead();
+        writeHeader();
+    }
+}
+
+bool PublishQueueRingFileEngine::removeEvent(uint32_t id) {
+    if (count == 0 || id - headSeq >= count) {
+        return false;
+    }
+    if (id == headSeq) {
+        removeFront();
+        return true;
+    }
+
+    uint32_t offset = headOffset;
+    uint32_t seq = headSeq;
+    PublishQueueRingRecordHeader hdr;
+    while(seq != id) {
+        if (!nextRecord(offset, seq, hdr)) {
+            return false;
+        }
+    }
+    if (!readData(offset, &hdr, sizeof(hdr)) || hdr.seq != id || (hdr.flags & (RECORD_FLAG_WRAP | RECORD_FLAG_REMOVED))) {
+        return false;
+    }
+
+    // Only the flags byte is written. It's not included in the CRC so the record is still valid.
+    hdr.flags |= RECORD_FLAG_REMOVED;
+    if (!writeData(offset + offsetof(PublishQueueRingRecordHeader, flags), &hdr.flags, sizeof(hdr.flags)) || fsync(fd) != 0) {
+        return false;
+    }
+    removedCount++;
+    return true;
+}
+
+void PublishQueueRingFileEngine::removeAll() {
+    headSeq += count;
+    count = removedCount = 0;
+    headOffset = tailOffset;
+    writeHeader();
+}
+
+//
+// PublishQueueRetainedStore
+//
+
+size_t PublishQueueRetainedStore::setup(void *buffer, size_t size, size_t numPriorities, const char *savePath) {
+    counts.assign(numPriorities, 0);
+    hdr = NULL;
+    buf = NULL;
+    if (!buffer || size < MIN_SIZE || size > 0xffff || ((uintptr_t)buffer & 3) != 0) {
+        return 0;
+    }
+    hdr = (PublishQueueRetainedHeader *)buffer;
+    buf = (uint8_t *)buffer;
+    this->size = size;
+
+    if (!isHeaderValid() && savePath) {
+        // After a power loss, use the copy saved by saveToFile() if there is one
+        int fd = open(savePath, O_RDONLY);
+        if (fd >= 0) {
+            struct stat sb;
+            if (fstat(fd, &sb) == 0 && (size_t)sb.st_size == size && read(fd, buf, size) == (ssize_t)size) {
+                _log.info("loaded retained events from %s", savePath);
+            }
+            close(fd);
+        }
+    }
+    if (savePath) {
+        // Either loaded, or older than the events in retained memory
+        unlink(savePath);
+    }
+
+    if (!isHeaderValid()) {
+        memset(hdr, 0, sizeof(PublishQueueRetainedHeader));
+        hdr->magic = RETAINED_MAGIC;
+        hdr->version = RETAINED_VERSION;
+        hdr->headerSize = sizeof(PublishQueueRetainedHeader);
+        hdr->size = (uint16_t)size;
+        setHeadTail(sizeof(PublishQueueRetainedHeader), sizeof(PublishQueueRetainedHeader));
+        return 0;
+    }
+
+    // Each pass moves forward by at least a record header, so this ends even if the offsets loop
+    size_t found = 0;
+    size_t tail = getTail();
+    size_t offset = firstOffset();
+    for(size_t bytes = 0; offset != tail; bytes += sizeof(PublishQueueRetainedRecordHeader)) {
+        PublishQueueRetainedRecordHeader recordHdr;
+        if (bytes > size || !readRecordHeader(offset, recordHdr) || (offset < tail && offset + recordSize(recordHdr) > tail)) {
+            // Not caused by a reset, records are complete before the tail includes them
+            _log.info("discarding corrupted records in retained memory at %u", (unsigned)offset);
+            setHeadTail(getHead(), offset);
+            break;
+        }
+        if ((recordHdr.flags & RECORD_FLAG_REMOVED) == 0) {
+            counts[recordHdr.priority]++;
+            found++;
+        }
+        if ((int32_t)(recordHdr.seq - nextSeq) >= 0) {
+            nextSeq = recordHdr.seq + 1;
+        }
+        offset = nextOffset(offset + recordSize(recordHdr));
+    }
+    return found;
+}
+
+bool PublishQueueRetainedStore::isHeaderValid() const {
+    if (hdr->magic != RETAINED_MAGIC ||
+        hdr->version != RETAINED_VERSION ||
+        hdr->headerSize != sizeof(PublishQueueRetainedHeader) ||
+        hdr->size != size) {
+        return false;
+    }
+    size_t head = getHead();
+    size_t tail = getTail();
+    return head >= sizeof(PublishQueueRetainedHeader) && head <= size &&
+        tail >= sizeof(PublishQueueRetainedHeader) && tail <= size;
+}
+
+size_t PublishQueueRetainedStore::nextOffset(size_t offset) const {
+    if (offset == getTail()) {
+        return offset;
+    }
+    if (size - offset < sizeof(PublishQueueRetainedRecordHeader)) {
+        return sizeof(PublishQueueRetainedHeader);
+    }
+    PublishQueueRetainedRecordHeader recordHdr;
+    memcpy(&recordHdr, &buf[offset], sizeof(recordHdr));
+    if (recordHdr.flags & RECORD_FLAG_WRAP) {
+        return sizeof(PublishQueueRetainedHeader);
+    }
+    return offset;
+}
+
+bool PublishQueueRetainedStore::readRecordHeader(size_t offset, PublishQueueRetainedRecordHeader &recordHdr) const {
+    if (offset < sizeof(PublishQueueRetainedHeader) || offset + sizeof(PublishQueueRetainedRecordHeader) > size) {
+        return false;
+    }
+    memcpy(&recordHdr, &buf[offset], sizeof(recordHdr));
+    if (recordHdr.priority >= counts.size() || recordHdr.length < 2 || (recordHdr.flags & RECORD_FLAG_WRAP) || offset + recordSize(recordHdr) > size) {
+        return false;
+    }
+
+    // The name and data are each null terminated
+    const char *name = (const char *)&buf[offset + sizeof(PublishQueueRetainedRecordHeader)];
+    size_t nameLen = strnlen(name, recordHdr.length);
+    if (nameLen > particle::protocol::MAX_EVENT_NAME_LENGTH || nameLen + 2 > recordHdr.length || name[recordHdr.length - 1] != 0 ||
+        recordHdr.length - nameLen - 2 > particle::protocol::MAX_EVENT_DATA_LENGTH) {
+        return false;
+    }
+
+    PublishQueueRetainedRecordHeader tempHdr = recordHdr;
+    tempHdr.crc = 0;
+    tempHdr.flags &= ~RECORD_FLAG_REMOVED;     // Set later without rewriting the record
+    uint32_t crc = queueCrc32(0, &tempHdr, sizeof(tempHdr));
+    return recordHdr.crc == queueCrc32(crc, name, recordHdr.length);
+}
+
+bool PublishQueueRetainedStore::append(uint8_t priority, const PublishQueueEvent *event) {
+    if (!hdr || priority >= counts.size()) {
+        return false;
+    }
+    size_t nameLen = strlen(event->eventName);
+    size_t dataLen = strlen(event->eventData);
+
+    PublishQueueRetainedRecordHeader recordHdr;
+    memset(&recordHdr, 0, sizeof(recordHdr));
+    recordHdr.seq = nextSeq;
+    recordHdr.length = (uint16_t)(nameLen + 1 + dataLen + 1);
+    recordHdr.priority = priority;
+    recordHdr.publishFlags = event->flags.value();
+    size_t recSize = recordSize(recordHdr);
+
+    // The head and tail are only equal when empty, so a full buffer leaves at least one byte unused
+    const size_t start = sizeof(PublishQueueRetainedHeader);
+    size_t head = getHead();
+    size_t tail = getTail();
+    size_t offset;
+    bool wrap = false;
+    if (head == tail) {
+        if (start + recSize > size) {
+            return false;
+        }
+        offset = head = start;
+    }
+    else
+    if (tail > head) {
+        if (tail + recSize <= size) {
+            offset = tail;
+        }
+        else
+        if (start + recSize < head) {
+            offset = start;
+            wrap = true;
+        }
+        else {
+            return false;
+        }
+    }
+    else {
+        if (tail + recSize >= head) {
+            return false;
+        }
+        offset = tail;
+    }
+
+    removeSavedFile();
+
+    if (wrap && size - tail >= sizeof(PublishQueueRetainedRecordHeader)) {
+        PublishQueueRetainedRecordHeader wrapHdr;
+        memset(&wrapHdr, 0, sizeof(wrapHdr));
+        wrapHdr.flags = RECORD_FLAG_WRAP;
+        memcpy(&buf[tail], &wrapHdr, sizeof(wrapHdr));
+    }
+
+    char *name = (char *)&buf[offset + sizeof(PublishQueueRetainedRecordHeader)];
+    memcpy(name, event->eventName, nameLen + 1);
+    memcpy(&name[nameLen + 1], event->eventData, dataLen + 1);
+    uint32_t crc = queueCrc32(0, &recordHdr, sizeof(recordHdr));
+    recordHdr.crc = queueCrc32(crc, name, recordHdr.length);
+    memcpy(&buf[offset], &recordHdr, sizeof(recordHdr));
+
+    // The record is not part of the buffer until the tail includes it
+    setHeadTail(head, offset + recSize);
+    counts[priority]++;
+    nextSeq++;
+    return true;
+}
+
+size_t PublishQueueRetainedStore::find(uint8_t priority, size_t index, PublishQueueRetainedRecordHeader &recordHdr) const {
+    if (!hdr) {
+        return 0;
+    }
+    size_t tail = getTail();
+    for(size_t offset = firstOffset(); offset != tail; offset = nextOffset(offset + recordSize(recordHdr))) {
+        memcpy(&recordHdr, &buf[offset], sizeof(recordHdr));
+        if (recordHdr.priority == priority && (recordHdr.flags & RECORD_FLAG_REMOVED) == 0 && index-- == 0) {
+            return offset;
+        }
+    }
+    return 0;
+}
+
+size_t PublishQueueRetainedStore::findSeq(uint8_t priority, uint32_t seq) const {
+    if (!hdr) {
+        return 0;
+    }
+    PublishQueueRetainedRecordHeader recordHdr;
+    size_t tail = getTail();
+    for(size_t offset = firstOffset(); offset != tail; offset = nextOffset(offset + recordSize(recordHdr))) {
+        memcpy(&recordHdr, &buf[offset], sizeof(recordHdr));
+        if (recordHdr.priority == priority && recordHdr.seq == seq && (recordHdr.flags & RECORD_FLAG_REMOVED) == 0) {
+            return offset;
+        }
+    }
+    return 0;
+}
+
+PublishQueueEvent *PublishQueueRetainedStore::readEvent(size_t offset) const {
+    PublishQueueRetainedRecordHeader recordHdr;
+    memcpy(&recordHdr, &buf[offset], sizeof(recordHdr));
+
+    const char *name = (const char *)&buf[offset + sizeof(PublishQueueRetainedRecordHeader)];
+    size_t nameLen = strlen(name);
+    const char *data = &name[nameLen + 1];
+
+    PublishQueueEvent *event = PublishQueuePosix::allocEvent(recordHdr.length - nameLen - 2);
+    if (event) {
+        event->flags = PublishFlags(PublishFlag(recordHdr.publishFlags));
+        strcpy(event->eventName, name);
+        strcpy(event->eventData, data);
+    }
+    return event;
+}
+
+void PublishQueueRetainedStore::remove(size_t offset) {
+    removeSavedFile();
+
+    // Setting the flag is a one byte write, so a reset leaves the record either present or removed
+    PublishQueueRetainedRecordHeader recordHdr;
+    memcpy(&recordHdr, &buf[offset], sizeof(recordHdr));
+    buf[offset + offsetof(PublishQueueRetainedRecordHeader, flags)] = recordHdr.flags | RECORD_FLAG_REMOVED;
+    counts[recordHdr.priority]--;
+
+    // Free the space of the removed records at the front
+    size_t tail = getTail();
+    size_t head = firstOffset();
+    while(head != tail) {
+        memcpy(&recordHdr, &buf[head], sizeof(recordHdr));
+        if ((recordHdr.flags & RECORD_FLAG_REMOVED) == 0) {
+            break;
+        }
+        head = nextOffset(head + recordSize(recordHdr));
+    }
+    if (head != getHead()) {
+        setHeadTail(head, tail);
+    }
+}
+
+bool PublishQueueRetainedStore::saveToFile(const char *path) {
+    if (!hdr) {
+        return false;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC);
+    if (fd < 0) {
+        _log.error("failed to create %s errno=%d", path, errno);
+        return false;
+    }
+    bool result = (write(fd, buf, size) == (ssize_t)size);
+    if (close(fd) != 0) {
+        result = false;
+    }
+    if (!result) {
+        _log.error("failed to write %s errno=%d", path, errno);
+        unlink(path);
+        return false;
+    }
+    savedPath = path;
+    return true;
+}
+
+void PublishQueueRetainedStore::removeSavedFile() {
+    if (savedPath.length()) {
+        unlink(savedPath.c_str());
+        savedPath = "";
+    }
+}
+
+//
+// PublishQueueRetainedEngine
+//
+
+PublishQueueRetainedEngine &PublishQueueRetainedEngine::withStore(PublishQueueRetainedStore *store, uint8_t priority, PublishQueueStorageEngine *flashEngine) {
+    this->store = store;
+    this->priority = priority;
+    this->flashEngine = flashEngine;
+    return *this;
+}
+
+bool PublishQueueRetainedEngine::setup() {
+    // The store and the flash engine were already set up by PublishQueuePosix::setup()
+    if (flashEngine->getQueueLen() > 0) {
+        startFlashIds();
+    }
+    return true;
+}
+
+void PublishQueueRetainedEngine::startFlashIds() {
+    uint32_t &nextSeq = store->getNextSeq();
+    flashStartId = nextSeq;
+    flashIdOffset = nextSeq - flashEngine->getFrontId();
+    nextSeq = flashEngine->getBackId() + flashIdOffset + 1;
+}
+
+bool PublishQueueRetainedEngine::writeEvent(const PublishQueueEvent *event) {
+    // Events in retained memory must be older than the events in flash
+    bool flashEmpty = (flashEngine->getQueueLen() == 0);
+    if (flashEmpty && store->append(priority, event)) {
+        return true;
+    }
+
+    if (!flashEngine->writeEvent(event)) {
+        return false;
+    }
+    numOverflows++;
+
+    if (flashEmpty) {
+        startFlashIds();
+    }
+    else {
+        // Only move forward. The store's identifiers are shared by all priorities, and another
+        // priority may already have used identifiers past this engine's flash events.
+        uint32_t &nextSeq = store->getNextSeq();
+        uint32_t flashNextSeq = flashEngine->getBackId() + flashIdOffset + 1;
+        if ((int32_t)(flashNextSeq - nextSeq) > 0) {
+            nextSeq = flashNextSeq;
+        }
+    }
+    return true;
+}
+
+PublishQueueEvent *PublishQueueRetainedEngine::readEvent(size_t index, uint32_t &id) {
+    size_t retainedCount = store->getCount(priority);
+    if (index < retainedCount) {
+        PublishQueueRetainedRecordHeader recordHdr;
+        size_t offset = store->find(priority, index, recordHdr);
+        if (!offset) {
+            return NULL;
+        }
+        id = recordHdr.seq;
+        return store->readEvent(offset);
+    }
+
+    id = 0;
+    PublishQueueEvent *event = flashEngine->readEvent(index - retainedCount, id);
+    if (id) {
+        id += flashIdOffset;
+    }
+    return event;
+}
+
+uint32_t PublishQueueRetainedEngine::getIdAt(size_t index) {
+    size_t retainedCount = store->getCount(priority);
+    if (index < retainedCount) {
+        PublishQueueRetainedRecordHeader recordHdr;
+        return store->find(priority, index, recordHdr) ? recordHdr.seq : 0;
+    }
+
+    uint32_t id = flashEngine->getIdAt(index - retainedCount);
+    return id ? id + flashIdOffset : 0;
+}
+
+void PublishQueueRetainedEngine::removeFront() {
+    PublishQueueRetainedRecordHeader recordHdr;
+    size_t offset = store->find(priority, 0, recordHdr);
+    if (offset) {
+        store->remove(offset);
+    }
+    else {
+        flashEngine->removeFront();
+    }
+}
+
+bool PublishQueueRetainedEngine::removeEvent(uint32_t id) {
+    if (isFlashId(id)) {
+        return flashEngine->removeEvent(id - flashIdOffset);
+    }
+
+    size_t offset = store->findSeq(priority, id);
+    if (!offset) {
+        return false;
+    }
+    store->remove(offset);
+    return true;
+}
+
+uint32_t PublishQueueRetainedEngine::getBackId() {
+    if (flashEngine->getQueueLen() > 0) {
+        return flashEngine->getBackId() + flashIdOffset;
+    }
+
+    size_t retainedCount = store->getCount(priority);
+    PublishQueueRetainedRecordHeader recordHdr;
+    return (retainedCount && store->find(priority, retainedCount - 1, recordHdr)) ? recordHdr.seq : 0;
+}
+
+void PublishQueueRetainedEngine::removeAll() {
+    while(store->getCount(priority) > 0) {
+        PublishQueueRetainedRecordHeader recordHdr;
+        store->remove(store->find(priority, 0, recordHdr));
+    }
+    flashEngine->removeAll();
+}
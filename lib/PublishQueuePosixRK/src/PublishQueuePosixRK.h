@@ -6,38 +6,649 @@
 
 #include "Particle.h"
 #include "SequentialFileRK.h"
+#include "BackgroundPublishRK.h"
+#include "PublishQueueEventPool.h"
+#include "PublishQueuePacing.h"
 
-#include <deque>
+#include <vector>
 
 /**
  * @brief Structure stored before the event data in files on the flash file system
  * 
  * Each file is sequentially numbered and has one event. The contents of the file
- * are this header (8 bytes) followed by the PublishQueueEvent structure, which
+ * are this header (16 bytes) followed by the PublishQueueEvent structure, which
  * is variably sized based on the size of the event.    
+ * 
+ * Version 1 files have only the first 8 bytes of the header, without eventSize and crc.
+ * They can still be read.
  */
 struct PublishQueueFileHeader {
     uint32_t magic;         //!< PublishQueuePosix::FILE_MAGIC = 0x31b67663
-    uint8_t version;        //!< PublishQueuePosix::FILE_VERSION = 1
-    uint8_t headerSize;     //!< sizeof(PublishQueueFileHeader) = 8
+    uint8_t version;        //!< PublishQueuePosix::FILE_VERSION = 2
+    uint8_t headerSize;     //!< sizeof(PublishQueueFileHeader) = 16, or 8 for version 1
     uint16_t nameLen;       //!< sizeof(PublishQueueEvent::eventName) = 64
+    uint32_t eventSize;     //!< Number of bytes of PublishQueueEvent after this header
+    uint32_t crc;           //!< CRC-32 of this header with crc set to 0 and the event
+};
+
+/**
+ * @brief Structure to hold an event in RAM or in files
+ * 
+ * In RAM, this structure is stored in the ramQueue. 
+ * 
+ * On the flash file system, each file contains one event and consists of the
+ * PublishQueueFileHeader above (8 bytes) plus this structure.
+ * 
+ * Note that the eventData is specified as 1 byte here, but it's actually
+ * sized to fit the event data with a null terminator.
+ */
+struct PublishQueueEvent {
+    PublishFlags flags; //!< NO_ACK or WITH_ACK. Can use PRIVATE, but that's no longer needed.
+    char eventName[particle::protocol::MAX_EVENT_NAME_LENGTH + 1]; //!< c-string event name (required)
+    char eventData[1]; //!< Variable size event data
+};
+
+/**
+ * @brief Header at the beginning of the ring file, used by PublishQueueRingFileEngine
+ * 
+ * There are two copies at the beginning of the file, written alternately, so a reset
+ * while one is being written leaves the other valid. The one with the newer generation
+ * is used.
+ */
+struct PublishQueueRingFileHeader {
+    uint32_t magic;         //!< PublishQueueRingFileEngine::RING_MAGIC = 0x52c4e9a1
+    uint8_t version;        //!< PublishQueueRingFileEngine::RING_VERSION = 1
+    uint8_t headerSize;     //!< sizeof(PublishQueueRingFileHeader) = 32
+    uint16_t nameLen;       //!< sizeof(PublishQueueEvent::eventName) = 64
+    uint32_t dataSize;      //!< Size of the circular data area after the two headers
+    uint32_t headOffset;    //!< Offset into the data area of the oldest record
+    uint32_t headSeq;       //!< Sequence number of the oldest record
+    uint32_t generation;    //!< Incremented each time a header is written
+    uint32_t reserved;      //!< 0
+    uint32_t crc;           //!< CRC-32 of this structure with crc set to 0
+};
+
+/**
+ * @brief Header before each record in the ring file data area
+ * 
+ * Records are consecutive and aligned to 4 bytes. The record header is followed by length
+ * bytes of PublishQueueEvent. A record with RECORD_FLAG_WRAP set has no data and means the 
+ * next record is at the beginning of the data area. A record with RECORD_FLAG_REMOVED set
+ * is skipped.
+ */
+struct PublishQueueRingRecordHeader {
+    uint32_t seq;           //!< Sequence number, one more than the record before it
+    uint16_t length;        //!< Number of bytes of PublishQueueEvent after this header
+    uint8_t flags;          //!< PublishQueueRingFileEngine::RECORD_FLAG_WRAP, RECORD_FLAG_REMOVED, or 0
+    uint8_t reserved;       //!< 0
+    uint32_t crc;           //!< CRC-32 of this header with crc set to 0 and the event data
+};
+
+/**
+ * @brief Header at the beginning of the retained memory buffer, used by PublishQueueRetainedStore
+ */
+struct PublishQueueRetainedHeader {
+    uint32_t magic;         //!< PublishQueueRetainedStore::RETAINED_MAGIC = 0x7e3a52d1
+    uint8_t version;        //!< PublishQueueRetainedStore::RETAINED_VERSION = 1
+    uint8_t headerSize;     //!< sizeof(PublishQueueRetainedHeader) = 16
+    uint16_t size;          //!< Size of the whole buffer, including this header
+    uint32_t headTail;      //!< Offset of the oldest record in the low 16 bits and offset after the newest record in the high 16 bits, written together
+    uint32_t reserved;      //!< 0
+};
+
+/**
+ * @brief Header before each event in the retained memory buffer
+ * 
+ * Records are consecutive, oldest first, for all priorities, in a circular area after the
+ * PublishQueueRetainedHeader. The header is followed by length bytes: the event name and the
+ * event data, each with a null terminator. A record with RECORD_FLAG_WRAP set has no data and
+ * means the next record is at the beginning of the area, as does having less room than a header
+ * before the end of the buffer. A record with RECORD_FLAG_REMOVED set is skipped.
+ */
+struct PublishQueueRetainedRecordHeader {
+    uint32_t seq;           //!< Identifier returned by PublishQueueRetainedEngine, increasing
+    uint16_t length;        //!< Number of bytes of event name and data after this header
+    uint8_t priority;       //!< PublishQueuePosix::Priority
+    uint8_t publishFlags;   //!< PublishFlags value
+    uint8_t flags;          //!< PublishQueueRetainedStore::RECORD_FLAG_WRAP, RECORD_FLAG_REMOVED, or 0
+    uint8_t reserved[3];    //!< 0
+    uint32_t crc;           //!< CRC-32 of this header with crc set to 0 and RECORD_FLAG_REMOVED clear, and the name and data
+};
+
+/**
+ * @brief Interface to the storage used for events that are not kept in RAM
+ * 
+ * The queue is first-in, first-out. Events are added to the back by writeEvent() and the
+ * front is read by readFront() and removed by removeFront() after it has been published.
+ * 
+ * The methods are called with the PublishQueuePosix mutex locked.
+ */
+class PublishQueueStorageEngine {
+public:
+    /**
+     * @brief Destructor
+     */
+    virtual ~PublishQueueStorageEngine() {};
+
+    /**
+     * @brief Find the events saved before the last reset. Called from PublishQueuePosix::setup().
+     */
+    virtual bool setup() = 0;
+
+    /**
+     * @brief Add an event to the back of the queue
+     * 
+     * @param event The event to store. The caller still owns it.
+     * 
+     * May discard the oldest events if there is not enough space.
+     */
+    virtual bool writeEvent(const PublishQueueEvent *event) = 0;
+
+    /**
+     * @brief Get an identifier for the event at the front of the queue, or 0 if the queue is empty
+     * 
+     * The identifier is used to make sure the front has not changed (by being discarded because
+     * the queue was full) while an event was being published.
+     */
+    virtual uint32_t getFrontId() = 0;
+
+    /**
+     * @brief Read the event at the front of the queue
+     * 
+     * May return NULL if the queue is empty, the event is corrupted, or out of memory.
+     * 
+     * You must free the result from this method using PublishQueuePosix::freeEvent() when you are done using it.
+     */
+    virtual PublishQueueEvent *readFront() = 0;
+
+    /**
+     * @brief Read an event without removing it
+     * 
+     * @param index 0 is the front of the queue (the same event as readFront()), 1 is the next event, and so on
+     * @param id Filled in with the identifier of the event, as would be returned by getFrontId() once it
+     * reaches the front of the queue. Identifiers increase from the front of the queue to the back.
+     * 
+     * May return NULL if there are not that many events, the event is corrupted, or out of memory.
+     * 
+     * You must free the result from this method using PublishQueuePosix::freeEvent() when you are done using it.
+     */
+    virtual PublishQueueEvent *readEvent(size_t index, uint32_t &id) = 0;
+
+    /**
+     * @brief Get the identifier of an event without reading it
+     * 
+     * @param index 0 for the front of the queue, 1 for the event behind it, and so on
+     * 
+     * @return The identifier, or 0 if index is past the end of the queue
+     */
+    virtual uint32_t getIdAt(size_t index) = 0;
+
+    /**
+     * @brief Remove the event at the front of the queue
+     */
+    virtual void removeFront() = 0;
+
+    /**
+     * @brief Remove an event anywhere in the queue
+     * 
+     * @param id The identifier of the event, from getFrontId(), getBackId() or readEvent()
+     * 
+     * @return true if the event was removed, false if it's no longer in the queue
+     */
+    virtual bool removeEvent(uint32_t id) = 0;
+
+    /**
+     * @brief Get the identifier of the event most recently added by writeEvent(), or 0 if the queue is empty
+     */
+    virtual uint32_t getBackId() = 0;
+
+    /**
+     * @brief Get the number of events in the queue. This does not access the file system.
+     */
+    virtual size_t getQueueLen() const = 0;
+
+    /**
+     * @brief Remove all events
+     */
+    virtual void removeAll() = 0;
+
+    /**
+     * @brief Get the number of bytes written to the flash file system since setup() or resetCounters()
+     */
+    uint32_t getBytesWritten() const { return bytesWritten; };
+
+    /**
+     * @brief Get the number of bytes read from the flash file system since setup() or resetCounters()
+     */
+    uint32_t getBytesRead() const { return bytesRead; };
+
+    /**
+     * @brief Get the number of events the engine discarded to make room for new ones since setup() or resetCounters()
+     */
+    uint32_t getNumDiscarded() const { return numDiscarded; };
+
+    /**
+     * @brief Get the number of events the engine discarded because their records were corrupted since setup() or resetCounters()
+     * 
+     * Records that fail their checks when an event is read are not included; PublishQueuePosix
+     * removes those and counts them in Metrics::evictedCorrupted. This counts events the
+     * engine had to drop because it could not find its way past a corrupted record.
+     */
+    uint32_t getNumCorrupted() const { return numCorrupted; };
+
+    /**
+     * @brief Set the byte and discarded event counts to 0
+     */
+    virtual void resetCounters() { bytesWritten = bytesRead = numDiscarded = numCorrupted = 0; };
+
+protected:
+    uint32_t bytesWritten = 0; //!< Bytes written to the file system
+    uint32_t bytesRead = 0; //!< Bytes read from the file system
+    uint32_t numDiscarded = 0; //!< Events discarded to make room
+    uint32_t numCorrupted = 0; //!< Events discarded after a corrupted record
+};
+
+/**
+ * @brief Storage engine that stores each event in a separate sequentially numbered file
+ * 
+ * This is the original storage method and is the default. Each file has a CRC of the header and
+ * event, so a file that was only partially written before a reset, or was corrupted later, is not
+ * published.
+ */
+class PublishQueueFileEngine : public PublishQueueStorageEngine {
+public:
+    /**
+     * @brief Constructor
+     * 
+     * @param fileQueue The SequentialFile object that manages the directory of event files
+     */
+    PublishQueueFileEngine(SequentialFile &fileQueue) : fileQueue(fileQueue) {};
+
+    virtual bool setup();
+    virtual bool writeEvent(const PublishQueueEvent *event);
+    virtual uint32_t getFrontId();
+    virtual PublishQueueEvent *readFront();
+    virtual PublishQueueEvent *readEvent(size_t index, uint32_t &id);
+    virtual uint32_t getIdAt(size_t index);
+    virtual void removeFront();
+    virtual bool removeEvent(uint32_t id);
+    virtual uint32_t getBackId();
+    virtual size_t getQueueLen() const { return (size_t) fileQueue.getQueueLen(); };
+    virtual void removeAll();
+
+    /**
+     * @brief Read an event from a sequentially numbered file 
+     * 
+     * @param fileNum The file number to read 
+     * 
+     * May return NULL if file does not exist, is incomplete or fails the CRC check, or out of memory.
+     * 
+     * You must free the result from this method using PublishQueuePosix::freeEvent() when you are done using it. 
+     */
+    PublishQueueEvent *readQueueFile(int fileNum);
+
+protected:
+    SequentialFile &fileQueue; //!< Directory of event files
 };
 
-/**
- * @brief Structure to hold an event in RAM or in files
- * 
- * In RAM, this structure is stored in the ramQueue. 
- * 
- * On the flash file system, each file contains one event and consists of the
- * PublishQueueFileHeader above (8 bytes) plus this structure.
- * 
- * Note that the eventData is specified as 1 byte here, but it's actually
- * sized to fit the event data with a null terminator.
- */
-struct PublishQueueEvent {
-    PublishFlags flags; //!< NO_ACK or WITH_ACK. Can use PRIVATE, but that's no longer needed.
-    char eventName[particle::protocol::MAX_EVENT_NAME_LENGTH + 1]; //!< c-string event name (required)
-    char eventData[1]; //!< Variable size event data
+/**
+ * @brief Storage engine that stores all events in one preallocated circular file
+ * 
+ * The file is ring.dat in the queue directory. Adding and removing an event writes to the 
+ * existing file without creating or deleting files, so there are no directory updates.
+ * Adding an event writes one record. Removing an event rewrites a header that holds the 
+ * position of the oldest record. The end of the queue is found at setup() by following 
+ * records with consecutive sequence numbers and valid CRCs from the head, so a record
+ * that was only partially written before a reset is ignored.
+ * 
+ * Removing an event that is not at the front sets a flag in its record header. The record
+ * stays in the file until the head moves past it.
+ * 
+ * If there is not enough space for a new event, the oldest events are discarded.
+ */
+class PublishQueueRingFileEngine : public PublishQueueStorageEngine {
+public:
+    /**
+     * @brief Constructor
+     * 
+     * @param fileQueue The SequentialFile object; only the directory path is used
+     */
+    PublishQueueRingFileEngine(SequentialFile &fileQueue) : fileQueue(fileQueue) {};
+
+    /**
+     * @brief Destructor. Closes the file.
+     */
+    virtual ~PublishQueueRingFileEngine();
+
+    /**
+     * @brief Set the size of the data area in bytes. Must be set before setup().
+     * 
+     * If the existing file was created with a different size it's recreated and any events
+     * in it are lost.
+     */
+    PublishQueueRingFileEngine &withDataSize(size_t size) { dataSize = size; return *this; };
+
+    /**
+     * @brief Get the size of the data area in bytes
+     */
+    size_t getDataSize() const { return dataSize; };
+
+    virtual bool setup();
+    virtual bool writeEvent(const PublishQueueEvent *event);
+    virtual uint32_t getFrontId() { return count ? headSeq : 0; };
+    virtual PublishQueueEvent *readFront();
+    virtual PublishQueueEvent *readEvent(size_t index, uint32_t &id);
+    virtual uint32_t getIdAt(size_t index);
+    virtual void removeFront();
+    virtual bool removeEvent(uint32_t id);
+    virtual uint32_t getBackId() { return count ? headSeq + count - 1 : 0; };
+    virtual size_t getQueueLen() const { return count - removedCount; };
+    virtual void removeAll();
+
+    static const uint32_t RING_MAGIC = 0x52c4e9a1; //!< Magic bytes in PublishQueueRingFileHeader
+    static const uint8_t RING_VERSION = 1; //!< Version in PublishQueueRingFileHeader
+    static const uint8_t RECORD_FLAG_WRAP = 0x01; //!< The next record is at the beginning of the data area
+    static const uint8_t RECORD_FLAG_REMOVED = 0x02; //!< The event was removed by removeEvent(). Not included in the CRC.
+    static const size_t MIN_DATA_SIZE = 4096; //!< Smallest allowed data size
+
+protected:
+    /**
+     * @brief Create an empty file of the configured size
+     */
+    bool format();
+
+    /**
+     * @brief Write the header with the current head, alternating between the two copies
+     */
+    bool writeHeader();
+
+    /**
+     * @brief Read and check the record header at offset in the data area
+     * 
+     * @param offset Offset into the data area
+     * @param seq Expected sequence number
+     * @param hdr Filled in with the record header
+     * @param event If not NULL, filled in with a copy of the event allocated by PublishQueuePosix::allocEvent()
+     * 
+     * @return true if the record is valid
+     */
+    bool readRecord(uint32_t offset, uint32_t seq, PublishQueueRingRecordHeader &hdr, PublishQueueEvent **event);
+
+    /**
+     * @brief Find the tail and count by following valid records from the head
+     */
+    void scan();
+
+    /**
+     * @brief Returns true if a record that failed readRecord() has an intact header and a valid record after it
+     * 
+     * @param offset Offset of the record into the data area
+     * @param seq Expected sequence number
+     * @param hdr The record header filled in by readRecord()
+     */
+    bool corruptedRecordHasNext(uint32_t offset, uint32_t seq, const PublishQueueRingRecordHeader &hdr);
+
+    /**
+     * @brief Move the head past the front record and any wrap marker or removed records after it, without writing the header
+     */
+    void advanceHead();
+
+    /**
+     * @brief Move from one record to the next
+     * 
+     * @param offset Offset of a record, updated to the offset of the next one
+     * @param seq Sequence number of the record, updated to the next sequence number
+     * @param hdr Filled in with the header of the record at offset
+     * 
+     * @return false if the record header is not valid
+     */
+    bool nextRecord(uint32_t &offset, uint32_t &seq, PublishQueueRingRecordHeader &hdr);
+
+    /**
+     * @brief Returns true if the record at the head was removed by removeEvent()
+     */
+    bool headRemoved();
+
+    /**
+     * @brief Read from the data area 
+     */
+    bool readData(uint32_t offset, void *buf, size_t len);
+
+    /**
+     * @brief Write to the data area 
+     */
+    bool writeData(uint32_t offset, const void *buf, size_t len);
+
+    /**
+     * @brief Total size of a record, including the header, rounded up to a multiple of 4 bytes
+     */
+    static uint32_t recordSize(size_t length) { return (sizeof(PublishQueueRingRecordHeader) + length + 3) & ~3; };
+
+    SequentialFile &fileQueue; //!< Used for the directory path
+    int fd = -1; //!< File descriptor for the ring file, kept open
+    size_t dataSize = 32768; //!< Size of the data area
+    uint32_t headOffset = 0; //!< Offset of the oldest record
+    uint32_t headSeq = 1; //!< Sequence number of the oldest record
+    uint32_t tailOffset = 0; //!< Offset where the next record will be written
+    size_t count = 0; //!< Number of records in the ring, including removed records
+    size_t removedCount = 0; //!< Number of records after the head that were removed by removeEvent()
+    uint32_t generation = 0; //!< Generation of the last header written
+};
+
+/**
+ * @brief Events kept in a buffer in retained memory, shared by the queues of all priorities
+ * 
+ * Retained memory survives sleep and a reset but not a loss of power. Writing to it is
+ * as fast as writing to RAM and does not wear the flash. The buffer is circular, like the
+ * ring file: an event is added after the newest record, and removing an event sets a flag
+ * in its record. The space is reused once the records before it have been removed too.
+ * 
+ * A record is written before the offsets in the header are changed to include it, and the
+ * head and tail offsets are changed with one 32-bit write, so a reset at any point leaves a
+ * valid buffer. Each record also has a CRC. If the buffer is not valid at setup() (after a
+ * power loss) it's cleared, unless saveToFile() saved it before the power was removed.
+ */
+class PublishQueueRetainedStore {
+public:
+    /**
+     * @brief Use a buffer in retained memory and find the events saved in it
+     * 
+     * @param buffer Buffer declared with the retained keyword, at least MIN_SIZE bytes and aligned to 4 bytes
+     * @param size Size of the buffer in bytes, up to 65535
+     * @param numPriorities Number of priorities
+     * @param savePath File written by saveToFile(). If the buffer is not valid, for example after a power
+     * loss, it's loaded from this file. The file is then removed. NULL to not use a file.
+     * 
+     * @return The number of events found
+     */
+    size_t setup(void *buffer, size_t size, size_t numPriorities, const char *savePath = NULL);
+
+    /**
+     * @brief Returns true if setup() was called with a usable buffer
+     */
+    bool isValid() const { return hdr != NULL; };
+
+    /**
+     * @brief Add an event to the end of the buffer, with the identifier from getNextSeq(), which is incremented
+     * 
+     * @return false if there is not enough room
+     */
+    bool append(uint8_t priority, const PublishQueueEvent *event);
+
+    /**
+     * @brief Get the number of events of one priority
+     */
+    size_t getCount(uint8_t priority) const { return (priority < counts.size()) ? counts[priority] : 0; };
+
+    /**
+     * @brief Find an event of one priority
+     * 
+     * @param priority The priority
+     * @param index 0 for the oldest event of the priority, 1 for the next, and so on
+     * @param recordHdr Filled in with the record header
+     * 
+     * @return The offset of the record in the buffer, or 0 if there is no such event
+     */
+    size_t find(uint8_t priority, size_t index, PublishQueueRetainedRecordHeader &recordHdr) const;
+
+    /**
+     * @brief Find an event by its identifier
+     * 
+     * @return The offset of the record in the buffer, or 0 if there is no such event
+     */
+    size_t findSeq(uint8_t priority, uint32_t seq) const;
+
+    /**
+     * @brief Copy an event from the buffer
+     * 
+     * @param offset Offset of the record, from find() or findSeq()
+     * 
+     * You must free the result from this method using PublishQueuePosix::freeEvent() when you are done using it. 
+     * Returns NULL if the event pool is full.
+     */
+    PublishQueueEvent *readEvent(size_t offset) const;
+
+    /**
+     * @brief Remove an event from the buffer
+     * 
+     * @param offset Offset of the record, from find() or findSeq()
+     * 
+     * The record is flagged as removed, then the head is moved past the removed records at the front.
+     */
+    void remove(size_t offset);
+
+    /**
+     * @brief Write the whole buffer to a file, so setup() can load it after a loss of power
+     * 
+     * The file is removed again when an event is added or removed, because it no longer matches.
+     * 
+     * @return false if the file could not be written
+     */
+    bool saveToFile(const char *path);
+
+    /**
+     * @brief Get the identifier for the next event added
+     * 
+     * The identifiers are shared with the PublishQueueRetainedEngine objects, which also use them
+     * for events in flash, so a reference is returned.
+     */
+    uint32_t &getNextSeq() { return nextSeq; };
+
+    static const uint32_t RETAINED_MAGIC = 0x7e3a52d1; //!< Magic bytes in PublishQueueRetainedHeader
+    static const uint8_t RETAINED_VERSION = 1; //!< Version in PublishQueueRetainedHeader
+    static const size_t MIN_SIZE = 256; //!< Smallest allowed buffer size
+    static const uint8_t RECORD_FLAG_WRAP = 0x01; //!< Next record is at the beginning of the record area
+    static const uint8_t RECORD_FLAG_REMOVED = 0x02; //!< Record was removed
+
+protected:
+    /**
+     * @brief Returns true if the header is valid for the buffer passed to setup()
+     */
+    bool isHeaderValid() const;
+
+    /**
+     * @brief Read the record header at offset and check it, including the CRC
+     */
+    bool readRecordHeader(size_t offset, PublishQueueRetainedRecordHeader &recordHdr) const;
+
+    /**
+     * @brief Get the offset of the next record, following a wrap, or the tail offset if there are no more
+     */
+    size_t nextOffset(size_t offset) const;
+
+    /**
+     * @brief Offset of the oldest record, following a wrap, or the tail offset if the buffer is empty
+     */
+    size_t firstOffset() const { return nextOffset(getHead()); };
+
+    /**
+     * @brief Change the head and tail offsets with one write
+     */
+    void setHeadTail(size_t head, size_t tail) { hdr->headTail = (uint32_t)head | ((uint32_t)tail << 16); };
+
+    size_t getHead() const { return hdr->headTail & 0xffff; }; //!< Offset of the oldest record
+    size_t getTail() const { return hdr->headTail >> 16; }; //!< Offset after the newest record
+
+    /**
+     * @brief Called before the buffer is changed, to remove the file written by saveToFile()
+     */
+    void removeSavedFile();
+
+    /**
+     * @brief Total size of a record, including the header
+     */
+    static size_t recordSize(const PublishQueueRetainedRecordHeader &recordHdr) { return sizeof(PublishQueueRetainedRecordHeader) + recordHdr.length; };
+
+    PublishQueueRetainedHeader *hdr = NULL; //!< Beginning of the buffer passed to setup()
+    uint8_t *buf = NULL; //!< The buffer passed to setup(). Record offsets are from its beginning, so 0 is never a record.
+    size_t size = 0; //!< Size of buf
+    std::vector<size_t> counts; //!< Number of events of each priority
+    uint32_t nextSeq = 1; //!< Identifier for the next event
+    String savedPath; //!< Set by saveToFile() until the buffer is changed
+};
+
+/**
+ * @brief Storage engine that keeps events in retained memory and uses another engine when it's full
+ * 
+ * This is a storage engine for one priority. Events are written to the retained memory buffer
+ * if there is room and there are no events in the other engine (the flash engine). Otherwise 
+ * they're written to the flash engine. The events in retained memory are always older than
+ * the events in flash, so the queue is the events in retained memory followed by the events
+ * in flash.
+ * 
+ * Identifiers of events in flash are translated so all identifiers increase from the front of
+ * the queue to the back.
+ */
+class PublishQueueRetainedEngine : public PublishQueueStorageEngine {
+public:
+    /**
+     * @brief Set the retained memory buffer and the engine to use when it's full. Call before setup().
+     * 
+     * @param store The retained memory buffer, shared with the engines for the other priorities
+     * @param priority The priority of events stored by this engine
+     * @param flashEngine The engine for events that don't fit, which must already be set up
+     */
+    PublishQueueRetainedEngine &withStore(PublishQueueRetainedStore *store, uint8_t priority, PublishQueueStorageEngine *flashEngine);
+
+    virtual bool setup();
+    virtual bool writeEvent(const PublishQueueEvent *event);
+    virtual uint32_t getFrontId() { return getIdAt(0); };
+    virtual PublishQueueEvent *readFront() { uint32_t id; return readEvent(0, id); };
+    virtual PublishQueueEvent *readEvent(size_t index, uint32_t &id);
+    virtual uint32_t getIdAt(size_t index);
+    virtual void removeFront();
+    virtual bool removeEvent(uint32_t id);
+    virtual uint32_t getBackId();
+    virtual size_t getQueueLen() const { return store->getCount(priority) + flashEngine->getQueueLen(); };
+    virtual void removeAll();
+
+    /**
+     * @brief Get the number of events written to flash because retained memory was full, since setup() or resetCounters()
+     */
+    uint32_t getNumOverflows() const { return numOverflows; };
+
+    virtual void resetCounters() { PublishQueueStorageEngine::resetCounters(); numOverflows = 0; };
+
+protected:
+    /**
+     * @brief Start translating the identifiers of the events in the flash engine
+     * 
+     * Called when the first event is written to an empty flash engine, and at setup() if the flash
+     * engine has events. They get identifiers after every identifier used so far.
+     */
+    void startFlashIds();
+
+    /**
+     * @brief Returns true if id is for an event in the flash engine
+     */
+    bool isFlashId(uint32_t id) const { return flashEngine->getQueueLen() > 0 && id >= flashStartId; };
+
+    PublishQueueRetainedStore *store = NULL; //!< Set by withStore()
+    uint8_t priority = 0; //!< Set by withStore()
+    PublishQueueStorageEngine *flashEngine = NULL; //!< Set by withStore()
+    uint32_t flashIdOffset = 0; //!< Added to flash engine identifiers
+    uint32_t flashStartId = 0; //!< Lowest translated identifier of events in the flash engine
+    uint32_t numOverflows = 0; //!< Events written to the flash engine
 };
 
 /**
@@ -80,7 +691,7 @@ public:
      * 
      * @param size The maximum number of files to store (one event per file)
      * 
-     * If you exceed this number of events, the oldest event is discarded.
+     * If you exceed this number of events, the oldest event of the lowest priority is discarded.
      */
     PublishQueuePosix &withFileQueueSize(size_t size);
 
@@ -103,14 +714,258 @@ public:
      * 
      * You must call this as you cannot use the root directory as a queue!
      */
-    PublishQueuePosix &withDirPath(const char *dirPath) { fileQueue.withDirPath(dirPath); return *this; };
+    PublishQueuePosix &withDirPath(const char *dirPath) { getQueue(Priority::NORMAL).fileQueue.withDirPath(dirPath); return *this; };
 
     /**
      * @brief Gets the directory path set using withDirPath()
      * 
      * The returned path will not end with a slash.
      */
-    const char *getDirPath() const { return fileQueue.getDirPath(); };
+    const char *getDirPath() const { return queues[(size_t)Priority::NORMAL].fileQueue.getDirPath(); };
+
+    /**
+     * @brief How events that are not kept in RAM are stored, set using withStorageEngine()
+     */
+    enum class StorageEngine {
+        FILE_PER_EVENT,     //!< One file per event in the queue directory (default)
+        RING_FILE           //!< All events in one preallocated circular file in the queue directory
+    };
+
+    /**
+     * @brief Sets how events are stored on the flash file system. Must be called before setup().
+     * 
+     * @param engine StorageEngine::FILE_PER_EVENT (default) or StorageEngine::RING_FILE
+     * 
+     * With RING_FILE, events queued in files by FILE_PER_EVENT are moved into the ring file
+     * at setup(), so changing engines does not lose events.
+     */
+    PublishQueuePosix &withStorageEngine(StorageEngine engine) { storageEngineType = engine; return *this; };
+
+    /**
+     * @brief Gets the storage engine set using withStorageEngine()
+     */
+    StorageEngine getStorageEngine() const { return storageEngineType; };
+
+    /**
+     * @brief Sets the size of the ring file data area in bytes (default is 32768). Must be called before setup().
+     * 
+     * Only used with StorageEngine::RING_FILE. Each priority has its own ring file; this sets the
+     * size of all of them. Use withPriorityRingFileSize() after this to change one priority.
+     * 
+     * The file queue size limit set with withFileQueueSize() still applies; whichever limit is 
+     * reached first discards the oldest events.
+     */
+    PublishQueuePosix &withRingFileSize(size_t size);
+
+    /**
+     * @brief Keep events in a buffer in retained memory before writing them to the flash file system. Must be called before setup().
+     * 
+     * @param buffer A buffer declared with the retained keyword, at least PublishQueueRetainedStore::MIN_SIZE bytes and aligned to 4 bytes
+     * 
+     * @param size The size of the buffer in bytes
+     * 
+     * Events moved out of the RAM queue (when offline, when disconnecting, or before a reset) go to
+     * the buffer instead of the storage engine until it's full. Retained memory survives sleep and 
+     * a reset, so events queued between hourly connections usually never reach the flash. Only the
+     * events that don't fit are written to the storage engine. The buffer is shared by all priorities.
+     * 
+     * Retained memory does not survive a loss of power. Call writeAllToFiles() before removing power.
+     */
+    PublishQueuePosix &withRetainedBuffer(void *buffer, size_t size) { retainedBuffer = buffer; retainedBufferSize = size; return *this; };
+
+    /**
+     * @brief Priority of an event, passed to publish()
+     * 
+     * Events are sent highest priority first, and oldest first within a priority. When the file
+     * queue is full, the oldest event of the lowest priority is discarded first.
+     */
+    enum class Priority {
+        CRITICAL = 0,       //!< Sent first and discarded last, for data that must be delivered
+        ALERT,              //!< Alerts
+        NORMAL,             //!< Used by the publish() overloads without a priority
+        DIAGNOSTIC          //!< Debugging information, discarded first
+    };
+
+    static const size_t NUM_PRIORITIES = 4; //!< Number of values in Priority
+
+    static const size_t NUM_EVENT_POOL_CLASSES = 3; //!< Number of size classes in the event pool, see withEventPoolSize()
+
+    /**
+     * @brief Sets the maximum number of events of one priority in the file queue (default is 0, no limit)
+     * 
+     * @param priority The priority to limit
+     * 
+     * @param size The maximum number of events, or 0 for no limit other than withFileQueueSize()
+     * 
+     * If you exceed this number of events with this priority, the oldest one is discarded even
+     * if the file queue has room. This keeps a burst of less important events from using the
+     * space needed by other priorities.
+     */
+    PublishQueuePosix &withPriorityQueueSize(Priority priority, size_t size);
+
+    /**
+     * @brief Gets the limit set using withPriorityQueueSize()
+     */
+    size_t getPriorityQueueSize(Priority priority) const { return queues[(size_t)priority].maxFileEvents; };
+
+    /**
+     * @brief Sets the size of the ring file data area for one priority. Must be called before setup().
+     * 
+     * Only used with StorageEngine::RING_FILE. Call after withRingFileSize(), which sets all of them.
+     * Events with Priority::NORMAL use the ring file in the queue directory. The other priorities
+     * use a ring file in a subdirectory of the queue directory.
+     */
+    PublishQueuePosix &withPriorityRingFileSize(Priority priority, size_t size) { getQueue(priority).ringEngine.withDataSize(size); return *this; };
+
+    /**
+     * @brief Sends queued events with the same name together in one publish. Must be called before setup().
+     * 
+     * @param eventName The name of the events to combine
+     * 
+     * @param batchEventName The name of the event used to send them
+     * 
+     * When an event named eventName is at the front of the file queue, the events behind it with
+     * the same name and flags are sent with it as one event named batchEventName. The data is a
+     * JSON array of the event data in the order the events were published, for example 
+     * `[{"a":1},{"a":2}]`, limited to particle::protocol::MAX_EVENT_DATA_LENGTH. When the publish
+     * succeeds all of the events in it are removed from the queue.
+     * 
+     * Events are only combined when they come from the file queue, which is where they accumulate
+     * while offline. A single event is always sent unchanged as eventName, so the data of each
+     * event must be a JSON value (typically an object) and there must be a webhook for both
+     * names. Particle webhooks match event name prefixes, so batchEventName must not begin with
+     * eventName or the webhook for eventName would also be triggered by batches.
+     * 
+     * You can call this more than once to combine more than one event name.
+     */
+    PublishQueuePosix &withCoalesce(const char *eventName, const char *batchEventName);
+
+    /**
+     * @brief Sets the number of publishes that can be waiting for an acknowledgement at the same time (default: 1)
+     * 
+     * @param maxInFlight 1 to BackgroundPublishRK::MAX_IN_FLIGHT
+     * @return PublishQueuePosix& 
+     * 
+     * Must be called before setup(). With 1, each event is published after the previous one completes.
+     * With more, the next event is published 1 second after the previous one was started, without waiting
+     * for its acknowledgement, which sends a backlog faster when acknowledgements take a long time.
+     * Publishes can complete in any order; each event is removed from the queue when its own publish succeeds.
+     */
+    PublishQueuePosix &withMaxInFlight(size_t maxInFlight);
+
+    /**
+     * @brief Gets the number of publishes that can be waiting for an acknowledgement at the same time
+     */
+    size_t getMaxInFlight() const { return maxInFlight; };
+
+    /**
+     * @brief Sets the number of blocks in each size class of the event pool. Must be called before setup().
+     * 
+     * @param smallBlocks Blocks for events with up to 128 bytes of data (default: 8)
+     * 
+     * @param mediumBlocks Blocks for events with up to 384 bytes of data (default: 4)
+     * 
+     * @param largeBlocks Blocks for events with up to particle::protocol::MAX_EVENT_DATA_LENGTH bytes of data
+     * (default: BackgroundPublishRK::MAX_IN_FLIGHT + 1)
+     * 
+     * Events in the RAM queue, being published, or read from the file queue are stored in fixed-size blocks 
+     * allocated once by setup() instead of being allocated from the heap one at a time, so events of different 
+     * sizes do not fragment the heap. An event uses the smallest free block it fits in. 
+     * 
+     * If there is no free block for a new event, the RAM queue is written to the file queue to free its blocks. 
+     * publish() only fails if the blocks are all being published. The default number of large blocks is one more
+     * than the most publishes that can be in flight so this can't happen. Set all three to 0 to allocate each 
+     * event from the heap instead.
+     * 
+     * Use PublishQueueEventPool::instance().getStats() for the number of blocks in use, the high-water mark
+     * and allocation failures.
+     */
+    PublishQueuePosix &withEventPoolSize(size_t smallBlocks, size_t mediumBlocks, size_t largeBlocks);
+
+    /**
+     * @brief Adjusts the delays between publishes from their results. Must be called before setup().
+     * 
+     * @param enable true to adjust the delays (default: false, the fixed delays are used)
+     * 
+     * The delay from the start of one publish to the start of the next, normally 1 second, gets shorter after each
+     * publish that is acknowledged quickly and doubles after a failure or a slow acknowledgement. Starts are limited to
+     * the cloud rate limit of 1 per second on average with bursts of up to 4. The delay after connecting, normally 
+     * 2 seconds, gets shorter each time the first publish after connecting succeeds. After a failure, instead of
+     * waiting 30 seconds, the delay starts at 2 seconds and doubles for each consecutive failure up to 30 seconds,
+     * with random jitter. See PublishQueuePacing for the limits.
+     * 
+     * With withMaxInFlight(1), an event is published as soon as the previous one is acknowledged, if the interval
+     * has passed, rather than 1 second after it's acknowledged.
+     */
+    PublishQueuePosix &withAdaptivePacing(bool enable = true) { adaptivePacing = enable; return *this; };
+
+    /**
+     * @brief Returns true if withAdaptivePacing() is enabled
+     */
+    bool getAdaptivePacing() const { return adaptivePacing; };
+
+    /**
+     * @brief Gets the current delays and the percentiles of recent acknowledgement times
+     * 
+     * The delays are only adjusted if withAdaptivePacing() is enabled, but the acknowledgement times are always measured.
+     */
+    PublishQueuePacing::Stats getPacingStats();
+
+    static const size_t NUM_LATENCY_BUCKETS = 7; //!< Number of entries in Metrics::latency
+
+    /**
+     * @brief Counters for the queue, returned by getMetrics()
+     * 
+     * The counts are since setup() or resetMetrics() and are kept in RAM, so they start over after a reset.
+     */
+    struct Metrics {
+        uint32_t latency[NUM_LATENCY_BUCKETS]; //!< Events acknowledged, by the time from publish() to the acknowledgement: under 10 seconds, 1 minute, 10 minutes, 1 hour, 6 hours, 24 hours, and longer
+        uint32_t maxLatencySec; //!< Longest time from publish() to acknowledgement in seconds
+        uint32_t eventsSent; //!< Events acknowledged, counting each event combined by withCoalesce()
+        uint32_t publishFailures; //!< Publishes that failed and will be retried
+        uint32_t maxDepth; //!< Most events queued at once, in RAM, in files and being published
+        uint32_t evictedQueueFull; //!< Events discarded because the file queue had withFileQueueSize() events
+        uint32_t evictedPriorityLimit; //!< Events discarded because their priority had withPriorityQueueSize() events
+        uint32_t evictedRingFull; //!< Events discarded because the ring file was full
+        uint32_t evictedCorrupted; //!< Events discarded because they failed the size or CRC checks, or were after a corrupted record
+        uint32_t evictedSuperseded; //!< Events removed by a newer event with the same supersede key
+        uint32_t evictedPoolFull; //!< Events not queued because every event pool block was being published
+        uint32_t evictedWriteFailed; //!< Events lost because writing them to the flash file system failed
+        uint32_t ramToFileSpills; //!< Events moved from the RAM queue to the file queue, or to the withRetainedBuffer() buffer
+        uint32_t retainedOverflows; //!< Events written to the flash file system because the withRetainedBuffer() buffer was full
+        uint32_t fileBytesWritten; //!< Bytes written to the flash file system by the storage engines
+        uint32_t fileBytesRead; //!< Bytes read from the flash file system by the storage engines
+    };
+
+    /**
+     * @brief Gets a copy of the queue counters
+     * 
+     * The latency is only measured for events published while the time is valid, and for events that have 
+     * been in the file queue, only the most recent MAX_ENQUEUE_TIMES events published.
+     */
+    Metrics getMetrics();
+
+    /**
+     * @brief Set the queue counters to 0
+     * 
+     * maxDepth is set to the current number of events.
+     */
+    void resetMetrics();
+
+    /**
+     * @brief Allocate an event from the event pool
+     * 
+     * @param dataLen The length of the event data, not including the null terminator
+     * 
+     * @return The event, or NULL if out of memory or dataLen is larger than particle::protocol::MAX_EVENT_DATA_LENGTH.
+     * Free it using freeEvent().
+     */
+    static PublishQueueEvent *allocEvent(size_t dataLen);
+
+    /**
+     * @brief Free an event returned by allocEvent(), newRamEvent() or a storage engine. NULL is ignored.
+     */
+    static void freeEvent(PublishQueueEvent *event) { PublishQueueEventPool::instance().free(event); };
 
     /**
      * @brief Adds a callback function to call with publish is complete
@@ -127,12 +982,33 @@ public:
      * - eventName: The original event name that was published (a copy of it, not the original pointer)
      * - eventData: The original event data
      * 
+     * eventName and eventData are only valid until the callback returns.
+     * 
+     * For events combined by withCoalesce() the callback is called once with the batch event name and data.
+     * 
      * Note that this callback will be called from the background thread used for publishing. You should not
      * perform any lengthy operations and you should avoid using large amounts of stack space during this
      * callback. 
      */
     PublishQueuePosix &withPublishCompleteUserCallback(std::function<void(bool succeeded, const char *eventName, const char *eventData)> cb) { publishCompleteUserCallback = cb; return *this; };
 
+    /**
+     * @brief Adds a callback function to call when the queue has drained
+     * 
+     * @param cb Callback function or C++ lambda.
+     * @return PublishQueuePosix& 
+     * 
+     * The callback has this prototype: void callback()
+     * 
+     * It's called once each time the queue goes from having events queued or being published to empty
+     * with all publishes acknowledged, which is a good time to disconnect from the cloud and sleep. It's
+     * also called when the queues are emptied by clearQueues().
+     * 
+     * Unlike withPublishCompleteUserCallback() this is called from loop(), so it's safe to change your
+     * state machine from the callback.
+     */
+    PublishQueuePosix &withQueueDrainedCallback(std::function<void()> cb) { queueDrainedCallback = cb; return *this; };
+
 
     /**
      * @brief You must call this from setup() to initialize this library
@@ -206,6 +1082,52 @@ public:
 		return publishCommon(eventName, data, ttl, flags1, flags2);
 	}
 
+	/**
+	 * @brief Overload for publishing an event with a priority
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
+	 *
+	 * @param priority Events with a higher priority are sent first and discarded last. The other
+	 * overloads use Priority::NORMAL.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 */
+	inline bool publish(const char *eventName, const char *data, Priority priority, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, data, 60, flags1, flags2, priority);
+	}
+
+	/**
+	 * @brief Overload for publishing an event that replaces an earlier event that has not been sent yet
+	 *
+	 * @param eventName The name of the event (63 character maximum).
+	 *
+	 * @param data The event data (255 bytes maximum, 622 bytes in system firmware 0.8.0-rc.4 and later).
+	 *
+	 * @param priority Events with a higher priority are sent first and discarded last. 
+	 *
+	 * @param supersedeKey If an event published with the same key is still in the RAM or file queue,
+	 * it's removed, so only the newest event with this key is sent. The key is usually the event name 
+	 * for events where only the latest value matters, such as configuration or status.
+	 *
+	 * @param flags1 Normally PRIVATE. You can also use PUBLIC, but one or the other must be specified.
+	 *
+	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
+	 *
+	 * @return true if the event was queued or false if it was not.
+	 *
+	 * An event that is being sent when the new one is published is not removed. The keys are kept in
+	 * RAM, so events queued before a reset are not replaced.
+	 */
+	inline bool publish(const char *eventName, const char *data, Priority priority, const char *supersedeKey, PublishFlags flags1, PublishFlags flags2 = PublishFlags()) {
+		return publishCommon(eventName, data, 60, flags1, flags2, priority, supersedeKey);
+	}
+
 	/**
 	 * @brief Common publish function. All other overloads lead here. This is a pure virtual function, implemented in subclasses.
 	 *
@@ -221,18 +1143,33 @@ public:
 	 *
 	 * @param flags2 (optional) You can use NO_ACK or WITH_ACK if desired.
 	 *
+	 * @param priority (optional) The priority of the event, default is Priority::NORMAL.
+	 *
+	 * @param supersedeKey (optional) Replace the queued event published with this key, default is NULL.
+	 *
 	 * @return true if the event was queued or false if it was not.
 	 *
 	 * This function almost always returns true. If you queue more events than fit in the buffer the
 	 * oldest (sometimes second oldest) is discarded.
 	 */
-	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags());
+	virtual bool publishCommon(const char *eventName, const char *data, int ttl, PublishFlags flags1, PublishFlags flags2 = PublishFlags(), Priority priority = Priority::NORMAL, const char *supersedeKey = NULL);
 
     /**
      * @brief If there are events in the RAM queue, write them to files in the flash file system
      */
     void writeQueueToFiles();
 
+    /**
+     * @brief Write the RAM queue and the withRetainedBuffer() buffer to the flash file system
+     * 
+     * Call before removing power, for example before deep power down using an external RTC, so the
+     * events are not lost. The RAM queue is written to the storage engine, and the retained memory
+     * buffer is copied as it is to retained.dat in the queue directory, which setup() loads back into
+     * the buffer if retained memory was lost. Event identifiers don't change, so it's safe to call
+     * while events are being published.
+     */
+    void writeAllToFiles();
+
     /**
      * @brief Empty both the RAM and file based queues. Any queued events are discarded. 
      */
@@ -266,6 +1203,19 @@ public:
      */
     bool getCanSleep() const { return canSleep; };
 
+    /**
+     * @brief Estimate how long until all queued events are published and acknowledged
+     * 
+     * @return Milliseconds, or 0 if nothing is queued or being published
+     * 
+     * The estimate is from the number of events queued, the delays between publishes (the adaptive
+     * delays if withAdaptivePacing() is used), the cloud rate limit, withMaxInFlight(), and the median
+     * acknowledgement time of recent publishes. If not connected to the cloud, it's the time from when
+     * the connection is made. Events combined by withCoalesce() are counted separately, so then it's
+     * an upper bound. Failures are not predicted.
+     */
+    unsigned long getDrainEstimateMs();
+
     /**
      * @brief Gets the total number of events queued
      * 
@@ -277,10 +1227,18 @@ public:
      */
     size_t getNumEvents();
 
+    /**
+     * @brief Gets the number of events queued with one priority
+     * 
+     * If an event with this priority is currently being sent, the result includes this event.
+     */
+    size_t getNumEvents(Priority priority);
+
     /**
      * @brief Check the queue limit, discarding events as necessary
      * 
-     * When the RAM queue exceeds the limit, all events are moved into files. 
+     * When the RAM queue exceeds the limit, all events are moved into files. When the file
+     * queue exceeds a limit, the oldest events of the lowest priority are discarded.
      */
     void checkQueueLimits();
     
@@ -310,7 +1268,22 @@ public:
     /**
      * @brief Version of the file header for events
      */
-    static const uint8_t FILE_VERSION = 1;
+    static const uint8_t FILE_VERSION = 2;
+
+    /**
+     * @brief Size of the file header in version 1 files, which have no CRC
+     */
+    static const uint8_t FILE_HEADER_SIZE_V1 = 8;
+
+    /**
+     * @brief Most events in the queue whose publish time is kept for Metrics::latency (12 bytes of RAM each)
+     */
+    static const size_t MAX_ENQUEUE_TIMES = 64;
+
+    /**
+     * @brief Acknowledgement time used by getDrainEstimateMs() before any have been measured
+     */
+    static const unsigned long DRAIN_ESTIMATE_ACK_MS = 2000;
 
 protected:
     /**
@@ -346,25 +1319,61 @@ protected:
      * 
      * May return NULL if eventName or eventData are invalid (too long) or out of memory.
      * 
-     * You must delete the result from this method when you are done using it. 
+     * You must free the result from this method using freeEvent() when you are done using it. 
      */
     PublishQueueEvent *newRamEvent(const char *eventName, const char *eventData, PublishFlags flags);
 
     /**
-     * @brief Read an event from a sequentially numbered file 
+     * @brief A publish that has been started and not yet handled by completePublishes()
+     */
+    struct InFlightPublish {
+        PublishQueueEvent *event; //!< The event being published, freed when complete
+        Priority priority; //!< Priority of the event
+        uint32_t storageId; //!< Storage engine identifier of the event (0 if from RAM queue)
+        uint32_t storageLastId; //!< Storage engine identifier of the last event combined into event (same as storageId if not combined)
+        bool cleared; //!< clearQueues() was called, so the event is not removed from or returned to the queue
+        volatile bool complete; //!< Set from the publish thread when the publish completes
+        volatile bool succeeded; //!< Set from the publish thread when the publish completes
+        bool inUse; //!< This entry in inFlightSlots is in inFlight
+        unsigned long startMs; //!< millis() value when the publish was started
+        bool firstAfterConnect; //!< First publish after connecting to the cloud
+    };
+
+    /**
+     * @brief Get the next event to publish, highest priority first, skipping events that are already in flight
      * 
-     * @param fileNum The file number to read 
+     * @return A free entry in inFlightSlots, or NULL if there are no events to publish or out of memory. Call with the mutex locked.
+     */
+    InFlightPublish *nextPublish();
+
+    /**
+     * @brief Returns true if the event with storageId in the file queue for priority is being published
+     */
+    bool isInFlight(Priority priority, uint32_t storageId) const;
+
+    /**
+     * @brief Remove the events for publishes that succeeded, and return the events for publishes that failed to the queue
+     * 
+     * @return true if a publish failed. stateTime and durationMs are set to wait waitAfterFailure.
+     */
+    bool completePublishes();
+
+    /**
+     * @brief Combine events behind publish->event in the file queue into one event, if configured by withCoalesce()
+     * 
+     * @param publish The event read from the file queue. If events are combined, publish->event is replaced 
+     * by an event allocated from the large blocks of the event pool and publish->storageLastId is set to the identifier of the last event included.
      * 
-     * May return NULL if file does not exist, or out of memory.
+     * @param storageEngine The storage engine it was read from
      * 
-     * You must delete the result from this method when you are done using it. 
+     * @param index The index of publish->event in the queue
      */
-    PublishQueueEvent *readQueueFile(int fileNum);
+    void coalesceEvents(InFlightPublish *publish, PublishQueueStorageEngine *storageEngine, size_t index);
 
     /**
      * @brief Callback for BackgroundPublishRK library
      */
-    void publishCompleteCallback(bool succeeded, const char *eventName, const char *eventData);
+    void publishCompleteCallback(InFlightPublish *publish, bool succeeded, const char *eventName, const char *eventData);
 
     /**
      * @brief State handler for waiting to connect to the Particle cloud
@@ -377,45 +1386,173 @@ protected:
      * @brief State handler for waiting to publish
      * 
      * stateTime and durationMs determine whether to stay in this state waiting, or whether
-     * to publish and go into statePublishWait.
+     * to publish. After publishing, goes into statePublishWait if maxInFlight publishes are in progress.
      * 
      * Next state: statePublishWait or stateConnectWait
      */
     void stateWait();
 
     /**
-     * @brief State handler for waiting for publish to complete
+     * @brief State handler for waiting for a publish to complete when maxInFlight publishes are in progress
      * 
      * Next state: stateWait
      */
     void statePublishWait();
 
     /**
-     * @brief SequentialFileRK library object for maintaining the queue of files on the POSIX file system
+     * @brief The RAM queue and file queue for one priority
+     */
+    struct PriorityQueue {
+        PriorityQueue() : fileEngine(fileQueue), ringEngine(fileQueue) {};
+
+        SequentialFile fileQueue; //!< SequentialFileRK library object for the directory of events with this priority
+        PublishQueueFileEngine fileEngine; //!< Storage engine for StorageEngine::FILE_PER_EVENT
+        PublishQueueRingFileEngine ringEngine; //!< Storage engine for StorageEngine::RING_FILE
+        PublishQueueRetainedEngine retainedEngine; //!< In front of fileEngine or ringEngine if withRetainedBuffer() is used
+        PublishQueueStorageEngine *storageEngine = &fileEngine; //!< The storage engine in use
+        std::vector<PublishQueueEvent*> ramQueue; //!< Queue in RAM, oldest first. A vector so its storage is reused.
+        size_t maxFileEvents = 0; //!< Set using withPriorityQueueSize(), 0 for no limit
+    };
+
+    /**
+     * @brief Gets the queues for a priority
+     */
+    PriorityQueue &getQueue(Priority priority) { return queues[(size_t)priority]; };
+
+    /**
+     * @brief Gets the number of events in the RAM queues of all priorities
+     */
+    size_t getRamQueueLen() const;
+
+    /**
+     * @brief Gets the number of events in the file queues of all priorities. This does not access the file system.
+     */
+    size_t getFileQueueLen() const;
+
+    /**
+     * @brief Gets the number of events in the RAM and file queues, and from the RAM queue being published
+     * 
+     * Unlike getNumEvents() this includes the file queue when the RAM queue is not empty. Call with the mutex locked.
+     */
+    size_t getTotalQueueLen() const;
+
+    PriorityQueue queues[NUM_PRIORITIES]; //!< Queues, indexed by Priority
+
+    /**
+     * @brief Remove the queued event published with supersedeKey, unless it's being sent
+     */
+    void removeSuperseded(const char *supersedeKey);
+
+    /**
+     * @brief Update the supersede entry for an event that was in the RAM queue
+     * 
+     * @param event The event that was moved or sent
+     * 
+     * @param storageId The storage engine identifier if it was moved to the file queue, or 0 if it's no longer queued
+     */
+    void updateSuperseded(const PublishQueueEvent *event, uint32_t storageId);
+
+    /**
+     * @brief Update the enqueue time entry for an event that was in the RAM queue, like updateSuperseded()
+     */
+    void updateEnqueueTime(const PublishQueueEvent *event, uint32_t storageId);
+
+    /**
+     * @brief Add the time from publish() to now to Metrics::latency for an event that was acknowledged
+     * 
+     * @param enqueueTime Time.now() when the event was published
+     */
+    void recordLatency(uint32_t enqueueTime);
+
+    /**
+     * @brief Update maxDepth in metrics from the number of events queued
+     */
+    void updateMaxDepth();
+
+    /**
+     * @brief Write the SequentialFile index of each priority's queue directory if it has changed
+     * 
+     * Called from loop() when the queue is idle and before reset or disconnect, so a burst of events
+     * does not rewrite the index for every file added or removed.
+     */
+    void flushIndexes();
+
+    /**
+     * @brief An event in the queue that was published with a supersede key
+     */
+    struct SupersedeEntry {
+        String key; //!< Key passed to publish()
+        Priority priority; //!< Priority the event was published with
+        const PublishQueueEvent *ramEvent; //!< The event if it's in the RAM queue, otherwise NULL
+        uint32_t storageId; //!< Storage engine identifier if it's in the file queue
+    };
+    std::vector<SupersedeEntry> supersedeEntries; //!< Events published with a supersede key, one per key
+
+    /**
+     * @brief The time an event in the queue was published, used for Metrics::latency
+     */
+    struct EnqueueTime {
+        Priority priority; //!< Priority the event was published with
+        const PublishQueueEvent *ramEvent; //!< The event if it's in the RAM queue, otherwise NULL
+        uint32_t storageId; //!< Storage engine identifier if it's in the file queue
+        uint32_t time; //!< Time.now() when it was published
+    };
+    std::vector<EnqueueTime> enqueueTimes; //!< Events in the queue published while the time was valid, oldest first
+
+    /**
+     * @brief Find the enqueue time entry for an event in the RAM queue (ramEvent not NULL) or the file queue
+     */
+    std::vector<EnqueueTime>::iterator findEnqueueTime(Priority priority, const PublishQueueEvent *ramEvent, uint32_t storageId);
+
+    /**
+     * @brief Add the enqueue time entry for an event just added to the RAM queue, if the time is valid
+     */
+    void addEnqueueTime(Priority priority, const PublishQueueEvent *event);
+    Metrics metrics = {}; //!< Counters returned by getMetrics()
+    StorageEngine storageEngineType = StorageEngine::FILE_PER_EVENT; //!< Set by withStorageEngine()
+    void *retainedBuffer = NULL; //!< Set by withRetainedBuffer()
+    size_t retainedBufferSize = 0; //!< Set by withRetainedBuffer()
+    PublishQueueRetainedStore retainedStore; //!< Events in retainedBuffer
+
+    /**
+     * @brief Path of the copy of the retained memory buffer written by writeAllToFiles()
+     */
+    String getRetainedFilePath() const { return String(getDirPath()) + "/retained.dat"; };
+
+    /**
+     * @brief Event names set using withCoalesce()
      */
-    SequentialFile fileQueue;
+    struct CoalesceRule {
+        String eventName; //!< Name of the events to combine
+        String batchEventName; //!< Name of the event they are sent as
+    };
+    std::vector<CoalesceRule> coalesceRules; //!< Set using withCoalesce()
 
 
     size_t ramQueueSize = 2; //!< size of the queue in RAM
-    size_t fileQueueSize = 100; //!< size of the queue on the flash file system
+    size_t fileQueueSize = 100; //!< size of the queue on the flash file system, all priorities
 
     os_mutex_recursive_t mutex; //!< mutex for protecting the queue
-    std::deque<PublishQueueEvent*> ramQueue; //!< Queue in RAM
 
-    PublishQueueEvent *curEvent = 0; //!< Current event being published
-    int curFileNum = 0; //!< Current file number being published (0 if from RAM queue)
+    std::vector<InFlightPublish *> inFlight; //!< Publishes in progress, oldest first. Points into inFlightSlots.
+    InFlightPublish inFlightSlots[BackgroundPublishRK::MAX_IN_FLIGHT] = {}; //!< Storage for inFlight
+    size_t maxInFlight = 1; //!< Set using withMaxInFlight()
+    size_t eventPoolBlocks[NUM_EVENT_POOL_CLASSES] = { 8, 4, BackgroundPublishRK::MAX_IN_FLIGHT + 1 }; //!< Set using withEventPoolSize()
     unsigned long stateTime = 0; //!< millis() value when entering the state, used for stateWait
     unsigned long durationMs = 0; //!< how long to wait before publishing in milliseconds, used in stateWait
-    bool publishComplete = false; //!< true if the publish has completed (successfully or not)
-    bool publishSuccess = false; //!< true if the publish succeeded
     bool pausePublishing = false; //!< flag to pause publishing (used from automated test)
+    bool adaptivePacing = false; //!< Set using withAdaptivePacing()
+    PublishQueuePacing pacing; //!< Delays used when adaptivePacing is true, and acknowledgement times
+    bool firstAfterConnect = false; //!< The next publish is the first since connecting
     bool canSleep = false; //!< returns true if this is a good time to go to sleep
+    bool drained = true; //!< Queue was empty with no publishes in flight at the last loop(), for queueDrainedCallback
 
     unsigned long waitAfterConnect = 2000; //!< time to wait after Particle.connected() before publishing
     unsigned long waitBetweenPublish = 1000; //!< how long to wait in milliseconds between publishes
     unsigned long waitAfterFailure = 30000; //!< how long to wait after failing to publish before trying again
 
     std::function<void(bool succeeded, const char *eventName, const char *eventData)> publishCompleteUserCallback = 0; //!< User callback for publish complete
+    std::function<void()> queueDrainedCallback = 0; //!< Set using withQueueDrainedCallback()
 
     std::function<void(PublishQueuePosix&)> stateHandler = 0; //!< state handler (stateConnectWait, stateWait, etc).
 
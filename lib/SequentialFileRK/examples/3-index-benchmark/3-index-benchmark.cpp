@@ -0,0 +1,76 @@
+#include "SequentialFileRK.h"
+
+#include <fcntl.h>
+
+// Measures scanDir() time with and without the index for several queue depths.
+// Results are printed to USB serial, for example:
+//   depth=200 scan=412345 us index=8123 us
+
+SerialLogHandler logHandler(LOG_LEVEL_INFO);
+
+SYSTEM_THREAD(ENABLED);
+SYSTEM_MODE(MANUAL);
+
+const char *benchDirPath = "/usr/seqbench";
+const int depths[] = { 0, 25, 50, 100, 200 };
+const int runsPerDepth = 3;
+
+void fillQueue(int depth) {
+    SequentialFile queue;
+    queue.withDirPath(benchDirPath).withIndex();
+    queue.removeAll(false);
+    queue.scanDir();
+
+    for(int ii = 0; ii < depth; ii++) {
+        int fileNum = queue.reserveFile();
+        int fd = open(queue.getPathForFileNum(fileNum), O_RDWR | O_CREAT | O_TRUNC);
+        if (fd >= 0) {
+            // About the size of a queued event
+            char buf[200];
+            memset(buf, 'x', sizeof(buf));
+            write(fd, buf, sizeof(buf));
+            close(fd);
+        }
+        queue.addFileToQueue(fileNum);
+    }
+    queue.flushIndex();
+}
+
+uint32_t timeScan(bool useIndex, int depth) {
+    SequentialFile queue;
+    queue.withDirPath(benchDirPath).withIndex(useIndex);
+
+    uint32_t start = micros();
+    queue.scanDir();
+    uint32_t elapsed = micros() - start;
+
+    if (queue.getQueueLen() != depth || queue.getLoadedFromIndex() != useIndex) {
+        Log.error("unexpected result depth=%d queueLen=%d loadedFromIndex=%d", depth, queue.getQueueLen(), queue.getLoadedFromIndex());
+    }
+    return elapsed;
+}
+
+void setup() {
+    // Wait for a USB serial connection for up to 10 seconds
+    waitFor(Serial.isConnected, 10000);
+    delay(1000);
+
+    for(size_t ii = 0; ii < sizeof(depths) / sizeof(depths[0]); ii++) {
+        int depth = depths[ii];
+        fillQueue(depth);
+
+        uint32_t scanTotal = 0, indexTotal = 0;
+        for(int run = 0; run < runsPerDepth; run++) {
+            scanTotal += timeScan(false, depth);
+            indexTotal += timeScan(true, depth);
+        }
+        Log.info("depth=%d scan=%lu us index=%lu us", depth, scanTotal / runsPerDepth, indexTotal / runsPerDepth);
+    }
+
+    SequentialFile queue;
+    queue.withDirPath(benchDirPath).removeAll(true);
+    Log.info("done");
+}
+
+void loop() {
+}
@@ -1,5 +1,6 @@
 #include "SequentialFileRK.h"
 
+#include <algorithm>
 #include <dirent.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -7,6 +8,21 @@
 
 static Logger _log("app.seqfile");
 
+const char *SequentialFile::INDEX_NAME = "seqfile.idx";
+
+// CRC-32 (IEEE 802.3), bitwise so it does not need a table in RAM or flash
+static uint32_t indexCrc32(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    for(size_t ii = 0; ii < len; ii++) {
+        crc ^= p[ii];
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
 
 SequentialFile::SequentialFile() {
 
@@ -36,6 +52,13 @@ bool SequentialFile::scanDir(void) {
         return false;
     }
 
+    loadedFromIndex = false;
+    if (indexEnabled && readIndex()) {
+        loadedFromIndex = true;
+        scanDirCompleted = true;
+        return true;
+    }
+
     _log.trace("scanning %s with pattern %s", dirPath.c_str(), pattern.c_str());
 
     DIR *dir = opendir(dirPath);
@@ -51,8 +74,8 @@ bool SequentialFile::scanDir(void) {
             break;
         }
         
-        if (ent->d_type != DT_REG) {
-            // Not a plain file
+        if (ent->d_type != DT_REG || strcmp(ent->d_name, INDEX_NAME) == 0) {
+            // Not a plain file, or the index
             continue;
         }
         
@@ -74,8 +97,19 @@ bool SequentialFile::scanDir(void) {
         }
     }
     closedir(dir);
+
+    // readdir() order depends on the file system, and the queue is oldest first
+    queueMutexLock();
+    std::sort(queue.begin(), queue.end());
+    queueMutexUnlock();
     
     scanDirCompleted = true;
+
+    if (indexEnabled) {
+        queueMutexLock();
+        writeIndex();
+        queueMutexUnlock();
+    }
     return true;
 }
 
@@ -97,6 +131,7 @@ void SequentialFile::addFileToQueue(int fileNum) {
 
     queueMutexLock();
     queue.push_back(fileNum); 
+    markIndexDirty();
     queueMutexUnlock();
 }
  
@@ -112,6 +147,7 @@ int SequentialFile::getFileFromQueue(bool remove) {
         fileNum = queue.front();
         if (remove) {
             queue.pop_front();
+            markIndexDirty();
         }
     }
     queueMutexUnlock();
@@ -123,6 +159,42 @@ int SequentialFile::getFileFromQueue(bool remove) {
     return fileNum;
 }
 
+int SequentialFile::getFileFromQueueAt(size_t index) {
+    int fileNum = 0;
+
+    if (!scanDirCompleted) {
+        scanDir();
+    }
+
+    queueMutexLock();
+    if (index < queue.size()) {
+        fileNum = queue[index];
+    }
+    queueMutexUnlock();
+
+    return fileNum;
+}
+
+bool SequentialFile::removeFileFromQueue(int fileNum) {
+    bool found = false;
+
+    if (!scanDirCompleted) {
+        scanDir();
+    }
+
+    queueMutexLock();
+    for(auto it = queue.begin(); it != queue.end(); it++) {
+        if (*it == fileNum) {
+            queue.erase(it);
+            markIndexDirty();
+            found = true;
+            break;
+        }
+    }
+    queueMutexUnlock();
+
+    return found;
+}
 
 String SequentialFile::getNameForFileNum(int fileNum, const char *overrideExt) {
     String name = String::format(pattern.c_str(), fileNum);
@@ -205,6 +277,7 @@ void SequentialFile::removeAll(bool removeDir) {
     }
     lastFileNum = 0;
     scanDirCompleted = false;
+    indexDirty = false;
 
     queueMutexUnlock();
 }
@@ -218,6 +291,157 @@ int SequentialFile::getQueueLen() const {
 }
 
 
+bool SequentialFile::readIndex() {
+    String path = dirPath + String("/") + INDEX_NAME;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    SequentialFileIndexHeader hdr;
+    uint8_t *bitmap = NULL;
+    bool valid = false;
+
+    if (read(fd, &hdr, sizeof(hdr)) == (int)sizeof(hdr) &&
+        hdr.magic == INDEX_MAGIC &&
+        hdr.version == INDEX_VERSION &&
+        hdr.headerSize == sizeof(SequentialFileIndexHeader) &&
+        hdr.nameHash == getNameHash() &&
+        hdr.bitmapBytes <= (MAX_INDEX_SPAN + 7) / 8) {
+
+        bitmap = new uint8_t[hdr.bitmapBytes + 1];
+        if (bitmap && read(fd, bitmap, hdr.bitmapBytes) == (int)hdr.bitmapBytes) {
+            uint32_t savedCrc = hdr.crc;
+            hdr.crc = 0;
+            uint32_t crc = indexCrc32(0, &hdr, sizeof(hdr));
+            valid = (savedCrc == indexCrc32(crc, bitmap, hdr.bitmapBytes));
+        }
+    }
+    close(fd);
+
+    std::deque<int> files;
+    if (valid) {
+        for(int bit = 0; bit < hdr.bitmapBytes * 8; bit++) {
+            if (bitmap[bit / 8] & (1 << (bit % 8))) {
+                files.push_back(hdr.firstFileNum + bit);
+            }
+        }
+        valid = (files.size() == hdr.count) && (files.empty() || files.back() <= hdr.lastFileNum);
+    }
+    delete[] bitmap;
+
+    // Check the ends of the queue against the directory. This catches files added or removed
+    // without updating the index, such as by a reset between writing a file and the index.
+    if (valid) {
+        if (!files.empty()) {
+            valid = fileNumExists(files.front()) && fileNumExists(files.back()) && !fileNumExists(files.front() - 1);
+        }
+        else {
+            valid = !fileNumExists(hdr.lastFileNum);
+        }
+        valid = valid && !fileNumExists(hdr.lastFileNum + 1);
+    }
+
+    if (!valid) {
+        _log.info("index not valid, scanning %s", dirPath.c_str());
+        return false;
+    }
+
+    queueMutexLock();
+    for(auto it = files.begin(); it != files.end(); it++) {
+        queue.push_back(*it);
+    }
+    lastFileNum = hdr.lastFileNum;
+    indexDirty = false;
+    queueMutexUnlock();
+
+    _log.trace("loaded %d files from index", (int)files.size());
+    return true;
+}
+
+void SequentialFile::flushIndex() {
+    queueMutexLock();
+    if (indexDirty) {
+        writeIndex();
+    }
+    queueMutexUnlock();
+}
+
+void SequentialFile::markIndexDirty() {
+    if (!indexEnabled || !scanDirCompleted || indexDirty) {
+        return;
+    }
+
+    // Remove the index on the first change after it was written, so a reset before flushIndex()
+    // scans the directory instead of loading a queue that is out of date
+    String path = dirPath + String("/") + INDEX_NAME;
+    unlink(path);
+    indexDirty = true;
+}
+
+void SequentialFile::writeIndex() {
+    if (!indexEnabled || !scanDirCompleted) {
+        return;
+    }
+
+    String path = dirPath + String("/") + INDEX_NAME;
+    indexDirty = false;
+
+    // The bitmap can only represent a queue in increasing order over a limited range
+    bool usable = queue.empty() || (queue.back() - queue.front() < MAX_INDEX_SPAN);
+    for(size_t ii = 1; usable && ii < queue.size(); ii++) {
+        if (queue[ii] <= queue[ii - 1]) {
+            usable = false;
+        }
+    }
+    if (!usable) {
+        unlink(path);
+        return;
+    }
+
+    SequentialFileIndexHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = INDEX_MAGIC;
+    hdr.version = INDEX_VERSION;
+    hdr.headerSize = sizeof(SequentialFileIndexHeader);
+    hdr.nameHash = getNameHash();
+    hdr.firstFileNum = queue.empty() ? 0 : queue.front();
+    hdr.lastFileNum = lastFileNum;
+    hdr.count = queue.size();
+    hdr.bitmapBytes = queue.empty() ? 0 : (queue.back() - queue.front() + 8) / 8;
+
+    uint8_t *bitmap = new uint8_t[hdr.bitmapBytes + 1];
+    if (!bitmap) {
+        unlink(path);
+        return;
+    }
+    memset(bitmap, 0, hdr.bitmapBytes);
+    for(auto it = queue.begin(); it != queue.end(); it++) {
+        int bit = *it - hdr.firstFileNum;
+        bitmap[bit / 8] |= (1 << (bit % 8));
+    }
+    hdr.crc = indexCrc32(indexCrc32(0, &hdr, sizeof(hdr)), bitmap, hdr.bitmapBytes);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC);
+    if (fd >= 0) {
+        write(fd, &hdr, sizeof(hdr));
+        write(fd, bitmap, hdr.bitmapBytes);
+        close(fd);
+    }
+    delete[] bitmap;
+}
+
+bool SequentialFile::fileNumExists(int fileNum) {
+    struct stat sb;
+    return stat(getPathForFileNum(fileNum), &sb) == 0;
+}
+
+uint32_t SequentialFile::getNameHash() const {
+    uint32_t hash = indexCrc32(0, pattern.c_str(), pattern.length() + 1);
+    return indexCrc32(hash, filenameExtension.c_str(), filenameExtension.length());
+}
+
 void SequentialFile::queueMutexLock() const {
     if (!queueMutex) {
         os_mutex_create(&queueMutex);
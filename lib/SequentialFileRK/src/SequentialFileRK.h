@@ -5,6 +5,24 @@
 
 #include <deque>
 
+/**
+ * @brief Header of the index file written when withIndex() is enabled
+ * 
+ * The header is followed by a bitmap of bitmapBytes bytes. Bit n (LSB first) is set if
+ * file number firstFileNum + n is in the queue.
+ */
+struct SequentialFileIndexHeader {
+    uint32_t magic;         //!< SequentialFile::INDEX_MAGIC
+    uint8_t version;        //!< SequentialFile::INDEX_VERSION
+    uint8_t headerSize;     //!< sizeof(SequentialFileIndexHeader) = 28
+    uint16_t bitmapBytes;   //!< Number of bytes of bitmap after this header
+    uint32_t nameHash;      //!< Hash of the pattern and filename extension, so changing either invalidates the index
+    int32_t firstFileNum;   //!< File number of the first file in the queue (bit 0), or 0 if the queue is empty
+    int32_t lastFileNum;    //!< Last file number used
+    uint32_t count;         //!< Number of files in the queue (bits set)
+    uint32_t crc;           //!< CRC-32 of this header with crc set to 0 followed by the bitmap
+};
+
 /**
  * @brief Class for maintaining a directory of files as a queue with unique filenames
  *
@@ -102,8 +120,40 @@ public:
      */
     const char *getFilenameExtension() const { return filenameExtension; };
 
+    /**
+     * @brief Keep an index file in the queue directory so scanDir() does not need to read the directory
+     * 
+     * @param value true to enable (default is disabled)
+     * 
+     * The index holds the range of file numbers in the queue and a bitmap of which are present.
+     * It's written by scanDir() and flushIndex(). The first time files are added to or removed from
+     * the queue after that, the index is deleted, so call flushIndex() when the queue is idle and before
+     * sleep or reset. At scanDir(), if the index is valid and the files at each end of the queue exist
+     * (and the files just outside it do not), the queue is loaded from the index. Otherwise the directory
+     * is scanned as usual and the index is rewritten. When the queue is loaded from the index,
+     * preScanAddHook() is not called.
+     * 
+     * The index is not used if files are added out of order or the queue spans more than
+     * MAX_INDEX_SPAN file numbers.
+     */
+    SequentialFile &withIndex(bool value = true) { indexEnabled = value; return *this; };
+
+    /**
+     * @brief Returns true if the last scanDir() loaded the queue from the index instead of the directory
+     */
+    bool getLoadedFromIndex() const { return loadedFromIndex; };
+
+    /**
+     * @brief Writes the index if the queue has changed since it was last written
+     * 
+     * Does nothing if withIndex() is not enabled. It's safe to call on every loop.
+     */
+    void flushIndex();
+
     /**
      * @brief Scans the queue directory for files. Typically called during setup().
+     * 
+     * The queue is sorted by file number, oldest first, whatever order the file system returns them in.
      */
     bool scanDir(void);
 
@@ -147,6 +197,30 @@ public:
      */
     int getFileFromQueue(bool remove = true);
 
+    /**
+     * @brief Gets a file from the queue without removing it
+     * 
+     * @param index 0 is the front of the queue (the same fileNum as getFileFromQueue(false)), 
+     * 1 is the next file, and so on.
+     * 
+     * @return 0 if there are not that many items in the queue, or a fileNum for an item in the queue.
+     * 
+     * This method does not need to access the filesystem.
+     */
+    int getFileFromQueueAt(size_t index);
+
+    /**
+     * @brief Removes a file from anywhere in the queue
+     * 
+     * @param fileNum The file number to remove
+     * 
+     * @return true if fileNum was in the queue
+     * 
+     * This only removes it from the queue in RAM and the index. Use removeFileNum() to 
+     * remove the file.
+     */
+    bool removeFileFromQueue(int fileNum);
+
     /**
      * @brief Uses pattern to create a filename given a fileNum
      * 
@@ -229,6 +303,15 @@ public:
      */
     static String getNameWithOptionalExt(const char *name, const char *ext);
 
+    /**
+     * @brief Name of the index file in the queue directory, used with withIndex()
+     */
+    static const char *INDEX_NAME;
+
+    static const uint32_t INDEX_MAGIC = 0x5f1d3b07; //!< Magic bytes in SequentialFileIndexHeader
+    static const uint8_t INDEX_VERSION = 1; //!< Version in SequentialFileIndexHeader
+    static const int MAX_INDEX_SPAN = 4096; //!< Maximum range of file numbers in the index (512 bytes of bitmap)
+
 protected:
     /**
      * @brief Allows a subclass to choose whether to queue a file or not during scanDir.
@@ -242,6 +325,33 @@ protected:
      */
     virtual bool preScanAddHook(const char *name) { return true; };
 
+    /**
+     * @brief Load the queue from the index file if it's valid and consistent with the directory
+     * 
+     * @return true if the queue was loaded, false if the directory must be scanned
+     */
+    bool readIndex();
+
+    /**
+     * @brief Rewrite the index file from the queue. Called with the queue mutex locked.
+     */
+    void writeIndex();
+
+    /**
+     * @brief Called with the queue mutex locked when the queue changes. Deletes the index if it was up to date.
+     */
+    void markIndexDirty();
+
+    /**
+     * @brief Returns true if the file for fileNum exists
+     */
+    bool fileNumExists(int fileNum);
+
+    /**
+     * @brief Hash of the pattern and filename extension, stored in the index
+     */
+    uint32_t getNameHash() const;
+
     /**
      * @brief Lock the mutex used to protect the queue
      */
@@ -281,6 +391,21 @@ protected:
      */
     int lastFileNum = 0;
 
+    /**
+     * @brief Maintain the index file. Set using withIndex().
+     */
+    bool indexEnabled = false;
+
+    /**
+     * @brief Set by scanDir() when the queue was loaded from the index
+     */
+    bool loadedFromIndex = false;
+
+    /**
+     * @brief Set when the queue has changed since the index was written, and the index file has been deleted
+     */
+    bool indexDirty = false;
+
     /**
      * @brief Mutex used to protect queue
      */
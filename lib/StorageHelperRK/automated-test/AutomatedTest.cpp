@@ -1,5 +1,8 @@
 #include "Particle.h"
 #include "StorageHelperRK.h"
+#include "TestAssert.h"
+
+#include <sys/wait.h>
 
 
 void readTestData(const char *filename, char *&data, size_t &size) {
@@ -30,37 +33,6 @@ char *readTestData(const char *filename) {
 	return data;
 }
 
-#define assertInt(msg, got, expected) _assertInt(msg, got, expected, __LINE__)
-void _assertInt(const char *msg, int got, int expected, int line) {
-	if (expected != got) {
-		printf("assertion failed %s line %d\n", msg, line);
-		printf("expected: %d\n", expected);
-		printf("     got: %d\n", got);
-		assert(false);
-	}
-}
-
-#define assertDouble(msg, got, expected, margin) _assertDouble(msg, got, expected, margin, __LINE__)
-void _assertDouble(const char *msg, double got, double expected, double margin, int line) {
-	if ((expected < (got - margin)) || (expected > (got + margin))) {
-		printf("assertion failed %s line %d\n", msg, line);
-		printf("expected: %lf\n", expected);
-		printf("     got: %lf\n", got);
-		assert(false);
-	}
-}
-
-
-#define assertStr(msg, got, expected) _assertStr(msg, got, expected, __LINE__)
-void _assertStr(const char *msg, const char *got, const char *expected, int line) {
-	if (strcmp(expected, got) != 0) {
-		printf("assertion failed %s line %d\n", msg, line);
-		printf("expected: %s\n", expected);
-		printf("     got: %s\n", got);
-		assert(false);
-	}
-}
-
 #define assertFile(msg, got, expected) _assertFile(msg, got, expected, __LINE__)
 void _assertFile(const char *msg, const char *gotPath, const char *expectedPath, int line) {
 	char *gotData, *expectedData;
@@ -268,6 +240,13 @@ void customPersistentDataTest() {
 	assertDouble("", data2.getValue_test3(), 9999999.12345, 0.001);
 	assertStr("", data2.getValue_test4(), "testing1!");
 
+	MyPersistentData::MyData snap = data2.getSnapshot<MyPersistentData::MyData>();
+	assertInt("", snap.test1, 0x55aa55aa);
+	assertInt("", snap.test2, true);
+	assertDouble("", snap.test3, 9999999.12345, 0.001);
+	assertStr("", snap.test4, "testing1!");
+	assertInt("", snap.header.hash, data2.getHash());
+
 	// Simulate a new version that adds a new field without changing the version or magic
 	MyPersistentData2 data2b;
 	data2b.load();
@@ -400,10 +379,810 @@ void customRetainedDataTest() {
 
 }
 
+static int getFileSize(const char *path) {
+	struct stat sb;
+	if (stat(path, &sb) != 0) {
+		return -1;
+	}
+	return (int)sb.st_size;
+}
+
+void journalTest() {
+	const int snapshotSize = (int)sizeof(MyPersistentData::MyData);
+	const int recordHeaderSize = (int)sizeof(StorageHelperRK::PersistentDataFileSystem::JournalRecordHeader);
+	String tempPath = String(persistentDataPath) + ".tmp";
+
+	unlink(persistentDataPath);
+
+	{
+		MyPersistentData data;
+		data.withJournal(4);
+		data.load();
+		data.save();
+		assertInt("", getFileSize(persistentDataPath), snapshotSize);
+		assertInt("", data.getJournalRecords(), 0);
+
+		// Each save appends only the changed bytes
+		data.setValue_test1(1234);
+		data.save();
+		assertInt("", getFileSize(persistentDataPath), snapshotSize + recordHeaderSize + (int)sizeof(int));
+		assertInt("", data.getJournalRecords(), 1);
+
+		data.setValue_test3(5.5);
+		data.save();
+		assertInt("", getFileSize(persistentDataPath), snapshotSize + 2 * recordHeaderSize + (int)sizeof(int) + (int)sizeof(double));
+		assertInt("", data.getJournalRecords(), 2);
+
+		// Nothing changed, nothing written
+		data.save();
+		assertInt("", data.getJournalRecords(), 2);
+	}
+
+	{
+		MyPersistentData data;
+		data.withJournal(4);
+		data.load();
+		assertInt("", data.getJournalRecords(), 2);
+		assertInt("", data.getValue_test1(), 1234);
+		assertDouble("", data.getValue_test3(), 5.5, 0.001);
+	}
+
+	// Simulate a reset while the last record was being written
+	assertInt("", truncate(persistentDataPath, getFileSize(persistentDataPath) - 3), 0);
+
+	{
+		MyPersistentData data;
+		data.withJournal(4);
+		data.load();
+		assertInt("", data.getJournalRecords(), 1);
+		assertInt("", data.getValue_test1(), 1234);
+		assertDouble("", data.getValue_test3(), 0.0, 0.001);
+
+		// Can't append after the partial record, so this compacts
+		data.setValue_test2(true);
+		data.save();
+		assertInt("", getFileSize(persistentDataPath), snapshotSize);
+		assertInt("", data.getJournalRecords(), 0);
+		assertInt("", getFileSize(tempPath), -1);
+
+		// Compacts after maxRecords records
+		for(int ii = 1; ii <= 5; ii++) {
+			data.setValue_test1(ii);
+			data.save();
+			assertInt("", data.getJournalRecords(), (ii <= 4) ? ii : 0);
+		}
+		assertInt("", getFileSize(persistentDataPath), snapshotSize);
+
+		data.setValue_test4("journal");
+		data.save();
+		assertInt("", data.getJournalRecords(), 1);
+	}
+
+	{
+		MyPersistentData data;
+		data.withJournal(4);
+		data.load();
+		assertInt("", data.getValue_test1(), 5);
+		assertInt("", data.getValue_test2(), true);
+		assertDouble("", data.getValue_test3(), 0.0, 0.001);
+		assertStr("", data.getValue_test4(), "journal");
+	}
+
+	// A corrupted record is ignored along with everything after it
+	{
+		int fd = open(persistentDataPath, O_RDWR);
+		lseek(fd, snapshotSize + recordHeaderSize, SEEK_SET);
+		uint8_t c = 0xff;
+		write(fd, &c, 1);
+		close(fd);
+
+		MyPersistentData data;
+		data.withJournal(4);
+		data.load();
+		assertInt("", data.getJournalRecords(), 0);
+		assertInt("", data.getValue_test1(), 5);
+		assertStr("", data.getValue_test4(), "");
+	}
+
+	// A file written without the journal loads in journal mode
+	unlink(persistentDataPath);
+	{
+		MyPersistentData data;
+		data.load();
+		data.setValue_test1(42);
+		data.save();
+	}
+	{
+		MyPersistentData data;
+		data.withJournal(4);
+		data.load();
+		assertInt("", data.getValue_test1(), 42);
+		data.setValue_test1(43);
+		data.save();
+		assertInt("", data.getJournalRecords(), 1);
+	}
+
+	unlink(persistentDataPath);
+}
+
+// Simulates power loss: after writeBudget bytes have been written, all further writes, syncs, and renames fail
+class FaultInjectionFileSystem : public StorageHelperRK::FileSystemPosix {
+public:
+	virtual size_t write(const uint8_t *buffer, size_t length) {
+		if (writeBudget < 0) {
+			return FileSystemPosix::write(buffer, length);
+		}
+		size_t count = (length < (size_t)writeBudget) ? length : (size_t)writeBudget;
+		if (count) {
+			count = FileSystemPosix::write(buffer, count);
+		}
+		writeBudget -= (int)count;
+		if (writeBudget == 0) {
+			powerLost = true;
+			if (exitOnPowerLoss) {
+				_exit(0);
+			}
+		}
+		return count;
+	}
+
+	virtual bool sync() {
+		return !powerLost && FileSystemPosix::sync();
+	}
+
+	virtual bool rename(const char *from, const char *to) {
+		return !powerLost && FileSystemPosix::rename(from, to);
+	}
+
+	int writeBudget = -1; //!< Bytes that can be written before power loss, -1 = unlimited
+	bool powerLost = false;
+	bool exitOnPowerLoss = false; //!< Exit the process at power loss, for testing recovery in a forked child
+};
+
+class FaultTestData : public StorageHelperRK::PersistentDataFileSystem {
+public:
+	FaultTestData(StorageHelperRK::FileSystemBase *fs) : PersistentDataFileSystem(fs, persistentDataPath, &myData.header, sizeof(MyPersistentData::MyData), MyPersistentData::DATA_MAGIC, MyPersistentData::DATA_VERSION) {};
+
+	int getValue_test1() const {
+		return getValue<int>(offsetof(MyPersistentData::MyData, test1));
+	}
+
+	void setValue_test1(int value) {
+		setValue<int>(offsetof(MyPersistentData::MyData, test1), value);
+	}
+
+	double getValue_test3() const {
+		return getValue<double>(offsetof(MyPersistentData::MyData, test3));
+	}
+
+	void setValue_test3(double value) {
+		setValue<double>(offsetof(MyPersistentData::MyData, test3), value);
+	}
+
+	MyPersistentData::MyData myData;
+};
+
+static void removeFaultTestFiles() {
+	String path = persistentDataPath;
+	unlink(path);
+	unlink(path + ".b");
+	unlink(path + ".tmp");
+}
+
+// Interrupts a save at every byte offset and checks that the data loads as either the old or the new values
+static void doubleBufferFaultTest(size_t journalMaxRecords) {
+	const int maxBudget = (int)sizeof(MyPersistentData::MyData) + 64;
+
+	for(int budget = 0; budget <= maxBudget; budget++) {
+		removeFaultTestFiles();
+
+		// Several saves so both slots (and journal records, if enabled) are in use
+		int oldValue = 0;
+		{
+			FaultTestData data(new StorageHelperRK::FileSystemPosix());
+			data.withJournal(journalMaxRecords).withDoubleBuffer();
+			data.load();
+			for(int ii = 1; ii <= 3; ii++) {
+				data.setValue_test1(ii);
+				data.save();
+				oldValue = ii;
+			}
+		}
+
+		{
+			FaultInjectionFileSystem *fs = new FaultInjectionFileSystem();
+			FaultTestData data(fs);
+			data.withJournal(journalMaxRecords).withDoubleBuffer();
+			data.load();
+			assertInt("", data.getValue_test1(), oldValue);
+
+			fs->writeBudget = budget;
+			data.setValue_test1(100);
+			data.setValue_test3(100.0);
+			data.save();
+		}
+
+		{
+			FaultTestData data(new StorageHelperRK::FileSystemPosix());
+			data.withJournal(journalMaxRecords).withDoubleBuffer();
+			data.load();
+
+			int value = data.getValue_test1();
+			if (value != oldValue && value != 100) {
+				printf("journalMaxRecords=%d budget=%d value=%d\n", (int)journalMaxRecords, budget, value);
+			}
+			assertInt("", (value == oldValue || value == 100), true);
+			assertDouble("", data.getValue_test3(), (value == 100) ? 100.0 : 0.0, 0.001);
+			if (budget == maxBudget) {
+				assertInt("", value, 100);
+			}
+
+			// Saving after recovery works and survives a reload
+			data.setValue_test1(200);
+			data.save();
+		}
+
+		{
+			FaultTestData data(new StorageHelperRK::FileSystemPosix());
+			data.withJournal(journalMaxRecords).withDoubleBuffer();
+			data.load();
+			assertInt("", data.getValue_test1(), 200);
+		}
+	}
+	removeFaultTestFiles();
+}
+
+void doubleBufferTest() {
+	removeFaultTestFiles();
+
+	// A file written without double buffering is used as slot A
+	{
+		MyPersistentData data;
+		data.load();
+		data.setValue_test1(42);
+		data.save();
+	}
+	{
+		FaultTestData data(new StorageHelperRK::FileSystemPosix());
+		data.withDoubleBuffer();
+		data.load();
+		assertInt("", data.getValue_test1(), 42);
+
+		// Saves alternate slots
+		data.setValue_test1(43);
+		data.save();
+		assertInt("", getFileSize((String(persistentDataPath) + ".b")), (int)sizeof(MyPersistentData::MyData));
+		assertInt("", data.myData.header.reserved1, 1);
+
+		data.setValue_test1(44);
+		data.save();
+		assertInt("", data.myData.header.reserved1, 2);
+	}
+	{
+		FaultTestData data(new StorageHelperRK::FileSystemPosix());
+		data.withDoubleBuffer();
+		data.load();
+		assertInt("", data.getValue_test1(), 44);
+	}
+
+	doubleBufferFaultTest(0);
+	doubleBufferFaultTest(1);
+	doubleBufferFaultTest(4);
+}
+
+
+// Same layout as sysStatusData::SysData in the Connected-Counter-Next application
+class SysStatusBench : public StorageHelperRK::PersistentDataFile {
+public:
+	class SysData {
+	public:
+		StorageHelperRK::PersistentDataBase::SavedDataHeader sysHeader;
+		uint8_t structuresVersion;
+		bool verboseMode;
+		bool solarPowerMode;
+		bool lowPowerMode;
+		bool lowBatteryMode;
+		uint8_t resetCount;
+		char timeZoneStr[39];
+		uint8_t openTime;
+		uint8_t closeTime;
+		time_t lastReport;
+		time_t lastConnection;
+		time_t lastHookResponse;
+		uint16_t lastConnectionDuration;
+		uint8_t sensorType;
+		char firmwareRelease[16];
+		char assetFirmwareRelease[16];
+	};
+
+	SysStatusBench() : PersistentDataFile("./temp03.dat", &sysData.sysHeader, sizeof(SysData), 0x20a99e75, 2) {};
+
+	void set_resetCount(uint8_t value) { setValue<uint8_t>(offsetof(SysData, resetCount), value); }
+	void set_lastConnection(time_t value) { setValue<time_t>(offsetof(SysData, lastConnection), value); }
+	void set_lastConnectionDuration(uint16_t value) { setValue<uint16_t>(offsetof(SysData, lastConnectionDuration), value); }
+
+	SysData sysData;
+};
+
+// Same layout as currentStatusData::CurrentData in the Connected-Counter-Next application
+class CurrentStatusBench : public StorageHelperRK::PersistentDataFile {
+public:
+	class CurrentData {
+	public:
+		StorageHelperRK::PersistentDataBase::SavedDataHeader currentHeader;
+		uint16_t hourlyCount;
+		uint16_t dailyCount;
+		time_t lastCountTime;
+		float internalTempC;
+		uint8_t alertCode;
+		float stateOfCharge;
+		uint8_t batteryState;
+		uint8_t sensorState;
+	};
+
+	CurrentStatusBench() : PersistentDataFile("./temp04.dat", &currentData.currentHeader, sizeof(CurrentData), 0x20a99e74, 2) {};
+
+	void set_hourlyCount(uint16_t value) { setValue<uint16_t>(offsetof(CurrentData, hourlyCount), value); }
+	void set_dailyCount(uint16_t value) { setValue<uint16_t>(offsetof(CurrentData, dailyCount), value); }
+	void set_lastCountTime(time_t value) { setValue<time_t>(offsetof(CurrentData, lastCountTime), value); }
+
+	CurrentData currentData;
+};
+
+// CurrentStatusBench with a file system that can fail, for a reset during the second save of a transaction
+class FaultTestCurrent : public StorageHelperRK::PersistentDataFileSystem {
+public:
+	FaultTestCurrent(StorageHelperRK::FileSystemBase *fs) : PersistentDataFileSystem(fs, "./temp04.dat", &currentData.currentHeader, sizeof(CurrentStatusBench::CurrentData), 0x20a99e74, 2) {};
+
+	void set_hourlyCount(uint16_t value) { setValue<uint16_t>(offsetof(CurrentStatusBench::CurrentData, hourlyCount), value); }
+
+	CurrentStatusBench::CurrentData currentData;
+};
+
+static double elapsedNs(const struct timespec &start, const struct timespec &end) {
+	return (double)(end.tv_sec - start.tv_sec) * 1e9 + (double)(end.tv_nsec - start.tv_nsec);
+}
+
+void setValueBenchmark() {
+	const int iterations = 1000000;
+	struct timespec start, end;
+
+	unlink("./temp03.dat");
+	unlink("./temp04.dat");
+
+	{
+		SysStatusBench data;
+		data.withSaveDelayMs(3600000).load();
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(int ii = 0; ii < iterations; ii++) {
+			data.set_resetCount((uint8_t)ii);
+			data.set_lastConnection((time_t)ii);
+			data.set_lastConnectionDuration((uint16_t)ii);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		data.flush(true);
+
+		printf("sysStatusData set_* %.1f ns/call (structure %u bytes)\n", elapsedNs(start, end) / (iterations * 3), (unsigned)sizeof(SysStatusBench::SysData));
+	}
+
+	{
+		CurrentStatusBench data;
+		data.withSaveDelayMs(3600000).load();
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(int ii = 0; ii < iterations; ii++) {
+			data.set_lastCountTime((time_t)ii);
+			data.set_hourlyCount((uint16_t)ii);
+			data.set_dailyCount((uint16_t)ii);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		data.flush(true);
+
+		printf("currentStatusData set_* %.1f ns/call (structure %u bytes)\n", elapsedNs(start, end) / (iterations * 3), (unsigned)sizeof(CurrentStatusBench::CurrentData));
+
+		// Deferred hash must still produce a file that loads
+		CurrentStatusBench data2;
+		data2.load();
+		assertInt("", data2.currentData.hourlyCount, (uint16_t)(iterations - 1));
+		assertInt("", data2.currentData.dailyCount, (uint16_t)(iterations - 1));
+	}
+
+	unlink("./temp03.dat");
+	unlink("./temp04.dat");
+}
+
 
+void transactionTest() {
+	const char *redoPath = "./temp05.dat";
+	const char *currentPath = "./temp04.dat";
+
+	removeFaultTestFiles();
+	unlink(currentPath);
+	unlink(redoPath);
+
+	// Changes are held until the end of the transaction, then saved together
+	{
+		FaultTestData data(new StorageHelperRK::FileSystemPosix());
+		data.withSaveDelayMs(0);
+		data.load();
+
+		CurrentStatusBench current;
+		current.withSaveDelayMs(0);
+		current.load();
+		{
+			StorageHelperRK::PersistentDataTransaction transaction(redoPath, {&data, &current});
+			data.setValue_test1(1);
+			current.set_hourlyCount(1);
+			current.set_dailyCount(1);
+			assertInt("", getFileSize(persistentDataPath), -1);
+			assertInt("", getFileSize(currentPath), -1);
+		}
+		assertInt("", getFileSize(redoPath), -1);
+
+		// Outside of a transaction, saveDelayMs 0 saves immediately again
+		data.setValue_test1(2);
+	}
+	{
+		FaultTestData data(new StorageHelperRK::FileSystemPosix());
+		data.load();
+		assertInt("", data.getValue_test1(), 2);
+
+		CurrentStatusBench current;
+		current.load();
+		assertInt("", current.getValue<uint16_t>(offsetof(CurrentStatusBench::CurrentData, dailyCount)), 1);
+
+		assertInt("", StorageHelperRK::PersistentDataTransaction::recover(redoPath, {&data, &current}), false);
+	}
+
+	// Reset at every byte of the second object's save. recover() completes the transaction.
+	for(int budget = 0; budget < (int)sizeof(MyPersistentData::MyData); budget++) {
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0) {
+			FaultInjectionFileSystem *fs = new FaultInjectionFileSystem();
+			fs->exitOnPowerLoss = true;
+			FaultTestData data(fs);
+			data.load();
+
+			CurrentStatusBench current;
+			current.load();
+			{
+				StorageHelperRK::PersistentDataTransaction transaction(redoPath, {&current, &data});
+				data.setValue_test1(budget + 100);
+				current.set_hourlyCount(budget + 100);
+				fs->writeBudget = budget;
+			}
+			_exit(1);
+		}
+		int status = 0;
+		waitpid(pid, &status, 0);
+		assertInt("", WIFEXITED(status) && WEXITSTATUS(status) == 0, true);
+		assertInt("", (getFileSize(redoPath) > 0), true);
+
+		FaultTestData data(new StorageHelperRK::FileSystemPosix());
+		data.load();
+
+		CurrentStatusBench current;
+		current.load();
+		assertInt("", current.getValue<uint16_t>(offsetof(CurrentStatusBench::CurrentData, hourlyCount)), budget + 100);
+
+		assertInt("", StorageHelperRK::PersistentDataTransaction::recover(redoPath, {&data, &current}), true);
+		assertInt("", data.getValue_test1(), budget + 100);
+		assertInt("", getFileSize(redoPath), -1);
+	}
+
+	// Reset after the double buffered, journaled object was saved. Recovery must not roll its generation
+	// back, or the other slot ties with it and journal records appended after recovery are lost.
+	{
+		removeFaultTestFiles();
+		unlink(currentPath);
+		{
+			FaultTestData data(new StorageHelperRK::FileSystemPosix());
+			data.withJournal(4).withDoubleBuffer();
+			data.load();
+			// Slot B is active with a full journal, so the transaction's save writes a snapshot to slot A
+			// and recovery writes one to slot B
+			for(int ii = 1; ii <= 10; ii++) {
+				data.setValue_test1(ii);
+				data.save();
+			}
+		}
+
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0) {
+			FaultTestData data(new StorageHelperRK::FileSystemPosix());
+			data.withJournal(4).withDoubleBuffer();
+			data.load();
+
+			FaultInjectionFileSystem *fs = new FaultInjectionFileSystem();
+			fs->exitOnPowerLoss = true;
+			FaultTestCurrent current(fs);
+			current.load();
+			{
+				StorageHelperRK::PersistentDataTransaction transaction(redoPath, {&data, &current});
+				data.setValue_test1(10);
+				data.setValue_test3(10.0);
+				current.set_hourlyCount(10);
+				fs->writeBudget = 0;
+			}
+			_exit(1);
+		}
+		int status = 0;
+		waitpid(pid, &status, 0);
+		assertInt("", WIFEXITED(status) && WEXITSTATUS(status) == 0, true);
+
+		{
+			FaultTestData data(new StorageHelperRK::FileSystemPosix());
+			data.withJournal(4).withDoubleBuffer();
+			data.load();
+
+			CurrentStatusBench current;
+			current.load();
+			assertInt("", StorageHelperRK::PersistentDataTransaction::recover(redoPath, {&data, &current}), true);
+			assertInt("", current.getValue<uint16_t>(offsetof(CurrentStatusBench::CurrentData, hourlyCount)), 10);
+
+			data.setValue_test1(11);
+			data.save();
+			data.setValue_test1(12);
+			data.save();
+		}
+		{
+			FaultTestData data(new StorageHelperRK::FileSystemPosix());
+			data.withJournal(4).withDoubleBuffer();
+			data.load();
+			assertInt("", data.getValue_test1(), 12);
+			assertDouble("", data.getValue_test3(), 10.0, 0.001);
+		}
+		removeFaultTestFiles();
+		unlink(currentPath);
+	}
+
+	// A redo file that was not completely written is discarded
+	{
+		FaultTestData data(new StorageHelperRK::FileSystemPosix());
+		data.load();
+
+		CurrentStatusBench current;
+		current.load();
+		{
+			StorageHelperRK::PersistentDataTransaction transaction(redoPath, {&data, &current});
+			data.setValue_test1(5);
+			current.set_hourlyCount(5);
+		}
+		int fd = open(redoPath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+		StorageHelperRK::PersistentDataTransaction::RedoHeader hdr = {StorageHelperRK::PersistentDataTransaction::REDO_MAGIC, 2, 0};
+		write(fd, &hdr, sizeof(hdr));
+		close(fd);
+
+		assertInt("", StorageHelperRK::PersistentDataTransaction::recover(redoPath, {&data, &current}), false);
+		assertInt("", data.getValue_test1(), 5);
+		assertInt("", getFileSize(redoPath), -1);
+	}
+
+	removeFaultTestFiles();
+	unlink(currentPath);
+}
+
+// Layouts of MigrationTestData saved by earlier versions. Once a version has been released it must be kept
+// so its saved data can be converted.
+class MigrationDataV1 {
+public:
+	StorageHelperRK::PersistentDataBase::SavedDataHeader header;
+	uint8_t count;
+	char name[8];
+};
+
+class MigrationDataV2 {
+public:
+	StorageHelperRK::PersistentDataBase::SavedDataHeader header;
+	uint16_t count;
+	int8_t offset;
+	char name[8];
+};
+
+class MigrationTestData : public StorageHelperRK::PersistentDataFile {
+public:
+	class MyData {
+	public:
+		StorageHelperRK::PersistentDataBase::SavedDataHeader header;
+		uint32_t count;			// uint8_t in v1, uint16_t in v2
+		int16_t offset;			// Added in v2 as int8_t
+		char name[4];			// 8 bytes in v1 and v2
+		uint8_t openTime;		// Added in v3, default 6
+	};
+
+	static const uint32_t DATA_MAGIC = 0x5e1c07a2;
+	static const uint16_t DATA_VERSION = 3;
+
+	MigrationTestData() : PersistentDataFile(persistentDataPath, &myData.header, sizeof(MyData), DATA_MAGIC, DATA_VERSION) {
+		withMigration(fromVersion1).withMigration(fromVersion2);
+	};
+
+	uint32_t getCount() const {
+		return getValue<uint32_t>(offsetof(MyData, count));
+	}
+
+	int16_t getOffset() const {
+		return getValue<int16_t>(offsetof(MyData, offset));
+	}
+
+	String getName() const {
+		String result;
+		getValueString(offsetof(MyData, name), sizeof(MyData::name), result);
+		return result;
+	}
+
+	uint8_t getOpenTime() const {
+		return getValue<uint8_t>(offsetof(MyData, openTime));
+	}
+
+	static void setDefaults(const uint8_t *from, uint8_t *to) {
+		((MyData *)to)->openTime = 6;
+	}
+
+	static const StorageHelperRK::PersistentDataBase::MigrationField fieldsVersion1[];
+	static const StorageHelperRK::PersistentDataBase::Migration fromVersion1;
+	static const StorageHelperRK::PersistentDataBase::MigrationField fieldsVersion2[];
+	static const StorageHelperRK::PersistentDataBase::Migration fromVersion2;
+
+	MyData myData;
+};
+
+const StorageHelperRK::PersistentDataBase::MigrationField MigrationTestData::fieldsVersion1[] = {
+	STORAGEHELPER_MIGRATE_FIELD(MigrationDataV1, MigrationTestData::MyData, count, UNSIGNED),
+	STORAGEHELPER_MIGRATE_FIELD(MigrationDataV1, MigrationTestData::MyData, name, STRING),
+};
+const StorageHelperRK::PersistentDataBase::Migration MigrationTestData::fromVersion1 = {
+	1, sizeof(MigrationDataV1), fieldsVersion1, sizeof(fieldsVersion1) / sizeof(fieldsVersion1[0]), MigrationTestData::setDefaults
+};
+
+const StorageHelperRK::PersistentDataBase::MigrationField MigrationTestData::fieldsVersion2[] = {
+	STORAGEHELPER_MIGRATE_FIELD(MigrationDataV2, MigrationTestData::MyData, count, UNSIGNED),
+	STORAGEHELPER_MIGRATE_FIELD(MigrationDataV2, MigrationTestData::MyData, offset, SIGNED),
+	STORAGEHELPER_MIGRATE_FIELD(MigrationDataV2, MigrationTestData::MyData, name, STRING),
+};
+const StorageHelperRK::PersistentDataBase::Migration MigrationTestData::fromVersion2 = {
+	2, sizeof(MigrationDataV2), fieldsVersion2, sizeof(fieldsVersion2) / sizeof(fieldsVersion2[0]), MigrationTestData::setDefaults
+};
+
+// Writes a saved image the way an old version of the firmware would have
+template<class T>
+static void writeSavedImage(const char *path, T &data, uint16_t version) {
+	data.header.magic = MigrationTestData::DATA_MAGIC;
+	data.header.version = version;
+	data.header.size = sizeof(T);
+	data.header.hash = 0;
+	data.header.hash = StorageHelperRK::murmur3_32((const uint8_t *)&data, sizeof(T), StorageHelperRK::PersistentDataBase::HASH_SEED);
+
+	FILE *fp = fopen(path, "w");
+	fwrite(&data, 1, sizeof(T), fp);
+	fclose(fp);
+}
+
+void migrationTest() {
+	removeFaultTestFiles();
+
+	// Version 1
+	{
+		MigrationDataV1 old;
+		memset(&old, 0, sizeof(old));
+		old.count = 200;
+		strcpy(old.name, "ab");
+		writeSavedImage(persistentDataPath, old, 1);
+
+		MigrationTestData data;
+		data.load();
+		assertInt("", (int)data.getCount(), 200);
+		assertInt("", data.getOffset(), 0);
+		assertStr("", data.getName(), "ab");
+		assertInt("", data.getOpenTime(), 6);
+
+		// Saved in the new layout by flush
+		data.flush(false);
+		assertInt("", getFileSize(persistentDataPath), (int)sizeof(MigrationTestData::MyData));
+	}
+	{
+		MigrationTestData data;
+		data.load();
+		assertInt("", data.myData.header.version, MigrationTestData::DATA_VERSION);
+		assertInt("", (int)data.getCount(), 200);
+		assertStr("", data.getName(), "ab");
+		assertInt("", data.getOpenTime(), 6);
+	}
+
+	// Version 2: widened integers keep their values, including the sign, and a shortened string is terminated
+	{
+		MigrationDataV2 old;
+		memset(&old, 0, sizeof(old));
+		old.count = 40000;
+		old.offset = -5;
+		strcpy(old.name, "abcdefg");
+		writeSavedImage(persistentDataPath, old, 2);
+
+		MigrationTestData data;
+		data.load();
+		assertInt("", (int)data.getCount(), 40000);
+		assertInt("", data.getOffset(), -5);
+		assertStr("", data.getName(), "abc");
+		assertInt("", data.getOpenTime(), 6);
+	}
+
+	// A damaged old image is not migrated
+	{
+		MigrationDataV2 old;
+		memset(&old, 0, sizeof(old));
+		old.count = 1234;
+		writeSavedImage(persistentDataPath, old, 2);
+		int fd = open(persistentDataPath, O_RDWR);
+		lseek(fd, offsetof(MigrationDataV2, count), SEEK_SET);
+		uint8_t c = 0xff;
+		write(fd, &c, 1);
+		close(fd);
+
+		MigrationTestData data;
+		data.load();
+		assertInt("", (int)data.getCount(), 0);
+		assertInt("", data.getOpenTime(), 0);
+	}
+
+	// A version without a migration, or with the wrong size for its version, is reinitialized
+	{
+		struct {
+			StorageHelperRK::PersistentDataBase::SavedDataHeader header;
+			uint8_t count;
+			char name[20];
+		} old;
+		memset(&old, 0, sizeof(old));
+		old.count = 7;
+		writeSavedImage(persistentDataPath, old, 2);
+
+		MigrationTestData data;
+		data.load();
+		assertInt("", (int)data.getCount(), 0);
+
+		writeSavedImage(persistentDataPath, old, 9);
+		data.load();
+		assertInt("", (int)data.getCount(), 0);
+	}
+
+	// Double buffered with a journal: the old file is slot A, and the converted data is written as a snapshot to slot B
+	removeFaultTestFiles();
+	{
+		MigrationDataV1 old;
+		memset(&old, 0, sizeof(old));
+		old.count = 17;
+		strcpy(old.name, "xyz");
+		writeSavedImage(persistentDataPath, old, 1);
+
+		MigrationTestData data;
+		data.withJournal(4).withDoubleBuffer();
+		data.load();
+		assertInt("", (int)data.getCount(), 17);
+		data.flush(true);
+		assertInt("", getFileSize((String(persistentDataPath) + ".b").c_str()), (int)sizeof(MigrationTestData::MyData));
+		assertInt("", data.getJournalRecords(), 0);
+	}
+	{
+		MigrationTestData data;
+		data.withJournal(4).withDoubleBuffer();
+		data.load();
+		assertInt("", (int)data.getCount(), 17);
+		assertStr("", data.getName(), "xyz");
+		assertInt("", data.getOpenTime(), 6);
+	}
+
+	removeFaultTestFiles();
+}
 
 int main(int argc, char *argv[]) {
 	customPersistentDataTest();
 	customRetainedDataTest();
+	journalTest();
+	doubleBufferTest();
+	transactionTest();
+	migrationTest();
+	setValueBenchmark();
 	return 0;
 }
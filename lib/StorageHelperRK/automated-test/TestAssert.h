@@ -0,0 +1,55 @@
+#ifndef __TESTASSERT_H
+#define __TESTASSERT_H
+
+// Assertion helpers for the host tests. Each prints what was expected and the line, then fails assert().
+// stdout is flushed first because assert() aborts without flushing it when it is a pipe or a file.
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define assertInt(msg, got, expected) _assertInt(msg, got, expected, __LINE__)
+inline void _assertInt(const char *msg, int got, int expected, int line) {
+	if (expected != got) {
+		printf("assertion failed %s line %d\n", msg, line);
+		printf("expected: %d\n", expected);
+		printf("     got: %d\n", got);
+		fflush(stdout);
+		assert(false);
+	}
+}
+
+#define assertDouble(msg, got, expected, margin) _assertDouble(msg, got, expected, margin, __LINE__)
+inline void _assertDouble(const char *msg, double got, double expected, double margin, int line) {
+	if ((expected < (got - margin)) || (expected > (got + margin))) {
+		printf("assertion failed %s line %d\n", msg, line);
+		printf("expected: %lf\n", expected);
+		printf("     got: %lf\n", got);
+		fflush(stdout);
+		assert(false);
+	}
+}
+
+#define assertStr(msg, got, expected) _assertStr(msg, got, expected, __LINE__)
+inline void _assertStr(const char *msg, const char *got, const char *expected, int line) {
+	if (strcmp(expected, got) != 0) {
+		printf("assertion failed %s line %d\n", msg, line);
+		printf("expected: %s\n", expected);
+		printf("     got: %s\n", got);
+		fflush(stdout);
+		assert(false);
+	}
+}
+
+// For conditions that are not a comparison of two values. The condition is printed.
+#define assertTrue(msg, condition) _assertTrue(msg, condition, #condition, __LINE__)
+inline void _assertTrue(const char *msg, bool condition, const char *conditionStr, int line) {
+	if (!condition) {
+		printf("assertion failed %s line %d\n", msg, line);
+		printf("expected: %s\n", conditionStr);
+		fflush(stdout);
+		assert(false);
+	}
+}
+
+#endif /* __TESTASSERT_H */
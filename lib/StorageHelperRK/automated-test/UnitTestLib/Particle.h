@@ -158,6 +158,7 @@ public:
         ::printf("%s", buf);
     }
 
+    void print(const char *s) const { ::printf("%s", s); }
     void dump(const void *data, size_t size) const {
         dump(LOG_LEVEL_TRACE, data, size);
     }
@@ -23,7 +23,7 @@ bool StorageHelperRK::PersistentDataBase::load() {
 
 
 void StorageHelperRK::PersistentDataBase::flush(bool force) {
-    if (lastUpdate) {
+    if (lastUpdate && !transactionDepth) {
         if (force || (millis() - lastUpdate >= saveDelayMs)) {
             save();
             lastUpdate = 0;
@@ -32,7 +32,8 @@ void StorageHelperRK::PersistentDataBase::flush(bool force) {
 }
 
 void StorageHelperRK::PersistentDataBase::saveOrDefer() {
-    if (saveDelayMs) {
+    if (saveDelayMs || transactionDepth) {
+        // In a transaction, the save is done by PersistentDataTransaction::commit()
         lastUpdate = millis();
     }
     else {
@@ -42,6 +43,15 @@ void StorageHelperRK::PersistentDataBase::saveOrDefer() {
 
 
 
+size_t StorageHelperRK::PersistentDataBase::getSnapshot(void *dest, size_t size) const {
+    size_t count = (size < savedDataSize) ? size : savedDataSize;
+
+    WITH_LOCK(*this) {
+        memcpy(dest, savedDataHeader, count);
+    }
+    return count;
+}
+
 bool StorageHelperRK::PersistentDataBase::getValueString(size_t offset, size_t size, String &value) const {
     bool result = false;
 
@@ -67,7 +77,7 @@ bool StorageHelperRK::PersistentDataBase::setValueString(size_t offset, size_t s
             if (strcmp(value, p) != 0) {
                 memset(p, 0, size);
                 strcpy(p, value);
-                updateHash();
+                markDirty(offset, size);
             }
             result = true;
         }
@@ -100,13 +110,71 @@ uint32_t StorageHelperRK::PersistentDataBase::getHash() const {
 }
 
 void StorageHelperRK::PersistentDataBase::updateHash() {
-    savedDataHeader->hash = getHash();
+    WITH_LOCK(*this) {
+        savedDataHeader->hash = getHash();
+        hashDirty = false;
 #ifdef LOG_HASH
         Log.trace("updateHash size=%u hash=%08lx", (int)savedDataHeader->size, savedDataHeader->hash);
         Log.dump((const uint8_t *)savedDataHeader, savedDataHeader->size);
         Log.print("\n");
 #endif
-    saveOrDefer();
+        // The caller may have changed any field
+        markDirty(0, savedDataSize);
+    }
+}
+
+void StorageHelperRK::PersistentDataBase::markDirty(size_t offset, size_t size) {
+    WITH_LOCK(*this) {
+        if (dirtyEnd == 0) {
+            dirtyStart = offset;
+            dirtyEnd = offset + size;
+        }
+        else {
+            if (offset < dirtyStart) {
+                dirtyStart = offset;
+            }
+            if (offset + size > dirtyEnd) {
+                dirtyEnd = offset + size;
+            }
+        }
+
+        if (deferHash) {
+            // Hash is calculated once, in save()
+            hashDirty = true;
+        }
+        else {
+            // There is no save step to calculate it later (retained memory, for example), so do it now
+            savedDataHeader->hash = getHash();
+            hashDirty = false;
+        }
+        saveOrDefer();
+    }
+}
+
+bool StorageHelperRK::PersistentDataBase::getDirtyRange(size_t &start, size_t &end) const {
+    bool result = false;
+
+    WITH_LOCK(*this) {
+        start = dirtyStart;
+        end = dirtyEnd;
+        result = (dirtyEnd != 0);
+    }
+    return result;
+}
+
+void StorageHelperRK::PersistentDataBase::commitHash() {
+    WITH_LOCK(*this) {
+        if (hashDirty) {
+            savedDataHeader->hash = getHash();
+            hashDirty = false;
+        }
+    }
+}
+
+void StorageHelperRK::PersistentDataBase::clearDirty() {
+    WITH_LOCK(*this) {
+        dirtyStart = dirtyEnd = 0;
+    }
 }
 
 bool StorageHelperRK::PersistentDataBase::validate(size_t dataSize) {
@@ -119,6 +187,14 @@ bool StorageHelperRK::PersistentDataBase::validate(size_t dataSize) {
     }
     uint32_t hash = 0;
 
+    if (dataSize >= 12 && 
+        savedDataHeader->magic == savedDataMagic && 
+        savedDataHeader->version != savedDataVersion &&
+        savedDataHeader->size <= (uint16_t) dataSize) {
+        // Saved by an older version of the structure
+        isValid = migrate(dataSize);
+    }
+    else
     if (dataSize >= 12 && 
         savedDataHeader->magic == savedDataMagic && 
         savedDataHeader->version == savedDataVersion &&
@@ -136,6 +212,8 @@ bool StorageHelperRK::PersistentDataBase::validate(size_t dataSize) {
             }
             savedDataHeader->size = (uint16_t) savedDataSize;
             savedDataHeader->hash = getHash();
+            hashDirty = false;
+            clearDirty();
             isValid = true;
         }
     }   
@@ -148,16 +226,88 @@ bool StorageHelperRK::PersistentDataBase::validate(size_t dataSize) {
     return isValid;
 }
 
+bool StorageHelperRK::PersistentDataBase::migrate(size_t dataSize) {
+    const Migration *migration = nullptr;
+
+    for(size_t ii = 0; ii < numMigrations; ii++) {
+        if (migrations[ii]->fromVersion == savedDataHeader->version && migrations[ii]->fromSize == savedDataHeader->size) {
+            migration = migrations[ii];
+            break;
+        }
+    }
+    if (!migration || migration->fromSize > dataSize || migration->fromSize > savedDataSize || migration->fromSize < sizeof(SavedDataHeader)) {
+        Log.info("no migration from version %d size %d", (int)savedDataHeader->version, (int)savedDataHeader->size);
+        return false;
+    }
+    if (savedDataHeader->hash != getHash()) {
+        return false;
+    }
+
+    uint8_t *from = (uint8_t *)malloc(migration->fromSize);
+    if (!from) {
+        return false;
+    }
+    memcpy(from, savedDataHeader, migration->fromSize);
+
+    // The header is kept, including reserved1, and the data after it starts at 0
+    uint8_t *to = (uint8_t *)savedDataHeader;
+    memset(to + sizeof(SavedDataHeader), 0, savedDataSize - sizeof(SavedDataHeader));
+
+    for(size_t ii = 0; ii < migration->fieldCount; ii++) {
+        const MigrationField &field = migration->fields[ii];
+        if (field.fromOffset + field.fromSize > migration->fromSize || field.toOffset + field.toSize > savedDataSize) {
+            continue;
+        }
+
+        size_t copySize = (field.fromSize < field.toSize) ? field.fromSize : field.toSize;
+        memcpy(to + field.toOffset, from + field.fromOffset, copySize);
+
+        if (field.type == MigrationFieldType::SIGNED && copySize > 0 && copySize < field.toSize && (from[field.fromOffset + copySize - 1] & 0x80) != 0) {
+            // Little endian, so the added high bytes are after the copied ones
+            memset(to + field.toOffset + copySize, 0xff, field.toSize - copySize);
+        }
+        if (field.type == MigrationFieldType::STRING && field.toSize > 0) {
+            to[field.toOffset + field.toSize - 1] = 0;
+        }
+    }
+
+    if (migration->convert) {
+        migration->convert(from, to);
+    }
+    free(from);
+
+    savedDataHeader->magic = savedDataMagic;
+    savedDataHeader->version = savedDataVersion;
+    savedDataHeader->size = (uint16_t) savedDataSize;
+    savedDataHeader->hash = getHash();
+    hashDirty = false;
+
+    // Save in the new layout. This is deferred to flush() because the file may still be open for reading.
+    dirtyStart = 0;
+    dirtyEnd = savedDataSize;
+    lastUpdate = millis();
+    if (lastUpdate == 0) {
+        lastUpdate = 1;
+    }
+
+    Log.info("migrated data from version %d size %d to version %d size %d", (int)migration->fromVersion, (int)migration->fromSize, (int)savedDataVersion, (int)savedDataSize);
+    return true;
+}
+
 void StorageHelperRK::PersistentDataBase::initialize() {
     memset(savedDataHeader, 0, savedDataSize);
     savedDataHeader->magic = savedDataMagic;
     savedDataHeader->version = savedDataVersion;
     savedDataHeader->size = (uint16_t) savedDataSize;
     savedDataHeader->hash = getHash();
+    hashDirty = false;
 }
 
 void StorageHelperRK::PersistentDataBase::save() {
-    savedDataHeader->hash = getHash();
+    // Subclasses that write the data somewhere call commitHash() before writing, so this is
+    // normally a no-op and the hash is only calculated once per save
+    commitHash();
+    clearDirty();
     if (logData) {
         Log.info("saving data size=%d", (int)savedDataHeader->size);
         Log.dump((const uint8_t *)savedDataHeader, savedDataHeader->size);
@@ -199,6 +349,7 @@ bool StorageHelperRK::PersistentDataEEPROM::load() {
 
 void StorageHelperRK::PersistentDataEEPROM::save() {
     WITH_LOCK(*this) {
+        commitHash();
 #ifdef USE_HAL_EEPROM
         HAL_EEPROM_Put(eepromOffset, savedDataHeader, savedDataSize);        
 #else
@@ -229,25 +380,29 @@ bool StorageHelperRK::PersistentDataFileSystem::load() {
     WITH_LOCK(*this) {
         bool loaded = false;
 
-        int dataSize = 0;
-
-        int fd = fs->open(filename, O_RDONLY);
-        if (fd != -1) {
-            dataSize = fs->read((uint8_t *)savedDataHeader, savedDataSize);
+        if (doubleBuffer) {
+            // Use the valid slot with the newer generation. Slot A is read last because it's the 
+            // one used when the file was written without double buffering.
+            bool validB = loadFile(getSlotPath(true));
+            uint32_t generationB = savedDataHeader->reserved1;
 
-            // Log.info("request to read %d, got %d bytes", (int)savedDataSize, (int) dataSize);
-            // Log.dump((const uint8_t *)savedDataHeader, dataSize);
-
-            if (validate(dataSize)) {
+            if (loadFile(getSlotPath(false)) && (!validB || (int32_t)(savedDataHeader->reserved1 - generationB) >= 0)) {
+                activeSlotB = false;
+                loaded = true;
+            }
+            else
+            if (validB && loadFile(getSlotPath(true))) {
+                activeSlotB = true;
                 loaded = true;
             }
-            fs->close();
         }
         else {
-            Log.trace("did not open file %s", filename.c_str());
+            loaded = loadFile(filename);
         }
         
         if (!loaded) {
+            journalAppendOk = false;
+            activeSlotB = true; // First save goes to slot A
             initialize();
         }
     }
@@ -255,21 +410,388 @@ bool StorageHelperRK::PersistentDataFileSystem::load() {
     return true;
 }
 
+bool StorageHelperRK::PersistentDataFileSystem::loadFile(const char *path) {
+    bool loaded = false;
+
+    int dataSize = 0;
+
+    journalRecords = 0;
+    journalAppendOk = false;
+
+    if (fs->open(path, O_RDONLY)) {
+        dataSize = fs->read((uint8_t *)savedDataHeader, savedDataSize);
+
+        // Log.info("request to read %d, got %d bytes", (int)savedDataSize, (int) dataSize);
+        // Log.dump((const uint8_t *)savedDataHeader, dataSize);
+
+        if (journalMaxRecords && 
+            dataSize >= (int)sizeof(SavedDataHeader) && 
+            savedDataHeader->magic == savedDataMagic && 
+            savedDataHeader->size <= dataSize) {
+            // Anything after the snapshot is change records
+            dataSize = savedDataHeader->size;
+            replayJournal(dataSize);
+        }
+
+        if (validate(dataSize)) {
+            loaded = true;
+        }
+        else {
+            journalAppendOk = false;
+        }
+        fs->close();
+    }
+    else {
+        Log.trace("did not open file %s", path);
+    }
+
+    return loaded;
+}
+
+String StorageHelperRK::PersistentDataFileSystem::getSlotPath(bool slotB) const {
+    String result = filename;
+    if (slotB) {
+        result += ".b";
+    }
+    return result;
+}
+
+String StorageHelperRK::PersistentDataFileSystem::getActivePath() const {
+    return doubleBuffer ? getSlotPath(activeSlotB) : filename;
+}
+
 void StorageHelperRK::PersistentDataFileSystem::save() {
     WITH_LOCK(*this) {
-        int fd = fs->open(filename, O_RDWR | O_CREAT | O_TRUNC);
-        if (fd != -1) {            
-            /* size_t count = */fs->write((const uint8_t *)savedDataHeader, savedDataSize);
+        commitHash();
 
-            // Log.info("request to write %d, wrote %d bytes", (int)savedDataSize, (int) count);
-            // Log.dump((const uint8_t *)savedDataHeader, savedDataSize);
+        if (journalMaxRecords) {
+            bool saved = false;
+            size_t start, end;
 
-            fs->close();
+            if (!getDirtyRange(start, end)) {
+                // Nothing changed, only need to write if the file isn't valid
+                saved = journalAppendOk;
+            }
+            else
+            if (journalAppendOk && journalRecords < journalMaxRecords && (end - start) <= savedDataSize / 2) {
+                saved = saveJournalRecord(start, end);
+            }
+            if (!saved) {
+                saveSnapshot();
+            }
+        }
+        else {
+            saveSnapshot();
         }
     }
     PersistentDataBase::save();
 }
 
+bool StorageHelperRK::PersistentDataFileSystem::saveSnapshot() {
+    bool result = false;
+    bool useTemp = false;
+    String path;
+
+    if (doubleBuffer) {
+        // Write the other slot with a newer generation. The active slot stays valid until this one is complete.
+        path = getSlotPath(!activeSlotB);
+        savedDataHeader->reserved1++;
+        savedDataHeader->hash = getHash();
+    }
+    else {
+        path = filename;
+        if (journalMaxRecords && fs->canRename()) {
+            // When compacting a journal, write to a temporary file and rename it so a reset 
+            // during the write leaves the old snapshot and records intact
+            path += ".tmp";
+            useTemp = true;
+        }
+    }
+
+    if (fs->open(path, O_RDWR | O_CREAT | O_TRUNC)) {
+        size_t count = fs->write((const uint8_t *)savedDataHeader, savedDataSize);
+
+        // Log.info("request to write %d, wrote %d bytes", (int)savedDataSize, (int) count);
+        // Log.dump((const uint8_t *)savedDataHeader, savedDataSize);
+
+        result = (count == savedDataSize) && fs->sync();
+        fs->close();
+    }
+
+    if (result && useTemp) {
+        result = fs->rename(path, filename);
+    }
+    if (result && doubleBuffer) {
+        activeSlotB = !activeSlotB;
+    }
+
+    journalRecords = 0;
+    journalAppendOk = result;
+
+    return result;
+}
+
+bool StorageHelperRK::PersistentDataFileSystem::saveJournalRecord(size_t start, size_t end) {
+    bool result = false;
+
+    const uint8_t *data = ((const uint8_t *)savedDataHeader) + start;
+
+    JournalRecordHeader hdr;
+    hdr.magic = JOURNAL_RECORD_MAGIC;
+    hdr.offset = (uint16_t) start;
+    hdr.length = (uint16_t) (end - start);
+    hdr.reserved = 0;
+    hdr.hash = savedDataHeader->hash;
+    hdr.check = getJournalCheck(hdr, data);
+
+    if (fs->open(getActivePath(), O_RDWR)) {
+        if (fs->seek(-1)) {
+            result = (fs->write((const uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr)) && 
+                     (fs->write(data, hdr.length) == hdr.length);
+        }
+        fs->close();
+    }
+
+    if (result) {
+        journalRecords++;
+    }
+    else {
+        // There may be a partial record at the end of the file, so the next save must compact
+        journalAppendOk = false;
+    }
+    return result;
+}
+
+void StorageHelperRK::PersistentDataFileSystem::replayJournal(size_t snapshotSize) {
+    uint8_t *p = (uint8_t *)savedDataHeader;
+
+    // Bytes after the snapshot were read from the change records, not the structure
+    memset(p + snapshotSize, 0, savedDataSize - snapshotSize);
+
+    int fileLength = fs->getLength();
+    int pos = (int)snapshotSize;
+
+    uint8_t *data = new uint8_t[snapshotSize];
+    if (!data || !fs->seek(pos)) {
+        delete[] data;
+        return;
+    }
+
+    while(pos + (int)sizeof(JournalRecordHeader) <= fileLength) {
+        JournalRecordHeader hdr;
+        if (fs->read((uint8_t *)&hdr, sizeof(hdr)) != sizeof(hdr)) {
+            break;
+        }
+        if (hdr.magic != JOURNAL_RECORD_MAGIC || hdr.length == 0 || ((size_t)hdr.offset + hdr.length) > snapshotSize) {
+            break;
+        }
+        if (fs->read(data, hdr.length) != hdr.length || getJournalCheck(hdr, data) != hdr.check) {
+            break;
+        }
+        memcpy(p + hdr.offset, data, hdr.length);
+        savedDataHeader->hash = hdr.hash;
+
+        pos += sizeof(hdr) + hdr.length;
+        journalRecords++;
+    }
+    delete[] data;
+
+    if (pos != fileLength) {
+        Log.info("%s: ignoring %d bytes after journal record %d", filename.c_str(), fileLength - pos, (int)journalRecords);
+    }
+
+    // If the structure has grown since the snapshot was written, records can't be appended to it
+    journalAppendOk = (pos == fileLength && snapshotSize == savedDataSize);
+}
+
+uint32_t StorageHelperRK::PersistentDataFileSystem::getJournalCheck(const JournalRecordHeader &hdr, const uint8_t *data) {
+    JournalRecordHeader tmp = hdr;
+    tmp.check = 0;
+
+    uint32_t hash = StorageHelperRK::murmur3_32((const uint8_t *)&tmp, sizeof(tmp), HASH_SEED);
+    return StorageHelperRK::murmur3_32(data, hdr.length, hash);
+}
+
+
+#if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
+//
+// PersistentDataTransaction
+//
+StorageHelperRK::PersistentDataTransaction::PersistentDataTransaction(const char *redoPath, std::initializer_list<PersistentDataBase *> objects) : redoPath(redoPath) {
+    for(PersistentDataBase *obj : objects) {
+        if (numObjects >= MAX_OBJECTS) {
+            Log.error("too many objects in transaction");
+            break;
+        }
+        obj->lock();
+        obj->transactionDepth++;
+        this->objects[numObjects++] = obj;
+    }
+}
+
+StorageHelperRK::PersistentDataTransaction::~PersistentDataTransaction() {
+    commit();
+}
+
+bool StorageHelperRK::PersistentDataTransaction::commit() {
+    if (committed) {
+        return true;
+    }
+    committed = true;
+
+    bool result = true;
+
+    // Only the outermost transaction for an object saves it
+    PersistentDataBase *changed[MAX_OBJECTS];
+    size_t numChanged = 0;
+
+    for(size_t ii = 0; ii < numObjects; ii++) {
+        PersistentDataBase *obj = objects[ii];
+        size_t start, end;
+
+        if (obj->transactionDepth == 1 && obj->getDirtyRange(start, end)) {
+            obj->commitHash();
+            changed[numChanged++] = obj;
+        }
+    }
+
+    // A single object is saved atomically by its own save(), if double buffered
+    bool useRedo = (numChanged > 1);
+    if (useRedo) {
+        result = writeRedo(changed, numChanged);
+        if (!result) {
+            Log.error("could not write %s, saving without transaction", redoPath);
+        }
+    }
+
+    for(size_t ii = 0; ii < numChanged; ii++) {
+        changed[ii]->save();
+        changed[ii]->lastUpdate = 0;
+    }
+
+    if (useRedo && result) {
+        FileSystemPosix fs;
+        fs.remove(redoPath);
+    }
+
+    for(size_t ii = 0; ii < numObjects; ii++) {
+        objects[ii]->transactionDepth--;
+        objects[ii]->unlock();
+    }
+
+    return result;
+}
+
+bool StorageHelperRK::PersistentDataTransaction::writeRedo(PersistentDataBase **changed, size_t numChanged) {
+    bool result = false;
+    FileSystemPosix fs;
+
+    if (fs.open(redoPath, O_RDWR | O_CREAT | O_TRUNC)) {
+        RedoHeader hdr;
+        hdr.magic = REDO_MAGIC;
+        hdr.count = (uint16_t) numChanged;
+        hdr.reserved = 0;
+
+        uint32_t hash = murmur3_32((const uint8_t *)&hdr, sizeof(hdr), PersistentDataBase::HASH_SEED);
+        result = (fs.write((const uint8_t *)&hdr, sizeof(hdr)) == sizeof(hdr));
+
+        for(size_t ii = 0; ii < numChanged && result; ii++) {
+            PersistentDataBase *obj = changed[ii];
+
+            RedoObjectHeader objHdr;
+            objHdr.savedDataMagic = obj->savedDataMagic;
+            objHdr.size = obj->savedDataSize;
+
+            hash = murmur3_32((const uint8_t *)&objHdr, sizeof(objHdr), hash);
+            hash = murmur3_32((const uint8_t *)obj->savedDataHeader, obj->savedDataSize, hash);
+
+            result = (fs.write((const uint8_t *)&objHdr, sizeof(objHdr)) == sizeof(objHdr)) &&
+                     (fs.write((const uint8_t *)obj->savedDataHeader, obj->savedDataSize) == obj->savedDataSize);
+        }
+        result = result && (fs.write((const uint8_t *)&hash, sizeof(hash)) == sizeof(hash)) && fs.sync();
+        fs.close();
+    }
+    return result;
+}
+
+// [static]
+bool StorageHelperRK::PersistentDataTransaction::recover(const char *redoPath, std::initializer_list<PersistentDataBase *> objects) {
+    bool recovered = false;
+    FileSystemPosix fs;
+
+    if (!fs.open(redoPath, O_RDONLY)) {
+        // No transaction was interrupted
+        return false;
+    }
+
+    int length = fs.getLength();
+    uint8_t *buf = (length > 0) ? new uint8_t[length] : nullptr;
+    if (buf && fs.read(buf, length) == (size_t)length && length >= (int)(sizeof(RedoHeader) + sizeof(uint32_t))) {
+        const RedoHeader *hdr = (const RedoHeader *)buf;
+        int checkOffset = length - (int)sizeof(uint32_t);
+
+        uint32_t check;
+        memcpy(&check, &buf[checkOffset], sizeof(check));
+
+        // Verify the whole file before applying any of it
+        bool valid = (hdr->magic == REDO_MAGIC);
+        uint32_t hash = murmur3_32(buf, sizeof(RedoHeader), PersistentDataBase::HASH_SEED);
+        int offset = (int)sizeof(RedoHeader);
+        for(size_t ii = 0; ii < hdr->count && valid; ii++) {
+            RedoObjectHeader objHdr;
+            if (offset + (int)sizeof(objHdr) > checkOffset) {
+                valid = false;
+                break;
+            }
+            memcpy(&objHdr, &buf[offset], sizeof(objHdr));
+            if (offset + (int)sizeof(objHdr) + (int)objHdr.size > checkOffset) {
+                valid = false;
+                break;
+            }
+            hash = murmur3_32(&buf[offset], sizeof(objHdr), hash);
+            hash = murmur3_32(&buf[offset + sizeof(objHdr)], objHdr.size, hash);
+            offset += sizeof(objHdr) + objHdr.size;
+        }
+        valid = valid && (offset == checkOffset) && (hash == check);
+
+        if (valid) {
+            offset = (int)sizeof(RedoHeader);
+            for(size_t ii = 0; ii < hdr->count; ii++) {
+                RedoObjectHeader objHdr;
+                memcpy(&objHdr, &buf[offset], sizeof(objHdr));
+
+                for(PersistentDataBase *obj : objects) {
+                    if (obj->savedDataMagic == objHdr.savedDataMagic && obj->savedDataSize == objHdr.size) {
+                        WITH_LOCK(*obj) {
+                            // Keep the generation that was loaded. The image has the one from before the
+                            // transaction, which could tie with the other slot and make it win on the next load.
+                            uint32_t generation = obj->savedDataHeader->reserved1;
+                            memcpy(obj->savedDataHeader, &buf[offset + sizeof(objHdr)], objHdr.size);
+                            obj->savedDataHeader->reserved1 = generation;
+                            obj->updateHash();
+                            obj->save();
+                            obj->lastUpdate = 0;
+                        }
+                        break;
+                    }
+                }
+                offset += sizeof(objHdr) + objHdr.size;
+            }
+            recovered = true;
+            Log.info("recovered transaction from %s", redoPath);
+        }
+        else {
+            // Reset while writing the redo file, before any object was saved
+            Log.info("discarding incomplete transaction %s", redoPath);
+        }
+    }
+    delete[] buf;
+    fs.close();
+    fs.remove(redoPath);
+
+    return recovered;
+}
+#endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
 
 uint32_t StorageHelperRK::murmur3_32(const uint8_t* key, size_t len, uint32_t seed) {
     // https://en.wikipedia.org/wiki/MurmurHash
@@ -4,10 +4,24 @@
 #include "Particle.h"
 
 #include <fcntl.h>
+#include <initializer_list>
+#include <type_traits>
 #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST)
 #include <sys/stat.h>
 #endif
 
+/**
+ * @brief Fill in a StorageHelperRK::PersistentDataBase::MigrationField for a field that is in both structures
+ * 
+ * @param FromStruct The old structure, which must be kept in the source once a migration uses it
+ * @param ToStruct The current structure
+ * @param field The member name, which must be the same in both
+ * @param type UNSIGNED, SIGNED, or STRING
+ */
+#define STORAGEHELPER_MIGRATE_FIELD(FromStruct, ToStruct, field, type) \
+    { offsetof(FromStruct, field), sizeof(FromStruct::field), offsetof(ToStruct, field), sizeof(ToStruct::field), \
+      StorageHelperRK::PersistentDataBase::MigrationFieldType::type }
+
 /**
  * @brief Class for storing data on a variety of different storage media
  */
@@ -200,6 +214,54 @@ public:
          */
         virtual int getLength() = 0;
 
+        /**
+         * @brief Flush data written to the open file to the storage medium
+         *
+         * @returns true on success or false on error
+         *
+         * The default implementation does nothing, for file systems that write through or
+         * commit on close.
+         */
+        virtual bool sync() {
+            return true;
+        }
+
+        /**
+         * @brief Returns true if rename() is implemented by this file system
+         */
+        virtual bool canRename() const {
+            return false;
+        }
+
+        /**
+         * @brief Rename a file, replacing the destination if it exists. The file must be closed.
+         *
+         * @param from Existing pathname
+         *
+         * @param to New pathname
+         *
+         * @returns true on success or false on error or if not supported by this file system
+         *
+         * Replacing a file by renaming a completely written temporary file over it is how
+         * PersistentDataFileSystem compacts its journal without a window where a reset
+         * leaves a truncated file. File systems that don't implement this (canRename() returns 
+         * false) rewrite the file in place instead.
+         */
+        virtual bool rename(const char *from, const char *to) {
+            return false;
+        }
+
+        /**
+         * @brief Delete a file. The file must be closed.
+         *
+         * @param path Pathname of the file to delete
+         *
+         * @returns true on success or false on error or if not supported by this file system
+         */
+        virtual bool remove(const char *path) {
+            return false;
+        }
+
     };
 
     #if defined(__SPIFFSPARTICLERK_H) || defined(DOXYGEN_BUILD)
@@ -421,6 +483,13 @@ public:
             return (int) file.fileSize();
         }
 
+        /**
+         * @brief Flush data written to the open file to the SD card
+         */
+        virtual bool sync() {
+            return file.sync();
+        }
+
         /**
          * @brief Truncate a file to a specified length in bytes
          *
@@ -542,6 +611,33 @@ public:
             return ftruncate(fd, (int)size) == 0;
         }
 
+        /**
+         * @brief Flush data written to the open file to the storage medium
+         */
+        virtual bool sync() {
+            return fsync(fd) == 0;
+        }
+
+        /**
+         * @brief Returns true because rename() is implemented
+         */
+        virtual bool canRename() const {
+            return true;
+        }
+
+        /**
+         * @brief Rename a file, replacing the destination if it exists. The file must be closed.
+         */
+        virtual bool rename(const char *from, const char *to) {
+            return ::rename(from, to) == 0;
+        }
+
+        /**
+         * @brief Delete a file. The file must be closed.
+         */
+        virtual bool remove(const char *path) {
+            return ::unlink(path) == 0;
+        }
 
     protected:
         int fd = -1;			//!< File descriptor for the events file
@@ -549,6 +645,8 @@ public:
 
     #endif /* HAL_PLATFORM_FILESYSTEM || defined(UNITTEST) || defined(DOXYGEN_BUILD) */
 
+    class PersistentDataTransaction;
+
     /**
      * @brief Base class for storing persistent binary data to a file or retained memory
      * 
@@ -568,9 +666,50 @@ public:
             uint16_t version;               //!< savedDataVersion, should rarely, if ever, change
             uint16_t size;                  //!< size of the whole structure, including the user data after it
             uint32_t hash;                  //!< hash value for verifying data integrity
-            uint32_t reserved1;             //!< reserved for future use
+            uint32_t reserved1;             //!< reserved for future use (generation counter when using withDoubleBuffer())
             // You cannot change the size of this structure without changing the version number!
         };
+
+        /**
+         * @brief How a field is converted when its size changes in a migration
+         */
+        enum class MigrationFieldType : uint8_t {
+            UNSIGNED,                       //!< Unsigned integer, bool, float, or bytes: low bytes copied, zero extended
+            SIGNED,                         //!< Signed integer: low bytes copied, sign extended
+            STRING                          //!< Character array: copied and null terminated if shortened
+        };
+
+        /**
+         * @brief Where one field was in an old layout and where it is in the current layout
+         * 
+         * Use the STORAGEHELPER_MIGRATE_FIELD macro to fill this in.
+         */
+        struct MigrationField {
+            uint16_t fromOffset;            //!< Offset in the old structure
+            uint16_t fromSize;              //!< Size in the old structure
+            uint16_t toOffset;              //!< Offset in the current structure
+            uint16_t toSize;                //!< Size in the current structure
+            MigrationFieldType type;        //!< How to convert if the size changed
+        };
+
+        /**
+         * @brief Converts data saved with an old version and size to the current layout
+         * 
+         * Fields that are not listed are set to 0 in the current layout. The optional convert function
+         * is called after the fields have been copied to set new fields or make conversions that are
+         * not a simple copy. It's passed the old data (including the header) and the new data.
+         * 
+         * The object is not copied, so it must remain valid (typically a static const).
+         */
+        struct Migration {
+            uint16_t fromVersion;           //!< Version in the saved header
+            uint16_t fromSize;              //!< Size in the saved header, which must not be larger than the current size
+            const MigrationField *fields;   //!< Fields to copy
+            size_t fieldCount;              //!< Number of entries in fields
+            void (*convert)(const uint8_t *from, uint8_t *to); //!< Optional, may be nullptr
+        };
+
+        static const size_t MAX_MIGRATIONS = 4; //!< Maximum number of migrations that can be added to one object
         
         /**
          * @brief Base class for persistent data saved in file or RAM
@@ -617,6 +756,24 @@ public:
             return *this;
         }
 
+        /**
+         * @brief Add a conversion from data saved by an older version of the structure
+         * 
+         * @param migration The old version and size and how its fields map to the current layout
+         * @return PersistentDataBase& 
+         * 
+         * Without a migration, changing the version makes the saved data invalid and it's reinitialized.
+         * With one, data whose header matches the version and size (and whose hash is valid) is converted
+         * to the current layout when it's loaded and saved again in the new layout. Call before load().
+         * Up to MAX_MIGRATIONS can be added.
+         */
+        PersistentDataBase &withMigration(const Migration &migration) {
+            if (numMigrations < MAX_MIGRATIONS) {
+                migrations[numMigrations++] = &migration;
+            }
+            return *this;
+        }
+
 
         
 
@@ -682,6 +839,32 @@ public:
             return result;
         }
 
+        /**
+         * @brief Copy the whole structure, including the header, under a single lock
+         * 
+         * @param dest Buffer to copy to
+         * @param size Size of the buffer. If smaller than the structure, only the beginning is copied.
+         * @return Number of bytes copied
+         * 
+         * Use this instead of several getValue() calls when the values must be consistent with each 
+         * other, or to avoid locking once per field.
+         */
+        size_t getSnapshot(void *dest, size_t size) const;
+
+        /**
+         * @brief Templated version of getSnapshot() that returns a copy of the structure
+         * 
+         * @tparam T The structure type, which must begin with the SavedDataHeader and be trivially copyable
+         */
+        template<class T>
+        T getSnapshot() const {
+            static_assert(std::is_trivially_copyable<T>::value, "getSnapshot requires a trivially copyable structure");
+            T result;
+            memset(&result, 0, sizeof(T));
+            getSnapshot(&result, sizeof(T));
+            return result;
+        }
+
         /**
          * @brief Templated class for setting integral values (uint32_t, float, double, etc.)
          * 
@@ -699,7 +882,7 @@ public:
                     T oldValue = *(T *)p;
                     if (oldValue != value) {
                         *(T *)p = value;
-                        updateHash();
+                        markDirty(offset, sizeof(T));
                     }
                 }
             }
@@ -740,9 +923,38 @@ public:
         /**
          * @brief Update the hash
          * 
+         * This recalculates the hash immediately, even if hash calculation is normally deferred.
+         * If you manually update fields without using setValue(), call this afterwards.
          */
         void updateHash();
 
+        /**
+         * @brief Mark a range of bytes as changed and schedule a save
+         * 
+         * @param offset Offset into the structure of the first changed byte
+         * @param size Number of bytes changed
+         * 
+         * This is called by setValue() and setValueString(). When hash calculation is deferred (the
+         * default for storage that is saved to a file, EEPROM, or FRAM) this only records the changed
+         * range, so the cost of a set call does not depend on the size of the structure. The hash is
+         * calculated once when the data is saved.
+         */
+        void markDirty(size_t offset, size_t size);
+
+        /**
+         * @brief Get the range of bytes changed since the last save
+         * 
+         * @param start Filled in with the offset of the first changed byte
+         * @param end Filled in with the offset after the last changed byte
+         * @return true if there are changes, false if the data has not changed since the last save
+         */
+        bool getDirtyRange(size_t &start, size_t &end) const;
+
+        /**
+         * @brief Returns true if the hash in the header is up to date
+         */
+        bool isHashValid() const { return !hashDirty; };
+
         static const uint32_t HASH_SEED = 0x851c2a3f; //!< Murmur32 hash seed value (randomly generated)
 
     protected:
@@ -779,6 +991,25 @@ public:
          */
         virtual void initialize();
 
+        /**
+         * @brief Convert data with a valid header and hash from an older version. Used internally by validate().
+         * 
+         * @param dataSize Number of bytes loaded. The old structure must fit in this.
+         * 
+         * @return true if a migration matched the saved version and size and the data was converted
+         */
+        bool migrate(size_t dataSize);
+
+        /**
+         * @brief Calculate the hash if it has been deferred. Used internally by save() before writing.
+         */
+        void commitHash();
+
+        /**
+         * @brief Clear the changed byte range. Used internally once the data has been saved.
+         */
+        void clearDirty();
+
 
         SavedDataHeader *savedDataHeader = 0; //!< Pointer to the saved data header, which is followed by the data
         uint32_t savedDataSize = 0;     //!< Size of the saved data (header + actual data)
@@ -790,6 +1021,17 @@ public:
         uint32_t saveDelayMs = 1000; //!< How long to wait to save before writing file to disk. Set to 0 to write immediately.
 
         bool logData = false; //!< Log data when read and saved
+
+        bool deferHash = false; //!< Calculate the hash at save time instead of on every set. Only safe when there is a save step.
+        bool hashDirty = false; //!< Data has changed and the hash has not been recalculated yet
+        size_t dirtyStart = 0; //!< Offset of the first byte changed since the last save
+        size_t dirtyEnd = 0; //!< Offset after the last byte changed since the last save (0 = nothing changed)
+        int transactionDepth = 0; //!< Number of PersistentDataTransaction objects in progress. Saves are held until 0.
+
+        const Migration *migrations[MAX_MIGRATIONS]; //!< Added by withMigration()
+        size_t numMigrations = 0; //!< Number of entries in migrations
+
+        friend class PersistentDataTransaction;
     };
 
     /**
@@ -837,6 +1079,7 @@ public:
          */
         PersistentDataEEPROM(int eepromOffset, SavedDataHeader *savedDataHeader, size_t savedDataSize, uint32_t savedDataMagic, uint16_t savedDataVersion) : 
             PersistentDataBase(savedDataHeader, savedDataSize, savedDataMagic, savedDataVersion), eepromOffset(eepromOffset) {
+            deferHash = true;
         };
         
 
@@ -876,6 +1119,7 @@ public:
          */
         PersistentDataFRAM(MB85RC &fram, int framOffset, SavedDataHeader *savedDataHeader, size_t savedDataSize, uint32_t savedDataMagic, uint16_t savedDataVersion) : 
             PersistentDataBase(savedDataHeader, savedDataSize, savedDataMagic, savedDataVersion), fram(fram), framOffset(framOffset) {
+            deferHash = true;
         };
         
         /**
@@ -900,6 +1144,7 @@ public:
          */
         virtual void save() {
             WITH_LOCK(*this) {
+                commitHash();
                 fram.writeData(framOffset, (const uint8_t*)savedDataHeader, savedDataSize);
             }
             PersistentDataBase::save();
@@ -935,6 +1180,7 @@ public:
          */
         PersistentDataFileSystem(FileSystemBase *fs, const char *filename, SavedDataHeader *savedDataHeader, size_t savedDataSize, uint32_t savedDataMagic, uint16_t savedDataVersion) : 
             PersistentDataBase(savedDataHeader, savedDataSize, savedDataMagic, savedDataVersion), fs(fs), filename(filename) {
+            deferHash = true;
         };
 
         virtual ~PersistentDataFileSystem() {
@@ -965,11 +1211,122 @@ public:
          */
         virtual void save();
 
- 
+        /**
+         * @brief Save changes by appending them to the file instead of rewriting the whole file
+         * 
+         * @param maxRecords Number of change records to append before compacting. 0 (the default) disables the journal.
+         * @return PersistentDataFileSystem& 
+         * 
+         * In journal mode the file holds a snapshot of the whole structure followed by change records, 
+         * each containing the range of bytes changed since the previous save, the hash of the structure
+         * after the change, and a check value covering the record. A save only appends a record, so 
+         * frequently changing fields like counts don't rewrite the whole file every time.
+         * 
+         * After maxRecords records the file is compacted back to a single snapshot. If the file system 
+         * supports rename(), the snapshot is written to a temporary file (filename + ".tmp") first and 
+         * renamed over the file.
+         * 
+         * When loading, records are replayed in order and replay stops at the first incomplete or corrupted
+         * record, so a reset during a save loses at most that save. A file without records is the same as 
+         * a file written without the journal, so enabling it on an existing file keeps the data. Disabling 
+         * it on a file that contains records will cause the data to be reinitialized.
+         */
+        PersistentDataFileSystem &withJournal(size_t maxRecords) {
+            journalMaxRecords = maxRecords;
+            return *this;
+        }
+
+        /**
+         * @brief Alternate between two files when saving so a reset during a save never loses the data
+         * 
+         * @param value true to enable (default) or false to disable
+         * @return PersistentDataFileSystem& 
+         * 
+         * The data is stored in two slots, filename and filename + ".b". Each save writes the whole structure
+         * to the slot that wasn't used last with a higher generation counter (stored in reserved1 in the 
+         * header), syncs it, and only then makes it the active slot. load() reads both slots and uses the 
+         * valid one with the newer generation, so an interrupted save reverts to the previous save instead
+         * of reinitializing the data.
+         * 
+         * This can be combined with withJournal(). In that case, records are appended to the active slot
+         * and compaction writes the other slot instead of using a temporary file.
+         * 
+         * A file written without double buffering is loaded as slot A. If you later disable double 
+         * buffering, only slot A is read, which may not contain the latest save.
+         */
+        PersistentDataFileSystem &withDoubleBuffer(bool value = true) {
+            doubleBuffer = value;
+            return *this;
+        }
+
+        /**
+         * @brief Get the number of change records currently appended after the snapshot
+         */
+        size_t getJournalRecords() const { return journalRecords; };
+
+        /**
+         * @brief Header before each change record in journal mode
+         */
+        class JournalRecordHeader { // 16 bytes
+        public:
+            uint16_t magic;                 //!< JOURNAL_RECORD_MAGIC
+            uint16_t offset;                //!< Offset of the changed bytes into the structure
+            uint16_t length;                //!< Number of changed bytes following this header
+            uint16_t reserved;              //!< Reserved for future use (0)
+            uint32_t hash;                  //!< savedDataHeader->hash after applying this record
+            uint32_t check;                 //!< Murmur3 of this header (with check = 0) followed by the changed bytes
+        };
+
+        static const uint16_t JOURNAL_RECORD_MAGIC = 0x4a52; //!< Magic bytes for JournalRecordHeader
 
     protected:
+        /**
+         * @brief Read a file, replaying any journal records, and validate it. Used internally by load().
+         * 
+         * @param path Pathname of the file to read
+         * @return true if the file contained valid data
+         */
+        bool loadFile(const char *path);
+
+        /**
+         * @brief Get the pathname of slot A (filename) or slot B (filename + ".b") for double buffering
+         */
+        String getSlotPath(bool slotB) const;
+
+        /**
+         * @brief Get the pathname of the file that contains the current data
+         */
+        String getActivePath() const;
+
+        /**
+         * @brief Write the whole structure, replacing the file. Used internally by save().
+         */
+        bool saveSnapshot();
+
+        /**
+         * @brief Append a change record for the bytes from start to end. Used internally by save().
+         */
+        bool saveJournalRecord(size_t start, size_t end);
+
+        /**
+         * @brief Apply the change records following the snapshot. Used internally by load(). The file must be open.
+         * 
+         * @param snapshotSize Size of the snapshot at the beginning of the file
+         */
+        void replayJournal(size_t snapshotSize);
+
+        /**
+         * @brief Calculate the check value for a change record
+         */
+        static uint32_t getJournalCheck(const JournalRecordHeader &hdr, const uint8_t *data);
+
         FileSystemBase *fs; //!< The file system object the persistent data will be stored on
         String filename; //!<  The filename on the file system
+        size_t journalMaxRecords = 0; //!< Records to append before compacting, 0 = journal disabled
+        size_t journalRecords = 0; //!< Number of records after the snapshot in the file
+        bool journalAppendOk = false; //!< The file ends with a valid snapshot or record, so it's safe to append
+        bool doubleBuffer = false; //!< Alternate saves between two slots, see withDoubleBuffer()
+        bool activeSlotB = false; //!< When double buffering, true if slot B contains the current data
     };
 
     #if HAL_PLATFORM_FILESYSTEM || defined(UNITTEST) || defined(DOXYGEN_BUILD)
@@ -994,6 +1351,99 @@ public:
     
     protected:
     };
+
+    /**
+     * @brief Saves changes to several PersistentDataBase objects together
+     * 
+     * Construct one of these on the stack before changing several objects that must stay consistent with
+     * each other. While it exists the objects are locked and are not saved. When it goes out of scope, or 
+     * commit() is called, the hash of each changed object is calculated once and they are saved together.
+     * 
+     * If more than one object changed, images of all of the changed objects are first written to a redo 
+     * file and synced, then each object is saved, and then the redo file is deleted. If a reset occurs 
+     * while the objects are being saved, recover() (called after loading the objects at boot) saves
+     * them again from the redo file, so either all of the changes are saved or none of them are.
+     * 
+     * Transactions can be nested; only the outermost transaction for an object saves it.
+     */
+    class PersistentDataTransaction {
+    public:
+        /**
+         * @brief Begin a transaction
+         * 
+         * @param redoPath Pathname of the redo file. Use the same pathname with recover().
+         * @param objects The objects that are changed in this transaction, up to MAX_OBJECTS
+         */
+        PersistentDataTransaction(const char *redoPath, std::initializer_list<PersistentDataBase *> objects);
+
+        /**
+         * @brief Commits the transaction, if it has not already been committed
+         */
+        virtual ~PersistentDataTransaction();
+
+        /**
+         * @brief Save the changes and release the objects. The destructor does this automatically.
+         * 
+         * @return true if the changes were saved atomically, false if the redo file could not be written
+         * (the objects are still saved individually)
+         */
+        bool commit();
+
+        /**
+         * @brief Finish saving a transaction that was interrupted by a reset
+         * 
+         * @param redoPath Pathname of the redo file
+         * @param objects The objects that may be in the redo file. They must have already been loaded.
+         * @return true if a transaction was recovered
+         * 
+         * Call this from setup() after loading the objects and before changing them. 
+         */
+        static bool recover(const char *redoPath, std::initializer_list<PersistentDataBase *> objects);
+
+        static const size_t MAX_OBJECTS = 4; //!< Maximum number of objects in a transaction
+        static const uint32_t REDO_MAGIC = 0x7e9d0a51; //!< Magic bytes at the beginning of the redo file
+
+        /**
+         * @brief Header at the beginning of the redo file, followed by a RedoObjectHeader and image for each object
+         * and a uint32_t murmur3 hash of everything before it
+         */
+        class RedoHeader { // 8 bytes
+        public:
+            uint32_t magic;                 //!< REDO_MAGIC
+            uint16_t count;                 //!< Number of objects in the file
+            uint16_t reserved;              //!< Reserved for future use (0)
+        };
+
+        /**
+         * @brief Header before the image of each object in the redo file
+         */
+        class RedoObjectHeader { // 8 bytes
+        public:
+            uint32_t savedDataMagic;        //!< Magic bytes of the object, used to match it at recovery
+            uint32_t size;                  //!< Size of the image that follows
+        };
+
+    protected:
+        /**
+         * This class cannot be copied
+         */
+        PersistentDataTransaction(const PersistentDataTransaction&) = delete;
+
+        /**
+         * This class cannot be copied
+         */
+        PersistentDataTransaction& operator=(const PersistentDataTransaction&) = delete;
+
+        /**
+         * @brief Write the images of the changed objects to the redo file and sync it
+         */
+        bool writeRedo(PersistentDataBase **changed, size_t numChanged);
+
+        const char *redoPath; //!< Pathname of the redo file
+        PersistentDataBase *objects[MAX_OBJECTS]; //!< Objects in this transaction
+        size_t numObjects = 0; //!< Number of entries in objects
+        bool committed = false; //!< commit() has been called
+    };
     #endif // HAL_PLATFORM_FILESYSTEM || defined(UNITTEST) || defined(DOXYGEN_BUILD)
 
     /**
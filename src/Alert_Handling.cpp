@@ -34,7 +34,7 @@ int Alert_Handling::alertResolution() {
   
   if (current.get_alertCode() > 10) {
     snprintf(data, sizeof(data), "{\"alerts\":%i,\"timestamp\":%lu000 }",current.get_alertCode(), Time.now());
-    PublishQueuePosix::instance().publish("Ubidots_Alert_Hook", data, PRIVATE);
+    PublishQueuePosix::instance().publish("Ubidots_Alert_Hook", data, PublishQueuePosix::Priority::ALERT, PRIVATE);
     Log.info(data);
   }
 
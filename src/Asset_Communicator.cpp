@@ -22,7 +22,7 @@ void Asset_Communicator::setup() {
     Serial1_Listener::instance().setup();    // Initialize the Serial1_Listener
     /** Initialize other listeners here if needed **/
     Asset_Communicator::instance().checkIfSensorTypeNeedsUpdate();  // We need to check if the asset has been changed without the Boron's knowledge
-    sysStatus.set_assetFirmwareRelease(Asset_Communicator::instance().retrieveAssetFirmwareVersion());
+    sysStatus.set_assetFirmwareRelease(Asset_Communicator::instance().retrieveAssetFirmwareVersion().c_str());
 }
 
 void Asset_Communicator::loop() {                        
@@ -27,6 +27,26 @@
 // v1.5.1 - Fixed bugs relating to improper messages sent via the serialAssetCommand particle function. Implemented a safe delay in Serial1_Listener that ensures the sensor has time to print to Serial1
 // v1.5.2 - Tried adding a litte more information on the daily reset issue.
 // v1.5.3 - Fixed bugs relating to time functions - Reporting state conditionals now compare to local time. Fixed edge case where closeTime = 24 was causing issues with the final report of the night coming in at 1am.
+// v1.5.4 - Sensor interrupts are now queued in a lock-free ring in Record_Counts so bursts of edges are no longer collapsed into one count. Added countOverflows variable.
+// v1.5.5 - Counts are accumulated in retained memory and committed to the current object in batches (10 counts, 60 seconds, or before a report, sleep or reset)
+// v1.5.6 - The current data file is journaled so count commits append a small record instead of rewriting the whole file
+// v1.5.7 - sysStatus and current are double buffered (.dat and .dat.b) so a reset during a save no longer reverts them to defaults
+// v1.5.8 - Changes to sysStatus and current in dailyCleanup, sendEvent and the "reset all" command are saved as one transaction
+// v1.5.9 - Report, status and configuration messages are built from a snapshot of sysStatus and current taken under one lock
+// v1.5.10 - sysStatus and current fields are described by constexpr tables that drive validation, defaults and JSON. Added the fields command. Configuration JSON is built by one shared builder without String concatenation
+// v1.5.11 - Firmware release strings in sysStatus are char arrays so the structure can be saved as bytes. Data saved by v1.5.10 and earlier is migrated on load.
+// v1.5.12 - Queued events are stored in a single ring file instead of one file per event. Events queued by earlier versions are moved into it at startup.
+// v1.5.13 - Hourly reports queued while offline are sent together as Ubidots-Counter-Batch-v1 (see README). Update-Device is sent once per connection so queued reports are consecutive.
+// v1.5.14 - Queued events have priorities: counts are sent first and discarded last, then alerts, configuration and commands, then diagnostics (limited to 24)
+// v1.5.15 - A configuration or command resolve event replaces the one still waiting in the queue, so only the latest is sent after being offline
+// v1.5.16 - Two queued events can be waiting for an acknowledgement at a time, which about halves the time to send a backlog
+// v1.5.17 - Queued events are handed to the background publish thread without copying them, which also saves the 2KB of copy buffers
+// v1.5.18 - Queued events are stored in fixed-size blocks allocated once at startup, so long uptimes with many event sizes no longer fragment the heap
+// v1.5.19 - Delays between queued publishes adapt to acknowledgement times and back off with jitter on failures, while staying under the cloud rate limit
+// v1.5.20 - Added the queueStats variable with publish queue latency, depth, evictions, failures and flash bytes. The configuration report includes a summary
+// v1.5.21 - Queued event files have a CRC, so events torn by a brown-out are discarded instead of published, and failed queue file writes are detected. Fixed the alert and critical queue directories not being created on a new file system
+// v1.5.22 - Queued events are kept in retained memory until it's full, and only then written to flash, saving flash wear and power while offline. The buffer is copied to a file before a deep power down and restored at startup
+// v1.5.23 - In low power mode, the device disconnects and sleeps 5 seconds after the publish queue has drained instead of always staying awake 90 seconds, and stays awake up to 5 minutes when the queue estimates it needs longer to send a backlog
 
 // Particle Libraries
 #include "Particle.h"                                 // Because it is a CPP file not INO
@@ -56,6 +76,7 @@ bool isParkOpen(bool verbose);						  // Simple function returns whether park is
 void dailyCleanup();								  // Reset each morning
 void softDelay(uint32_t t);							  // function for a safe delay()
 void recordCount();									  // Called from the main loop when a sensor is triggered
+void publishQueueDrained();							  // Called by the publish queue when everything has been acknowledged
 
 // System Health Variables
 int outOfMemory = -1;                                 // From reference code provided in AN0023 (see above)
@@ -74,8 +95,8 @@ AB1805 ab1805(Wire);                                  // Rickkas' RTC / Watchdog
 
 // Program Variables
 volatile bool userSwitchDectected = false;		
-volatile bool sensorDetect = false;					  // Flag for sensor interrupt
 bool dataInFlight = false;                            // Flag for whether we are waiting for a response from the webhook
+retained uint8_t publishQueueRetainedBuffer[2048] __attribute__((aligned(4)));  // Queued reports survive sleep and resets without a flash write - about 10 reports, the rest go to flash
 
 Timer countSignalTimer(1000, countSignalTimerISR, true);      // This is how we will ensure the BlueLED stays on long enough for folks to see it.
 
@@ -83,10 +104,14 @@ Timer countSignalTimer(1000, countSignalTimerISR, true);      // This is how we
 const int wakeBoundary = 1*3600 + 0*60 + 0;           // Sets a reporting frequency of 1 hour 0 minutes 0 seconds
 const unsigned long stayAwakeLong = 90000UL;          // In lowPowerMode, how long to stay awake every hour
 const unsigned long stayAwakeShort = 1000UL;		  // In lowPowerMode, how long to stay awake when not reporting
+const unsigned long stayAwakeAfterDrain = 5000UL;	  // In lowPowerMode, how long to stay connected once the publish queue has drained - time for a function call or update to start
+const unsigned long stayAwakeMax = 300000UL;		  // In lowPowerMode, the longest we will stay awake for the publish queue to drain
 const unsigned long webhookWait = 45000UL;            // How long will we wait for a WebHook response
 const unsigned long resetWait = 30000UL;              // How long will we wait in ERROR_STATE until reset
 unsigned long stayAwakeTimeStamp = 0UL;               // Timestamps for our timing variables..
 unsigned long stayAwake = stayAwakeLong;              // Stores the time we need to wait before napping
+bool queueDrained = false;                            // Set by publishQueueDrained() - cleared when we publish or sleep
+unsigned long queueDrainedTimeStamp = 0UL;            // When the publish queue drained
 
 // Testing variables
 // bool dailyCleanupTestExecuted = false;
@@ -111,12 +136,29 @@ void setup() {
     initializePowerCfg();                             // Sets the power configuration for solar
 
 	sysStatus.setup();								  // Initialize persistent storage
-	sysStatus.set_firmwareRelease(FIRMWARE_RELEASE);
 	current.setup();
+	statusTransaction::recover();					  // Finish saving sysStatus and current if a reset interrupted it
+	sysStatus.set_firmwareRelease(FIRMWARE_RELEASE);
 	current.set_alertCode(0);						  // Clear any alert codes
-
-  	PublishQueuePosix::instance().setup();            // Start the Publish Queue
-	PublishQueuePosix::instance().withFileQueueSize(200);
+	Record_Counts::instance()						  // Commits any counts left in retained memory by a reset
+		.withCommitCountThreshold(10)				  // At most 9 counts or 60 seconds of counts lost on a brown-out
+		.withCommitIntervalSec(60)
+		.setup();
+
+  	PublishQueuePosix::instance()
+		.withStorageEngine(PublishQueuePosix::StorageEngine::RING_FILE)	// One preallocated file instead of a file per queued event
+		.withRingFileSize(65536)						  // Room for the 200 event limit at typical webhook payload sizes
+		.withPriorityRingFileSize(PublishQueuePosix::Priority::ALERT, 8192)		// Alerts and diagnostics are small and few
+		.withPriorityRingFileSize(PublishQueuePosix::Priority::DIAGNOSTIC, 8192)
+		.withCoalesce("Ubidots-Counter-Hook-v1", "Ubidots-Counter-Batch-v1")	// Reports queued while offline are sent as one JSON array
+		.withMaxInFlight(2)								  // LTE-M acknowledgements take 1-2 seconds, don't wait for each one to send the backlog
+		.withAdaptivePacing()							  // Shorter delays while acknowledgements are quick, backs off with jitter on failures
+		.withRetainedBuffer(publishQueueRetainedBuffer, sizeof(publishQueueRetainedBuffer))	// Queued events go to retained memory before flash
+		.withQueueDrainedCallback(publishQueueDrained)	  // Lets us disconnect as soon as everything is acknowledged
+		.setup();									  // Start the Publish Queue
+	PublishQueuePosix::instance()
+		.withFileQueueSize(200)
+		.withPriorityQueueSize(PublishQueuePosix::Priority::DIAGNOSTIC, 24);	// A day of debugging messages can't crowd out the counts
 
 	// Take note if we are restarting due to a pin reset - either by the user or the watchdog - could be sign of trouble
   	if (System.resetReason() == RESET_REASON_PIN_RESET || System.resetReason() == RESET_REASON_USER) { // Check to see if we are starting from a pin reset or a reset in the sketch
@@ -178,20 +220,32 @@ void setup() {
 	isParkOpen(true);
 
 	Alert_Handling::instance().setup();
-	Record_Counts::instance().setup();
 }
 
 void loop() {
 	switch (state) {
 		case IDLE_STATE: {						      // This is the default state - we will be here most of the time when awake
 			if (state != oldState) publishStateTransition();
-			if (sysStatus.get_lowPowerMode() && (millis() - stayAwakeTimeStamp) > stayAwake) state = SLEEPING_STATE;         // When in low power mode, we can nap between taps
+			if (sysStatus.get_lowPowerMode()) {                                // When in low power mode, we can nap between taps
+				if (queueDrained && !dataInFlight && (millis() - queueDrainedTimeStamp) > stayAwakeAfterDrain) {
+					Log.info("Publish queue drained - sleeping after %lu secs awake", (millis() - stayAwakeTimeStamp) / 1000);
+					state = SLEEPING_STATE;                                    // Everything is acknowledged - no need to wait out stayAwake
+				}
+				else if ((millis() - stayAwakeTimeStamp) > stayAwake) {
+					unsigned long drainMs = Particle.connected() ? PublishQueuePosix::instance().getDrainEstimateMs() : 0;
+					if (drainMs && stayAwake < stayAwakeMax) {                 // Still sending a backlog - stay long enough to finish, within reason
+						stayAwake = constrain(millis() - stayAwakeTimeStamp + drainMs, stayAwake, stayAwakeMax);
+						Log.info("Staying awake %lu secs for the publish queue to drain", drainMs / 1000);
+					}
+					else state = SLEEPING_STATE;
+				}
+			}
 			if (isParkOpen(false) && Time.hour() != Time.hour(sysStatus.get_lastReport())) state = REPORTING_STATE;          // We want to report on the hour but not after bedtime
 		} break;
 
 		case SLEEPING_STATE: {
 			if (state != oldState) publishStateTransition();              	// We will apply the back-offs before sending to ERROR state - so if we are here we will take action
-	    	if (sensorDetect || countSignalTimer.isActive())  break;        // Don't nap until we are done with event - exits back to main loop but stays in napping state
+	    	if (Record_Counts::countsPending() || countSignalTimer.isActive())  break;        // Don't nap until we are done with event - exits back to main loop but stays in napping state
 			if (Particle.connected() || !Cellular.isOff()) {
 				if (!Particle_Functions::instance().disconnectFromParticle()) {         // Disconnect cleanly from Particle and power down the modem
 					current.set_alertCode(15);
@@ -206,6 +260,8 @@ void loop() {
 				.gpio(BUTTON_PIN,CHANGE)
 				.gpio(INT_PIN,RISING)
 				.duration(wakeInSeconds * 1000L);
+			Record_Counts::instance().commitCounts(true);					 // Counts are safely in the current object before we sleep
+			queueDrained = false;											 // Only counts for this connection
 			ab1805.stopWDT();  												 // No watchdogs interrupting our slumber
 			SystemSleepResult result = System.sleep(config);              	 // Put the device to sleep device continues operations from here
 			ab1805.resumeWDT();                                              // Wakey Wakey - WDT can resume
@@ -241,10 +297,12 @@ void loop() {
 
 			char lastReportData[128];
 			snprintf(lastReportData, sizeof(lastReportData),"midnightCorrectedLocalHour = %d midnightCorrectedClosingHour = %d", midnightCorrectedLocalHour, midnightCorrectedClosingHour);
-			PublishQueuePosix::instance().publish("Time Variables", lastReportData, PRIVATE | WITH_ACK);
+			PublishQueuePosix::instance().publish("Time Variables", lastReportData, PublishQueuePosix::Priority::DIAGNOSTIC, PRIVATE | WITH_ACK);	// Diagnostic queue is sent after the counts so it does not split a batch of reports
 
 			Take_Measurements::instance().takeMeasurements();                 // Take Measurements here for reporting
 
+			queueDrained = false;                                             // Wait for this report to be acknowledged
+
 			Particle_Functions::instance().sendEvent();                       // Publish hourly but not at opening time as there is nothing to publish
 
 			if (midnightCorrectedClosingHour == midnightCorrectedLocalHour) { // If we are closed now, let's clean up the data
@@ -321,6 +379,8 @@ void loop() {
 				snprintf(data, sizeof(data),"Connected in %i secs",sysStatus.get_lastConnectionDuration());  // Make up connection string and publish
 				Log.info(data);
 				if (sysStatus.get_verboseMode()) Particle.publish("Cellular",data,PRIVATE);
+				queueDrained = false;                                          // Wait for the queued reports and this one to be acknowledged
+				PublishQueuePosix::instance().publish("Update-Device", nullptr, PRIVATE | WITH_ACK);  // Once per connection, after any reports queued while offline
 				(retainedOldState == REPORTING_STATE) ? state = RESP_WAIT_STATE : state = IDLE_STATE; // so, if we are connecting to report - next step is response wait - otherwise IDLE
 			}
 			else if (sysStatus.get_lastConnectionDuration() > 600) { 		   // What happens if we do not connect - non-zero alert code will send us to the Error state
@@ -356,15 +416,19 @@ void loop() {
 					break;
 				case 2:
 					Log.info("Resetting");
+					Record_Counts::instance().commitCounts(true);	// Don't lose pending counts
 					delay(1000);						// Give the system a second to get the message out
 					System.reset();						// device needs to be reset
 					break;
 				case 3: 
 					Log.info("Powering down");
+					Record_Counts::instance().commitCounts(true);	// Retained memory will not survive the power down
+					PublishQueuePosix::instance().writeAllToFiles();	// Neither will queued events in RAM or retained memory - saved to flash and restored by setup()
 					delay(1000);						// Give the system a second to get the message out
 					ab1805.deepPowerDown();				// Power off the device for 30 seconds
 					break;
 				default:								// Ensure we do not get trapped in the ERROR State
+					Record_Counts::instance().commitCounts(true);
 					System.reset();
 					break;
 			}
@@ -387,8 +451,7 @@ void loop() {
 
 	if (current.get_alertCode() > 0) state = ERROR_STATE;
 
-	if (sensorDetect) {									// If the sensor has been triggered, we need to record the count
-		sensorDetect = false;
+	if (Record_Counts::countsPending()) {				// If the sensor has been triggered, we need to record the counts queued by the ISR
 		if (Record_Counts::instance().recordCounts()) {
 			Log.info("Count recorded");
 			pinSetFast(BLUE_LED);                       // Turn on the blue LED
@@ -432,7 +495,7 @@ void userSwitchISR() {
 }
 
 void sensorISR() {
-	sensorDetect = true;											// Set the flag for the sensor interrupt
+	Record_Counts::queueCountEvent(INT_PIN);						// Queue the edge - it is drained in the main loop
 }
 
 void countSignalTimerISR() {
@@ -469,6 +532,17 @@ void UbidotsHandler(const char *event, const char *data) {          // Looks at
   Log.info(responseString);
 }
 
+/**
+ * @brief Called from PublishQueuePosix::loop() when every queued event has been acknowledged
+ *
+ * @details In low power mode the Idle state uses this to go to sleep a few seconds later instead of
+ * staying awake for the full stayAwakeLong.
+ */
+void publishQueueDrained() {
+  queueDrained = true;
+  queueDrainedTimeStamp = millis();
+}
+
 /**
  * @brief Cleanup function that is run at the beginning of the day.
  *
@@ -476,6 +550,7 @@ void UbidotsHandler(const char *event, const char *data) {          // Looks at
  * Called from Reporting State ONLY. Cleans house at the beginning of a new day.
  */
 void dailyCleanup() {
+  statusTransaction transaction;                                            // The new day's settings and zeroed counts are saved together
   if (Particle.connected()) Particle.publish("Daily Cleanup","Running", PRIVATE);   // Make sure this is being run
   Log.info("Running Daily Cleanup based on (last = %i / current = %i)", Time.day(sysStatus.get_lastConnection()), Time.day());
   sysStatus.set_verboseMode(false);                                       			// Saves bandwidth - keep extra chatter off
@@ -483,9 +558,8 @@ void dailyCleanup() {
     sysStatus.set_lowPowerMode(true);
   }
   Asset_Communicator::instance().setup();						 // Check if we have changed our asset recently and need to update sysStatus.sensorType
-  char configData[256]; 							 	 // Store the configuration data in this character array - not global
-  snprintf(configData, sizeof(configData), "{\"timestamp\":%lu000, \"power\":\"%s\", \"lowPowerMode\":\"%s\", \"timeZone\":\"" + sysStatus.get_timeZoneStr() + "\", \"open\":%i, \"close\":%i, \"sensorType\":%i, \"verbose\":\"%s\", \"connecttime\":%i, \"battery\":%4.2f}", Time.now(), sysStatus.get_solarPowerMode() ? "Solar" : "Utility", sysStatus.get_lowPowerMode() ? "Low Power" : "Not Low Power", sysStatus.get_openTime(), sysStatus.get_closeTime(), sysStatus.get_sensorType(), sysStatus.get_verboseMode() ? "Verbose" : "Not Verbose", sysStatus.get_lastConnectionDuration(), current.get_stateOfCharge());
-  PublishQueuePosix::instance().publish("Send-Configuration", configData, PRIVATE | WITH_ACK);    // Send new configuration to FleetManager backend. (v1.4)
+  Particle_Functions::instance().sendConfiguration();    // Send new configuration to FleetManager backend. (v1.4)
+  Record_Counts::instance().commitCounts();              // Pending counts belong to the day that is ending
   current.resetEverything();                             // If so, we need to Zero the counts for the new day
 }
 
@@ -25,8 +25,57 @@ sysStatusData::sysStatusData() : StorageHelperRK::PersistentDataFile(persistentD
 sysStatusData::~sysStatusData() {
 }
 
+// Layout saved by SYS_DATA_VERSION 2. The release strings were declared as String, but set_*() wrote the
+// characters into those sizeof(String) bytes, null terminated, so they migrate like any other string.
+class SysDataV2 {
+public:
+    StorageHelperRK::PersistentDataBase::SavedDataHeader sysHeader;
+    uint8_t structuresVersion;
+    bool verboseMode;
+    bool solarPowerMode;
+    bool lowPowerMode;
+    bool lowBatteryMode;
+    uint8_t resetCount;
+    char timeZoneStr[39];
+    uint8_t openTime;
+    uint8_t closeTime;
+    time_t lastReport;
+    time_t lastConnection;
+    time_t lastHookResponse;
+    uint16_t lastConnectionDuration;
+    uint8_t sensorType;
+    alignas(String) char firmwareRelease[sizeof(String)];
+    alignas(String) char assetFirmwareRelease[sizeof(String)];
+};
+
+// SysDataV2 -> SysData
+static const StorageHelperRK::PersistentDataBase::MigrationField sysFieldsVersion2[] = {
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, structuresVersion, UNSIGNED),
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, verboseMode, UNSIGNED),
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, solarPowerMode, UNSIGNED),
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, lowPowerMode, UNSIGNED),
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, lowBatteryMode, UNSIGNED),
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, resetCount, UNSIGNED),
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, timeZoneStr, STRING),
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, openTime, UNSIGNED),
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, closeTime, UNSIGNED),
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, lastReport, SIGNED),
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, lastConnection, SIGNED),
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, lastHookResponse, SIGNED),
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, lastConnectionDuration, UNSIGNED),
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, sensorType, UNSIGNED),
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, firmwareRelease, STRING),
+    STORAGEHELPER_MIGRATE_FIELD(SysDataV2, sysStatusData::SysData, assetFirmwareRelease, STRING),
+};
+
+static const StorageHelperRK::PersistentDataBase::Migration sysMigrationVersion2 = {
+    2, sizeof(SysDataV2), sysFieldsVersion2, sizeof(sysFieldsVersion2) / sizeof(sysFieldsVersion2[0]), nullptr
+};
+
 void sysStatusData::setup() {
     sysStatus
+        .withDoubleBuffer()                                 // A reset during a save reverts to the previous save, not the defaults
+        .withMigration(sysMigrationVersion2)                // Keeps settings saved by v1.5.10 and earlier
     //  .withLogData(true)
         .withSaveDelayMs(100)
         .load();
@@ -38,19 +87,34 @@ void sysStatusData::loop() {
     sysStatus.flush(false);
 }
 
+// Field table - validate(), the defaults in initialize() and the fields command JSON all come from here
+static constexpr PersistentSchema::FieldInfo sysFields[] = {
+    //           structure               field                   type    min     max             default
+    SCHEMA_FIELD(sysStatusData::SysData, structuresVersion,      UINT8,  0,      255,            1),
+    SCHEMA_FIELD(sysStatusData::SysData, verboseMode,            BOOL,   0,      1,              false),
+    SCHEMA_FIELD(sysStatusData::SysData, solarPowerMode,         BOOL,   0,      1,              false),
+    SCHEMA_FIELD(sysStatusData::SysData, lowPowerMode,           BOOL,   0,      1,              true),
+    SCHEMA_FIELD(sysStatusData::SysData, lowBatteryMode,         BOOL,   0,      1,              false),
+    SCHEMA_FIELD(sysStatusData::SysData, resetCount,             UINT8,  0,      255,            0),
+    SCHEMA_STRING(sysStatusData::SysData, timeZoneStr,                                           "ANAT-12"),      // NZ Time
+    SCHEMA_FIELD(sysStatusData::SysData, openTime,               UINT8,  0,      12,             0),
+    SCHEMA_FIELD(sysStatusData::SysData, closeTime,              UINT8,  0,      24,             24),             // New standard with v20
+    SCHEMA_FIELD(sysStatusData::SysData, lastReport,             TIME,   0,      4294967295.0,   0),
+    SCHEMA_FIELD(sysStatusData::SysData, lastConnection,         TIME,   0,      4294967295.0,   0),
+    SCHEMA_FIELD(sysStatusData::SysData, lastHookResponse,       TIME,   0,      4294967295.0,   0),
+    SCHEMA_FIELD(sysStatusData::SysData, lastConnectionDuration, UINT16, 0,      900,            0),
+    SCHEMA_FIELD(sysStatusData::SysData, sensorType,             UINT8,  0,      3,              2),              // Magnetometer sensor
+    SCHEMA_STRING(sysStatusData::SysData, firmwareRelease,                                       ""),
+    SCHEMA_STRING(sysStatusData::SysData, assetFirmwareRelease,                                  ""),
+};
+static_assert(PersistentSchema::tableValid(sysFields, sizeof(sysStatusData::SysData)), "sysFields does not match SysData");
+
+const PersistentSchema::FieldTable sysStatusData::fieldTable = {sysFields, sizeof(sysFields) / sizeof(sysFields[0])};
+
 bool sysStatusData::validate(size_t dataSize) {
     bool valid = PersistentDataFile::validate(dataSize);
     if (valid) {
-        // If test1 < 0 or test1 > 100, then the data is invalid
-
-        if (sysStatus.get_openTime() < 0 || sysStatus.get_openTime() > 12) {
-            Log.info("data not valid open time =%d", sysStatus.get_openTime());
-            valid = false;
-        }
-        else if (sysStatus.get_lastConnection() < 0 || sysStatus.get_lastConnectionDuration() > 900) {
-            Log.info("data not valid last connection duration =%d", sysStatus.get_lastConnectionDuration());
-            valid = false;
-        }
+        valid = PersistentSchema::validate(fieldTable, (const uint8_t *)&sysData);
     }
     Log.info("sysStatus data is %s",(valid) ? "valid": "not valid");
     return valid;
@@ -63,16 +127,11 @@ void sysStatusData::initialize() {
     Log.info(message);
     if (Particle.connected()) Particle.publish("Mode",message, PRIVATE);
     Log.info("Loading system defaults");
-    sysStatus.set_structuresVersion(1);
-    sysStatus.set_verboseMode(false);
-    sysStatus.set_lowBatteryMode(false);
-    sysStatus.set_solarPowerMode(false);
-    sysStatus.set_lowPowerMode(true);          // This should be changed to true once we have tested
-    sysStatus.set_timeZoneStr("ANAT-12");       // NZ Time
-    sysStatus.set_sensorType(2);                // Magnetometer sensor
-    sysStatus.set_openTime(0);
-    sysStatus.set_closeTime(24);                // New standard with v20
-    sysStatus.set_lastConnectionDuration(0);    // New measure
+    PersistentSchema::setDefaults(fieldTable, *this);
+}
+
+sysStatusData::SysData sysStatusData::snapshot() const {
+    return getSnapshot<SysData>();
 }
 
 uint8_t sysStatusData::get_structuresVersion() const {
@@ -179,24 +238,23 @@ void sysStatusData::set_sensorType(uint8_t value) {
 }
 
 String sysStatusData::get_firmwareRelease() const {
-    String value;
-    getValueString(offsetof(SysData,firmwareRelease), sizeof(value), value);
-    return value;
-
+	String result;
+	getValueString(offsetof(SysData, firmwareRelease), sizeof(SysData::firmwareRelease), result);
+	return result;
 }
 
-void sysStatusData::set_firmwareRelease(String value) {
-    setValueString(offsetof(SysData, firmwareRelease), sizeof(value), value);
+bool sysStatusData::set_firmwareRelease(const char *str) {
+	return setValueString(offsetof(SysData, firmwareRelease), sizeof(SysData::firmwareRelease), str);
 }
 
 String sysStatusData::get_assetFirmwareRelease() const {
-    String value;
-    getValueString(offsetof(SysData,assetFirmwareRelease), sizeof(value), value);
-    return value;
+	String result;
+	getValueString(offsetof(SysData, assetFirmwareRelease), sizeof(SysData::assetFirmwareRelease), result);
+	return result;
 }
 
-void sysStatusData::set_assetFirmwareRelease(String value) {
-    setValueString(offsetof(SysData, assetFirmwareRelease), sizeof(value), value);
+bool sysStatusData::set_assetFirmwareRelease(const char *str) {
+	return setValueString(offsetof(SysData, assetFirmwareRelease), sizeof(SysData::assetFirmwareRelease), str);
 }
 
 // *****************  Current Status Storage Object *******************
@@ -223,6 +281,8 @@ currentStatusData::~currentStatusData() {
 
 void currentStatusData::setup() {
     current
+        .withJournal(32)                                    // Count commits append a small record instead of rewriting the file
+        .withDoubleBuffer()                                 // Compaction writes the other slot so a reset can't lose the data
     //    .withLogData(true)
         .withSaveDelayMs(250)
         .load();
@@ -241,9 +301,29 @@ void currentStatusData::resetEverything() {          // The device is waking up
 }
 
 
-bool currentStatusData::validate(size_t dataSize) {  // This needs to be fleshed out
-    return true;
+// Field table - validate(), the defaults in initialize() and the fields command JSON all come from here
+static constexpr PersistentSchema::FieldInfo currentFields[] = {
+    //           structure                    field           type    min     max             default
+    SCHEMA_FIELD(currentStatusData::CurrentData, hourlyCount,   UINT16, 0,      65535,          0),
+    SCHEMA_FIELD(currentStatusData::CurrentData, dailyCount,    UINT16, 0,      65535,          0),
+    SCHEMA_FIELD(currentStatusData::CurrentData, lastCountTime, TIME,   0,      4294967295.0,   0),
+    SCHEMA_FIELD(currentStatusData::CurrentData, internalTempC, FLOAT,  -50,    280,            0),    // Full range of the TMP36 reading
+    SCHEMA_FIELD(currentStatusData::CurrentData, alertCode,     UINT8,  0,      255,            0),
+    SCHEMA_FIELD(currentStatusData::CurrentData, stateOfCharge, FLOAT,  -1,     200,            0),    // -1 if the fuel gauge can't be read
+    SCHEMA_FIELD(currentStatusData::CurrentData, batteryState,  UINT8,  0,      6,              0),    // Index into batteryContext
+    SCHEMA_FIELD(currentStatusData::CurrentData, sensorState,   UINT8,  0,      1,              0),    // WAITING:0, SENSING:1
+};
+static_assert(PersistentSchema::tableValid(currentFields, sizeof(currentStatusData::CurrentData)), "currentFields does not match CurrentData");
 
+const PersistentSchema::FieldTable currentStatusData::fieldTable = {currentFields, sizeof(currentFields) / sizeof(currentFields[0])};
+
+bool currentStatusData::validate(size_t dataSize) {
+    bool valid = PersistentDataFile::validate(dataSize);  // Header, size and hash - previously skipped, so junk was accepted
+    if (valid) {
+        valid = PersistentSchema::validate(fieldTable, (const uint8_t *)&currentData);
+    }
+    Log.info("current data is %s",(valid) ? "valid": "not valid");
+    return valid;
 };                      
 
 void currentStatusData::initialize() {
@@ -251,11 +331,16 @@ void currentStatusData::initialize() {
 
     Log.info("Current Data Initialized");
 
+    PersistentSchema::setDefaults(fieldTable, *this);
     currentStatusData::resetEverything();
 
     updateHash();                                    // If you manually update fields here, be sure to update the hash
 }
 
+currentStatusData::CurrentData currentStatusData::snapshot() const {
+    return getSnapshot<CurrentData>();
+}
+
 uint16_t currentStatusData::get_hourlyCount() const {
     return getValue<uint16_t>(offsetof(CurrentData, hourlyCount));
 }
@@ -309,3 +394,18 @@ uint8_t currentStatusData::get_batteryState() const  {
 void currentStatusData::set_batteryState(uint8_t value) {
     setValue<uint8_t>(offsetof(CurrentData, batteryState), value);
 }
+
+// *******************  Transaction across sysStatus and current **********************
+//
+// ********************************************************************
+
+const char *persistentDataPathTransaction = "/usr/transaction.dat";
+
+statusTransaction::statusTransaction() : StorageHelperRK::PersistentDataTransaction(persistentDataPathTransaction, {&sysStatus, &current}) {
+
+};
+
+// [static]
+bool statusTransaction::recover() {
+    return StorageHelperRK::PersistentDataTransaction::recover(persistentDataPathTransaction, {&sysStatus, &current});
+}
@@ -3,6 +3,7 @@
 
 #include "Particle.h"
 #include "StorageHelperRK.h"
+#include "Persistent_Schema.h"
 
 //Define external class instances. These are typically declared public in the main .CPP. I wonder if we can only declare it here?
 // extern MB85RC64 fram;
@@ -88,12 +89,29 @@ public:
 		time_t lastHookResponse;                   		  // Last time we got a valid Webhook response
 		uint16_t lastConnectionDuration;                  // How long - in seconds - did it take to last connect to the Particle cloud
 		uint8_t sensorType;                               // What is the sensor type - 0-Pressure Sensor, 1-PIR Sensor
-		String firmwareRelease;							  // Point release - helpful in development
-		String assetFirmwareRelease;					  // Asset's point release - helpful in development
+		char firmwareRelease[16];						  // Point release - helpful in development
+		char assetFirmwareRelease[32];					  // Asset's point release - helpful in development
 	};
+	static_assert(std::is_trivially_copyable<SysData>::value, "SysData is saved as bytes so it can't contain objects like String");
 
 	SysData sysData;
 
+	/**
+	 * @brief Copy all of the fields under one lock
+	 * 
+	 * @details Use this when building a message from several fields instead of calling each getter
+	 * 
+	 * @returns A consistent copy of the data
+	 */
+	SysData snapshot() const;
+
+	/**
+	 * @brief Name, offset, type, valid range and default of each field in SysData
+	 * 
+	 * @details Drives validate(), the defaults in initialize() and the JSON for the fields command
+	 */
+	static const PersistentSchema::FieldTable fieldTable;
+
 	// 	******************* Get and Set Functions for each variable in the storage object ***********
     
 	/**
@@ -164,10 +182,10 @@ public:
 	void set_sensorType(uint8_t value);
 
 	String get_firmwareRelease() const;
-	void set_firmwareRelease(String value);
+	bool set_firmwareRelease(const char *str);
 
 	String get_assetFirmwareRelease() const;
-	void set_assetFirmwareRelease(String value);
+	bool set_assetFirmwareRelease(const char *str);
 
 	//Members here are internal only and therefore protected
 protected:
@@ -202,7 +220,7 @@ protected:
 
     //Since these variables are only used internally - They can be private. 
 	static const uint32_t SYS_DATA_MAGIC = 0x20a99e75;
-	static const uint16_t SYS_DATA_VERSION = 2;
+	static const uint16_t SYS_DATA_VERSION = 3;        // 3 - firmware release strings are char arrays instead of String
 
 };
 
@@ -282,8 +300,27 @@ public:
 		uint8_t batteryState;                             	// Stores the current battery state
 		uint8_t sensorState;                             	// Stores the current sensor state (WAITING:0, SENSING:1)
 	};
+	static_assert(std::is_trivially_copyable<CurrentData>::value, "CurrentData is saved as bytes so it can't contain objects like String");
+
 	CurrentData currentData;
 
+	/**
+	 * @brief Copy all of the fields under one lock
+	 * 
+	 * @details Use this when building a message from several fields instead of calling each getter.
+	 * The hourly and daily counts in the copy are always from the same commit.
+	 * 
+	 * @returns A consistent copy of the data
+	 */
+	CurrentData snapshot() const;
+
+	/**
+	 * @brief Name, offset, type, valid range and default of each field in CurrentData
+	 * 
+	 * @details Drives validate(), the defaults in initialize() and the JSON for the fields command
+	 */
+	static const PersistentSchema::FieldTable fieldTable;
+
 	// 	******************* Get and Set Functions for each variable in the storage object ***********
     
 	/**
@@ -372,4 +409,30 @@ protected:
 };
 
 
+// *******************  Transaction across sysStatus and current **********************
+//
+// ********************************************************************
+
+/**
+ * @brief Saves the changes made to sysStatus and current in a scope together
+ * 
+ * Declare one on the stack before changing fields in both objects that must stay consistent
+ * (for example the hourly count and the last report time). The changes are saved when it goes
+ * out of scope, and a reset while saving is completed by recover() at the next boot.
+ */
+class statusTransaction : public StorageHelperRK::PersistentDataTransaction {
+public:
+    /**
+     * @brief Begin a transaction on sysStatus and current
+     */
+    statusTransaction();
+
+    /**
+     * @brief Complete a transaction interrupted by a reset; call from setup() after sysStatus.setup() and current.setup()
+     * 
+     * @return true if a transaction was recovered
+     */
+    static bool recover();
+};
+
 #endif  /* __MYPERSISTENTDATA_H */
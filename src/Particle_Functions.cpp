@@ -3,6 +3,7 @@
 #include "take_measurements.h"
 #include "MyPersistentData.h"
 #include "Asset_Communicator.h"
+#include "Record_Counts.h"
 #include "Particle_Functions.h"
 #include "JsonParserGeneratorRK.h"
 #include "PublishQueuePosixRK.h"
@@ -24,6 +25,36 @@ const char* batteryContext[7] = {"Unknown","Not Charging","Charging","Charged","
 
 Particle_Functions *Particle_Functions::_instance;
 
+static int countOverflowsVariable() {
+  return (int)Record_Counts::getOverflowCount();
+}
+
+static String queueStatsVariable() {                                  // Publish queue counters since startup (v1.5.20)
+  char data[512];
+  const PublishQueuePosix::Metrics metrics = PublishQueuePosix::instance().getMetrics();
+
+  JsonWriter writer(data, sizeof(data));
+  writer.startObject();
+  writer.insertKeyArray("latency", metrics.latency, PublishQueuePosix::NUM_LATENCY_BUCKETS);    // <10s, <1m, <10m, <1h, <6h, <24h, longer
+  writer.insertKeyValue("maxLatency", metrics.maxLatencySec);
+  writer.insertKeyValue("sent", metrics.eventsSent);
+  writer.insertKeyValue("failures", metrics.publishFailures);
+  writer.insertKeyValue("maxDepth", metrics.maxDepth);
+  writer.insertKeyValue("queueFull", metrics.evictedQueueFull);
+  writer.insertKeyValue("priorityLimit", metrics.evictedPriorityLimit);
+  writer.insertKeyValue("ringFull", metrics.evictedRingFull);
+  writer.insertKeyValue("corrupted", metrics.evictedCorrupted);
+  writer.insertKeyValue("superseded", metrics.evictedSuperseded);
+  writer.insertKeyValue("poolFull", metrics.evictedPoolFull);
+  writer.insertKeyValue("writeFailed", metrics.evictedWriteFailed);
+  writer.insertKeyValue("spills", metrics.ramToFileSpills);
+  writer.insertKeyValue("retainedOverflows", metrics.retainedOverflows);
+  writer.insertKeyValue("bytesWritten", metrics.fileBytesWritten);
+  writer.insertKeyValue("bytesRead", metrics.fileBytesRead);
+  writer.finishObjectOrArray();
+  return String(data);
+}
+
 // [static]
 Particle_Functions &Particle_Functions::instance() {
     if (!_instance) {
@@ -41,6 +72,8 @@ Particle_Functions::~Particle_Functions() {
 void Particle_Functions::setup() {
     Log.info("Initializing Particle functions and variables");     // Note: Don't have to be connected but these functions need to in first 30 seconds
     Particle.function("Commands", &Particle_Functions::jsonFunctionParser, this);
+    Particle.variable("countOverflows", countOverflowsVariable);   // Sensor events dropped because the ISR queue was full
+    Particle.variable("queueStats", queueStatsVariable);           // Publish queue latency, depth, evictions and flash use (v1.5.20)
 
     // Setup local time and set the publishing schedule
 	  LocalTime::instance().withConfig(LocalTimePosixTimezone("EST5EDT,M3.2.0/2:00:00,M11.1.0/2:00:00"));			// East coast of the US
@@ -76,7 +109,7 @@ int Particle_Functions::jsonFunctionParser(String command) {
     snprintf(data, sizeof(data), "{\"commands\":%i,\"context\":\"%s,\"timestamp\":%lu000 }", -1, command.c_str(), Time.now());        // Send -1 (Syntax Error) to the 'commands' Synthetic Variable
     PublishQueuePosix::instance().publish("Ubidots_Command_Hook", data, PRIVATE);
     snprintf(data, sizeof(data), "{\"commands\":%i,\"context\":\"%s\",\"timestamp\":%lu000 }", -10, command.c_str(), Time.now());    // Send -10, resolve any events
-    PublishQueuePosix::instance().publish("Ubidots_Command_Hook", data, PRIVATE);
+    PublishQueuePosix::instance().publish("Ubidots_Command_Hook", data, PublishQueuePosix::Priority::NORMAL, "command-resolve", PRIVATE);
 		return 0;
 	}
 
@@ -100,13 +133,17 @@ int Particle_Functions::jsonFunctionParser(String command) {
       // Format - function - reset,  variables - either "current", or "all" 
       // Test - {"cmd":[{"var":"all","fn":"reset"}]}
 
+      Record_Counts::instance().commitCounts();                   // So pending counts are cleared along with the rest
       if (variable == "all") {
+          statusTransaction transaction;                          // System and current data are reset together
           snprintf(messaging,sizeof(messaging),"Resetting the gateway's system and current data");
           sysStatus.initialize();                                 // All will reset system values as well
           current.resetEverything();
       }
-      else snprintf(messaging,sizeof(messaging),"Resetting the gateway's current data");
-      current.resetEverything();
+      else {
+        snprintf(messaging,sizeof(messaging),"Resetting the gateway's current data");
+        current.resetEverything();
+      }
     }
 
     else if (function == "restart") {
@@ -129,18 +166,41 @@ int Particle_Functions::jsonFunctionParser(String command) {
       // Format - function - status, variables - short, long
       // Test - {"cmd":[{"var":"short", "fn":"status"}]}
       Take_Measurements::instance().takeMeasurements();
-      int tempValue = sysStatus.get_sensorType();
-      snprintf(data, sizeof(data),"Hourly: %d, Daily: %d, Sensor: %s, Battery: %4.2f and %s",current.get_hourlyCount(), current.get_dailyCount(),(tempValue==0) ? "Car" : (tempValue == 1) ? "Person" : (tempValue == 2) ? "Magnetometer" : (tempValue == 3) ? "Accelerometer" : "Not Set", current.get_stateOfCharge(), batteryContext[current.get_batteryState()]);
+      Record_Counts::instance().commitCounts();                   // Report includes the pending counts
+      const currentStatusData::CurrentData currentSnap = current.snapshot();   // One lock per object, consistent hourly / daily pair
+      const sysStatusData::SysData sysSnap = sysStatus.snapshot();
+      int tempValue = sysSnap.sensorType;
+      snprintf(data, sizeof(data),"Hourly: %d, Daily: %d, Sensor: %s, Battery: %4.2f and %s",currentSnap.hourlyCount, currentSnap.dailyCount,(tempValue==0) ? "Car" : (tempValue == 1) ? "Person" : (tempValue == 2) ? "Magnetometer" : (tempValue == 3) ? "Accelerometer" : "Not Set", currentSnap.stateOfCharge, batteryContext[currentSnap.batteryState]);
       Log.info(data);
       Particle.publish("status",data,PRIVATE);
       if (variable == "long") {
         conv.withCurrentTime().convert();  	
-        snprintf(data,sizeof(data),"Time: %s, open: %d, close: %d, mode %s, release %s, asset release %s", conv.format("%I:%M:%S%p").c_str(), sysStatus.get_openTime(), sysStatus.get_closeTime(), (sysStatus.get_lowPowerMode()) ? "low power":"not low power", sysStatus.get_firmwareRelease().c_str(), sysStatus.get_assetFirmwareRelease().c_str());
+        snprintf(data,sizeof(data),"Time: %s, open: %d, close: %d, mode %s, release %s, asset release %s", conv.format("%I:%M:%S%p").c_str(), sysSnap.openTime, sysSnap.closeTime, (sysSnap.lowPowerMode) ? "low power":"not low power", sysSnap.firmwareRelease, sysSnap.assetFirmwareRelease);
         Log.info(data);
         Particle.publish("status",data,PRIVATE);
       }
     }
 
+    // Report every field in sysStatus or current, from the field tables
+    else if (function == "fields") {
+      // Format - function - fields, variables - sys or current
+      // Test - {"cmd":[{"var":"current","fn":"fields"}]}
+      char data[512];
+      JsonWriter writer(data, sizeof(data));                      // Writes into data - no heap allocation
+      writer.startObject();
+      if (variable == "current") {
+        const currentStatusData::CurrentData currentSnap = current.snapshot();
+        PersistentSchema::writeJson(currentStatusData::fieldTable, (const uint8_t *)&currentSnap, writer);
+      }
+      else {
+        const sysStatusData::SysData sysSnap = sysStatus.snapshot();
+        PersistentSchema::writeJson(sysStatusData::fieldTable, (const uint8_t *)&sysSnap, writer);
+      }
+      writer.finishObjectOrArray();
+      Log.info("%s", data);
+      Particle.publish("fields", data, PRIVATE);
+    }
+
     // Command to send data
     else if (function == "send") {
       // Format - function - send, variables - NA
@@ -198,6 +258,7 @@ int Particle_Functions::jsonFunctionParser(String command) {
       int tempValue = strtol(variable,&pEND,10);                       // Looks for the first integer and interprets it
       if ((tempValue >= 0 ) && (tempValue <= 2048)) {
         snprintf(messaging,sizeof(messaging),"Setting daily count to %d", tempValue);
+        Record_Counts::instance().commitCounts();                      // Otherwise pending counts would be added on top of the new value
         current.set_dailyCount(tempValue);
       }
       else {
@@ -265,28 +326,26 @@ int Particle_Functions::jsonFunctionParser(String command) {
 
 	}
   if (function != "send") {                                                                                           // "Send" will call sendEvent and send a configuration anyway, so we can skip this command here.
-    char configData[256]; // Store the configuration data in this character array - not global
-    snprintf(configData, sizeof(configData), "{\"timestamp\":%lu000, \"power\":\"%s\", \"lowPowerMode\":\"%s\", \"timeZone\":\"" + sysStatus.get_timeZoneStr() + "\", \"open\":%i, \"close\":%i, \"sensorType\":%i, \"verbose\":\"%s\", \"connecttime\":%i, \"battery\":%4.2f}", Time.now(), sysStatus.get_solarPowerMode() ? "Solar" : "Utility", sysStatus.get_lowPowerMode() ? "Low Power" : "Not Low Power", sysStatus.get_openTime(), sysStatus.get_closeTime(), sysStatus.get_sensorType(), sysStatus.get_verboseMode() ? "Verbose" : "Not Verbose", sysStatus.get_lastConnectionDuration(), current.get_stateOfCharge());
-    PublishQueuePosix::instance().publish("Send-Configuration", configData, PRIVATE | WITH_ACK);                                    // Send new configuration to FleetManager backend. (v1.4)
+    sendConfiguration();                                                                                              // Send new configuration to FleetManager backend. (v1.4)
   }
   if(success == true){           // send the Success slack notification if the command was not recognized
     char data[128];
     snprintf(data, sizeof(data), "{\"commands\":%i,\"context\":\"%s\",\"timestamp\":%lu000 }", 1, function.c_str(), Time.now());    // Send 1 (Execution Success) to the 'commands' Synthetic Variable
     PublishQueuePosix::instance().publish("Ubidots_Command_Hook", data, PRIVATE);
     snprintf(data, sizeof(data), "{\"commands\":%i,\"context\":\"%s\",\"timestamp\":%lu000 }", -10, function.c_str(), Time.now());  // Send -10, resolve any events
-    PublishQueuePosix::instance().publish("Ubidots_Command_Hook", data, PRIVATE);
+    PublishQueuePosix::instance().publish("Ubidots_Command_Hook", data, PublishQueuePosix::Priority::NORMAL, "command-resolve", PRIVATE);
   } else {
     char data[128];
     if(invalidCommand == true){  // send the Invalid Command slack notification if the command was not recognized
       snprintf(data, sizeof(data), "{\"commands\":%i,\"context\":\"%s\",\"timestamp\":%lu000 }", 2, function.c_str(), Time.now());    // Send 2 (Invalid Command) to the 'commands' Synthetic Variable
       PublishQueuePosix::instance().publish("Ubidots_Command_Hook", data, PRIVATE);
       snprintf(data, sizeof(data), "{\"commands\":%i,\"context\":\"%s\",\"timestamp\":%lu000 }", -10, function.c_str(), Time.now());  // Send -10, resolve any events
-      PublishQueuePosix::instance().publish("Ubidots_Command_Hook", data, PRIVATE);
+      PublishQueuePosix::instance().publish("Ubidots_Command_Hook", data, PublishQueuePosix::Priority::NORMAL, "command-resolve", PRIVATE);
     } else {                     // send the Execution Failure slack notification if the command was not recognized
       snprintf(data, sizeof(data), "{\"commands\":%i,\"context\":\"%s\",\"timestamp\":%lu000 }", 0, function.c_str(), Time.now());    // Send 0 (Execution Failure) to the 'commands' Synthetic Variable
       PublishQueuePosix::instance().publish("Ubidots_Command_Hook", data, PRIVATE);
       snprintf(data, sizeof(data), "{\"commands\":%i,\"context\":\"%s\",\"timestamp\":%lu000 }", -10, function.c_str(), Time.now());  // Send -10, resolve any events
-      PublishQueuePosix::instance().publish("Ubidots_Command_Hook", data, PRIVATE);
+      PublishQueuePosix::instance().publish("Ubidots_Command_Hook", data, PublishQueuePosix::Priority::NORMAL, "command-resolve", PRIVATE);
     }
   }
 
@@ -307,10 +366,19 @@ void Particle_Functions::sendEvent() {
   unsigned long timeStampValue;                                       // Going to start sending timestamps - and will modify for midnight to fix reporting issue
   timeStampValue = Time.now()-(Time.minute()*60L+Time.second()+1L);   // Set the timestamp as the last second of the previous hour
 
-  snprintf(data, sizeof(data), "{\"hourly\":%i, \"daily\":%i, \"battery\":%4.2f,\"key1\":\"%s\", \"temp\":%4.2f, \"resets\":%i, \"alerts\":%i,\"connecttime\":%i,\"timestamp\":%lu000}",current.get_hourlyCount(), current.get_dailyCount(), current.get_stateOfCharge(), batteryContext[current.get_batteryState()],current.get_internalTempC(), sysStatus.get_resetCount(), current.get_alertCode(), sysStatus.get_lastConnectionDuration(), timeStampValue);
-  PublishQueuePosix::instance().publish("Ubidots-Counter-Hook-v1", data, PRIVATE | WITH_ACK);
+  statusTransaction transaction;                                      // The hourly count reset and lastReport are saved together
+
+  Record_Counts::instance().commitCounts();                           // The report has to include the counts that are still pending
 
-  PublishQueuePosix::instance().publish("Update-Device", nullptr, PRIVATE | WITH_ACK);  // Tell the UpdateDevice UbiFunction to update this device if any updates are available in SQS.
+  const currentStatusData::CurrentData currentSnap = current.snapshot();   // One lock per object, consistent hourly / daily pair
+  const sysStatusData::SysData sysSnap = sysStatus.snapshot();
+
+  snprintf(data, sizeof(data), "{\"hourly\":%i, \"daily\":%i, \"battery\":%4.2f,\"key1\":\"%s\", \"temp\":%4.2f, \"resets\":%i, \"alerts\":%i,\"connecttime\":%i,\"timestamp\":%lu000}",currentSnap.hourlyCount, currentSnap.dailyCount, currentSnap.stateOfCharge, batteryContext[currentSnap.batteryState],currentSnap.internalTempC, sysSnap.resetCount, (int8_t)currentSnap.alertCode, sysSnap.lastConnectionDuration, timeStampValue);
+  PublishQueuePosix::instance().publish("Ubidots-Counter-Hook-v1", data, PublishQueuePosix::Priority::CRITICAL, PRIVATE | WITH_ACK);   // Counts are sent first and discarded last
+
+  if (Particle.connected()) {                                         // When offline, CONNECTING_STATE sends it after connecting so queued reports are consecutive
+    PublishQueuePosix::instance().publish("Update-Device", nullptr, PRIVATE | WITH_ACK);  // Tell the UpdateDevice UbiFunction to update this device if any updates are available in SQS.
+  }
 
   Log.info("Ubidots Webhook: %s", data);                              // For monitoring via serial
 
@@ -320,6 +388,37 @@ void Particle_Functions::sendEvent() {
 }
 
 
+void Particle_Functions::sendConfiguration() {
+  char configData[384];                                               // Store the configuration data in this character array - not global. Fits a medium event pool block.
+  char timestamp[16];
+
+  const sysStatusData::SysData sysSnap = sysStatus.snapshot();    // One lock instead of one per field
+  const PublishQueuePosix::Metrics queueMetrics = PublishQueuePosix::instance().getMetrics();
+  snprintf(timestamp, sizeof(timestamp), "%lu000", (unsigned long)Time.now());   // Milliseconds without 64-bit math
+
+  JsonWriter writer(configData, sizeof(configData));                  // Writes into configData - no String or heap allocation
+  writer.setFloatPlaces(2);
+  writer.startObject();
+  writer.insertKeyJson("timestamp", timestamp);
+  writer.insertKeyValue("power", sysSnap.solarPowerMode ? "Solar" : "Utility");
+  writer.insertKeyValue("lowPowerMode", sysSnap.lowPowerMode ? "Low Power" : "Not Low Power");
+  writer.insertKeyValue("timeZone", (const char *)sysSnap.timeZoneStr);
+  writer.insertKeyValue("open", (int)sysSnap.openTime);
+  writer.insertKeyValue("close", (int)sysSnap.closeTime);
+  writer.insertKeyValue("sensorType", (int)sysSnap.sensorType);
+  writer.insertKeyValue("verbose", sysSnap.verboseMode ? "Verbose" : "Not Verbose");
+  writer.insertKeyValue("connecttime", (int)sysSnap.lastConnectionDuration);
+  writer.insertKeyValue("battery", current.get_stateOfCharge());
+  writer.insertKeyValue("queueMaxDepth", queueMetrics.maxDepth);     // Publish queue summary, details in the queueStats variable (v1.5.20)
+  writer.insertKeyValue("queueEvicted", queueMetrics.evictedQueueFull + queueMetrics.evictedPriorityLimit + queueMetrics.evictedRingFull + 
+    queueMetrics.evictedCorrupted + queueMetrics.evictedPoolFull + queueMetrics.evictedWriteFailed);
+  writer.insertKeyValue("queueFailures", queueMetrics.publishFailures);
+  writer.insertKeyValue("queueKBWritten", queueMetrics.fileBytesWritten / 1024);
+  writer.finishObjectOrArray();
+
+  PublishQueuePosix::instance().publish("Send-Configuration", configData, PublishQueuePosix::Priority::NORMAL, "Send-Configuration", PRIVATE | WITH_ACK);     // Only the latest configuration is sent (v1.5.15)
+}
+
 bool Particle_Functions::disconnectFromParticle() {                   // Ensures we disconnect cleanly from Particle
                                                                       // Updated based on this thread: https://community.particle.io/t/waitfor-particle-connected-timeout-does-not-time-out/59181
   time_t startTime = Time.now();
@@ -62,6 +62,13 @@ public:
      */
     void sendEvent();
 
+    /**
+     * @brief Sends the device configuration to the FleetManager backend (Send-Configuration hook)
+     * 
+     * @details Built with JsonWriter into a stack buffer from one snapshot of sysStatus
+     */
+    void sendConfiguration();
+
     /**
      * @brief Disconnects from the Particle network completely
      * 
@@ -0,0 +1,77 @@
+#include "Persistent_Schema.h"
+
+// Reads a T from an unaligned position in the structure
+template<class T>
+static T readField(const uint8_t *data, const PersistentSchema::FieldInfo &field) {
+  T value;
+  memcpy(&value, data + field.offset, sizeof(T));
+  return value;
+}
+
+double PersistentSchema::getNumber(const FieldInfo &field, const uint8_t *data) {
+  switch(field.type) {
+    case FieldType::BOOL:   return readField<uint8_t>(data, field);      // Raw byte so a corrupted value is caught by validate()
+    case FieldType::UINT8:  return readField<uint8_t>(data, field);
+    case FieldType::INT8:   return readField<int8_t>(data, field);
+    case FieldType::UINT16: return readField<uint16_t>(data, field);
+    case FieldType::UINT32: return readField<uint32_t>(data, field);
+    case FieldType::TIME:   return (double)readField<time_t>(data, field);
+    case FieldType::FLOAT:  return readField<float>(data, field);
+    default:                return 0;
+  }
+}
+
+bool PersistentSchema::validate(const FieldTable &table, const uint8_t *data) {
+  for (size_t ii = 0; ii < table.count; ii++) {
+    const FieldInfo &field = table.fields[ii];
+
+    if (field.type == FieldType::STRING) {
+      if (memchr(data + field.offset, 0, field.size) == nullptr) {
+        Log.info("data not valid %s is not terminated", field.name);
+        return false;
+      }
+    }
+    else {
+      double value = getNumber(field, data);
+      if (!(value >= field.minValue && value <= field.maxValue)) {       // Also catches NaN
+        Log.info("data not valid %s = %.2lf", field.name, value);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void PersistentSchema::setDefaults(const FieldTable &table, StorageHelperRK::PersistentDataBase &storage) {
+  for (size_t ii = 0; ii < table.count; ii++) {
+    const FieldInfo &field = table.fields[ii];
+
+    switch(field.type) {
+      case FieldType::BOOL:   storage.setValue<bool>(field.offset, field.defaultValue != 0); break;
+      case FieldType::UINT8:  storage.setValue<uint8_t>(field.offset, (uint8_t)field.defaultValue); break;
+      case FieldType::INT8:   storage.setValue<int8_t>(field.offset, (int8_t)field.defaultValue); break;
+      case FieldType::UINT16: storage.setValue<uint16_t>(field.offset, (uint16_t)field.defaultValue); break;
+      case FieldType::UINT32: storage.setValue<uint32_t>(field.offset, (uint32_t)field.defaultValue); break;
+      case FieldType::TIME:   storage.setValue<time_t>(field.offset, (time_t)field.defaultValue); break;
+      case FieldType::FLOAT:  storage.setValue<float>(field.offset, (float)field.defaultValue); break;
+      case FieldType::STRING: storage.setValueString(field.offset, field.size, field.defaultString); break;
+    }
+  }
+}
+
+void PersistentSchema::writeJson(const FieldTable &table, const uint8_t *data, JsonWriter &writer) {
+  for (size_t ii = 0; ii < table.count; ii++) {
+    const FieldInfo &field = table.fields[ii];
+
+    switch(field.type) {
+      case FieldType::BOOL:   writer.insertKeyValue(field.name, readField<uint8_t>(data, field) != 0); break;
+      case FieldType::UINT8:  writer.insertKeyValue(field.name, (int)readField<uint8_t>(data, field)); break;
+      case FieldType::INT8:   writer.insertKeyValue(field.name, (int)readField<int8_t>(data, field)); break;
+      case FieldType::UINT16: writer.insertKeyValue(field.name, (int)readField<uint16_t>(data, field)); break;
+      case FieldType::UINT32: writer.insertKeyValue(field.name, (unsigned long)readField<uint32_t>(data, field)); break;
+      case FieldType::TIME:   writer.insertKeyValue(field.name, (long)readField<time_t>(data, field)); break;
+      case FieldType::FLOAT:  writer.insertKeyValue(field.name, readField<float>(data, field)); break;
+      case FieldType::STRING: writer.insertKeyValue(field.name, (const char *)(data + field.offset)); break;
+    }
+  }
+}
@@ -0,0 +1,128 @@
+/*
+ * @file Persistent_Schema.h
+ * @brief Compile-time description of the fields in the persistent data objects
+ *
+ * @details Each storage object (sysStatus, current) has a constexpr table with one entry per field:
+ * name, offset, size, type, valid range and default. The table drives validate(), the defaults
+ * set by initialize() and a JSON serializer that writes into a caller supplied buffer, so a new
+ * field only needs a line in the table to be validated, initialized and reported.
+ *
+ */
+
+#ifndef __PERSISTENT_SCHEMA_H
+#define __PERSISTENT_SCHEMA_H
+
+#include "Particle.h"
+#include "StorageHelperRK.h"
+#include "JsonParserGeneratorRK.h"
+
+namespace PersistentSchema {
+
+/**
+ * @brief Storage type of a field
+ */
+enum class FieldType : uint8_t {
+    BOOL,
+    UINT8,
+    INT8,
+    UINT16,
+    UINT32,
+    TIME,                                                   // time_t
+    FLOAT,
+    STRING                                                  // Null terminated characters, size is the buffer size
+};
+
+/**
+ * @brief Description of one field in a persistent data structure
+ */
+struct FieldInfo {
+    const char *name;                                       // Key used in JSON
+    uint16_t offset;                                        // offsetof() the field in the structure
+    uint16_t size;                                          // sizeof() the field
+    FieldType type;
+    double minValue;                                        // Valid range, inclusive (numeric types only)
+    double maxValue;
+    double defaultValue;                                    // Set by setDefaults() (numeric types only)
+    const char *defaultString;                              // Set by setDefaults() (STRING only)
+};
+
+/**
+ * @brief A table of fields and the size of the structure it describes
+ */
+struct FieldTable {
+    const FieldInfo *fields;
+    size_t count;
+};
+
+// Table entry for a numeric or bool field
+#define SCHEMA_FIELD(Struct, field, type, minValue, maxValue, defaultValue) \
+    { #field, offsetof(Struct, field), sizeof(Struct::field), PersistentSchema::FieldType::type, minValue, maxValue, defaultValue, nullptr }
+
+// Table entry for a character array field
+#define SCHEMA_STRING(Struct, field, defaultString) \
+    { #field, offsetof(Struct, field), sizeof(Struct::field), PersistentSchema::FieldType::STRING, 0, 0, 0, defaultString }
+
+/**
+ * @brief Size of the storage for a field type, or 0 for STRING which can be any size
+ */
+constexpr size_t typeSize(FieldType type) {
+    return (type == FieldType::BOOL) ? sizeof(bool) :
+           (type == FieldType::UINT8) ? sizeof(uint8_t) :
+           (type == FieldType::INT8) ? sizeof(int8_t) :
+           (type == FieldType::UINT16) ? sizeof(uint16_t) :
+           (type == FieldType::UINT32) ? sizeof(uint32_t) :
+           (type == FieldType::TIME) ? sizeof(time_t) :
+           (type == FieldType::FLOAT) ? sizeof(float) : 0;
+}
+
+/**
+ * @brief Compile-time check of one entry: the type matches the member size, the field is inside
+ * the structure and the default is in range
+ */
+constexpr bool fieldValid(const FieldInfo &field, size_t structSize) {
+    return (field.offset + field.size <= structSize) &&
+           ((field.type == FieldType::STRING) ?
+                (field.size > 0 && field.defaultString != nullptr) :
+                (field.size == typeSize(field.type) && field.minValue <= field.defaultValue && field.defaultValue <= field.maxValue));
+}
+
+/**
+ * @brief Compile-time check of a table: every entry is valid and fields are in order without overlapping
+ *
+ * @details Use in a static_assert next to the table
+ */
+template<size_t N>
+constexpr bool tableValid(const FieldInfo (&fields)[N], size_t structSize, size_t index = 0) {
+    return (index >= N) ||
+           (fieldValid(fields[index], structSize) &&
+            (index == 0 || fields[index - 1].offset + fields[index - 1].size <= fields[index].offset) &&
+            tableValid(fields, structSize, index + 1));
+}
+
+/**
+ * @brief Read a numeric field from a copy of the structure
+ */
+double getNumber(const FieldInfo &field, const uint8_t *data);
+
+/**
+ * @brief Check every field in a copy of the structure against its range
+ *
+ * @returns false, logging the first field that is out of range, if the data should be reinitialized
+ */
+bool validate(const FieldTable &table, const uint8_t *data);
+
+/**
+ * @brief Set every field to its default, using the setValue methods so changes are saved
+ */
+void setDefaults(const FieldTable &table, StorageHelperRK::PersistentDataBase &storage);
+
+/**
+ * @brief Insert every field in a copy of the structure as a key / value pair
+ *
+ * @details Call between writer.startObject() and writer.finishObjectOrArray()
+ */
+void writeJson(const FieldTable &table, const uint8_t *data, JsonWriter &writer);
+
+}
+
+#endif /* __PERSISTENT_SCHEMA_H */
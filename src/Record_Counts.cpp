@@ -8,6 +8,13 @@
 
 Record_Counts *Record_Counts::_instance;
 
+CountEvent Record_Counts::countEvents[Record_Counts::COUNT_EVENT_QUEUE_SIZE];
+std::atomic<uint16_t> Record_Counts::countEventHead(0);
+std::atomic<uint16_t> Record_Counts::countEventTail(0);
+std::atomic<uint32_t> Record_Counts::countEventOverflows(0);
+
+retained Record_Counts::PendingCounts Record_Counts::pendingCounts;
+
 // [static]
 Record_Counts &Record_Counts::instance() {
   if (!_instance) {
@@ -23,53 +30,126 @@ Record_Counts::~Record_Counts() {
 }
 
 void Record_Counts::setup() {
+  if (pendingCounts.magic != PENDING_COUNTS_MAGIC) {      // Cold boot - retained memory is not valid
+    memset(&pendingCounts, 0, sizeof(pendingCounts));
+    pendingCounts.magic = PENDING_COUNTS_MAGIC;
+  }
+  else if (pendingCounts.counts > 0) {
+    Log.info("Recovered %i uncommitted counts from retained memory", pendingCounts.counts);
+    commitCounts();
+  }
 }
 
 void Record_Counts::loop() {
+  if (pendingCounts.counts > 0 && (millis() - firstPendingMs) >= commitIntervalSec * 1000UL) {
+    commitCounts();                                       // Don't let counts sit uncommitted for too long
+  }
+}
+
+void Record_Counts::commitCounts(bool flush) {
+  if (pendingCounts.counts > 0) {
+    current.set_lastCountTime(pendingCounts.lastCountTime);
+    current.set_hourlyCount(current.get_hourlyCount() + pendingCounts.counts);
+    current.set_dailyCount(current.get_dailyCount() + pendingCounts.counts);
+    pendingCounts.counts = 0;
+  }
+  if (flush) current.flush(true);
 }
 
-bool Record_Counts::recordCounts()                        // This is where we check to see if an interrupt is set when not asleep or act on a tap that woke the device
+// [static]
+void Record_Counts::queueCountEvent(uint16_t pin) {       // Called from the ISR - keep it short
+  uint16_t head = countEventHead.load(std::memory_order_relaxed);
+  uint16_t tail = countEventTail.load(std::memory_order_acquire);
+
+  if ((uint16_t)(head - tail) >= COUNT_EVENT_QUEUE_SIZE) { // Ring is full - drop the event but keep track of it
+    countEventOverflows.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  CountEvent &event = countEvents[head & (COUNT_EVENT_QUEUE_SIZE - 1)];
+  event.timeMs = millis();
+  event.timeUs = micros();
+  event.pin = pin;
+  countEventHead.store(head + 1, std::memory_order_release);  // Publish the event to the main loop
+}
+
+// [static]
+bool Record_Counts::countsPending() {
+  return countEventHead.load(std::memory_order_acquire) != countEventTail.load(std::memory_order_relaxed);
+}
+
+// [static]
+uint32_t Record_Counts::getOverflowCount() {
+  return countEventOverflows.load(std::memory_order_relaxed);
+}
+
+bool Record_Counts::recordCounts()                        // This is where we drain the events queued by the sensor interrupt when not asleep or act on a tap that woke the device
 {
-  bool doesItCount = false;                               // Whether or not each count should be recorded depends on the sensor and the settings
-
-  switch(sysStatus.get_sensorType()) {
-    case 0: {                                             /*** Pressure Sensor - only count the front tire ***/
-      static bool frontTire = true;                       // Keep track of which tire we are counting
-      if (!frontTire) {                                   // We want to count the back tire 
-        doesItCount = true;                               // Then we should count it
-        frontTire = true;                                 // And then set the flag to true as the next tire will be a front
-      } else if (frontTire) {                             // Thie is a front tire
-        doesItCount = false;                              // Then we should not count it
-        frontTire = false;                                // And then set the flag to true so we count the front tire next time
-      }
-    } break;
-    case 1: {                                             /*** PIR Sensor - count all ***/
-      doesItCount = true;
-    }break;
-    case 2: {                                             /*** Magnetometer Sensor - count all interrupts ***/
-      doesItCount = true;                                                          
-    } break;
-    case 3: {
-      doesItCount = true;                                 /*** Accelerometer Sensor - count all ***/
-      // Place holder for future code
-    } break;
-    default:
-      doesItCount = false;                                // Default to not counting
-      break;  
+  static uint32_t lastOverflowCount = 0;                  // So we only log new overflows
+  uint16_t newCounts = 0;                                 // How many of the queued events counted as visitors
+  uint32_t lastCountMs = 0;                               // When the most recent counted edge happened
+  uint8_t sensorType = sysStatus.get_sensorType();        // Same sensor for the whole batch
+
+  uint16_t tail = countEventTail.load(std::memory_order_relaxed);
+  uint16_t head = countEventHead.load(std::memory_order_acquire);   // Snapshot - events that arrive after this are picked up on the next pass
+
+  while (tail != head) {
+    const CountEvent &event = countEvents[tail & (COUNT_EVENT_QUEUE_SIZE - 1)];
+    bool doesItCount = false;                             // Whether or not each count should be recorded depends on the sensor and the settings
+
+    switch(sensorType) {
+      case 0: {                                           /*** Pressure Sensor - only count the front tire ***/
+        static bool frontTire = true;                     // Keep track of which tire we are counting
+        if (!frontTire) {                                 // We want to count the back tire 
+          doesItCount = true;                             // Then we should count it
+          frontTire = true;                               // And then set the flag to true as the next tire will be a front
+        } else if (frontTire) {                           // Thie is a front tire
+          doesItCount = false;                            // Then we should not count it
+          frontTire = false;                              // And then set the flag to true so we count the front tire next time
+        }
+      } break;
+      case 1: {                                           /*** PIR Sensor - count all ***/
+        doesItCount = true;
+      }break;
+      case 2: {                                           /*** Magnetometer Sensor - count all interrupts ***/
+        doesItCount = true;                                                          
+      } break;
+      case 3: {
+        doesItCount = true;                               /*** Accelerometer Sensor - count all ***/
+        // Place holder for future code
+      } break;
+      default:
+        doesItCount = false;                              // Default to not counting
+        break;  
+    }
+
+    if (doesItCount) {
+      newCounts++;
+      lastCountMs = event.timeMs;
+    }
+    tail++;
   }
+  countEventTail.store(tail, std::memory_order_release);  // Hand the drained slots back to the ISR
 
-  if (doesItCount) {                                                   // If we should count it
+  uint32_t overflowCount = getOverflowCount();
+  if (overflowCount != lastOverflowCount) {
+    Log.info("Count event queue overflowed - %lu events dropped in total", overflowCount);
+    lastOverflowCount = overflowCount;
+  }
+
+  if (newCounts > 0) {                                                 // If we should count it
     char data[256]; 
-    current.set_lastCountTime(Time.now());
-    current.set_hourlyCount(current.get_hourlyCount()+1);              // Increment the PersonCount
-    current.set_dailyCount(current.get_dailyCount() +1);               // Increment the PersonCount
-    snprintf(data, sizeof(data), "Count, hourly: %i. daily: %i",current.get_hourlyCount(),current.get_dailyCount());
+    if (pendingCounts.counts == 0) firstPendingMs = millis();          // Start the commit interval with the first pending count
+    pendingCounts.lastCountTime = Time.now() - (millis() - lastCountMs)/1000;   // Time of the last edge, not when we got around to processing it
+    pendingCounts.counts += newCounts;                                 // Increment the PersonCount - committed to the current object in batches
+    snprintf(data, sizeof(data), "Count %i, hourly: %i. daily: %i", newCounts, current.get_hourlyCount() + pendingCounts.counts, current.get_dailyCount() + pendingCounts.counts);
     Log.info(data);
     if (sysStatus.get_verboseMode() && Particle.connected()) {
       waitUntil(Particle_Functions::instance().meterParticlePublish);  // Keep within publish rate limit
       Particle.publish("Count",data, PRIVATE);                         // Helpful for monitoring and calibration
     }
+    if (pendingCounts.counts >= commitCountThreshold) commitCounts();   // Bounds how many counts a brown-out can lose
   }
 
-  return doesItCount;
-}
\ No newline at end of file
+  return (newCounts > 0);
+}
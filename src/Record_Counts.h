@@ -14,7 +14,20 @@
 #define __RECORD_COUNTS_H
 
 #include "Particle.h"
+#include <atomic>
 
+/**
+ * @brief A single sensor edge captured by the interrupt service routine
+ * 
+ * @details Events are written by the ISR and drained in a batch from the main loop so
+ * bursts of edges (a group of cyclists, or edges arriving while the loop is blocked)
+ * are each counted instead of collapsing into a single flag.
+ */
+struct CountEvent {
+    uint32_t timeMs;                                   // millis() when the edge was seen
+    uint32_t timeUs;                                   // micros() when the edge was seen - for spacing between edges
+    uint16_t pin;                                      // Pin that generated the interrupt
+};
 
 /**
  * This class is a singleton; you do not create one as a global, on the stack, or with new.
@@ -49,15 +62,79 @@ public:
     void loop();
 
     /**
-     * @brief This function is called once a hardware interrupt is triggered by the device's sensor
+     * @brief This function is called from the main loop when the sensor interrupt has queued events
      * 
      * @details The sensor may change based on the settings in sysSettings but the overall concept of operations
-     * is the same regardless.  The sensor will trigger an interrupt, which will set a flag. In the main loop
-     * that flag will call this function which will determine if this event should "count" as a visitor.
+     * is the same regardless.  The sensor will trigger an interrupt, which will queue a CountEvent. In the main loop
+     * this function drains every queued event and determines if each one should "count" as a visitor.  The 
+     * persistent counts are updated once for the whole batch.
      * 
+     * @returns true if at least one of the queued events was recorded as a count
      */
     bool recordCounts();                               // Determine if a count should be recorded
 
+    /**
+     * @brief Queues a sensor event - call this from the sensor interrupt service routine
+     * 
+     * @details Single producer / single consumer and lock-free: only the ISR advances the head and only
+     * recordCounts() advances the tail.  If the queue is full the event is dropped and the overflow counter
+     * is incremented.  This is static so the ISR never has to allocate the singleton.
+     * 
+     * @param pin The pin that generated the interrupt
+     */
+    static void queueCountEvent(uint16_t pin);
+
+    /**
+     * @brief Are there sensor events waiting to be processed by recordCounts()
+     * 
+     * @returns true if the ISR has queued events that have not been drained yet
+     */
+    static bool countsPending();
+
+    /**
+     * @brief Number of sensor events dropped because the queue was full
+     * 
+     * @details Reported as a Particle variable - a non-zero value means COUNT_EVENT_QUEUE_SIZE is too small
+     * for the traffic at this location or the main loop is being blocked for too long
+     */
+    static uint32_t getOverflowCount();
+
+    static const uint16_t COUNT_EVENT_QUEUE_SIZE = 64;   // Must be a power of two
+
+    /**
+     * @brief Commit pending counts to the current object once this many have accumulated
+     * 
+     * @details Counts are accumulated in retained memory and only written to currentStatusData (which
+     * hashes the whole object and rewrites /usr/current.dat) when a threshold is reached.  Retained memory
+     * survives a reset but not a loss of power, so on a brown-out at most (value - 1) counts or
+     * withCommitIntervalSec() seconds worth of counts - whichever is reached first - can be lost.
+     * 
+     * @param value Number of counts (1 commits every count - the old behaviour)
+     */
+    Record_Counts &withCommitCountThreshold(uint16_t value) { commitCountThreshold = (value > 0) ? value : 1; return *this; };
+
+    /**
+     * @brief Commit pending counts to the current object once the oldest has been pending this long
+     * 
+     * @param value Seconds (default 60)
+     */
+    Record_Counts &withCommitIntervalSec(uint16_t value) { commitIntervalSec = value; return *this; };
+
+    /**
+     * @brief Moves any pending counts into the current object
+     * 
+     * @details Call this before anything reads or resets the hourly / daily counts (reports, status,
+     * daily cleanup) and before sleep or reset.
+     * 
+     * @param flush Also write the current object to the file system now rather than after its save delay
+     */
+    void commitCounts(bool flush = false);
+
+    /**
+     * @brief Number of counts recorded but not yet committed to the current object
+     */
+    uint16_t getPendingCounts() const { return pendingCounts.counts; };
+
 protected:
     /**
      * @brief The constructor is protected because the class is a singleton
@@ -88,5 +165,28 @@ protected:
      */
     static Record_Counts *_instance;
 
+    /**
+     * @brief Counts that have not been committed to the current object yet
+     * 
+     * Kept in retained memory so they survive a soft reset or watchdog reset - setup() commits them.
+     */
+    struct PendingCounts {
+        uint32_t magic;                                 // PENDING_COUNTS_MAGIC when the contents are valid
+        uint16_t counts;                                // Counts to add to both the hourly and daily counts
+        time_t lastCountTime;                           // Time of the most recent pending count
+    };
+    static PendingCounts pendingCounts;
+    static const uint32_t PENDING_COUNTS_MAGIC = 0x5e7c0a11;
+
+    uint16_t commitCountThreshold = 10;                 // Commit once this many counts are pending
+    uint16_t commitIntervalSec = 60;                    // Commit once the oldest pending count is this old
+    unsigned long firstPendingMs = 0;                   // millis() of the oldest pending count
+
+    static CountEvent countEvents[COUNT_EVENT_QUEUE_SIZE];      // Ring of events written by the ISR
+    static std::atomic<uint16_t> countEventHead;               // Next slot the ISR will write - only changed by the ISR
+    static std::atomic<uint16_t> countEventTail;               // Next slot recordCounts() will read - only changed by the main loop
+    static std::atomic<uint32_t> countEventOverflows;          // Events dropped because the ring was full
+
+    static_assert((COUNT_EVENT_QUEUE_SIZE & (COUNT_EVENT_QUEUE_SIZE - 1)) == 0, "COUNT_EVENT_QUEUE_SIZE must be a power of two");
 };
 #endif  /* __Record_Counts_H */